@@ -0,0 +1,428 @@
+#include "LuaCompat.h"
+
+#include "LuaEngine.h"
+#include "ArgumentView.h"
+
+/**
+ * Helpers reading the value at given stack index.
+ * Index 0 means no value (e.g. argument out of range).
+ */
+
+static Variant::Type typeOfIndex(lua_State *pLuaState, int index)
+{
+    if (index == 0) {
+        return Variant::Type_Invalid;
+    }
+
+    switch (lua_type(pLuaState, index)) {
+    case LUA_TNIL:
+        return Variant::Type_Null;
+    case LUA_TBOOLEAN:
+        return Variant::Type_Boolean;
+    case LUA_TNUMBER:
+        return lua_isinteger(pLuaState, index) ? Variant::Type_Integer : Variant::Type_Real;
+    case LUA_TSTRING:
+        return Variant::Type_String;
+    case LUA_TTABLE:
+        return Variant::Type_Map;
+    case LUA_TFUNCTION:
+        return Variant::Type_Function;
+    default:
+        return Variant::Type_Invalid;
+    }
+}
+
+static bool booleanOfIndex(lua_State *pLuaState, int index, bool def)
+{
+    if (index == 0 || lua_isnoneornil(pLuaState, index)) {
+        return def;
+    }
+    return lua_toboolean(pLuaState, index) != 0;
+}
+
+static long long int64OfIndex(lua_State *pLuaState, int index, long long def)
+{
+    if (index == 0) {
+        return def;
+    }
+
+    int isNum = 0;
+    lua_Integer i = lua_tointegerx(pLuaState, index, &isNum);
+    if (isNum) {
+        return static_cast<long long>(i);
+    }
+
+    // Floats with fractional part are truncated
+    lua_Number d = lua_tonumberx(pLuaState, index, &isNum);
+    return isNum ? static_cast<long long>(d) : def;
+}
+
+static double realOfIndex(lua_State *pLuaState, int index, double def)
+{
+    if (index == 0) {
+        return def;
+    }
+
+    int isNum = 0;
+    lua_Number d = lua_tonumberx(pLuaState, index, &isNum);
+    return isNum ? static_cast<double>(d) : def;
+}
+
+static std::string_view stringViewOfIndex(lua_State *pLuaState, int index)
+{
+    // Numbers are not converted: that would replace the value in place
+    if (index == 0 || lua_type(pLuaState, index) != LUA_TSTRING) {
+        return std::string_view();
+    }
+
+    size_t length = 0;
+    const char *str = lua_tolstring(pLuaState, index, &length);
+    return std::string_view(str, length);
+}
+
+static Variant valueOfIndex(LuaEngine *pLuaEngine, lua_State *pLuaState, int index)
+{
+    if (index == 0 || !lua_checkstack(pLuaState, 1)) {
+        return Variant();
+    }
+
+    lua_pushvalue(pLuaState, index);
+    return pLuaEngine->popValue(pLuaState);
+}
+
+
+/*
+ *  class TableView
+ */
+
+TableView::TableView()
+    : m_pLuaEngine(0),
+      m_pLuaState(0),
+      m_index(0),
+      m_owner(false)
+{
+}
+
+TableView::TableView(LuaEngine *pLuaEngine, lua_State *pLuaState, int index)
+    : m_pLuaEngine(pLuaEngine),
+      m_pLuaState(pLuaState),
+      m_index(lua_absindex(pLuaState, index)),
+      m_owner(false)
+{
+}
+
+TableView::TableView(const TableView &view)
+    : m_pLuaEngine(0),
+      m_pLuaState(0),
+      m_index(0),
+      m_owner(false)
+{
+    assign(view);
+}
+
+TableView::TableView(TableView &&view)
+    : m_pLuaEngine(view.m_pLuaEngine),
+      m_pLuaState(view.m_pLuaState),
+      m_index(view.m_index),
+      m_owner(view.m_owner)
+{
+    view.m_owner = false;
+}
+
+TableView::~TableView()
+{
+    release();
+}
+
+TableView& TableView::operator =(const TableView &view)
+{
+    if (&view != this) {
+        release();
+        assign(view);
+    }
+    return *this;
+}
+
+TableView& TableView::operator =(TableView &&view)
+{
+    if (&view != this) {
+        release();
+        m_pLuaEngine = view.m_pLuaEngine;
+        m_pLuaState = view.m_pLuaState;
+        m_index = view.m_index;
+        m_owner = view.m_owner;
+        view.m_owner = false;
+    }
+    return *this;
+}
+
+void TableView::assign(const TableView &view)
+{
+    m_pLuaEngine = view.m_pLuaEngine;
+    m_pLuaState = view.m_pLuaState;
+    m_index = view.m_index;
+    m_owner = false;
+
+    if (view.m_owner) {
+        if (!lua_checkstack(m_pLuaState, 1)) {
+            m_pLuaEngine = 0;
+            m_pLuaState = 0;
+            m_index = 0;
+            return;
+        }
+        lua_pushvalue(m_pLuaState, view.m_index);
+        m_index = lua_gettop(m_pLuaState);
+        m_owner = true;
+    }
+}
+
+void TableView::release()
+{
+    // Only the top-most slot can go without moving the other views' tables
+    if (m_owner && lua_gettop(m_pLuaState) == m_index) {
+        lua_pop(m_pLuaState, 1);
+    }
+    m_owner = false;
+}
+
+size_t TableView::length() const
+{
+    return isValid() ? lua_rawlen(m_pLuaState, m_index) : 0;
+}
+
+Variant::Type TableView::typeAt(int i) const
+{
+    int index = pushAt(i);
+    Variant::Type type = typeOfIndex(m_pLuaState, index);
+    if (index != 0) {
+        lua_pop(m_pLuaState, 1);
+    }
+    return type;
+}
+
+bool TableView::booleanAt(int i, bool def) const
+{
+    int index = pushAt(i);
+    bool res = booleanOfIndex(m_pLuaState, index, def);
+    if (index != 0) {
+        lua_pop(m_pLuaState, 1);
+    }
+    return res;
+}
+
+long long TableView::int64At(int i, long long def) const
+{
+    int index = pushAt(i);
+    long long res = int64OfIndex(m_pLuaState, index, def);
+    if (index != 0) {
+        lua_pop(m_pLuaState, 1);
+    }
+    return res;
+}
+
+double TableView::realAt(int i, double def) const
+{
+    int index = pushAt(i);
+    double res = realOfIndex(m_pLuaState, index, def);
+    if (index != 0) {
+        lua_pop(m_pLuaState, 1);
+    }
+    return res;
+}
+
+std::string_view TableView::stringViewAt(int i) const
+{
+    // The string stays referenced by the table
+    int index = pushAt(i);
+    std::string_view res = stringViewOfIndex(m_pLuaState, index);
+    if (index != 0) {
+        lua_pop(m_pLuaState, 1);
+    }
+    return res;
+}
+
+TableView TableView::tableAt(int i) const
+{
+    if (pushAt(i) == 0) {
+        return TableView();
+    }
+    return popTable();
+}
+
+Variant TableView::valueAt(int i) const
+{
+    if (pushAt(i) == 0) {
+        return Variant();
+    }
+    return m_pLuaEngine->popValue(m_pLuaState);
+}
+
+bool TableView::hasField(const char *key) const
+{
+    Variant::Type type = typeOf(key);
+    return type != Variant::Type_Invalid && type != Variant::Type_Null;
+}
+
+Variant::Type TableView::typeOf(const char *key) const
+{
+    int index = pushField(key);
+    Variant::Type type = typeOfIndex(m_pLuaState, index);
+    if (index != 0) {
+        lua_pop(m_pLuaState, 1);
+    }
+    return type;
+}
+
+bool TableView::booleanField(const char *key, bool def) const
+{
+    int index = pushField(key);
+    bool res = booleanOfIndex(m_pLuaState, index, def);
+    if (index != 0) {
+        lua_pop(m_pLuaState, 1);
+    }
+    return res;
+}
+
+long long TableView::int64Field(const char *key, long long def) const
+{
+    int index = pushField(key);
+    long long res = int64OfIndex(m_pLuaState, index, def);
+    if (index != 0) {
+        lua_pop(m_pLuaState, 1);
+    }
+    return res;
+}
+
+double TableView::realField(const char *key, double def) const
+{
+    int index = pushField(key);
+    double res = realOfIndex(m_pLuaState, index, def);
+    if (index != 0) {
+        lua_pop(m_pLuaState, 1);
+    }
+    return res;
+}
+
+std::string_view TableView::stringViewField(const char *key) const
+{
+    int index = pushField(key);
+    std::string_view res = stringViewOfIndex(m_pLuaState, index);
+    if (index != 0) {
+        lua_pop(m_pLuaState, 1);
+    }
+    return res;
+}
+
+TableView TableView::tableField(const char *key) const
+{
+    if (pushField(key) == 0) {
+        return TableView();
+    }
+    return popTable();
+}
+
+Variant TableView::valueField(const char *key) const
+{
+    if (pushField(key) == 0) {
+        return Variant();
+    }
+    return m_pLuaEngine->popValue(m_pLuaState);
+}
+
+Variant TableView::toVariant() const
+{
+    return valueOfIndex(m_pLuaEngine, m_pLuaState, m_index);
+}
+
+int TableView::pushAt(int i) const
+{
+    if (!isValid() || !lua_checkstack(m_pLuaState, 1)) {
+        return 0;
+    }
+    lua_rawgeti(m_pLuaState, m_index, i);
+    return lua_gettop(m_pLuaState);
+}
+
+int TableView::pushField(const char *key) const
+{
+    if (!isValid() || !lua_checkstack(m_pLuaState, 2)) {
+        return 0;
+    }
+    lua_pushstring(m_pLuaState, key);
+    lua_rawget(m_pLuaState, m_index);
+    return lua_gettop(m_pLuaState);
+}
+
+TableView TableView::popTable() const
+{
+    if (lua_type(m_pLuaState, -1) != LUA_TTABLE) {
+        lua_pop(m_pLuaState, 1);
+        return TableView();
+    }
+
+    // Nested table is left on the stack while the view is in use
+    TableView view(m_pLuaEngine, m_pLuaState, -1);
+    view.m_owner = true;
+    return view;
+}
+
+
+/*
+ *  class ArgumentView
+ */
+
+ArgumentView::ArgumentView(LuaEngine *pLuaEngine, lua_State *pLuaState, int first, int count)
+    : m_pLuaEngine(pLuaEngine),
+      m_pLuaState(pLuaState),
+      m_first(first),
+      m_count(count)
+{
+}
+
+Variant::Type ArgumentView::typeAt(int i) const
+{
+    return typeOfIndex(m_pLuaState, stackIndex(i));
+}
+
+bool ArgumentView::booleanAt(int i, bool def) const
+{
+    return booleanOfIndex(m_pLuaState, stackIndex(i), def);
+}
+
+long long ArgumentView::int64At(int i, long long def) const
+{
+    return int64OfIndex(m_pLuaState, stackIndex(i), def);
+}
+
+double ArgumentView::realAt(int i, double def) const
+{
+    return realOfIndex(m_pLuaState, stackIndex(i), def);
+}
+
+std::string_view ArgumentView::stringViewAt(int i) const
+{
+    return stringViewOfIndex(m_pLuaState, stackIndex(i));
+}
+
+TableView ArgumentView::tableAt(int i) const
+{
+    int index = stackIndex(i);
+    if (index == 0 || lua_type(m_pLuaState, index) != LUA_TTABLE) {
+        return TableView();
+    }
+    return TableView(m_pLuaEngine, m_pLuaState, index);
+}
+
+Variant ArgumentView::valueAt(int i) const
+{
+    return valueOfIndex(m_pLuaEngine, m_pLuaState, stackIndex(i));
+}
+
+VariantList ArgumentView::toList() const
+{
+    VariantList list;
+    for (int i = 0; i < m_count; i++) {
+        list.push_back(valueAt(i));
+    }
+    return list;
+}
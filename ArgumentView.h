@@ -0,0 +1,130 @@
+#ifndef ARGUMENTVIEW_H
+#define ARGUMENTVIEW_H
+
+#include <string_view>
+#include "Variant.h"
+
+struct lua_State;
+class LuaEngine;
+
+/**
+ * @brief View of a Lua table on the stack.
+ *
+ * Values are converted on demand, only the fields actually read
+ * get converted. Access is raw (metamethods are not invoked).
+ * Array indices are 1-based as in Lua.
+ *
+ * Views are valid until the native function they have been
+ * passed to returns. Nested table views (tableAt(), tableField())
+ * keep the nested table on the Lua stack while they are alive and
+ * pop it when destroyed, so reading nested tables in a loop takes
+ * constant stack space. A slot can only be popped while it is on
+ * top of the stack: views destroyed out of order keep their table
+ * on the stack until the native function returns. Copies of nested
+ * views hold their own slot.
+ */
+class TableView
+{
+public:
+
+    TableView();
+    TableView(LuaEngine *pLuaEngine, lua_State *pLuaState, int index);
+    TableView(const TableView &view);
+    TableView(TableView &&view);
+    ~TableView();
+
+    TableView& operator =(const TableView &view);
+    TableView& operator =(TableView &&view);
+
+    bool isValid() const { return m_pLuaState != 0; }
+
+    /// Length of the array part (the # operator without metamethods).
+    size_t length() const;
+
+    Variant::Type typeAt(int i) const;
+    bool booleanAt(int i, bool def = false) const;
+    long long int64At(int i, long long def = 0) const;
+    double realAt(int i, double def = 0.0) const;
+    /// Empty view if the value is not a string.
+    std::string_view stringViewAt(int i) const;
+    TableView tableAt(int i) const;
+    Variant valueAt(int i) const;
+
+    bool hasField(const char *key) const;
+    Variant::Type typeOf(const char *key) const;
+    bool booleanField(const char *key, bool def = false) const;
+    long long int64Field(const char *key, long long def = 0) const;
+    double realField(const char *key, double def = 0.0) const;
+    /// Empty view if the value is not a string.
+    std::string_view stringViewField(const char *key) const;
+    TableView tableField(const char *key) const;
+    Variant valueField(const char *key) const;
+
+    /// Convert the whole table.
+    Variant toVariant() const;
+
+private:
+
+    /// Push value of the field or array item onto the stack.
+    int pushAt(int i) const;
+    int pushField(const char *key) const;
+
+    /// Pop value and keep it on the stack if it is a table.
+    TableView popTable() const;
+
+    /// Copy view, taking a stack slot of its own if the view owns one.
+    void assign(const TableView &view);
+
+    /// Pop owned stack slot if it is on top.
+    void release();
+
+    LuaEngine *m_pLuaEngine;
+    lua_State *m_pLuaState;
+    int m_index;    ///< Absolute stack index of the table.
+    bool m_owner;   ///< Whether the view owns the stack slot of the table.
+};
+
+/**
+ * @brief View of native function arguments on the Lua stack.
+ *
+ * Lightweight alternative to the list of arguments converted
+ * up front: arguments are converted only when accessed, so
+ * functions ignoring (parts of) their arguments do not pay
+ * for the conversion. Argument indices are 0-based.
+ *
+ * The view is only valid during the native function call.
+ */
+class ArgumentView
+{
+public:
+
+    ArgumentView(LuaEngine *pLuaEngine, lua_State *pLuaState, int first, int count);
+
+    int size() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+
+    Variant::Type typeAt(int i) const;
+    bool booleanAt(int i, bool def = false) const;
+    long long int64At(int i, long long def = 0) const;
+    double realAt(int i, double def = 0.0) const;
+    /// Empty view if the argument is not a string.
+    std::string_view stringViewAt(int i) const;
+    /// Invalid view if the argument is not a table.
+    TableView tableAt(int i) const;
+    Variant valueAt(int i) const;
+
+    /// Convert all the arguments.
+    VariantList toList() const;
+
+private:
+
+    /// Stack index of the argument, 0 if out of range.
+    int stackIndex(int i) const { return (i >= 0 && i < m_count) ? m_first + i : 0; }
+
+    LuaEngine *m_pLuaEngine;
+    lua_State *m_pLuaState;
+    int m_first;    ///< Stack index of the first argument.
+    int m_count;    ///< Number of arguments.
+};
+
+#endif // ARGUMENTVIEW_H
@@ -0,0 +1,531 @@
+#include "LuaCompat.h"
+
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include <condition_variable>
+#include "Serializer.h"
+#include "LuaEngine.h"
+#include "Channel.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+/// Name of the channel view metatable in Lua registry.
+const static char *cChannelMetatable = "cxLua.Channel";
+
+/// Cache line size, to keep producer and consumer positions apart.
+const static size_t cCacheLine = 64;
+
+struct Channel::Private
+{
+    /// Ring buffer slot
+    struct Slot
+    {
+        std::atomic<size_t> sequence;   ///< MPMC slot state, see push() and pop().
+        std::string data;               ///< Serialized message.
+    };
+
+    Mode mode;
+    size_t mask;                        ///< Capacity - 1.
+    std::unique_ptr<Slot[]> slots;
+
+    alignas(cCacheLine) std::atomic<size_t> head;   ///< Next position to read.
+    alignas(cCacheLine) std::atomic<size_t> tail;   ///< Next position to write.
+
+    alignas(cCacheLine) std::atomic<bool> closed;
+    std::atomic<int> waiters;           ///< Number of threads waiting on the condition.
+    std::mutex mutex;
+    std::condition_variable condition;
+    int eventFd;                        ///< Receivers wait on it if not -1.
+
+    Private(size_t capacity, Mode mode, WaitMode waitMode);
+    ~Private();
+
+    bool push(std::string &data);
+    bool pop(std::string &data);
+
+    /// Wake up waiting threads, called after a successful push or pop.
+    void notify(bool pushed);
+
+    /// Take one message token from the eventfd, if any (does not wait).
+    void takeToken();
+
+    /// Wait until operation succeeds, the channel gets closed or the timeout expires.
+    template <typename Operation>
+    bool wait(Operation operation, long long timeout, bool receiving);
+};
+
+Channel::Private::Private(size_t capacity, Mode mode, WaitMode waitMode)
+    : mode(mode),
+      mask(0),
+      slots(),
+      head(0),
+      tail(0),
+      closed(false),
+      waiters(0),
+      mutex(),
+      condition(),
+      eventFd(-1)
+{
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    mask = size - 1;
+    slots.reset(new Slot[size]);
+    for (size_t i = 0; i < size; i++) {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+#ifdef __linux__
+    if (waitMode == Wait_EventFd) {
+        eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC | EFD_SEMAPHORE);
+    }
+#else
+    (void)waitMode;
+#endif
+}
+
+Channel::Private::~Private()
+{
+#ifdef __linux__
+    if (eventFd >= 0) {
+        ::close(eventFd);
+    }
+#endif
+}
+
+bool Channel::Private::push(std::string &data)
+{
+    if (mode == Mode_SPSC) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        if (pos - head.load(std::memory_order_acquire) > mask) {
+            return false;
+        }
+        slots[pos & mask].data.swap(data);
+        tail.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Slot is free for position pos when its sequence equals pos
+    Slot *pSlot = 0;
+    size_t pos = tail.load(std::memory_order_relaxed);
+    for (;;) {
+        pSlot = &slots[pos & mask];
+        size_t sequence = pSlot->sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence - pos);
+        if (diff == 0) {
+            if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    pSlot->data.swap(data);
+    pSlot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool Channel::Private::pop(std::string &data)
+{
+    if (mode == Mode_SPSC) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        if (pos == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        data.swap(slots[pos & mask].data);
+        head.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Slot holds a message for position pos when its sequence equals pos + 1
+    Slot *pSlot = 0;
+    size_t pos = head.load(std::memory_order_relaxed);
+    for (;;) {
+        pSlot = &slots[pos & mask];
+        size_t sequence = pSlot->sequence.load(std::memory_order_acquire);
+        std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence - (pos + 1));
+        if (diff == 0) {
+            if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = head.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Buffer of the previous message is left for the next sender to reuse
+    data.swap(pSlot->data);
+    pSlot->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+}
+
+void Channel::Private::notify(bool pushed)
+{
+#ifdef __linux__
+    if (pushed && eventFd >= 0) {
+        uint64_t one = 1;
+        ssize_t res = ::write(eventFd, &one, sizeof(one));
+        (void)res;
+    }
+#else
+    (void)pushed;
+#endif
+
+    // Pairs with the waiters increment in wait(): either the waiter
+    // sees the queue change or we see the waiter
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        condition.notify_all();
+    }
+}
+
+void Channel::Private::takeToken()
+{
+#ifdef __linux__
+    if (eventFd >= 0) {
+        uint64_t count = 0;
+        ssize_t res = ::read(eventFd, &count, sizeof(count));
+        (void)res;
+    }
+#endif
+}
+
+template <typename Operation>
+bool Channel::Private::wait(Operation operation, long long timeout, bool receiving)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point deadline = Clock::now() + std::chrono::microseconds(timeout > 0 ? timeout : 0);
+
+#ifdef __linux__
+    if (receiving && eventFd >= 0) {
+        bool readable = false;
+        for (;;) {
+            if (operation()) {
+                return true;
+            }
+            if (closed.load(std::memory_order_acquire)) {
+                // Pass the close wake-up on to the other receivers
+                notify(true);
+                return operation();
+            }
+
+            if (readable) {
+                // Token left by a message taken before its token was
+                // written, drop it not to spin on it
+                takeToken();
+            }
+
+            int waitTime = -1;
+            if (timeout >= 0) {
+                long long left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+                if (left < 0) {
+                    return false;
+                }
+                waitTime = static_cast<int>(left + 1);
+            }
+
+            struct pollfd pfd;
+            pfd.fd = eventFd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            // The token is taken with the message, see receiveSerialized()
+            readable = poll(&pfd, 1, waitTime) > 0;
+        }
+    }
+#else
+    (void)receiving;
+#endif
+
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool done = operation();
+        if (!done && !closed.load(std::memory_order_acquire)) {
+            if (timeout < 0) {
+                condition.wait(lock);
+            } else if (condition.wait_until(lock, deadline) == std::cv_status::timeout) {
+                waiters.fetch_sub(1, std::memory_order_relaxed);
+                return operation();
+            }
+        }
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+
+        if (done) {
+            return true;
+        }
+        if (closed.load(std::memory_order_acquire)) {
+            return operation();
+        }
+    }
+}
+
+
+/*
+ *  Lua bindings
+ */
+
+/**
+ * Lua userdata viewing a channel.
+ * Keeps the channel alive.
+ */
+struct ChannelView
+{
+    Channel channel;
+    LuaEngine *pLuaEngine;  ///< Engine serializing and decoding the values.
+};
+
+static int channelSend(lua_State *pLuaState);
+static int channelRecv(lua_State *pLuaState);
+static int channelClose(lua_State *pLuaState);
+static int channelClosed(lua_State *pLuaState);
+static int channelLength(lua_State *pLuaState);
+static int channelGc(lua_State *pLuaState);
+
+static ChannelView* checkView(lua_State *pLuaState)
+{
+    return static_cast<ChannelView*>(luaL_checkudata(pLuaState, 1, cChannelMetatable));
+}
+
+/// Convert optional timeout in seconds to microseconds.
+static long long checkTimeout(lua_State *pLuaState, int index)
+{
+    if (lua_isnoneornil(pLuaState, index)) {
+        return 0;
+    }
+    lua_Number seconds = luaL_checknumber(pLuaState, index);
+    if (seconds < 0 || seconds > 1e9) {
+        return -1;
+    }
+    return static_cast<long long>(seconds * 1e6);
+}
+
+/**
+ * ch:send(value [, timeout]) returns whether the value has been queued.
+ */
+static int channelSend(lua_State *pLuaState)
+{
+    ChannelView *pView = checkView(pLuaState);
+    luaL_checkany(pLuaState, 2);
+    long long timeout = checkTimeout(pLuaState, 3);
+
+    bool sent = false;
+    {
+        std::string data;
+        StringSink sink(data);
+        BinaryWriter writer(sink);
+        lua_pushvalue(pLuaState, 2);
+        pView->pLuaEngine->serializeValue(pLuaState, writer);
+        writer.flush();
+
+        sent = pView->channel.sendSerialized(data, timeout);
+    }
+
+    lua_pushboolean(pLuaState, sent ? 1 : 0);
+    return 1;
+}
+
+/**
+ * ch:recv([timeout]) returns true and the value, or false
+ * if there is no message.
+ */
+static int channelRecv(lua_State *pLuaState)
+{
+    ChannelView *pView = checkView(pLuaState);
+    long long timeout = checkTimeout(pLuaState, 2);
+
+    bool received = false;
+    {
+        std::string data;
+        if (pView->channel.receiveSerialized(data, timeout)) {
+            received = pView->pLuaEngine->pushSerialized(pLuaState, data.data(), data.size(), SerialFormat_Binary);
+        }
+    }
+
+    if (!received) {
+        lua_pushboolean(pLuaState, 0);
+        return 1;
+    }
+
+    lua_pushboolean(pLuaState, 1);
+    lua_insert(pLuaState, -2);
+    return 2;
+}
+
+static int channelClose(lua_State *pLuaState)
+{
+    checkView(pLuaState)->channel.close();
+    return 0;
+}
+
+static int channelClosed(lua_State *pLuaState)
+{
+    lua_pushboolean(pLuaState, checkView(pLuaState)->channel.isClosed() ? 1 : 0);
+    return 1;
+}
+
+static int channelLength(lua_State *pLuaState)
+{
+    lua_pushinteger(pLuaState, static_cast<lua_Integer>(checkView(pLuaState)->channel.size()));
+    return 1;
+}
+
+static int channelGc(lua_State *pLuaState)
+{
+    ChannelView *pView = checkView(pLuaState);
+    pView->~ChannelView();
+    return 0;
+}
+
+
+/*
+ *  class Channel
+ */
+
+Channel::Channel()
+    : m()
+{
+}
+
+Channel::Channel(size_t capacity, Mode mode, WaitMode waitMode)
+    : m(std::make_shared<Private>(capacity, mode, waitMode))
+{
+}
+
+size_t Channel::capacity() const
+{
+    return m ? m->mask + 1 : 0;
+}
+
+size_t Channel::size() const
+{
+    if (!m) {
+        return 0;
+    }
+    size_t head = m->head.load(std::memory_order_relaxed);
+    size_t tail = m->tail.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+}
+
+bool Channel::sendSerialized(std::string &data, long long timeout)
+{
+    if (!m || m->closed.load(std::memory_order_acquire)) {
+        return false;
+    }
+
+    bool sent = m->push(data);
+    if (!sent && timeout != 0) {
+        sent = m->wait([this, &data]() {
+            return !m->closed.load(std::memory_order_relaxed) && m->push(data);
+        }, timeout, false);
+    }
+    if (sent) {
+        m->notify(true);
+    }
+    return sent;
+}
+
+bool Channel::receiveSerialized(std::string &data, long long timeout)
+{
+    if (!m) {
+        return false;
+    }
+
+    bool received = m->pop(data);
+    if (!received && timeout != 0) {
+        received = m->wait([this, &data]() { return m->pop(data); }, timeout, true);
+    }
+    if (received) {
+        // One token per dequeued message, however it has been received
+        m->takeToken();
+        m->notify(false);
+    }
+    return received;
+}
+
+bool Channel::send(const Variant &value, long long timeout)
+{
+    std::string data = toBinary(value);
+    return sendSerialized(data, timeout);
+}
+
+bool Channel::receive(Variant &value, long long timeout)
+{
+    std::string data;
+    if (!receiveSerialized(data, timeout)) {
+        return false;
+    }
+    value = fromBinary(data);
+    return true;
+}
+
+void Channel::close()
+{
+    if (!m) {
+        return;
+    }
+    m->closed.store(true, std::memory_order_release);
+    m->notify(true);
+}
+
+bool Channel::isClosed() const
+{
+    return m ? m->closed.load(std::memory_order_acquire) : true;
+}
+
+int Channel::eventFd() const
+{
+    return m ? m->eventFd : -1;
+}
+
+void Channel::push(lua_State *pLuaState, LuaEngine *pLuaEngine) const
+{
+    if (!m) {
+        lua_pushnil(pLuaState);
+        return;
+    }
+
+    void *ptr = lua_newuserdata(pLuaState, sizeof(ChannelView));
+    ChannelView *pView = new (ptr) ChannelView();
+    pView->channel = *this;
+    pView->pLuaEngine = pLuaEngine;
+
+    if (luaL_newmetatable(pLuaState, cChannelMetatable)) {
+        static const luaL_Reg methods[] = {
+            { "send",   channelSend },
+            { "recv",   channelRecv },
+            { "close",  channelClose },
+            { "closed", channelClosed },
+            { 0, 0 }
+        };
+        lua_newtable(pLuaState);
+        luaL_setfuncs(pLuaState, methods, 0);
+        lua_setfield(pLuaState, -2, "__index");
+
+        static const luaL_Reg metamethods[] = {
+            { "__len",  channelLength },
+            { "__gc",   channelGc },
+            { 0, 0 }
+        };
+        luaL_setfuncs(pLuaState, metamethods, 0);
+
+        // Protect the metatable from scripts
+        lua_pushboolean(pLuaState, 0);
+        lua_setfield(pLuaState, -2, "__metatable");
+    }
+    lua_setmetatable(pLuaState, -2);
+}
@@ -0,0 +1,113 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <string>
+#include <memory>
+#include "Variant.h"
+
+struct lua_State;
+class LuaEngine;
+
+/**
+ * @brief Bounded message channel between Lua engines.
+ *
+ * Values are serialized once into a compact binary buffer by the sender
+ * and decoded by the receiver straight into its Lua state (or into a
+ * Variant on the C++ side). Messages are passed through a lock-free ring
+ * buffer: single-producer/single-consumer, or multi-producer/multi-consumer
+ * (bounded MPMC queue with per-slot sequence numbers).
+ *
+ * Non-blocking calls never lock. Waiting receivers block either on a
+ * condition variable, or on an eventfd which can also be polled by
+ * an event loop (Linux only, see eventFd()). Waiting senders always use
+ * the condition variable. Locks are only taken when somebody waits.
+ *
+ * Channel objects are handles, copies refer to the same channel.
+ * Register a channel with LuaEngine::registerChannel() in every engine
+ * using it; scripts call ch:send(value [, timeout]) and
+ * ch:recv([timeout]), which returns true and the value, or false.
+ * Timeouts are in seconds, negative to wait forever, none to not wait.
+ */
+class Channel
+{
+public:
+
+    /// Concurrency mode
+    enum Mode {
+        Mode_SPSC,  ///< One sending and one receiving thread at a time.
+        Mode_MPMC   ///< Any number of sending and receiving threads.
+    };
+
+    /// How receivers wait for messages
+    enum WaitMode {
+        Wait_Condition, ///< Condition variable.
+        Wait_EventFd    ///< eventfd, falls back to condition variable where not available.
+    };
+
+    Channel();
+
+    /**
+     * Create channel.
+     * @param capacity Maximal number of queued messages, rounded up to a power of two.
+     * @param mode Concurrency mode.
+     * @param waitMode How receivers wait.
+     */
+    explicit Channel(size_t capacity, Mode mode = Mode_MPMC, WaitMode waitMode = Wait_Condition);
+
+    bool isValid() const { return m != 0; }
+
+    size_t capacity() const;
+
+    /// Number of queued messages (approximate while in use).
+    size_t size() const;
+
+    /**
+     * Queue serialized (SerialFormat_Binary) message.
+     * @param data Message, swapped with an unspecified string on success.
+     * @param timeout Time to wait for space, in microseconds (0 not to wait, negative to wait forever).
+     * @return false if the channel is full or closed.
+     */
+    bool sendSerialized(std::string &data, long long timeout = 0);
+
+    /**
+     * Dequeue serialized message.
+     * @param data Receives the message.
+     * @param timeout Time to wait for a message, in microseconds (0 not to wait, negative to wait forever).
+     * @return false if there is no message.
+     */
+    bool receiveSerialized(std::string &data, long long timeout = 0);
+
+    bool send(const Variant &value, long long timeout = 0);
+    bool receive(Variant &value, long long timeout = 0);
+
+    /**
+     * Close the channel: sending fails from now on, receivers
+     * get the queued messages and then stop waiting.
+     */
+    void close();
+    bool isClosed() const;
+
+    /**
+     * File descriptor readable while messages may be available,
+     * -1 unless the wait mode is Wait_EventFd. It counts queued messages
+     * (semaphore mode) and every received message takes its count, so
+     * an event loop polling it should not read it, just receive until
+     * the channel is empty. It stays readable once the channel is closed.
+     */
+    int eventFd() const;
+
+    /**
+     * Push Lua view of the channel onto the engine stack.
+     * The view serializes and decodes values through the engine.
+     */
+    void push(lua_State *pLuaState, LuaEngine *pLuaEngine) const;
+
+    /// Internal channel state.
+    struct Private;
+
+private:
+
+    std::shared_ptr<Private> m;
+};
+
+#endif // CHANNEL_H
@@ -0,0 +1,342 @@
+#include "LuaCompat.h"
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include "ChunkBinder.h"
+
+#if LUA_VERSION_NUM < 502
+const int ChunkBinder::cMaxBindings = 60;
+#else
+const int ChunkBinder::cMaxBindings = 100;
+#endif
+
+/// Lua reserved words
+static const char *cLuaKeywords[] = {
+    "and", "break", "do", "else", "elseif", "end", "false", "for", "function",
+    "goto", "if", "in", "local", "nil", "not", "or", "repeat", "return", "then",
+    "true", "until", "while"
+};
+
+static bool isKeyword(const char *first, size_t length)
+{
+    for (size_t i = 0; i < sizeof(cLuaKeywords) / sizeof(cLuaKeywords[0]); i++) {
+        if (strlen(cLuaKeywords[i]) == length && memcmp(cLuaKeywords[i], first, length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline bool isNameStart(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static inline bool isNameChar(char c)
+{
+    return isNameStart(c) || (c >= '0' && c <= '9');
+}
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/**
+ * Level of the long bracket ([[, [==[ etc.) starting at the position,
+ * -1 if there is none.
+ */
+static int longBracketLevel(const char *pos, const char *end)
+{
+    if (pos == end || *pos != '[') {
+        return -1;
+    }
+    int level = 0;
+    ++pos;
+    while (pos != end && *pos == '=') {
+        ++level;
+        ++pos;
+    }
+    return pos != end && *pos == '[' ? level : -1;
+}
+
+/// Skip long string or comment started by a bracket of the level.
+static const char* skipLongBracket(const char *pos, const char *end, int level)
+{
+    pos += level + 2;
+    while (pos != end) {
+        if (*pos++ != ']') {
+            continue;
+        }
+        const char *close = pos;
+        while (close != end && *close == '=') {
+            ++close;
+        }
+        if (close != end && *close == ']' && close - pos == level) {
+            return close + 1;
+        }
+    }
+    return end;
+}
+
+/// Skip string quoted by the character at the position.
+static const char* skipQuotedString(const char *pos, const char *end)
+{
+    char quote = *pos++;
+    while (pos != end && *pos != quote && *pos != '\n') {
+        if (*pos == '\\' && pos + 1 != end) {
+            ++pos;
+        }
+        ++pos;
+    }
+    return pos != end ? pos + 1 : end;
+}
+
+/// Skip comment starting at the position ("--").
+static const char* skipComment(const char *pos, const char *end)
+{
+    pos += 2;
+    int level = longBracketLevel(pos, end);
+    if (level >= 0) {
+        return skipLongBracket(pos, end, level);
+    }
+    while (pos != end && *pos != '\n') {
+        ++pos;
+    }
+    return pos;
+}
+
+/// Skip spaces and comments.
+static const char* skipBlank(const char *pos, const char *end)
+{
+    while (pos != end) {
+        if (isSpace(*pos)) {
+            ++pos;
+        } else if (*pos == '-' && pos + 1 != end && pos[1] == '-') {
+            pos = skipComment(pos, end);
+        } else {
+            break;
+        }
+    }
+    return pos;
+}
+
+/**
+ * Whether the name ending at the position is assigned to: it is followed
+ * by "=", or by "," and more assignment targets (names, fields, indexing,
+ * calls) up to "=", as in "a, t[i], f = ...". Conservative: the last name
+ * of an expression list followed by an assignment counts as well.
+ */
+static bool isAssigned(const char *pos, const char *end)
+{
+    pos = skipBlank(pos, end);
+    if (pos == end || (*pos != '=' && *pos != ',')) {
+        return false;
+    }
+
+    int depth = 0;
+    while (pos != end) {
+        char c = *pos;
+        if (isSpace(c) || (c == '-' && pos + 1 != end && pos[1] == '-')) {
+            pos = skipBlank(pos, end);
+        } else if (c == '"' || c == '\'') {
+            pos = skipQuotedString(pos, end);
+        } else if (c == '[' && longBracketLevel(pos, end) >= 0) {
+            pos = skipLongBracket(pos, end, longBracketLevel(pos, end));
+        } else if (c == '(' || c == '[' || c == '{') {
+            ++depth;
+            ++pos;
+        } else if (c == ')' || c == ']' || c == '}') {
+            if (depth == 0) {
+                return false;
+            }
+            --depth;
+            ++pos;
+        } else if (depth > 0) {
+            // Index or argument expressions
+            ++pos;
+        } else if (c == '=') {
+            return pos + 1 == end || pos[1] != '=';
+        } else if (isNameStart(c)) {
+            const char *first = pos;
+            while (pos != end && isNameChar(*pos)) {
+                ++pos;
+            }
+            if (isKeyword(first, pos - first)) {
+                return false;
+            }
+        } else if (c == ',' || c == '.' || c == ':') {
+            ++pos;
+        } else {
+            return false;
+        }
+    }
+    return false;
+}
+
+/// Reference of a bound name in the chunk
+struct NameReference
+{
+    int count;
+    bool assigned;
+};
+
+/*
+ *  class ChunkBinder
+ */
+
+ChunkBinder::ChunkBinder()
+    : m_bindings()
+{
+}
+
+void ChunkBinder::bind(const std::string &name)
+{
+    m_bindings[name] = std::string();
+}
+
+void ChunkBinder::bindConstant(const std::string &name, const std::string &literal)
+{
+    m_bindings[name] = literal;
+}
+
+void ChunkBinder::unbind(const std::string &name)
+{
+    m_bindings.erase(name);
+}
+
+bool ChunkBinder::wrap(const char *source, size_t size, std::string &result) const
+{
+    // Precompiled chunks start with the escape character (LUA_SIGNATURE)
+    if (m_bindings.empty() || size == 0 || source[0] == '\x1b') {
+        return false;
+    }
+
+    // Token preceding a name
+    enum Preceding {
+        Preceding_Other,
+        Preceding_Field,    ///< "." or ":", the name is a field.
+        Preceding_Function, ///< "function", the name may be defined.
+        Preceding_Local     ///< "local" or "goto", the name is not a global reference.
+    };
+
+    std::map<std::string, NameReference> references;
+    Preceding preceding = Preceding_Other;
+    const char *pos = source;
+    const char *end = source + size;
+
+    while (pos != end) {
+        char c = *pos;
+
+        if (isSpace(c)) {
+            ++pos;
+        } else if (isNameStart(c)) {
+            const char *first = pos;
+            while (pos != end && isNameChar(*pos)) {
+                ++pos;
+            }
+            size_t length = pos - first;
+
+            if (isKeyword(first, length)) {
+                if (length == 8 && memcmp(first, "function", 8) == 0) {
+                    preceding = Preceding_Function;
+                } else if ((length == 5 && memcmp(first, "local", 5) == 0)
+                           || (length == 4 && memcmp(first, "goto", 4) == 0)) {
+                    preceding = Preceding_Local;
+                } else {
+                    preceding = Preceding_Other;
+                }
+                continue;
+            }
+
+            if (preceding != Preceding_Field && preceding != Preceding_Local) {
+                std::string name(first, length);
+                if (m_bindings.find(name) != m_bindings.end()) {
+                    const char *next = skipBlank(pos, end);
+                    bool assigned = isAssigned(pos, end)
+                            || (preceding == Preceding_Function && (next == end || *next == '('));
+
+                    NameReference &reference = references[name];
+                    ++reference.count;
+                    reference.assigned = reference.assigned || assigned;
+                }
+            }
+            preceding = Preceding_Other;
+        } else if (c >= '0' && c <= '9') {
+            // Number, including exponent signs and hexadecimal digits
+            char prev = 0;
+            while (pos != end && (isNameChar(*pos) || *pos == '.'
+                    || ((*pos == '+' || *pos == '-') && (prev == 'e' || prev == 'E' || prev == 'p' || prev == 'P')))) {
+                prev = *pos++;
+            }
+            preceding = Preceding_Other;
+        } else if (c == '"' || c == '\'') {
+            pos = skipQuotedString(pos, end);
+            preceding = Preceding_Other;
+        } else if (c == '[') {
+            int level = longBracketLevel(pos, end);
+            pos = level >= 0 ? skipLongBracket(pos, end, level) : pos + 1;
+            preceding = Preceding_Other;
+        } else if (c == '-' && pos + 1 != end && pos[1] == '-') {
+            pos = skipComment(pos, end);
+        } else if (c == '.' || c == ':') {
+            // Concatenation, varargs and labels are not field accesses
+            const char *first = pos;
+            while (pos != end && *pos == c) {
+                ++pos;
+            }
+            preceding = pos - first == 1 ? Preceding_Field : Preceding_Other;
+        } else {
+            ++pos;
+            preceding = Preceding_Other;
+        }
+    }
+
+    // Most referenced names first
+    std::vector<std::pair<int, std::string>> names;
+    for (std::map<std::string, NameReference>::const_iterator it = references.begin(); it != references.end(); ++it) {
+        if (!it->second.assigned) {
+            names.push_back(std::make_pair(-it->second.count, it->first));
+        }
+    }
+    if (names.empty()) {
+        return false;
+    }
+    std::stable_sort(names.begin(), names.end());
+    if (names.size() > static_cast<size_t>(cMaxBindings)) {
+        names.resize(cMaxBindings);
+    }
+
+#if LUA_VERSION_NUM >= 504
+    const char *attribute = "<const>";
+#else
+    const char *attribute = "";
+#endif
+
+    // Prologue: "local a, b = a, b; local c = 1;" (space after the
+    // attribute, "<const>=" would be read as ">=")
+    std::string variables;
+    std::string values;
+    std::string constants;
+    for (std::vector<std::pair<int, std::string>>::const_iterator it = names.begin(); it != names.end(); ++it) {
+        const std::string &literal = m_bindings.find(it->second)->second;
+        if (literal.empty()) {
+            variables.append(variables.empty() ? "" : ",").append(it->second).append(attribute);
+            values.append(values.empty() ? "" : ",").append(it->second);
+        } else {
+            constants.append("local ").append(it->second).append(attribute)
+                     .append(" =").append(literal).append(";");
+        }
+    }
+
+    result.clear();
+    result.reserve(size + variables.size() + values.size() + constants.size() + 16);
+    if (!variables.empty()) {
+        result.append("local ").append(variables).append(" =").append(values).append(";");
+    }
+    result.append(constants);
+    result.append(source, size);
+
+    return true;
+}
@@ -0,0 +1,64 @@
+#ifndef CHUNKBINDER_H
+#define CHUNKBINDER_H
+
+#include <map>
+#include <string>
+
+/**
+ * @brief Rewrites Lua source chunks to bind globals as locals.
+ *
+ * Every access to a global variable is a lookup in the global table by
+ * string. The binder scans a chunk for the bound names it references and
+ * prepends a prologue declaring them as locals, initialized once when the
+ * chunk starts: `local f, obj = f, obj;`. The chunk body (and functions it
+ * defines, as upvalues) then reaches them directly. Constants are declared
+ * with their literal value instead, and in Lua 5.4 bound locals are
+ * `<const>`.
+ *
+ * The prologue is put on the first line, so line numbers in error messages
+ * and tracebacks are not affected. Names the chunk assigns to anywhere
+ * (`f = ...`, `a, f = ...`, `function f()`) are not bound, as the
+ * assignment would not reach the global.
+ */
+class ChunkBinder
+{
+public:
+
+    /**
+     * Maximal number of names bound in a chunk, leaves room for the
+     * chunk's own locals (200 per function) and, in Lua 5.1, upvalues
+     * (60 per function).
+     */
+    static const int cMaxBindings;
+
+    ChunkBinder();
+
+    /// Bind global variable, the chunk reads it once at start.
+    void bind(const std::string &name);
+
+    /**
+     * Bind global variable as a constant.
+     * @param literal Lua literal of the value (number, string, boolean or nil).
+     */
+    void bindConstant(const std::string &name, const std::string &literal);
+
+    void unbind(const std::string &name);
+
+    bool isEmpty() const { return m_bindings.empty(); }
+
+    /**
+     * Prepend bindings of the names referenced by the source.
+     * @param source Chunk source.
+     * @param size Source size.
+     * @param result Receives the rewritten chunk.
+     * @return false if there is nothing to bind (or the chunk is precompiled),
+     *         the result is not set in this case.
+     */
+    bool wrap(const char *source, size_t size, std::string &result) const;
+
+private:
+
+    std::map<std::string, std::string> m_bindings; ///< Names with literals, empty for variables.
+};
+
+#endif // CHUNKBINDER_H
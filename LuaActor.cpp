@@ -0,0 +1,340 @@
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "LuaActor.h"
+
+struct LuaActor::Private
+{
+    /// Mailbox message
+    struct Message
+    {
+        std::atomic<Message*> next;
+        Task task;
+        std::promise<Result> promise;
+    };
+
+    /// Queue message, any thread.
+    void push(Message *pMessage);
+
+    /// Dequeue message, actor thread only. Returns null if empty (or a push is in progress).
+    Message* pop();
+
+    /// Whether there are no messages, actor thread only.
+    bool isEmpty() const;
+
+    /// Queue task and wake the actor up if it sleeps.
+    std::future<Result> post(const Task &task);
+
+    /// Execute all queued messages, returns their number.
+    size_t drain(LuaEngine &lua);
+
+    /// Actor thread.
+    void run();
+
+    int libraries;
+    std::thread thread;
+
+    // Intrusive MPSC queue (Vyukov): producers exchange the head,
+    // the actor thread consumes from the tail
+    Message stub;
+    std::atomic<Message*> head;
+    Message *tail;
+
+    std::mutex mutex;               ///< Guards sleeping only.
+    std::condition_variable wakeup;
+    std::atomic<bool> sleeping;
+    std::atomic<bool> stopping;
+    std::atomic<int> posting;       ///< Producers between the stopping check and the push.
+    std::mutex stopMutex;
+
+    std::atomic<unsigned long long> requests;
+    std::atomic<unsigned long long> wakeups;
+};
+
+/// Whether the value holds a function, at any depth.
+static bool hasFunction(const Variant &value)
+{
+    switch (value.type()) {
+    case Variant::Type_Function:
+        return true;
+    case Variant::Type_List:
+        for (VariantList::const_iterator it = value.list().begin(); it != value.list().end(); ++it) {
+            if (hasFunction(*it)) {
+                return true;
+            }
+        }
+        return false;
+    case Variant::Type_Array:
+        for (VariantArray::const_iterator it = value.array().begin(); it != value.array().end(); ++it) {
+            if (hasFunction(*it)) {
+                return true;
+            }
+        }
+        return false;
+    case Variant::Type_Map:
+        for (VariantMap::const_iterator it = value.map().begin(); it != value.map().end(); ++it) {
+            if (hasFunction(it->second)) {
+                return true;
+            }
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Replace functions by null. Their handles release Lua references
+ * when destroyed, which must not happen outside of the actor thread.
+ * Shared payloads are copied on write, other copies are left intact.
+ */
+static void stripFunctions(Variant &value)
+{
+    if (!hasFunction(value)) {
+        return;
+    }
+    switch (value.type()) {
+    case Variant::Type_Function:
+        value = Variant(Variant::Type_Null);
+        break;
+    case Variant::Type_List:
+        for (VariantList::iterator it = value.list().begin(); it != value.list().end(); ++it) {
+            stripFunctions(*it);
+        }
+        break;
+    case Variant::Type_Array:
+        for (VariantArray::iterator it = value.array().begin(); it != value.array().end(); ++it) {
+            stripFunctions(*it);
+        }
+        break;
+    case Variant::Type_Map:
+        for (VariantMap::iterator it = value.map().begin(); it != value.map().end(); ++it) {
+            stripFunctions(it->second);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void LuaActor::Private::push(Message *pMessage)
+{
+    pMessage->next.store(0, std::memory_order_relaxed);
+    Message *pPrev = head.exchange(pMessage, std::memory_order_acq_rel);
+    pPrev->next.store(pMessage, std::memory_order_release);
+}
+
+LuaActor::Private::Message* LuaActor::Private::pop()
+{
+    Message *pTail = tail;
+    Message *pNext = pTail->next.load(std::memory_order_acquire);
+
+    if (pTail == &stub) {
+        if (pNext == 0) {
+            return 0;
+        }
+        tail = pNext;
+        pTail = pNext;
+        pNext = pNext->next.load(std::memory_order_acquire);
+    }
+
+    if (pNext != 0) {
+        tail = pNext;
+        return pTail;
+    }
+
+    if (pTail != head.load(std::memory_order_acquire)) {
+        // A producer has exchanged the head but not linked the message yet
+        return 0;
+    }
+
+    // Last message: put the stub behind it to keep the queue non-empty
+    push(&stub);
+    pNext = pTail->next.load(std::memory_order_acquire);
+    if (pNext != 0) {
+        tail = pNext;
+        return pTail;
+    }
+    return 0;
+}
+
+bool LuaActor::Private::isEmpty() const
+{
+    // The tail is the next message to execute unless it is the stub
+    return tail == &stub && stub.next.load(std::memory_order_acquire) == 0
+        && head.load(std::memory_order_seq_cst) == &stub;
+}
+
+std::future<LuaActor::Result> LuaActor::Private::post(const Task &task)
+{
+    Message *pMessage = new Message();
+    pMessage->task = task;
+    std::future<Result> future = pMessage->promise.get_future();
+
+    posting.fetch_add(1, std::memory_order_seq_cst);
+    if (stopping.load(std::memory_order_seq_cst)) {
+        posting.fetch_sub(1, std::memory_order_release);
+        Result result;
+        result.error.code = -1;
+        result.error.message = "actor stopped";
+        pMessage->promise.set_value(std::move(result));
+        delete pMessage;
+        return future;
+    }
+
+    push(pMessage);
+
+    // The actor publishes sleeping before checking the queue (both seq_cst),
+    // so either it sees the message or we see it sleeping
+    if (sleeping.load(std::memory_order_seq_cst)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        wakeup.notify_one();
+    }
+    posting.fetch_sub(1, std::memory_order_release);
+
+    return future;
+}
+
+size_t LuaActor::Private::drain(LuaEngine &lua)
+{
+    size_t count = 0;
+    while (!isEmpty()) {
+        Message *pMessage = pop();
+        if (pMessage == 0) {
+            // Wait for the producer to link its message
+            std::this_thread::yield();
+            continue;
+        }
+
+        Result result;
+        lua.clearError();
+        try {
+            result.value = pMessage->task(lua);
+            stripFunctions(result.value);
+            result.error = lua.lastError();
+            pMessage->promise.set_value(std::move(result));
+        } catch (...) {
+            // Task exceptions must not leave the actor thread
+            pMessage->promise.set_exception(std::current_exception());
+        }
+        delete pMessage;
+        ++count;
+    }
+
+    if (count > 0) {
+        requests.fetch_add(count, std::memory_order_relaxed);
+        wakeups.fetch_add(1, std::memory_order_relaxed);
+    }
+    return count;
+}
+
+void LuaActor::Private::run()
+{
+    LuaEngine lua(libraries);
+
+    for (;;) {
+        drain(lua);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_seq_cst);
+        if (!isEmpty()) {
+            sleeping.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        if (stopping.load(std::memory_order_acquire)) {
+            sleeping.store(false, std::memory_order_relaxed);
+            break;
+        }
+        wakeup.wait(lock, [this]() {
+            return !isEmpty() || stopping.load(std::memory_order_acquire);
+        });
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    // Requests which passed the stopping check are still executed
+    while (posting.load(std::memory_order_seq_cst) > 0) {
+        std::this_thread::yield();
+    }
+    drain(lua);
+}
+
+
+/*
+ *  class LuaActor
+ */
+
+LuaActor::LuaActor(int libraries)
+{
+    m = new LuaActor::Private();
+    m->libraries = libraries;
+    m->stub.next = 0;
+    m->head = &m->stub;
+    m->tail = &m->stub;
+    m->sleeping = false;
+    m->stopping = false;
+    m->posting = 0;
+    m->requests = 0;
+    m->wakeups = 0;
+    m->thread = std::thread(&LuaActor::Private::run, m);
+}
+
+LuaActor::~LuaActor()
+{
+    stop();
+    delete m;
+}
+
+std::future<LuaActor::Result> LuaActor::evaluate(const std::string &script, const std::string &chunkName)
+{
+    return m->post([script, chunkName](LuaEngine &lua) {
+        return lua.evaluate(script, chunkName);
+    });
+}
+
+std::future<LuaActor::Result> LuaActor::evaluateFile(const std::string &fileName)
+{
+    return m->post([fileName](LuaEngine &lua) {
+        return lua.evaluateFile(fileName);
+    });
+}
+
+std::future<LuaActor::Result> LuaActor::invoke(const std::string &funcName, const VariantList &args)
+{
+    return m->post([funcName, args](LuaEngine &lua) {
+        return lua.invoke(funcName, args);
+    });
+}
+
+std::future<LuaActor::Result> LuaActor::execute(const Task &task)
+{
+    return m->post(task);
+}
+
+void LuaActor::stop()
+{
+    std::lock_guard<std::mutex> stopLock(m->stopMutex);
+    if (!m->thread.joinable()) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m->mutex);
+        m->stopping.store(true, std::memory_order_seq_cst);
+        m->wakeup.notify_one();
+    }
+    m->thread.join();
+}
+
+bool LuaActor::isRunning() const
+{
+    return !m->stopping.load(std::memory_order_acquire);
+}
+
+LuaActor::Statistics LuaActor::statistics() const
+{
+    Statistics res;
+    res.requests = m->requests.load(std::memory_order_relaxed);
+    res.wakeups = m->wakeups.load(std::memory_order_relaxed);
+    return res;
+}
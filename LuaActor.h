@@ -0,0 +1,89 @@
+#ifndef LUAACTOR_H
+#define LUAACTOR_H
+
+#include <string>
+#include <future>
+#include <functional>
+#include "LuaEngine.h"
+
+/**
+ * @brief Lua engine running on a thread of its own.
+ *
+ * The actor owns a LuaEngine and a dedicated thread, the only one
+ * touching the engine. Requests (evaluate, invoke or any task using the
+ * engine) can be posted from any thread into a lock-free multi-producer
+ * mailbox and are executed in posting order; results come back through
+ * futures. Requests queued while the actor is busy are all executed
+ * within a single wakeup, and posting only takes a lock when the actor
+ * thread is sleeping.
+ *
+ * Arguments and results cross threads as Variants, which share their
+ * payloads safely; arguments must not be allocated in a VariantArena
+ * (see Variant::clone()). Functions in results are replaced by null
+ * on the actor thread, as their handles belong to the actor engine:
+ * keep functions in the engine (e.g. in globals) and call them by name
+ * or from tasks.
+ */
+class LuaActor
+{
+public:
+
+    /// Request outcome
+    struct Result
+    {
+        Variant value;          ///< Returned value.
+        LuaEngine::Error error; ///< Error, code -1 if the actor has been stopped.
+
+        bool isError() const { return error.code != 0; }
+    };
+
+    /// Task run on the actor thread
+    typedef std::function<Variant(LuaEngine &lua)> Task;
+
+    /// Mailbox counters
+    struct Statistics
+    {
+        unsigned long long requests;    ///< Executed requests.
+        unsigned long long wakeups;     ///< Times the actor thread has woken up to drain the mailbox.
+    };
+
+    /**
+     * Start actor thread with a new engine.
+     * @param libraries Standard libraries of the engine, see LuaEngine::Library.
+     */
+    explicit LuaActor(int libraries = LuaEngine::Library_All);
+
+    /// Execute the queued requests and stop the thread.
+    ~LuaActor();
+
+    std::future<Result> evaluate(const std::string &script, const std::string &chunkName = std::string());
+    std::future<Result> evaluateFile(const std::string &fileName);
+    std::future<Result> invoke(const std::string &funcName, const VariantList &args = VariantList());
+
+    /**
+     * Run task with the engine on the actor thread, e.g. to register
+     * natives. The error is the engine error after the task. Exceptions
+     * thrown by the task are rethrown by the future's get().
+     */
+    std::future<Result> execute(const Task &task);
+
+    /**
+     * Stop accepting requests, execute the queued ones and stop the thread.
+     * Requests posted later fail immediately.
+     */
+    void stop();
+
+    bool isRunning() const;
+
+    Statistics statistics() const;
+
+private:
+
+    LuaActor(const LuaActor&) = delete;
+    LuaActor& operator =(const LuaActor&) = delete;
+
+    struct Private;
+    Private *m;
+};
+
+#endif // LUAACTOR_H
@@ -0,0 +1,227 @@
+#ifndef LUACOMPAT_H
+#define LUACOMPAT_H
+
+/**
+ * Lua C API compatibility layer.
+ *
+ * Include this header instead of the Lua headers. It brings the
+ * Lua 5.1 (and LuaJIT) and 5.2 APIs up to the subset of Lua 5.3
+ * used by the wrapper, so the same code builds against Lua 5.1,
+ * LuaJIT 2.x, 5.2, 5.3 and 5.4. The backend is selected by the
+ * include and library paths of the build (see cxLua.cbp targets);
+ * LuaJIT builds must also define CXLUA_LUAJIT.
+ *
+ * Functions whose signature differs between versions are wrapped
+ * under the cxlua_ prefix.
+ */
+
+extern "C"
+{
+    #include <lua.h>
+    #include <lauxlib.h>
+    #include <lualib.h>
+#ifdef CXLUA_LUAJIT
+    #include <luajit.h>
+#endif
+}
+
+#include <math.h>
+
+#if LUA_VERSION_NUM < 502
+
+/*
+ *  Lua 5.1 and LuaJIT
+ */
+
+#ifndef LUA_OK
+#define LUA_OK 0
+#endif
+
+#define lua_rawlen(L, i) lua_objlen(L, (i))
+#define lua_pushglobaltable(L) lua_pushvalue(L, LUA_GLOBALSINDEX)
+
+static inline int lua_absindex(lua_State *L, int i)
+{
+    return (i > 0 || i <= LUA_REGISTRYINDEX) ? i : lua_gettop(L) + i + 1;
+}
+
+static inline void lua_len(lua_State *L, int i)
+{
+    i = lua_absindex(L, i);
+    if (!luaL_callmeta(L, i, "__len")) {
+        lua_pushnumber(L, static_cast<lua_Number>(lua_objlen(L, i)));
+    }
+}
+
+#ifndef LUAJIT_VERSION
+// LuaJIT 2.x provides these Lua 5.2 functions itself
+
+static inline lua_Number lua_tonumberx(lua_State *L, int i, int *isnum)
+{
+    lua_Number n = lua_tonumber(L, i);
+    if (isnum) {
+        *isnum = (n != 0 || lua_isnumber(L, i)) ? 1 : 0;
+    }
+    return n;
+}
+
+static inline lua_Integer lua_tointegerx(lua_State *L, int i, int *isnum)
+{
+    lua_Integer n = lua_tointeger(L, i);
+    if (isnum) {
+        *isnum = (n != 0 || lua_isnumber(L, i)) ? 1 : 0;
+    }
+    return n;
+}
+
+static inline void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup)
+{
+    luaL_checkstack(L, nup, "too many upvalues");
+    for (; l->name != 0; l++) {
+        for (int i = 0; i < nup; i++) {
+            lua_pushvalue(L, -nup);
+        }
+        lua_pushcclosure(L, l->func, nup);
+        lua_setfield(L, -(nup + 2), l->name);
+    }
+    lua_pop(L, nup);
+}
+
+/// Load mode is not supported, chunks may be either text or binary.
+#define luaL_loadbufferx(L, b, sz, n, mode) luaL_loadbuffer(L, (b), (sz), (n))
+
+#endif // LUAJIT_VERSION
+
+static inline void luaL_requiref(lua_State *L, const char *modname, lua_CFunction openf, int glb)
+{
+    lua_pushcfunction(L, openf);
+    lua_pushstring(L, modname);
+    lua_call(L, 1, 1);
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    lua_pushvalue(L, -2);
+    lua_setfield(L, -2, modname);
+    lua_pop(L, 1);
+    if (glb) {
+        lua_pushvalue(L, -1);
+        lua_setglobal(L, modname);
+    }
+}
+
+#endif // LUA_VERSION_NUM < 502
+
+#if LUA_VERSION_NUM < 503
+
+/*
+ *  Lua 5.1, LuaJIT and 5.2: numbers are doubles only,
+ *  whole numbers are treated as integers.
+ */
+
+static inline int lua_isinteger(lua_State *L, int i)
+{
+    if (lua_type(L, i) != LUA_TNUMBER) {
+        return 0;
+    }
+    lua_Number n = lua_tonumber(L, i);
+    return (n == floor(n) && n >= -9007199254740992.0 && n <= 9007199254740992.0) ? 1 : 0;
+}
+
+#endif // LUA_VERSION_NUM < 503
+
+/**
+ * Dump function on top of the stack as bytecode.
+ * Stripping debug information is ignored before Lua 5.3.
+ */
+static inline int cxlua_dump(lua_State *L, lua_Writer writer, void *data, int strip)
+{
+#if LUA_VERSION_NUM >= 503
+    return lua_dump(L, writer, data, strip);
+#else
+    (void)strip;
+    return lua_dump(L, writer, data);
+#endif
+}
+
+/**
+ * Set environment table (popped from the stack) of the Lua function at given index.
+ * Lua 5.2+ replace the _ENV upvalue, which is the first upvalue of main chunks.
+ */
+static inline void cxlua_setfuncenv(lua_State *L, int funcIndex)
+{
+#if LUA_VERSION_NUM >= 502
+    if (lua_setupvalue(L, funcIndex, 1) == 0) {
+        lua_pop(L, 1);
+    }
+#else
+    lua_setfenv(L, funcIndex);
+#endif
+}
+
+/**
+ * Resume coroutine, the number of results is returned in *nresults.
+ */
+static inline int cxlua_resume(lua_State *L, lua_State *from, int nargs, int *nresults)
+{
+#if LUA_VERSION_NUM >= 504
+    return lua_resume(L, from, nargs, nresults);
+#elif LUA_VERSION_NUM >= 502
+    int status = lua_resume(L, from, nargs);
+    *nresults = lua_gettop(L);
+    return status;
+#else
+    (void)from;
+    int status = lua_resume(L, nargs);
+    *nresults = lua_gettop(L);
+    return status;
+#endif
+}
+
+/**
+ * Close suspended or failed coroutine, running its pending to-be-closed
+ * variables (Lua 5.4). Returns the status, with the error object on top
+ * of the coroutine stack on failure. Older versions have nothing to close.
+ */
+static inline int cxlua_closethread(lua_State *L, lua_State *from)
+{
+#if LUA_VERSION_NUM >= 504 && LUA_VERSION_RELEASE_NUM >= 50406
+    return lua_closethread(L, from);
+#elif LUA_VERSION_NUM >= 504
+    (void)from;
+    return lua_resetthread(L);
+#else
+    (void)L;
+    (void)from;
+    return LUA_OK;
+#endif
+}
+
+/**
+ * Yieldable protected call continuations.
+ *
+ * With Lua 5.3 and 5.4 the continuation is called when the callee
+ * yields and is resumed later. Lua 5.1 and LuaJIT have no continuations
+ * and 5.2 has an incompatible signature: on those the call is not yieldable
+ * and the continuation is never called, the caller has to handle the
+ * results after cxlua_pcallk returns (which is the same for non-yielding
+ * calls on all versions).
+ */
+#if LUA_VERSION_NUM >= 503
+typedef lua_KContext cxlua_KContext;
+typedef lua_KFunction cxlua_KFunction;
+#else
+typedef ptrdiff_t cxlua_KContext;
+typedef int (*cxlua_KFunction)(lua_State *L, int status, cxlua_KContext ctx);
+#endif
+
+static inline int cxlua_pcallk(lua_State *L, int nargs, int nresults, int msgh,
+                               cxlua_KContext ctx, cxlua_KFunction k)
+{
+#if LUA_VERSION_NUM >= 503
+    return lua_pcallk(L, nargs, nresults, msgh, ctx, k);
+#else
+    (void)ctx;
+    (void)k;
+    return lua_pcall(L, nargs, nresults, msgh);
+#endif
+}
+
+#endif // LUACOMPAT_H
@@ -1,12 +1,12 @@
-extern "C"
-{
-    #include <lua.h>
-    #include <lauxlib.h>
-    #include <lualib.h>
-}
+#include "LuaCompat.h"
 
-#include <sstream>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include "Utils.h"
 #include "LuaEngine.h"
+#include "ModuleBuilder.h"
 
 /**
  * Global variable used to store script engine reference in
@@ -17,6 +17,44 @@ const static char *cLuaScriptEngineRef = "__script_engine__";
 /// Maximal allowed depth of Lua tables
 const static int cLuaMaxTableLevel = 16;
 
+/// Maximal number of table slots preallocated from the size hint of decoded data
+const static size_t cLuaMaxSizeHint = 1 << 16;
+
+/// Maximal number of stack frames captured on error
+const static int cLuaMaxTracebackFrames = 32;
+
+/// Registry key of the metatable shared by all sandbox environments
+const static char *cLuaSandboxMetatable = "cxLua.Sandbox";
+
+/// Standard libraries
+static const struct {
+    int flag;
+    const char *name;
+    lua_CFunction open;
+} cLuaLibraries[] = {
+    { LuaEngine::Library_Base,      "_G",             luaopen_base },
+    { LuaEngine::Library_Package,   LUA_LOADLIBNAME,  luaopen_package },
+#if LUA_VERSION_NUM >= 502
+    { LuaEngine::Library_Coroutine, LUA_COLIBNAME,    luaopen_coroutine },
+#endif
+    { LuaEngine::Library_Table,     LUA_TABLIBNAME,   luaopen_table },
+    { LuaEngine::Library_IO,        LUA_IOLIBNAME,    luaopen_io },
+    { LuaEngine::Library_OS,        LUA_OSLIBNAME,    luaopen_os },
+    { LuaEngine::Library_String,    LUA_STRLIBNAME,   luaopen_string },
+    { LuaEngine::Library_Math,      LUA_MATHLIBNAME,  luaopen_math },
+#if LUA_VERSION_NUM >= 503
+    { LuaEngine::Library_UTF8,      LUA_UTF8LIBNAME,  luaopen_utf8 },
+#endif
+    { LuaEngine::Library_Debug,     LUA_DBLIBNAME,    luaopen_debug }
+};
+
+/// Current time in microseconds.
+static long long microseconds()
+{
+    using namespace std::chrono;
+    return duration_cast<std::chrono::microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
 static LuaEngine* getLuaEngine(lua_State *pLuaState)
 {
 	lua_getglobal(pLuaState, cLuaScriptEngineRef);
@@ -26,6 +64,440 @@ static LuaEngine* getLuaEngine(lua_State *pLuaState)
 	return static_cast<LuaEngine*>(ptr);
 }
 
+/**
+ * Lua source literal of the string at the stack index, control
+ * characters are escaped so that the literal stays on one line.
+ */
+static std::string luaStringLiteral(lua_State *pLuaState, int index)
+{
+    size_t length = 0;
+    const char *str = lua_tolstring(pLuaState, index, &length);
+
+    std::string res("\"");
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = static_cast<unsigned char>(str[i]);
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += static_cast<char>(c);
+        } else if (c < 0x20 || c == 0x7f) {
+            // Three digits, so that a following digit is not taken in
+            char escape[5] = { '\\', static_cast<char>('0' + c / 100),
+                               static_cast<char>('0' + c / 10 % 10), static_cast<char>('0' + c % 10), 0 };
+            res += escape;
+        } else {
+            res += static_cast<char>(c);
+        }
+    }
+    res += '"';
+
+    return res;
+}
+
+/**
+ * Format chunk name the way Lua does in error messages.
+ */
+static std::string chunkId(const char *chunkName)
+{
+    if (*chunkName == '=' || *chunkName == '@') {
+        return std::string(chunkName + 1);
+    }
+
+    // String chunk: show the first line only
+    const char *eol = chunkName;
+    while (*eol != '\0' && *eol != '\n' && *eol != '\r') {
+        ++eol;
+    }
+    std::string id("[string \"");
+    id.append(chunkName, eol);
+    if (*eol != '\0') {
+        id.append("...");
+    }
+    id.append("\"]");
+    return id;
+}
+
+/// Append stack frames from the given level on to the error traceback.
+static void captureFrames(lua_State *pLuaState, int firstLevel, LuaEngine::Error &error)
+{
+    lua_Debug ar;
+    for (int level = firstLevel; level < firstLevel + cLuaMaxTracebackFrames && lua_getstack(pLuaState, level, &ar); level++) {
+        lua_getinfo(pLuaState, "Sln", &ar);
+        LuaEngine::StackFrame frame;
+        frame.source = ar.short_src;
+        frame.function = ar.name ? ar.name : "";
+        frame.what = ar.what ? ar.what : "";
+        frame.line = ar.currentline;
+        if (error.chunkName.empty() && frame.what != "C") {
+            error.chunkName = frame.source;
+        }
+        error.frames.push_back(frame);
+    }
+}
+
+static void pushReadOnlyProxy(lua_State *pLuaState, int index, int cacheIndex, int hiddenIndex);
+
+/**
+ * Replace table on top of the stack with its read-only proxy, so that
+ * nested tables are protected too. Proxies are created once and kept in
+ * the weak cache at cacheIndex. Tables in the hidden set at hiddenIndex
+ * (the global table, the registry, the debug library) are replaced with
+ * nil, they are never exposed.
+ */
+static void wrapReadOnly(lua_State *pLuaState, int cacheIndex, int hiddenIndex)
+{
+    if (lua_type(pLuaState, -1) != LUA_TTABLE) {
+        return;
+    }
+
+    lua_pushvalue(pLuaState, -1);
+    lua_rawget(pLuaState, hiddenIndex);
+    bool hidden = lua_toboolean(pLuaState, -1) != 0;
+    lua_pop(pLuaState, 1);
+    if (hidden) {
+        lua_pop(pLuaState, 1);
+        lua_pushnil(pLuaState);
+        return;
+    }
+
+    lua_pushvalue(pLuaState, -1);
+    lua_rawget(pLuaState, cacheIndex);
+    if (lua_isnil(pLuaState, -1)) {
+        lua_pop(pLuaState, 1);
+        pushReadOnlyProxy(pLuaState, -1, cacheIndex, hiddenIndex);
+        lua_pushvalue(pLuaState, -2);
+        lua_pushvalue(pLuaState, -2);
+        lua_rawset(pLuaState, cacheIndex);
+    }
+    lua_replace(pLuaState, -2);
+}
+
+/**
+ * Lookup in a read-only proxy. Upvalue 1 is the target table,
+ * upvalue 2 the proxy cache and upvalue 3 the hidden set.
+ */
+static int readOnlyIndex(lua_State *pLuaState)
+{
+    lua_settop(pLuaState, 2);
+    lua_gettable(pLuaState, lua_upvalueindex(1));
+    wrapReadOnly(pLuaState, lua_upvalueindex(2), lua_upvalueindex(3));
+    return 1;
+}
+
+static int readOnlyNewIndex(lua_State *pLuaState)
+{
+    return luaL_error(pLuaState, "attempt to modify a read-only table");
+}
+
+/// Iterator over a read-only proxy, upvalues as of readOnlyIndex.
+static int readOnlyNext(lua_State *pLuaState)
+{
+    lua_settop(pLuaState, 2);
+    if (lua_next(pLuaState, lua_upvalueindex(1))) {
+        wrapReadOnly(pLuaState, lua_upvalueindex(2), lua_upvalueindex(3));
+        return 2;
+    }
+    return 0;
+}
+
+static int readOnlyPairs(lua_State *pLuaState)
+{
+    lua_pushvalue(pLuaState, lua_upvalueindex(1));
+    lua_pushvalue(pLuaState, lua_upvalueindex(2));
+    lua_pushvalue(pLuaState, lua_upvalueindex(3));
+    lua_pushcclosure(pLuaState, readOnlyNext, 3);
+    lua_pushvalue(pLuaState, 1);
+    lua_pushnil(pLuaState);
+    return 3;
+}
+
+static int readOnlyLength(lua_State *pLuaState)
+{
+    lua_pushinteger(pLuaState, static_cast<lua_Integer>(lua_rawlen(pLuaState, lua_upvalueindex(1))));
+    return 1;
+}
+
+/**
+ * Push read-only proxy of the table at given index.
+ * The proxy is a userdata so it cannot be modified with rawset.
+ * Tables read through the proxy are wrapped in proxies as well,
+ * using the cache and the hidden set at given indices.
+ */
+static void pushReadOnlyProxy(lua_State *pLuaState, int index, int cacheIndex, int hiddenIndex)
+{
+    index = lua_absindex(pLuaState, index);
+    cacheIndex = lua_absindex(pLuaState, cacheIndex);
+    hiddenIndex = lua_absindex(pLuaState, hiddenIndex);
+    lua_newuserdata(pLuaState, 0);
+    lua_createtable(pLuaState, 0, 5);
+    lua_pushvalue(pLuaState, index);
+    lua_pushvalue(pLuaState, cacheIndex);
+    lua_pushvalue(pLuaState, hiddenIndex);
+    lua_pushcclosure(pLuaState, readOnlyIndex, 3);
+    lua_setfield(pLuaState, -2, "__index");
+    lua_pushcfunction(pLuaState, readOnlyNewIndex);
+    lua_setfield(pLuaState, -2, "__newindex");
+    lua_pushvalue(pLuaState, index);
+    lua_pushvalue(pLuaState, cacheIndex);
+    lua_pushvalue(pLuaState, hiddenIndex);
+    lua_pushcclosure(pLuaState, readOnlyPairs, 3);
+    lua_setfield(pLuaState, -2, "__pairs");
+    lua_pushvalue(pLuaState, index);
+    lua_pushcclosure(pLuaState, readOnlyLength, 1);
+    lua_setfield(pLuaState, -2, "__len");
+    lua_pushboolean(pLuaState, 0);
+    lua_setfield(pLuaState, -2, "__metatable");
+    lua_setmetatable(pLuaState, -2);
+}
+
+/**
+ * Global lookup for sandbox environments.
+ * Upvalue 1 is the global table, upvalue 2 is a weak cache of
+ * read-only proxies of global tables, upvalue 3 is the hidden set,
+ * which also holds the names of the hidden globals (e.g. dofile).
+ */
+static int sandboxIndex(lua_State *pLuaState)
+{
+    lua_settop(pLuaState, 2);
+    lua_pushvalue(pLuaState, 2);
+    lua_rawget(pLuaState, lua_upvalueindex(3));
+    if (lua_toboolean(pLuaState, -1)) {
+        lua_pushnil(pLuaState);
+        return 1;
+    }
+    lua_pop(pLuaState, 1);
+
+    lua_rawget(pLuaState, lua_upvalueindex(1));
+    wrapReadOnly(pLuaState, lua_upvalueindex(2), lua_upvalueindex(3));
+    return 1;
+}
+
+/**
+ * Replacement of require() for sandbox environments: modules are
+ * returned as read-only proxies. Upvalue 1 is the original require(),
+ * upvalues 2 and 3 as of sandboxIndex.
+ */
+static int sandboxRequire(lua_State *pLuaState)
+{
+    lua_pushvalue(pLuaState, lua_upvalueindex(1));
+    lua_insert(pLuaState, 1);
+    lua_call(pLuaState, lua_gettop(pLuaState) - 1, LUA_MULTRET);
+    if (lua_gettop(pLuaState) > 0) {
+        lua_pushvalue(pLuaState, 1);
+        wrapReadOnly(pLuaState, lua_upvalueindex(2), lua_upvalueindex(3));
+        lua_replace(pLuaState, 1);
+    }
+    return lua_gettop(pLuaState);
+}
+
+/**
+ * Replacement of getmetatable() for sandbox environments. Metatables of
+ * values other than tables (e.g. the string metatable) are shared by the
+ * whole engine and are returned as read-only proxies. Upvalues 1 and 2
+ * are the proxy cache and the hidden set.
+ */
+static int sandboxGetMetatable(lua_State *pLuaState)
+{
+    luaL_checkany(pLuaState, 1);
+    if (!lua_getmetatable(pLuaState, 1)) {
+        lua_pushnil(pLuaState);
+        return 1;
+    }
+
+    // Protected metatable
+    lua_pushliteral(pLuaState, "__metatable");
+    lua_rawget(pLuaState, -2);
+    if (!lua_isnil(pLuaState, -1)) {
+        return 1;
+    }
+    lua_pop(pLuaState, 1);
+
+    if (lua_type(pLuaState, 1) != LUA_TTABLE) {
+        wrapReadOnly(pLuaState, lua_upvalueindex(1), lua_upvalueindex(2));
+    }
+    return 1;
+}
+
+/**
+ * Replacement of load() for sandbox environments: text chunks only,
+ * loaded into the calling environment (upvalue 1) unless specified.
+ */
+static int sandboxLoad(lua_State *pLuaState)
+{
+    int nArgs = lua_gettop(pLuaState);
+#if LUA_VERSION_NUM >= 502
+    lua_getglobal(pLuaState, "load");
+    lua_pushvalue(pLuaState, 1);
+    if (nArgs >= 2) {
+        lua_pushvalue(pLuaState, 2);
+    } else {
+        lua_pushnil(pLuaState);
+    }
+    lua_pushliteral(pLuaState, "t");
+    if (nArgs >= 4) {
+        lua_pushvalue(pLuaState, 4);
+    } else {
+        lua_pushvalue(pLuaState, lua_upvalueindex(1));
+    }
+    lua_call(pLuaState, 4, LUA_MULTRET);
+    return lua_gettop(pLuaState) - nArgs;
+#else
+    // Lua 5.1 loads strings with loadstring() and has no load modes
+    size_t length = 0;
+    const char *str = lua_tolstring(pLuaState, 1, &length);
+    if (str && length > 0 && str[0] == LUA_SIGNATURE[0]) {
+        lua_pushnil(pLuaState);
+        lua_pushliteral(pLuaState, "attempt to load a binary chunk");
+        return 2;
+    }
+    lua_getglobal(pLuaState, str ? "loadstring" : "load");
+    lua_pushvalue(pLuaState, 1);
+    if (nArgs >= 2) {
+        lua_pushvalue(pLuaState, 2);
+    } else {
+        lua_pushnil(pLuaState);
+    }
+    lua_call(pLuaState, 2, 2);
+    if (!lua_isfunction(pLuaState, -2)) {
+        return 2;
+    }
+    lua_pop(pLuaState, 1);
+    if (nArgs >= 4) {
+        lua_pushvalue(pLuaState, 4);
+    } else {
+        lua_pushvalue(pLuaState, lua_upvalueindex(1));
+    }
+    lua_setfenv(pLuaState, -2);
+    return 1;
+#endif
+}
+
+/**
+ * Serialized values handler building Lua values on the stack.
+ */
+class LuaStackBuilder : public ValueHandler
+{
+public:
+
+    LuaStackBuilder(lua_State *pLuaState, int maxLevel)
+        : m_pLuaState(pLuaState),
+          m_maxLevel(maxLevel),
+          m_frames()
+    {
+    }
+
+    bool onNull() override
+    {
+        lua_pushnil(m_pLuaState);
+        return store();
+    }
+
+    bool onBoolean(bool value) override
+    {
+        lua_pushboolean(m_pLuaState, value ? 1 : 0);
+        return store();
+    }
+
+    bool onInteger(long long value) override
+    {
+        lua_pushinteger(m_pLuaState, static_cast<lua_Integer>(value));
+        return store();
+    }
+
+    bool onReal(double value) override
+    {
+        lua_pushnumber(m_pLuaState, value);
+        return store();
+    }
+
+    bool onString(const char *str, size_t length) override
+    {
+        lua_pushlstring(m_pLuaState, str, length);
+        return store();
+    }
+
+    bool onBeginList(size_t sizeHint) override
+    {
+        return begin(true, sizeHint, 0);
+    }
+
+    bool onEndList() override
+    {
+        m_frames.pop_back();
+        return store();
+    }
+
+    bool onBeginMap(size_t sizeHint) override
+    {
+        return begin(false, 0, sizeHint);
+    }
+
+    bool onKey(const char *key, size_t length) override
+    {
+        lua_pushlstring(m_pLuaState, key, length);
+        return true;
+    }
+
+    bool onEndMap() override
+    {
+        m_frames.pop_back();
+        return store();
+    }
+
+private:
+
+    /// Open table frame: number of list items stored so far, or -1 for a map.
+    typedef lua_Integer Frame;
+
+    bool begin(bool list, size_t nArray, size_t nRecords)
+    {
+        if (static_cast<int>(m_frames.size()) >= m_maxLevel || !lua_checkstack(m_pLuaState, 4)) {
+            return false;
+        }
+        // Size hints only preallocate, larger tables grow as they are filled
+        lua_createtable(m_pLuaState, static_cast<int>(std::min(nArray, cLuaMaxSizeHint)),
+                        static_cast<int>(std::min(nRecords, cLuaMaxSizeHint)));
+        m_frames.push_back(list ? 0 : -1);
+        return true;
+    }
+
+    /// Store value on top of the stack into the enclosing table, if any.
+    bool store()
+    {
+        if (m_frames.empty()) {
+            return true;
+        }
+        Frame &frame = m_frames.back();
+        if (frame < 0) {
+            // Table, key, value
+            lua_rawset(m_pLuaState, -3);
+        } else {
+            lua_rawseti(m_pLuaState, -2, ++frame);
+        }
+        return true;
+    }
+
+    lua_State *m_pLuaState;
+    int m_maxLevel;
+    std::vector<Frame> m_frames;
+};
+
+/// Decoding input, parsed under lua_pcall so that Lua errors (out of memory) do not escape.
+struct SerializedInput
+{
+    ValueReader *pReader;
+    const char *data;
+    size_t size;
+    bool parsed;
+};
+
+static int parseSerialized(lua_State *pLuaState)
+{
+    SerializedInput *pInput = static_cast<SerializedInput*>(lua_touserdata(pLuaState, 1));
+    lua_pop(pLuaState, 1);
+    pInput->parsed = pInput->pReader->parse(pInput->data, pInput->size);
+    return lua_gettop(pLuaState);
+}
+
 static int scriptableObjectGateway(lua_State *pLuaState)
 {
 	LuaEngine *pLuaEngine = getLuaEngine(pLuaState);
@@ -41,13 +513,54 @@ static int scriptableObjectGateway(lua_State *pLuaState)
 	int nArgs = lua_gettop(pLuaState);
 	VariantList args;
 	for (int i = 0; i < nArgs; i++) {
-		args.push_front(pLuaEngine->popValue());
+		args.push_front(pLuaEngine->popValue(pLuaState));
+	}
+
+	MetricsTimer timer(pLuaEngine->metrics(), Metrics::Operation_NativeCall);
+	// Qualified name is only fetched when recording
+	Recorder *pRecorder = pLuaEngine->recorder();
+	RecorderScope record(pRecorder, Recorder::Event_NativeCall,
+	                     pRecorder ? lua_tostring(pLuaState, lua_upvalueindex(3)) : 0);
+	record.setArgs(args);
+
+	// Invoke the method
+	Variant ret = pScriptable->invokeMethod(methodName, args);
+	record.setResult(ret);
+	if (ret.isValid()) {
+        pLuaEngine->pushValue(pLuaState, ret);
+		return 1;
 	}
 
+    // No return value from the method
+	return 0;
+}
+
+static int scriptableViewGateway(lua_State *pLuaState)
+{
+	LuaEngine *pLuaEngine = getLuaEngine(pLuaState);
+
+	// Fetch method name
+	std::string methodName(lua_tostring(pLuaState, lua_upvalueindex(1)));
+
+	// Fetch object pointer
+	void *ptr = lua_touserdata(pLuaState, lua_upvalueindex(2));
+	Scriptable *pScriptable = static_cast<Scriptable*>(ptr);
+
+	// Arguments are left on the stack
+	ArgumentView args(pLuaEngine, pLuaState, 1, lua_gettop(pLuaState));
+
+	MetricsTimer timer(pLuaEngine->metrics(), Metrics::Operation_NativeCall);
+	// Qualified name is only fetched when recording
+	Recorder *pRecorder = pLuaEngine->recorder();
+	RecorderScope record(pRecorder, Recorder::Event_NativeCall,
+	                     pRecorder ? lua_tostring(pLuaState, lua_upvalueindex(3)) : 0);
+	record.setArgs(args);
+
 	// Invoke the method
 	Variant ret = pScriptable->invokeMethod(methodName, args);
+	record.setResult(ret);
 	if (ret.isValid()) {
-        pLuaEngine->pushValue(ret);
+        pLuaEngine->pushValue(pLuaState, ret);
 		return 1;
 	}
 
@@ -55,6 +568,128 @@ static int scriptableObjectGateway(lua_State *pLuaState)
 	return 0;
 }
 
+/**
+ * Read property of a scriptable object (__index metamethod).
+ * Upvalues: table of properties, scriptable object.
+ */
+static int scriptablePropertyIndex(lua_State *pLuaState)
+{
+    lua_pushvalue(pLuaState, 2);
+    lua_rawget(pLuaState, lua_upvalueindex(1));
+    const Scriptable::Property *pProperty = static_cast<const Scriptable::Property*>(lua_touserdata(pLuaState, -1));
+    if (pProperty == 0) {
+        // Not a property
+        return 1;
+    }
+
+    Scriptable *pScriptable = static_cast<Scriptable*>(lua_touserdata(pLuaState, lua_upvalueindex(2)));
+    const void *ptr = pScriptable->propertyAddress(*pProperty);
+
+    switch (pProperty->type) {
+    case Scriptable::Property_Boolean:
+        lua_pushboolean(pLuaState, *static_cast<const bool*>(ptr) ? 1 : 0);
+        break;
+    case Scriptable::Property_Integer:
+        lua_pushinteger(pLuaState, static_cast<lua_Integer>(*static_cast<const int*>(ptr)));
+        break;
+    case Scriptable::Property_Integer64:
+        lua_pushinteger(pLuaState, static_cast<lua_Integer>(*static_cast<const long long*>(ptr)));
+        break;
+    case Scriptable::Property_Float:
+        lua_pushnumber(pLuaState, static_cast<lua_Number>(*static_cast<const float*>(ptr)));
+        break;
+    case Scriptable::Property_Real:
+        lua_pushnumber(pLuaState, static_cast<lua_Number>(*static_cast<const double*>(ptr)));
+        break;
+    case Scriptable::Property_String: {
+        const std::string *pString = static_cast<const std::string*>(ptr);
+        lua_pushlstring(pLuaState, pString->data(), pString->size());
+        break;
+    }
+    case Scriptable::Property_Accessor:
+        getLuaEngine(pLuaState)->pushValue(pLuaState, (pScriptable->*pProperty->getter)());
+        break;
+    }
+
+    return 1;
+}
+
+/**
+ * Assign property of a scriptable object (__newindex metamethod).
+ * Other keys are assigned to the object table itself.
+ * Upvalues: table of properties, scriptable object.
+ */
+static int scriptablePropertyNewIndex(lua_State *pLuaState)
+{
+    lua_settop(pLuaState, 3);
+    lua_pushvalue(pLuaState, 2);
+    lua_rawget(pLuaState, lua_upvalueindex(1));
+    const Scriptable::Property *pProperty = static_cast<const Scriptable::Property*>(lua_touserdata(pLuaState, -1));
+    lua_pop(pLuaState, 1);
+    if (pProperty == 0) {
+        lua_rawset(pLuaState, 1);
+        return 0;
+    }
+    if (pProperty->readOnly) {
+        return luaL_error(pLuaState, "property '%s' is read-only", lua_tostring(pLuaState, 2));
+    }
+
+    Scriptable *pScriptable = static_cast<Scriptable*>(lua_touserdata(pLuaState, lua_upvalueindex(2)));
+    void *ptr = pScriptable->propertyAddress(*pProperty);
+    int isNum = 0;
+
+    // Errors are raised before any C++ object is constructed
+    switch (pProperty->type) {
+    case Scriptable::Property_Boolean:
+        *static_cast<bool*>(ptr) = lua_toboolean(pLuaState, 3) != 0;
+        break;
+    case Scriptable::Property_Integer:
+    case Scriptable::Property_Integer64: {
+        lua_Integer i = lua_tointegerx(pLuaState, 3, &isNum);
+        if (!isNum) {
+            lua_Number n = lua_tonumberx(pLuaState, 3, &isNum);
+            if (!isNum) {
+                return luaL_error(pLuaState, "property '%s': number expected", lua_tostring(pLuaState, 2));
+            }
+            i = static_cast<lua_Integer>(n);
+        }
+        if (pProperty->type == Scriptable::Property_Integer) {
+            *static_cast<int*>(ptr) = static_cast<int>(i);
+        } else {
+            *static_cast<long long*>(ptr) = static_cast<long long>(i);
+        }
+        break;
+    }
+    case Scriptable::Property_Float:
+    case Scriptable::Property_Real: {
+        lua_Number n = lua_tonumberx(pLuaState, 3, &isNum);
+        if (!isNum) {
+            return luaL_error(pLuaState, "property '%s': number expected", lua_tostring(pLuaState, 2));
+        }
+        if (pProperty->type == Scriptable::Property_Float) {
+            *static_cast<float*>(ptr) = static_cast<float>(n);
+        } else {
+            *static_cast<double*>(ptr) = static_cast<double>(n);
+        }
+        break;
+    }
+    case Scriptable::Property_String: {
+        size_t length = 0;
+        const char *str = lua_tolstring(pLuaState, 3, &length);
+        if (str == 0) {
+            return luaL_error(pLuaState, "property '%s': string expected", lua_tostring(pLuaState, 2));
+        }
+        static_cast<std::string*>(ptr)->assign(str, length);
+        break;
+    }
+    case Scriptable::Property_Accessor:
+        (pScriptable->*pProperty->setter)(getLuaEngine(pLuaState)->popValue(pLuaState));
+        break;
+    }
+
+    return 0;
+}
+
 static int nativeFunctionGateway(lua_State *pLuaState)
 {
     LuaEngine *pLuaEngine = getLuaEngine(pLuaState);
@@ -72,14 +707,56 @@ static int nativeFunctionGateway(lua_State *pLuaState)
     // Fetch arguments
     VariantList args;
     for (int i = 0; i < nArgs; i++) {
-        args.push_front(pLuaEngine->popValue());
+        args.push_front(pLuaEngine->popValue(pLuaState));
+    }
+
+    MetricsTimer timer(pLuaEngine->metrics(), Metrics::Operation_NativeCall);
+    // Qualified name is only fetched when recording
+    Recorder *pRecorder = pLuaEngine->recorder();
+    RecorderScope record(pRecorder, Recorder::Event_NativeCall,
+                         pRecorder ? lua_tostring(pLuaState, lua_upvalueindex(3)) : 0);
+    record.setArgs(args);
+
+    // Call native function
+    Variant res = func(args, pData);
+    record.setResult(res);
+
+    if (res.isValid()) {
+        pLuaEngine->pushValue(pLuaState, res);
+        return 1;
     }
 
+    // No return value from the function
+    return 0;
+}
+
+static int nativeViewGateway(lua_State *pLuaState)
+{
+    LuaEngine *pLuaEngine = getLuaEngine(pLuaState);
+
+    // Get native function pointer
+    void *ptr = lua_touserdata(pLuaState, lua_upvalueindex(1));
+    LuaEngine::NativeViewFunction func = reinterpret_cast<LuaEngine::NativeViewFunction>(reinterpret_cast<size_t>(ptr));
+
+    // Get user data
+    void *pData = lua_touserdata(pLuaState, lua_upvalueindex(2));
+
+    // Arguments are left on the stack
+    ArgumentView args(pLuaEngine, pLuaState, 1, lua_gettop(pLuaState));
+
+    MetricsTimer timer(pLuaEngine->metrics(), Metrics::Operation_NativeCall);
+    // Qualified name is only fetched when recording
+    Recorder *pRecorder = pLuaEngine->recorder();
+    RecorderScope record(pRecorder, Recorder::Event_NativeCall,
+                         pRecorder ? lua_tostring(pLuaState, lua_upvalueindex(3)) : 0);
+    record.setArgs(args);
+
     // Call native function
     Variant res = func(args, pData);
+    record.setResult(res);
 
     if (res.isValid()) {
-        pLuaEngine->pushValue(res);
+        pLuaEngine->pushValue(pLuaState, res);
         return 1;
     }
 
@@ -91,8 +768,29 @@ struct LuaEngine::Private
 {
     lua_State *pLuaState;       ///< Lua VM state.
     bool internalLuaState;		///< Whether the Lua state is created by this class.
-    int error;                  ///< Error code.
-    std::string errorText;      ///< Error message.
+    int libraries;              ///< Standard libraries to be loaded.
+    LuaEngine::Error error;     ///< Last error.
+    std::shared_ptr<LuaEngine*> anchor; ///< Engine pointer shared with function handles.
+
+    ModuleRegistry *pModuleRegistry;    ///< Registry of loaded modules, null if none.
+    unsigned moduleGeneration;          ///< Registry generation seen at the last refresh.
+    std::map<std::string, unsigned> moduleVersions; ///< Versions of loaded modules.
+
+    Metrics *pMetrics;          ///< Metrics, null if disabled.
+    Recorder *pRecorder;        ///< Calls recorder, null if disabled.
+    std::map<std::string, MemoCache*> memoized; ///< Caches of memoized functions.
+    bool bindGlobals;           ///< Whether chunks are loaded with the globals bound.
+    ChunkBinder binder;         ///< Registered natives and frozen globals.
+    std::vector<ModuleBuilder> nativeModules;   ///< Registered native modules.
+    size_t arrayThreshold;      ///< Minimal length of tables popped as arrays, 0 if disabled.
+    size_t convertedBytes;      ///< String bytes converted by the current conversion.
+
+    unsigned gcCycles;          ///< Number of GC cycles finished by explicit calls.
+    unsigned gcSteps;           ///< Number of explicit GC steps.
+    long long gcPauseTime;      ///< Total time of explicit GC calls, us.
+    long long gcMaxPauseTime;   ///< Longest explicit GC call, us.
+    long long gcLastPauseTime;  ///< Last explicit GC call, us.
+    bool gcStopped;             ///< Whether GC has been stopped by stopGc().
 };
 
 
@@ -223,266 +921,1569 @@ Variant LuaEngine::Reference::operator ()(const Variant &a1,
 
 
 /*
- * 	class LuaEngine
+ *  class LuaEngine::Environment
  */
 
-LuaEngine::LuaEngine()
+struct LuaEngine::Environment::Private
 {
-    m = new LuaEngine::Private();
-    initLuaState();
-}
+    std::shared_ptr<LuaEngine*> engine; ///< Owning engine, nulled when Lua state is closed.
+    int ref;                            ///< Registry reference of the environment table.
+
+    ~Private()
+    {
+        LuaEngine *pLuaEngine = *engine;
+        if (pLuaEngine) {
+            pLuaEngine->releaseRef(ref);
+        }
+    }
+};
 
-LuaEngine::LuaEngine(lua_State *pLuaState)
+LuaEngine::Environment::Environment()
+    : m()
 {
-    m = new LuaEngine::Private();
-    initLuaState(pLuaState);
 }
 
-LuaEngine::~LuaEngine()
+bool LuaEngine::Environment::isValid() const
 {
-	if (m->internalLuaState) {
-		lua_close(m->pLuaState);
-	}
-    delete m;
+    return m && *m->engine != 0;
+}
+
+Variant LuaEngine::Environment::value(const std::string &identifier) const
+{
+    if (!isValid()) {
+        return Variant();
+    }
+    LuaEngine *pLuaEngine = *m->engine;
+    lua_State *pLuaState = pLuaEngine->m->pLuaState;
+    lua_rawgeti(pLuaState, LUA_REGISTRYINDEX, m->ref);
+    lua_getfield(pLuaState, -1, identifier.c_str());
+    Variant res = pLuaEngine->popValue();
+    lua_pop(pLuaState, 1);
+    return res;
+}
+
+void LuaEngine::Environment::setValue(const std::string &identifier, const Variant &value)
+{
+    if (!isValid()) {
+        return;
+    }
+    LuaEngine *pLuaEngine = *m->engine;
+    lua_State *pLuaState = pLuaEngine->m->pLuaState;
+    lua_rawgeti(pLuaState, LUA_REGISTRYINDEX, m->ref);
+    pLuaEngine->pushValue(value);
+    lua_setfield(pLuaState, -2, identifier.c_str());
+    lua_pop(pLuaState, 1);
+}
+
+
+/*
+ *  class LuaEngine::Results
+ */
+
+LuaEngine::Results::Results()
+    : m_overflow(),
+      m_size(0)
+{
+}
+
+const Variant& LuaEngine::Results::operator [](int index) const
+{
+    return index < cInlineCapacity ? m_inline[index] : m_overflow[index - cInlineCapacity];
+}
+
+Variant& LuaEngine::Results::operator [](int index)
+{
+    return index < cInlineCapacity ? m_inline[index] : m_overflow[index - cInlineCapacity];
+}
+
+void LuaEngine::Results::append(Variant &&value)
+{
+    if (m_size < cInlineCapacity) {
+        m_inline[m_size] = std::move(value);
+    } else {
+        m_overflow.push_back(std::move(value));
+    }
+    ++m_size;
+}
+
+void LuaEngine::Results::clear()
+{
+    for (int i = 0; i < m_size && i < cInlineCapacity; i++) {
+        m_inline[i] = Variant();
+    }
+    m_overflow.clear();
+    m_size = 0;
+}
+
+
+/*
+ *  struct LuaEngine::Error
+ */
+
+std::string LuaEngine::Error::traceback() const
+{
+    std::string res("stack traceback:");
+    for (std::vector<StackFrame>::const_iterator it = frames.begin(); it != frames.end(); ++it) {
+        res.append("\n\t");
+        res.append(it->source);
+        res.append(":");
+        if (it->line >= 0) {
+            res.append(numberToString(it->line));
+            res.append(":");
+        }
+        if (it->what == "main") {
+            res.append(" in main chunk");
+        } else if (!it->function.empty()) {
+            res.append(" in function '");
+            res.append(it->function);
+            res.append("'");
+        } else {
+            res.append(" in ?");
+        }
+    }
+    return res;
+}
+
+
+/*
+ *  class LuaEngine
+ */
+
+LuaEngine::LuaEngine()
+{
+    m = new LuaEngine::Private();
+    m->libraries = Library_All;
+    initLuaState();
+}
+
+LuaEngine::LuaEngine(int libraries)
+{
+    m = new LuaEngine::Private();
+    m->libraries = libraries;
+    initLuaState();
+}
+
+LuaEngine::LuaEngine(lua_State *pLuaState)
+{
+    m = new LuaEngine::Private();
+    m->libraries = 0;
+    initLuaState(pLuaState);
+}
+
+LuaEngine::~LuaEngine()
+{
+    // Invalidate all function handles
+    *m->anchor = 0;
+
+	if (m->internalLuaState) {
+		lua_close(m->pLuaState);
+	}
+    delete m;
 }
 
 void LuaEngine::clearError()
 {
-    m->error = 0;
-    m->errorText = "";
+    m->error.code = 0;
+    m->error.message.clear();
+    m->error.chunkName.clear();
+    m->error.frames.clear();
 }
 
 int LuaEngine::error() const
 {
-    return m->error;
+    return m->error.code;
 }
 
 std::string LuaEngine::errorText() const
 {
-    return m->errorText;
+    return m->error.message;
+}
+
+const LuaEngine::Error& LuaEngine::lastError() const
+{
+    return m->error;
 }
 
 void LuaEngine::reset()
 {
+    // Registry references do not survive the Lua state
+    *m->anchor = 0;
+
 	lua_close(m->pLuaState);
 	initLuaState();
+
+    // Registered natives and frozen globals are gone
+    m->binder = ChunkBinder();
+    m->nativeModules.clear();
+
+    // Modules are loaded again on the next refresh
+    if (m->pModuleRegistry) {
+        m->moduleVersions.clear();
+        m->moduleGeneration = m->pModuleRegistry->generation() - 1;
+    }
+}
+
+Variant LuaEngine::evaluate(const std::string &script, const std::string &chunkName)
+{
+    return evaluate(script, Environment(), chunkName);
+}
+
+Variant LuaEngine::evaluateFile(const std::string &fileName)
+{
+    return evaluateFile(fileName, Environment());
+}
+
+LuaEngine::Environment LuaEngine::createEnvironment()
+{
+    Environment env;
+
+    lua_createtable(m->pLuaState, 0, 4);
+
+    // Own global variable
+    lua_pushvalue(m->pLuaState, -1);
+    lua_setfield(m->pLuaState, -2, "_G");
+
+    // load() must not escape the environment
+    lua_pushvalue(m->pLuaState, -1);
+    lua_pushcclosure(m->pLuaState, sandboxLoad, 1);
+    lua_setfield(m->pLuaState, -2, "load");
+
+    // Shared metatables and modules are read-only
+    pushSandboxBase();
+    lua_getfield(m->pLuaState, -1, "getmetatable");
+    lua_setfield(m->pLuaState, -3, "getmetatable");
+    lua_getfield(m->pLuaState, -1, "require");
+    lua_setfield(m->pLuaState, -3, "require");
+    lua_setmetatable(m->pLuaState, -2);
+
+    env.m = std::make_shared<Environment::Private>();
+    env.m->engine = m->anchor;
+    env.m->ref = luaL_ref(m->pLuaState, LUA_REGISTRYINDEX);
+
+    return env;
+}
+
+Variant LuaEngine::evaluate(const std::string &script, const Environment &env,
+                            const std::string &chunkName)
+{
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_Evaluate);
+    RecorderScope record(m->pRecorder, Recorder::Event_Evaluate, script);
+    clearError();
+    const char *cName = chunkName.empty() ? script.c_str() : chunkName.c_str();
+    int err = loadChunk(script.data(), script.size(), cName);
+
+    Variant res = runChunk(err, env, cName);
+    timer.setErrorCode(error());
+    record.setErrorCode(error());
+    return res;
+}
+
+Variant LuaEngine::evaluateFile(const std::string &fileName, const Environment &env)
+{
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_EvaluateFile);
+    RecorderScope record(m->pRecorder, Recorder::Event_EvaluateFile, fileName);
+	clearError();
+	std::string chunkName = "@" + fileName;
+	int err = loadFileChunk(fileName);
+
+	Variant res = runChunk(err, env, chunkName.c_str());
+    timer.setErrorCode(error());
+    record.setErrorCode(error());
+	return res;
+}
+
+Variant LuaEngine::invoke(const std::string &funcName,
+                          const VariantList &args)
+{
+    MemoCache *pCache = 0;
+    if (!m->memoized.empty()) {
+        std::map<std::string, MemoCache*>::const_iterator it = m->memoized.find(funcName);
+        if (it != m->memoized.end()) {
+            pCache = it->second;
+            Variant res;
+            if (pCache->lookup(funcName, args, res)) {
+                clearError();
+                return res;
+            }
+        }
+    }
+
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_Invoke);
+    RecorderScope record(m->pRecorder, Recorder::Event_Invoke, funcName);
+    record.setArgs(args);
+    clearError();
+    int top = lua_gettop(m->pLuaState);
+
+    lua_getglobal(m->pLuaState, funcName.c_str());
+
+    Variant res = call(top, args);
+    timer.setErrorCode(error());
+    record.setErrorCode(error());
+    if (pCache && error() == 0) {
+        pCache->insert(funcName, args, res);
+    }
+    return res;
+}
+
+bool LuaEngine::invoke(const std::string &funcName, const VariantList &args, Results &results)
+{
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_Invoke);
+    RecorderScope record(m->pRecorder, Recorder::Event_Invoke, funcName);
+    record.setArgs(args);
+    clearError();
+    int top = lua_gettop(m->pLuaState);
+
+    lua_getglobal(m->pLuaState, funcName.c_str());
+    int err = callWithArgs(args);
+    timer.setErrorCode(err);
+    record.setErrorCode(err);
+
+    return popResults(top, results);
+}
+
+bool LuaEngine::evaluate(const std::string &script, Results &results, const std::string &chunkName)
+{
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_Evaluate);
+    RecorderScope record(m->pRecorder, Recorder::Event_Evaluate, script);
+    clearError();
+    const char *cName = chunkName.empty() ? script.c_str() : chunkName.c_str();
+    int top = lua_gettop(m->pLuaState);
+    int err = loadChunk(script.data(), script.size(), cName);
+    if (err == 0) {
+        err = pcall(0);
+    }
+    popError(err, cName);
+    timer.setErrorCode(err);
+    record.setErrorCode(err);
+
+    return popResults(top, results);
+}
+
+LuaStream LuaEngine::iterate(const std::string &funcName, const VariantList &args)
+{
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_Invoke);
+    clearError();
+    int top = lua_gettop(m->pLuaState);
+
+    lua_getglobal(m->pLuaState, funcName.c_str());
+    int err = callWithArgs(args);
+    timer.setErrorCode(err);
+    if (err != 0) {
+        return LuaStream();
+    }
+
+    // Keep the iterator function, state, control variable
+    // and closing value (Lua 5.4) in one table
+    lua_settop(m->pLuaState, top + 4);
+#if LUA_VERSION_NUM < 504
+    lua_pushnil(m->pLuaState);
+    lua_replace(m->pLuaState, top + 4);
+#endif
+    lua_createtable(m->pLuaState, 4, 0);
+    for (int i = 4; i >= 1; i--) {
+        lua_insert(m->pLuaState, -2);
+        lua_rawseti(m->pLuaState, -2, i);
+    }
+
+    return LuaStream(this, luaL_ref(m->pLuaState, LUA_REGISTRYINDEX), false);
+}
+
+LuaStream LuaEngine::generate(const std::string &funcName, const VariantList &args)
+{
+    clearError();
+
+    lua_State *pThread = lua_newthread(m->pLuaState);
+    int ref = luaL_ref(m->pLuaState, LUA_REGISTRYINDEX);
+
+    // Function and arguments wait on the coroutine stack for the first resume
+    int nArgs = static_cast<int>(args.size());
+    lua_checkstack(pThread, nArgs + 1);
+    lua_getglobal(m->pLuaState, funcName.c_str());
+    for (VariantList::const_iterator it = args.begin(); it != args.end(); ++it) {
+        pushValue(*it);
+    }
+    lua_xmove(m->pLuaState, pThread, nArgs + 1);
+
+    return LuaStream(this, ref, true);
+}
+
+void LuaEngine::registerObject(const std::string &objectName, Scriptable *pScriptable)
+{
+	if (pScriptable == 0) {
+		return;
+	}
+
+	lua_newtable(m->pLuaState);
+	const Scriptable::MetaMethodsTable &methods = pScriptable->methods();
+
+	for (Scriptable::MetaMethodsTable::const_iterator it = methods.begin(); it != methods.end(); ++it) {
+		std::string name = it->first;
+		pushString(name);
+		pushString(name);
+		pushData(static_cast<void*>(pScriptable));
+		pushString(objectName + "." + name);
+		lua_pushcclosure(m->pLuaState, scriptableObjectGateway, 3);
+		lua_settable(m->pLuaState, -3);
+	}
+
+	const Scriptable::ViewMethodsTable &viewMethods = pScriptable->viewMethods();
+
+	for (Scriptable::ViewMethodsTable::const_iterator it = viewMethods.begin(); it != viewMethods.end(); ++it) {
+		std::string name = it->first;
+		pushString(name);
+		pushString(name);
+		pushData(static_cast<void*>(pScriptable));
+		pushString(objectName + "." + name);
+		lua_pushcclosure(m->pLuaState, scriptableViewGateway, 3);
+		lua_settable(m->pLuaState, -3);
+	}
+
+	const Scriptable::PropertiesTable &properties = pScriptable->properties();
+
+	if (!properties.empty()) {
+		// Properties are resolved by the metatable, the table of properties
+		// maps property names to their descriptions
+		lua_createtable(m->pLuaState, 0, 2);
+		lua_createtable(m->pLuaState, 0, static_cast<int>(properties.size()));
+		for (Scriptable::PropertiesTable::const_iterator it = properties.begin(); it != properties.end(); ++it) {
+			pushString(it->first);
+			pushData(const_cast<Scriptable::Property*>(&it->second));
+			lua_rawset(m->pLuaState, -3);
+		}
+
+		lua_pushvalue(m->pLuaState, -1);
+		pushData(static_cast<void*>(pScriptable));
+		lua_pushcclosure(m->pLuaState, scriptablePropertyIndex, 2);
+		lua_setfield(m->pLuaState, -3, "__index");
+
+		pushData(static_cast<void*>(pScriptable));
+		lua_pushcclosure(m->pLuaState, scriptablePropertyNewIndex, 2);
+		lua_setfield(m->pLuaState, -2, "__newindex");
+
+		lua_setmetatable(m->pLuaState, -2);
+	}
+
+	lua_setglobal(m->pLuaState, objectName.c_str());
+	m->binder.bind(objectName);
+}
+
+void LuaEngine::registerFunction(const std::string &funcName, LuaEngine::NativeFunction func, void *pData)
+{
+    if (func) {
+        pushData(reinterpret_cast<void*>(reinterpret_cast<size_t>(func)));
+        pushData(pData);
+        pushString(funcName);
+        lua_pushcclosure(m->pLuaState, nativeFunctionGateway, 3);
+        lua_setglobal(m->pLuaState, funcName.c_str());
+        m->binder.bind(funcName);
+    }
+}
+
+void LuaEngine::registerFunction(const std::string &funcName, LuaEngine::NativeViewFunction func, void *pData)
+{
+    if (func) {
+        pushData(reinterpret_cast<void*>(reinterpret_cast<size_t>(func)));
+        pushData(pData);
+        pushString(funcName);
+        lua_pushcclosure(m->pLuaState, nativeViewGateway, 3);
+        lua_setglobal(m->pLuaState, funcName.c_str());
+        m->binder.bind(funcName);
+    }
+}
+
+void LuaEngine::registerSharedTable(const std::string &tableName, const SharedTable &table)
+{
+    table.push(m->pLuaState);
+    lua_setglobal(m->pLuaState, tableName.c_str());
+}
+
+void LuaEngine::registerTypedArray(const std::string &arrayName, const TypedArray &array)
+{
+    array.push(m->pLuaState);
+    lua_setglobal(m->pLuaState, arrayName.c_str());
+}
+
+void LuaEngine::registerArrayLibrary(const std::string &libraryName)
+{
+    TypedArray::openLibrary(m->pLuaState);
+    lua_setglobal(m->pLuaState, libraryName.c_str());
+}
+
+TypedArray LuaEngine::globalTypedArray(const std::string &identifier)
+{
+    lua_getglobal(m->pLuaState, identifier.c_str());
+    TypedArray array = TypedArray::fromStack(m->pLuaState, -1);
+    lua_pop(m->pLuaState, 1);
+    return array;
+}
+
+void LuaEngine::registerChannel(const std::string &channelName, const Channel &channel)
+{
+    channel.push(m->pLuaState, this);
+    lua_setglobal(m->pLuaState, channelName.c_str());
+}
+
+void LuaEngine::registerModule(const ModuleBuilder &module, bool lazy)
+{
+    m->nativeModules.push_back(module);
+
+    // package.preload and package.loaded
+    lua_getglobal(m->pLuaState, LUA_LOADLIBNAME);
+    bool hasPackage = lua_istable(m->pLuaState, -1);
+
+    if (lazy && hasPackage) {
+        lua_getfield(m->pLuaState, -1, "preload");
+        if (lua_istable(m->pLuaState, -1)) {
+            module.pushLoader(m->pLuaState, this);
+            lua_setfield(m->pLuaState, -2, module.name().c_str());
+            lua_pop(m->pLuaState, 2);
+            return;
+        }
+        lua_pop(m->pLuaState, 1);
+    }
+
+    module.push(m->pLuaState, this);
+    if (hasPackage) {
+        lua_getfield(m->pLuaState, -2, "loaded");
+        if (lua_istable(m->pLuaState, -1)) {
+            lua_pushvalue(m->pLuaState, -2);
+            lua_setfield(m->pLuaState, -2, module.name().c_str());
+        }
+        lua_pop(m->pLuaState, 1);
+    }
+    lua_setglobal(m->pLuaState, module.name().c_str());
+    lua_pop(m->pLuaState, 1);
+    m->binder.bind(module.name());
+}
+
+bool LuaEngine::loadModules(ModuleRegistry &registry)
+{
+    m->pModuleRegistry = &registry;
+    m->moduleVersions.clear();
+    m->moduleGeneration = registry.generation() - 1;
+
+    return refreshModules();
+}
+
+bool LuaEngine::refreshModules()
+{
+    clearError();
+    if (m->pModuleRegistry == 0) {
+        return true;
+    }
+
+    unsigned generation = m->pModuleRegistry->generation();
+    if (generation == m->moduleGeneration) {
+        return true;
+    }
+
+    bool ok = true;
+    std::vector<ModuleRegistry::ModulePtr> modules = m->pModuleRegistry->modules();
+    for (std::vector<ModuleRegistry::ModulePtr>::const_iterator it = modules.begin(); it != modules.end(); ++it) {
+        const ModuleRegistry::Module &module = **it;
+        std::map<std::string, unsigned>::const_iterator itVersion = m->moduleVersions.find(module.name);
+        if (itVersion != m->moduleVersions.end() && itVersion->second == module.version) {
+            continue;
+        }
+
+        // Failed module is not retried until recompiled
+        m->moduleVersions[module.name] = module.version;
+        if (!runModule(module)) {
+            ok = false;
+        }
+    }
+    m->moduleGeneration = generation;
+
+    return ok;
+}
+
+Variant LuaEngine::globalValue(const std::string &identifier)
+{
+	lua_getglobal(m->pLuaState, identifier.c_str());
+	return popValue();
+}
+
+void LuaEngine::setGlobalValue(const std::string &identifier, const Variant &value)
+{
+	pushValue(value);
+	lua_setglobal(m->pLuaState, identifier.c_str());
+}
+
+LuaEngine::Reference LuaEngine::operator [](const std::string &identifier)
+{
+	return Reference(identifier, this);
+}
+
+void LuaEngine::setGcIncremental(int pause, int stepMultiplier, int stepSize)
+{
+#if LUA_VERSION_NUM >= 504
+    lua_gc(m->pLuaState, LUA_GCINC, pause, stepMultiplier, stepSize);
+#else
+    (void)stepSize; // Not configurable at run time
+    if (pause > 0) {
+        lua_gc(m->pLuaState, LUA_GCSETPAUSE, pause);
+    }
+    if (stepMultiplier > 0) {
+        lua_gc(m->pLuaState, LUA_GCSETSTEPMUL, stepMultiplier);
+    }
+#endif
+}
+
+bool LuaEngine::setGcGenerational(int minorMultiplier, int majorMultiplier)
+{
+#if LUA_VERSION_NUM >= 504
+    lua_gc(m->pLuaState, LUA_GCGEN, minorMultiplier, majorMultiplier);
+    return true;
+#else
+    (void)minorMultiplier;
+    (void)majorMultiplier;
+    return false;
+#endif
+}
+
+bool LuaEngine::stepGc(int stepSize)
+{
+    long long start = microseconds();
+    bool finished = lua_gc(m->pLuaState, LUA_GCSTEP, stepSize) != 0;
+    m->gcSteps++;
+    updateGcStatistics(start, finished);
+    return finished;
+}
+
+bool LuaEngine::stepGcFor(long long timeBudget, int stepSize)
+{
+    long long start = microseconds();
+    long long deadline = start + timeBudget;
+    bool finished = false;
+    do {
+        finished = lua_gc(m->pLuaState, LUA_GCSTEP, stepSize) != 0;
+        m->gcSteps++;
+    } while (!finished && microseconds() < deadline);
+    updateGcStatistics(start, finished);
+    return finished;
+}
+
+void LuaEngine::collectGc()
+{
+    long long start = microseconds();
+    lua_gc(m->pLuaState, LUA_GCCOLLECT, 0);
+    updateGcStatistics(start, true);
+}
+
+void LuaEngine::stopGc()
+{
+    lua_gc(m->pLuaState, LUA_GCSTOP, 0);
+    m->gcStopped = true;
+}
+
+void LuaEngine::restartGc()
+{
+    lua_gc(m->pLuaState, LUA_GCRESTART, 0);
+    m->gcStopped = false;
+}
+
+bool LuaEngine::isGcRunning() const
+{
+#ifdef LUA_GCISRUNNING
+    return lua_gc(m->pLuaState, LUA_GCISRUNNING, 0) != 0;
+#else
+    return !m->gcStopped;
+#endif
+}
+
+LuaEngine::GcStatistics LuaEngine::gcStatistics() const
+{
+    GcStatistics stats;
+    stats.heapSize = static_cast<size_t>(lua_gc(m->pLuaState, LUA_GCCOUNT, 0)) * 1024
+                   + static_cast<size_t>(lua_gc(m->pLuaState, LUA_GCCOUNTB, 0));
+    stats.running = isGcRunning();
+    stats.cycles = m->gcCycles;
+    stats.steps = m->gcSteps;
+    stats.pauseTime = m->gcPauseTime;
+    stats.maxPauseTime = m->gcMaxPauseTime;
+    stats.lastPauseTime = m->gcLastPauseTime;
+    return stats;
+}
+
+void LuaEngine::setMetrics(Metrics *pMetrics)
+{
+    m->pMetrics = pMetrics;
+}
+
+Metrics* LuaEngine::metrics() const
+{
+    return m->pMetrics;
+}
+
+void LuaEngine::setArrayThreshold(size_t length)
+{
+    m->arrayThreshold = length;
+}
+
+size_t LuaEngine::arrayThreshold() const
+{
+    return m->arrayThreshold;
+}
+
+void LuaEngine::setRecorder(Recorder *pRecorder)
+{
+    m->pRecorder = pRecorder;
+}
+
+Recorder* LuaEngine::recorder() const
+{
+    return m->pRecorder;
+}
+
+void LuaEngine::setBindGlobals(bool enable)
+{
+    m->bindGlobals = enable;
+}
+
+bool LuaEngine::bindGlobals() const
+{
+    return m->bindGlobals;
+}
+
+void LuaEngine::freezeGlobal(const std::string &identifier)
+{
+    lua_getglobal(m->pLuaState, identifier.c_str());
+
+    std::string literal;
+    switch (lua_type(m->pLuaState, -1)) {
+    case LUA_TNIL:
+        literal = "nil";
+        break;
+    case LUA_TBOOLEAN:
+        literal = lua_toboolean(m->pLuaState, -1) ? "true" : "false";
+        break;
+    case LUA_TNUMBER:
+        if (lua_isinteger(m->pLuaState, -1)) {
+            appendNumber(literal, static_cast<long long>(lua_tointeger(m->pLuaState, -1)));
+        } else {
+            double value = lua_tonumber(m->pLuaState, -1);
+            if (value == value && value - value == 0.0) {
+                // Finite, keeps float subtype in Lua 5.3+
+                appendNumber(literal, value);
+                if (literal.find_first_of(".e") == std::string::npos) {
+                    literal.append(".0");
+                }
+            }
+        }
+        break;
+    case LUA_TSTRING:
+        literal = luaStringLiteral(m->pLuaState, -1);
+        break;
+    default:
+        break;
+    }
+    lua_pop(m->pLuaState, 1);
+
+    if (literal.empty()) {
+        m->binder.bind(identifier);
+    } else {
+        m->binder.bindConstant(identifier, literal);
+    }
+}
+
+void LuaEngine::unbindGlobal(const std::string &identifier)
+{
+    m->binder.unbind(identifier);
+}
+
+void LuaEngine::memoize(const std::string &funcName, MemoCache &cache)
+{
+    m->memoized[funcName] = &cache;
+}
+
+void LuaEngine::unmemoize(const std::string &funcName)
+{
+    std::map<std::string, MemoCache*>::iterator it = m->memoized.find(funcName);
+    if (it != m->memoized.end()) {
+        it->second->remove(funcName);
+        m->memoized.erase(it);
+    }
+}
+
+void LuaEngine::pushValue(const Variant &value)
+{
+    pushValue(m->pLuaState, value);
+}
+
+void LuaEngine::pushValue(lua_State *pLuaState, const Variant &value)
+{
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_PushValue);
+    m->convertedBytes = 0;
+    pushValueSafe(pLuaState, value);
+    timer.addBytes(m->convertedBytes);
+}
+
+void LuaEngine::pushValueSafe(lua_State *pLuaState, const Variant &value)
+{
+    switch (value.type()) {
+    case Variant::Type_Boolean:
+        lua_pushboolean(pLuaState, value.toBoolean() ? 1 : 0);
+        break;
+    case Variant::Type_Integer:
+        lua_pushinteger(pLuaState, value.toInteger());
+        break;
+    case Variant::Type_Real:
+        lua_pushnumber(pLuaState, value.toReal());
+        break;
+    case Variant::Type_String:
+        m->convertedBytes += value.string().size();
+        lua_pushstring(pLuaState, value.string().c_str());
+        break;
+    case Variant::Type_List: {
+        const VariantList &list = value.list();
+        lua_newtable(pLuaState);
+        int i = 1; // Lua array index starts with 1
+        for (VariantList::const_iterator it = list.begin(); it != list.end(); ++it, ++i) {
+            lua_pushinteger(pLuaState, i);
+            pushValueSafe(pLuaState, *it);
+            lua_settable(pLuaState, -3);
+        }
+        break;
+    }
+    case Variant::Type_Array: {
+        const VariantArray &array = value.array();
+        lua_createtable(pLuaState, static_cast<int>(array.size()), 0);
+        int i = 1;
+        for (VariantArray::const_iterator it = array.begin(); it != array.end(); ++it, ++i) {
+            pushValueSafe(pLuaState, *it);
+            lua_rawseti(pLuaState, -2, i);
+        }
+        break;
+    }
+    case Variant::Type_Map: {
+        const VariantMap &map = value.map();
+        lua_newtable(pLuaState);
+        VariantMap::const_iterator it = map.begin();
+        while (it != map.end()) {
+            m->convertedBytes += it->first.size();
+            lua_pushstring(pLuaState, it->first.c_str());
+            pushValueSafe(pLuaState, it->second);
+            lua_settable(pLuaState, -3);
+            ++it;
+        }
+        break;
+    }
+    case Variant::Type_Function: {
+        const LuaFunction &function = value.function();
+        if (function.luaEngine() == this) {
+            lua_rawgeti(pLuaState, LUA_REGISTRYINDEX, function.ref());
+        } else {
+            // Functions cannot be passed between Lua states
+            lua_pushnil(pLuaState);
+        }
+        break;
+    }
+    default:
+    	// For invalid and null
+        lua_pushnil(pLuaState);
+        break;
+    }
+}
+
+Variant LuaEngine::popValue()
+{
+	return popTopValue(m->pLuaState, 0);
+}
+
+Variant LuaEngine::popValue(lua_State *pLuaState)
+{
+    return popTopValue(pLuaState, 0);
+}
+
+Variant LuaEngine::popValue(VariantArena &arena)
+{
+    return popTopValue(m->pLuaState, &arena);
+}
+
+Variant LuaEngine::popTopValue(lua_State *pLuaState, VariantArena *pArena)
+{
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_PopValue);
+    m->convertedBytes = 0;
+    Variant res = popValueSafe(pLuaState, cLuaMaxTableLevel, pArena);
+    timer.addBytes(m->convertedBytes);
+    return res;
+}
+
+Variant LuaEngine::evaluate(const std::string &script, VariantArena &arena,
+                            const std::string &chunkName)
+{
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_Evaluate);
+    RecorderScope record(m->pRecorder, Recorder::Event_Evaluate, script);
+    clearError();
+    const char *cName = chunkName.empty() ? script.c_str() : chunkName.c_str();
+    int err = loadChunk(script.data(), script.size(), cName);
+
+    Variant res = runChunk(err, Environment(), cName, &arena);
+    timer.setErrorCode(error());
+    record.setErrorCode(error());
+    return res;
 }
 
-Variant LuaEngine::evaluate(const std::string &script)
+Variant LuaEngine::invoke(const std::string &funcName, const VariantList &args, VariantArena &arena)
 {
-    const char *cStr = script.c_str();
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_Invoke);
+    RecorderScope record(m->pRecorder, Recorder::Event_Invoke, funcName);
+    record.setArgs(args);
+    clearError();
     int top = lua_gettop(m->pLuaState);
-    int err = luaL_dostring(m->pLuaState, cStr);
-    popError(err);
-
-    return popReturnValues(top);
-}
 
-Variant LuaEngine::evaluateFile(const std::string &fileName)
-{
-	clearError();
-	int top = lua_gettop(m->pLuaState);
-	int err = luaL_dofile(m->pLuaState, fileName.c_str());
-	popError(err);
+    lua_getglobal(m->pLuaState, funcName.c_str());
 
-	return popReturnValues(top);
+    Variant res = call(top, args, &arena);
+    timer.setErrorCode(error());
+    record.setErrorCode(error());
+    return res;
 }
 
-Variant LuaEngine::invoke(const std::string &funcName,
-                          const VariantList &args)
+bool LuaEngine::invoke(const std::string &funcName, const VariantList &args, ValueWriter &writer)
 {
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_Invoke);
+    RecorderScope record(m->pRecorder, Recorder::Event_Invoke, funcName);
+    record.setArgs(args);
+    clearError();
     int top = lua_gettop(m->pLuaState);
 
     lua_getglobal(m->pLuaState, funcName.c_str());
-    for (VariantList::const_iterator it = args.begin(); it != args.end(); ++it) {
-        pushValue(*it);
+    int err = callWithArgs(args);
+    if (err != 0) {
+        timer.setErrorCode(err);
+        record.setErrorCode(err);
+        return false;
     }
 
-    int err = lua_pcall(m->pLuaState, args.size(), LUA_MULTRET, 0);
-    popError(err);
-
-    return popReturnValues(top);
+    if (lua_gettop(m->pLuaState) == top) {
+        writer.writeNull();
+    } else {
+        // Only the first return value is written
+        lua_settop(m->pLuaState, top + 1);
+        serializeValue(writer);
+    }
+    return true;
 }
 
-void LuaEngine::registerObject(const std::string &objectName, Scriptable *pScriptable)
+void LuaEngine::serializeGlobal(const std::string &identifier, ValueWriter &writer)
 {
-	if (pScriptable == 0) {
-		return;
-	}
-
-	lua_newtable(m->pLuaState);
-	const Scriptable::MetaMethodsTable &methods = pScriptable->methods();
-
-	for (Scriptable::MetaMethodsTable::const_iterator it = methods.begin(); it != methods.end(); ++it) {
-		std::string name = it->first;
-		pushString(name);
-		pushString(name);
-		pushData(static_cast<void*>(pScriptable));
-		lua_pushcclosure(m->pLuaState, scriptableObjectGateway, 2);
-		lua_settable(m->pLuaState, -3);
-	}
+    lua_getglobal(m->pLuaState, identifier.c_str());
+    serializeValue(writer);
+}
 
-	lua_setglobal(m->pLuaState, objectName.c_str());
+void LuaEngine::serializeValue(ValueWriter &writer)
+{
+    serializeValue(m->pLuaState, writer);
 }
 
-void LuaEngine::registerFunction(const std::string &funcName, LuaEngine::NativeFunction func, void *pData)
+void LuaEngine::serializeValue(lua_State *pLuaState, ValueWriter &writer)
 {
-    if (func) {
-        pushData(reinterpret_cast<void*>(reinterpret_cast<size_t>(func)));
-        pushData(pData);
-        lua_pushcclosure(m->pLuaState, nativeFunctionGateway, 2);
-        lua_setglobal(m->pLuaState, funcName.c_str());
-    }
+    std::vector<const void*> path;
+    serializeSafe(pLuaState, writer, cLuaMaxTableLevel, path);
+    lua_pop(pLuaState, 1);
 }
 
-Variant LuaEngine::globalValue(const std::string &identifier)
+bool LuaEngine::pushSerialized(const char *data, size_t size, SerialFormat format)
 {
-	int top = lua_gettop(m->pLuaState);
-	lua_getglobal(m->pLuaState, identifier.c_str());
-	return popReturnValues(top);
+    return pushSerialized(m->pLuaState, data, size, format);
 }
 
-void LuaEngine::setGlobalValue(const std::string &identifier, const Variant &value)
+bool LuaEngine::pushSerialized(lua_State *pLuaState, const char *data, size_t size, SerialFormat format)
 {
-	pushValue(value);
-	lua_setglobal(m->pLuaState, identifier.c_str());
+    int top = lua_gettop(pLuaState);
+
+    // The reader and builder live outside the protected call,
+    // nothing has to be destroyed when Lua raises an error
+    LuaStackBuilder builder(pLuaState, cLuaMaxTableLevel);
+    ValueReader reader(format, builder);
+    SerializedInput input = { &reader, data, size, false };
+
+    lua_pushcfunction(pLuaState, parseSerialized);
+    lua_pushlightuserdata(pLuaState, &input);
+    int err = lua_pcall(pLuaState, 1, LUA_MULTRET, 0);
+    if (err != 0 || !input.parsed || lua_gettop(pLuaState) != top + 1) {
+        lua_settop(pLuaState, top);
+        return false;
+    }
+    return true;
 }
 
-LuaEngine::Reference LuaEngine::operator [](const std::string &identifier)
+bool LuaEngine::setGlobalSerialized(const std::string &identifier, const char *data, size_t size,
+                                    SerialFormat format)
 {
-	return Reference(identifier, this);
+    if (!pushSerialized(data, size, format)) {
+        return false;
+    }
+    lua_setglobal(m->pLuaState, identifier.c_str());
+    return true;
 }
 
-void LuaEngine::pushValue(const Variant &value)
+void LuaEngine::serializeSafe(lua_State *pLuaState, ValueWriter &writer, int tableLevel,
+                              std::vector<const void*> &path)
 {
-    switch (value.type()) {
-    case Variant::Type_Boolean:
-        pushBoolean(value.toBoolean());
-        break;
-    case Variant::Type_Integer:
-        pushInteger(value.toInteger());
-        break;
-    case Variant::Type_Real:
-        pushReal(value.toReal());
-        break;
-    case Variant::Type_String:
-        pushString(value.toString());
-        break;
-    case Variant::Type_List: {
-        const VariantList &list = value.list();
-        lua_newtable(m->pLuaState);
-        int i = 1; // Lua array index starts with 1
-        for (VariantList::const_iterator it = list.begin(); it != list.end(); ++it, ++i) {
-            pushInteger(i);
-            pushValue(*it);
-            lua_settable(m->pLuaState, -3);
+    switch (lua_type(pLuaState, -1)) {
+    case LUA_TBOOLEAN:
+        writer.writeBoolean(lua_toboolean(pLuaState, -1) != 0);
+        return;
+    case LUA_TNUMBER:
+        if (lua_isinteger(pLuaState, -1)) {
+            writer.writeInteger(lua_tointeger(pLuaState, -1));
+        } else {
+            writer.writeReal(lua_tonumber(pLuaState, -1));
         }
+        return;
+    case LUA_TSTRING: {
+        size_t length = 0;
+        const char *str = lua_tolstring(pLuaState, -1, &length);
+        writer.writeString(str, length);
+        return;
+    }
+    case LUA_TTABLE:
         break;
+    default:
+        // nil, functions, userdata and threads
+        writer.writeNull();
+        return;
     }
-    case Variant::Type_Map: {
-        const VariantMap &map = value.map();
-        lua_newtable(m->pLuaState);
-        VariantMap::const_iterator it = map.begin();
-        while (it != map.end()) {
-            pushString(it->first);
-            pushValue(it->second);
-            lua_settable(m->pLuaState, -3);
-            ++it;
+
+    const void *pTable = lua_topointer(pLuaState, -1);
+    if (tableLevel == 0 || !lua_checkstack(pLuaState, 4)
+        || std::find(path.begin(), path.end(), pTable) != path.end()) {
+        // Too deep or cyclic
+        writer.writeNull();
+        return;
+    }
+
+    // First pass: count entries and check whether the table is a sequence
+    size_t count = 0;
+    lua_Integer maxIndex = 0;
+    bool sequence = true;
+    lua_pushnil(pLuaState);
+    while (lua_next(pLuaState, -2)) {
+        lua_pop(pLuaState, 1);
+        int keyType = lua_type(pLuaState, -1);
+        if (keyType == LUA_TNUMBER && lua_isinteger(pLuaState, -1)) {
+            lua_Integer index = lua_tointeger(pLuaState, -1);
+            if (index < 1) {
+                sequence = false;
+            } else if (index > maxIndex) {
+                maxIndex = index;
+            }
+        } else if (keyType == LUA_TNUMBER || keyType == LUA_TSTRING) {
+            sequence = false;
+        } else {
+            // Keys of other types cannot be represented
+            sequence = false;
+            continue;
         }
-        break;
+        count++;
     }
-    default:
-    	// For invalid and null
-        pushNull();
-        break;
+
+    path.push_back(pTable);
+
+    if (sequence && count > 0 && maxIndex == static_cast<lua_Integer>(count)) {
+        writer.beginList(count);
+        for (lua_Integer i = 1; i <= maxIndex; i++) {
+            lua_rawgeti(pLuaState, -1, i);
+            serializeSafe(pLuaState, writer, tableLevel - 1, path);
+            lua_pop(pLuaState, 1);
+        }
+        writer.endList();
+    } else {
+        writer.beginMap(count);
+        lua_pushnil(pLuaState);
+        while (lua_next(pLuaState, -2)) {
+            int keyType = lua_type(pLuaState, -2);
+            if (keyType == LUA_TSTRING) {
+                size_t length = 0;
+                const char *key = lua_tolstring(pLuaState, -2, &length);
+                writer.writeKey(key, length);
+            } else if (keyType == LUA_TNUMBER) {
+                // Never convert the key in place, it would break lua_next
+                char key[cMaxNumberLength];
+                size_t length = lua_isinteger(pLuaState, -2)
+                              ? formatNumber(static_cast<long long>(lua_tointeger(pLuaState, -2)), key)
+                              : formatNumber(static_cast<double>(lua_tonumber(pLuaState, -2)), key);
+                writer.writeKey(key, length);
+            } else {
+                lua_pop(pLuaState, 1);
+                continue;
+            }
+            serializeSafe(pLuaState, writer, tableLevel - 1, path);
+            lua_pop(pLuaState, 1);
+        }
+        writer.endMap();
     }
-}
 
-Variant LuaEngine::popValue()
-{
-	return popValueSafe(cLuaMaxTableLevel);
+    path.pop_back();
 }
 
-Variant LuaEngine::popValueSafe(int tableLevel)
+Variant LuaEngine::popValueSafe(lua_State *pLuaState, int tableLevel, VariantArena *pArena)
 {
     Variant res;
 
-    int luaType = lua_type(m->pLuaState, -1);
+    int luaType = lua_type(pLuaState, -1);
     switch (luaType) {
     case LUA_TNIL:
     	res = Variant(Variant::Type_Null);
     	break;
     case LUA_TBOOLEAN:
-        res = toBoolean();
+        res = lua_toboolean(pLuaState, -1) != 0;
         break;
     case LUA_TNUMBER:
-        res = toReal();
+        res = static_cast<double>(lua_tonumber(pLuaState, -1));
         break;
-    case LUA_TSTRING:
-        res = toString();
+    case LUA_TSTRING: {
+        std::string str(lua_tostring(pLuaState, -1));
+        m->convertedBytes += str.size();
+        res = Variant(std::move(str), pArena);
         break;
+    }
     case LUA_TTABLE: {
 
     	if (tableLevel == 0) {
-    		lua_pop(m->pLuaState, 1);
+    		lua_pop(pLuaState, 1);
     		return Variant();
     	}
 
         VariantMap map;
         VariantList list;
-        pushNull();
-        while (lua_next(m->pLuaState, -2)) {
-            if (lua_type(m->pLuaState, -2) == LUA_TSTRING) {
+        VariantArray array(pArena ? pArena->resource() : std::pmr::get_default_resource());
+
+        // Large sequences and sequences in the arena are stored contiguously
+        size_t length = (pArena || m->arrayThreshold > 0) ? lua_rawlen(pLuaState, -1) : 0;
+        bool contiguous = pArena || (length > 0 && length >= m->arrayThreshold);
+        if (contiguous) {
+            array.reserve(length);
+        }
+
+        lua_pushnil(pLuaState);
+        while (lua_next(pLuaState, -2)) {
+            if (lua_type(pLuaState, -2) == LUA_TSTRING) {
                 // Key is a string => constructing a map;
-                const char *cKey = lua_tostring(m->pLuaState, -2);
-                map[std::string(cKey)] = popValueSafe(tableLevel - 1);
+                size_t keyLength = 0;
+                const char *cKey = lua_tolstring(pLuaState, -2, &keyLength);
+                m->convertedBytes += keyLength;
+                map[std::string(cKey)] = popValueSafe(pLuaState, tableLevel - 1, pArena);
+            } else if (contiguous) {
+                array.push_back(popValueSafe(pLuaState, tableLevel - 1, pArena));
             } else {
-                list.push_back(popValueSafe(tableLevel - 1));
+                list.push_back(popValueSafe(pLuaState, tableLevel - 1, pArena));
             }
         }
 
         if (map.empty()) {
-            if (list.empty()) {
-                res = map;
+            if (!array.empty()) {
+                res = Variant(std::move(array), pArena);
+            } else if (list.empty()) {
+                res = Variant(std::move(map), pArena);
             } else {
-                res = list;
+                res = Variant(std::move(list), pArena);
             }
         } else {
-            if (!list.empty()) {
-                // Append list entries to the map
-                int i = 1;
-                for (VariantList::const_iterator it = list.begin(); it != list.end(); ++it, ++i) {
-                    std::ostringstream ss;
-                    ss << i;
-                    std::string key = ss.str();
-                    map[key] = *it;
-                }
+            // Append list entries to the map
+            int i = 1;
+            for (VariantList::const_iterator it = list.begin(); it != list.end(); ++it, ++i) {
+                map[numberToString(i)] = *it;
+            }
+            for (VariantArray::const_iterator it = array.begin(); it != array.end(); ++it, ++i) {
+                map[numberToString(i)] = *it;
             }
-            res = map;
+            res = Variant(std::move(map), pArena);
         }
         break;
     }
     case LUA_TFUNCTION: {
-        int ref = luaL_ref(m->pLuaState, LUA_REGISTRYINDEX);
-        res = ref;
-        return res; // Do not pop function reference
+        int ref = luaL_ref(pLuaState, LUA_REGISTRYINDEX);
+        res = LuaFunction(this, ref);
+        return res; // Function has been popped by luaL_ref
     }
     default:
         break;
     }
 
-    lua_pop(m->pLuaState, 1);
+    lua_pop(pLuaState, 1);
+    return res;
+}
+
+const std::shared_ptr<LuaEngine*>& LuaEngine::anchor() const
+{
+    return m->anchor;
+}
+
+Variant LuaEngine::invokeRef(int ref, const VariantList &args)
+{
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_Invoke);
+    clearError();
+    int top = lua_gettop(m->pLuaState);
+
+    lua_rawgeti(m->pLuaState, LUA_REGISTRYINDEX, ref);
+
+    Variant res = call(top, args);
+    timer.setErrorCode(error());
     return res;
 }
 
+void LuaEngine::releaseRef(int ref)
+{
+    luaL_unref(m->pLuaState, LUA_REGISTRYINDEX, ref);
+}
+
+bool LuaEngine::streamNext(int ref, bool coroutine, Variant &value)
+{
+    MetricsTimer timer(m->pMetrics, Metrics::Operation_Invoke);
+    clearError();
+    int top = lua_gettop(m->pLuaState);
+    lua_rawgeti(m->pLuaState, LUA_REGISTRYINDEX, ref);
+
+    if (coroutine) {
+        lua_State *pThread = lua_tothread(m->pLuaState, -1);
+        lua_pop(m->pLuaState, 1);
+
+        // A coroutine which has not started yet has the function at the bottom
+        int nArgs = lua_status(pThread) == LUA_YIELD ? 0 : lua_gettop(pThread) - 1;
+        int nResults = 0;
+        int err = cxlua_resume(pThread, m->pLuaState, nArgs, &nResults);
+        if (err == LUA_YIELD) {
+            if (!lua_checkstack(m->pLuaState, nResults)) {
+                // Yielded values do not fit onto the engine stack, the stream fails
+                lua_pop(pThread, nResults);
+                m->error.code = LUA_ERRRUN;
+                m->error.message = "stack overflow (too many values yielded)";
+                timer.setErrorCode(LUA_ERRRUN);
+                return false;
+            }
+            lua_xmove(pThread, m->pLuaState, nResults);
+            value = popReturnValues(top);
+            return true;
+        }
+        if (err != LUA_OK) {
+            // The coroutine stack is left as it was at the failure point
+            captureFrames(pThread, 0, m->error);
+            lua_xmove(pThread, m->pLuaState, 1);
+            popError(err);
+            timer.setErrorCode(err);
+        }
+        return false;
+    }
+
+    // Call iterator with the state and the control variable
+    int iterator = top + 1;
+    lua_rawgeti(m->pLuaState, iterator, 1);
+    lua_rawgeti(m->pLuaState, iterator, 2);
+    lua_rawgeti(m->pLuaState, iterator, 3);
+    int err = pcall(2);
+    popError(err);
+    timer.setErrorCode(err);
+    if (err != 0 || lua_gettop(m->pLuaState) == iterator || lua_isnil(m->pLuaState, iterator + 1)) {
+        lua_settop(m->pLuaState, top);
+        return false;
+    }
+
+    lua_pushvalue(m->pLuaState, iterator + 1);
+    lua_rawseti(m->pLuaState, iterator, 3);
+    lua_remove(m->pLuaState, iterator);
+    value = popReturnValues(top);
+    return true;
+}
+
+void LuaEngine::closeStream(int ref, bool coroutine)
+{
+    int top = lua_gettop(m->pLuaState);
+    lua_rawgeti(m->pLuaState, LUA_REGISTRYINDEX, ref);
+
+    // Like in Lua, an error while closing replaces the error of the stream
+    Error streamError = m->error;
+    clearError();
+    int err = LUA_OK;
+    if (coroutine) {
+        lua_State *pThread = lua_tothread(m->pLuaState, -1);
+        int status = lua_status(pThread);
+        if (status == LUA_YIELD) {
+            err = cxlua_closethread(pThread, m->pLuaState);
+            if (err != LUA_OK) {
+                lua_xmove(pThread, m->pLuaState, 1);
+            }
+        } else if (status != LUA_OK) {
+            // Failed coroutine, its error has been reported already
+            cxlua_closethread(pThread, m->pLuaState);
+        }
+    } else {
+#if LUA_VERSION_NUM >= 504
+        lua_rawgeti(m->pLuaState, -1, 4);
+        if (!lua_isnil(m->pLuaState, -1) && luaL_getmetafield(m->pLuaState, -1, "__close") != LUA_TNIL) {
+            lua_insert(m->pLuaState, -2);
+            lua_pushnil(m->pLuaState);
+            err = pcall(2);
+        }
+#endif
+    }
+
+    if (err != LUA_OK) {
+        popError(err);
+    } else {
+        m->error = std::move(streamError);
+    }
+    lua_settop(m->pLuaState, top);
+    releaseRef(ref);
+}
+
+void LuaEngine::updateGcStatistics(long long startTime, bool cycleFinished)
+{
+    long long pause = microseconds() - startTime;
+    if (m->pMetrics) {
+        m->pMetrics->record(Metrics::Operation_Gc, static_cast<unsigned long long>(pause) * 1000);
+    }
+    if (cycleFinished) {
+        m->gcCycles++;
+    }
+    m->gcPauseTime += pause;
+    m->gcLastPauseTime = pause;
+    if (pause > m->gcMaxPauseTime) {
+        m->gcMaxPauseTime = pause;
+    }
+}
+
+Variant LuaEngine::call(int top, const VariantList &args, VariantArena *pArena)
+{
+    callWithArgs(args);
+
+    return popReturnValues(top, pArena);
+}
+
+int LuaEngine::callWithArgs(const VariantList &args)
+{
+    for (VariantList::const_iterator it = args.begin(); it != args.end(); ++it) {
+        pushValue(*it);
+    }
+
+    int err = pcall(static_cast<int>(args.size()));
+    popError(err);
+
+    return err;
+}
+
+int LuaEngine::loadChunk(const char *source, size_t size, const char *chunkName)
+{
+    std::string wrapped;
+    if (m->bindGlobals && m->binder.wrap(source, size, wrapped)) {
+        int err = luaL_loadbuffer(m->pLuaState, wrapped.data(), wrapped.size(), chunkName);
+        if (err == 0) {
+            return 0;
+        }
+        // Too many locals, reassigned constant or syntax error: load as is
+        lua_pop(m->pLuaState, 1);
+    }
+
+    return luaL_loadbuffer(m->pLuaState, source, size, chunkName);
+}
+
+int LuaEngine::loadFileChunk(const std::string &fileName)
+{
+    std::ifstream file(fileName.c_str(), std::ios::in | std::ios::binary);
+    if (!m->bindGlobals || m->binder.isEmpty() || !file) {
+        return luaL_loadfile(m->pLuaState, fileName.c_str());
+    }
+    std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    // Skip UTF-8 BOM and "#" first line the way luaL_loadfile does, keeping line numbers
+    size_t start = source.compare(0, 3, "\xEF\xBB\xBF") == 0 ? 3 : 0;
+    if (start < source.size() && source[start] == '#') {
+        start = source.find('\n', start);
+        if (start == std::string::npos) {
+            start = source.size();
+        }
+    }
+
+    std::string chunkName = "@" + fileName;
+    return loadChunk(source.data() + start, source.size() - start, chunkName.c_str());
+}
+
+Variant LuaEngine::runChunk(int err, const Environment &env, const char *chunkName,
+                            VariantArena *pArena)
+{
+    // Loaded chunk or error message is on top of the stack
+    int top = lua_gettop(m->pLuaState) - 1;
+
+    if (err == 0) {
+        if (env.isValid()) {
+            lua_rawgeti(m->pLuaState, LUA_REGISTRYINDEX, env.m->ref);
+            cxlua_setfuncenv(m->pLuaState, -2);
+        }
+        err = pcall(0);
+    }
+    popError(err, chunkName);
+
+    return popReturnValues(top, pArena);
+}
+
+bool LuaEngine::runModule(const ModuleRegistry::Module &module)
+{
+    int top = lua_gettop(m->pLuaState);
+    std::string chunkName = "@" + module.fileName;
+
+    int err = luaL_loadbufferx(m->pLuaState, module.bytecode.data(), module.bytecode.size(),
+                               chunkName.c_str(), "b");
+    if (err == 0) {
+        err = pcall(0);
+    }
+    popError(err, chunkName.c_str());
+    if (err != 0) {
+        lua_settop(m->pLuaState, top);
+        return false;
+    }
+
+    if (lua_gettop(m->pLuaState) == top || lua_isnil(m->pLuaState, top + 1)) {
+        // Module has defined its globals itself
+        lua_settop(m->pLuaState, top);
+        return true;
+    }
+    lua_settop(m->pLuaState, top + 1);
+
+    lua_getglobal(m->pLuaState, module.name.c_str());
+    if (lua_istable(m->pLuaState, -1) && lua_istable(m->pLuaState, -2)) {
+        // Update the module table in place
+        lua_pushnil(m->pLuaState);
+        while (lua_next(m->pLuaState, -3)) {
+            lua_pushvalue(m->pLuaState, -2);
+            lua_insert(m->pLuaState, -2);
+            lua_rawset(m->pLuaState, -4);
+        }
+    } else {
+        lua_pop(m->pLuaState, 1);
+        lua_pushvalue(m->pLuaState, -1);
+        lua_setglobal(m->pLuaState, module.name.c_str());
+    }
+
+    // Value on top is the module published under its name
+    lua_getglobal(m->pLuaState, LUA_LOADLIBNAME);
+    if (lua_istable(m->pLuaState, -1)) {
+        lua_getfield(m->pLuaState, -1, "loaded");
+        if (lua_istable(m->pLuaState, -1)) {
+            lua_pushvalue(m->pLuaState, -3);
+            lua_setfield(m->pLuaState, -2, module.name.c_str());
+        }
+    }
+    lua_settop(m->pLuaState, top);
+
+    return true;
+}
+
+void LuaEngine::pushSandboxBase()
+{
+    if (luaL_newmetatable(m->pLuaState, cLuaSandboxMetatable)) {
+        int base = lua_gettop(m->pLuaState);
+
+        // Weak cache of read-only proxies
+        lua_pushglobaltable(m->pLuaState);
+        lua_createtable(m->pLuaState, 0, 16);
+        lua_createtable(m->pLuaState, 0, 1);
+        lua_pushliteral(m->pLuaState, "k");
+        lua_setfield(m->pLuaState, -2, "__mode");
+        lua_setmetatable(m->pLuaState, -2);
+
+        // Hidden set: tables giving write access to the engine state and
+        // globals loading or running code outside of the environment
+        static const char *hiddenGlobals[] = {
+            "debug", "dofile", "loadfile", "loadstring", "getfenv", "setfenv", "module"
+        };
+        lua_createtable(m->pLuaState, 0, 16);
+        lua_pushglobaltable(m->pLuaState);
+        lua_pushboolean(m->pLuaState, 1);
+        lua_rawset(m->pLuaState, -3);
+        lua_pushvalue(m->pLuaState, LUA_REGISTRYINDEX);
+        lua_pushboolean(m->pLuaState, 1);
+        lua_rawset(m->pLuaState, -3);
+        lua_getglobal(m->pLuaState, "debug");
+        if (lua_istable(m->pLuaState, -1)) {
+            lua_pushboolean(m->pLuaState, 1);
+            lua_rawset(m->pLuaState, -3);
+        } else {
+            lua_pop(m->pLuaState, 1);
+        }
+        for (size_t i = 0; i < sizeof(hiddenGlobals) / sizeof(hiddenGlobals[0]); i++) {
+            lua_pushboolean(m->pLuaState, 1);
+            lua_setfield(m->pLuaState, -2, hiddenGlobals[i]);
+        }
+
+        lua_pushvalue(m->pLuaState, base + 1);
+        lua_pushvalue(m->pLuaState, base + 2);
+        lua_pushvalue(m->pLuaState, base + 3);
+        lua_pushcclosure(m->pLuaState, sandboxIndex, 3);
+        lua_setfield(m->pLuaState, base, "__index");
+
+        // require() of the environments
+        lua_getglobal(m->pLuaState, "require");
+        if (lua_isfunction(m->pLuaState, -1)) {
+            lua_pushvalue(m->pLuaState, base + 2);
+            lua_pushvalue(m->pLuaState, base + 3);
+            lua_pushcclosure(m->pLuaState, sandboxRequire, 3);
+            lua_setfield(m->pLuaState, base, "require");
+        } else {
+            lua_pop(m->pLuaState, 1);
+        }
+
+        // getmetatable() of the environments, sharing the proxy cache
+        lua_pushcclosure(m->pLuaState, sandboxGetMetatable, 2);
+        lua_setfield(m->pLuaState, base, "getmetatable");
+        lua_pop(m->pLuaState, 1);
+
+        lua_pushboolean(m->pLuaState, 0);
+        lua_setfield(m->pLuaState, -2, "__metatable");
+    }
+}
+
+int LuaEngine::pcall(int nArgs)
+{
+    // Place message handler below the function
+    int base = lua_gettop(m->pLuaState) - nArgs;
+    lua_pushcfunction(m->pLuaState, messageHandler);
+    lua_insert(m->pLuaState, base);
+
+    int err = lua_pcall(m->pLuaState, nArgs, LUA_MULTRET, base);
+    lua_remove(m->pLuaState, base);
+
+    return err;
+}
+
+int LuaEngine::messageHandler(lua_State *pLuaState)
+{
+    LuaEngine *pLuaEngine = getLuaEngine(pLuaState);
+
+    // Make sure the error message is a string
+    if (lua_type(pLuaState, 1) != LUA_TSTRING) {
+        if (luaL_callmeta(pLuaState, 1, "__tostring") && lua_type(pLuaState, -1) == LUA_TSTRING) {
+            lua_replace(pLuaState, 1);
+        } else {
+            lua_pushfstring(pLuaState, "(error object is a %s value)", luaL_typename(pLuaState, 1));
+            lua_replace(pLuaState, 1);
+        }
+        lua_settop(pLuaState, 1);
+    }
+
+    if (pLuaEngine == 0) {
+        return 1;
+    }
+
+    // Capture the stack before it gets unwound.
+    // Level 0 is the handler itself.
+    captureFrames(pLuaState, 1, pLuaEngine->m->error);
+
+    return 1;
+}
+
 void LuaEngine::initLuaState(lua_State *pLuaState)
 {
+    m->anchor = std::make_shared<LuaEngine*>(this);
+    m->gcStopped = false;
+
 	if (pLuaState == 0) {
 		m->pLuaState = luaL_newstate();
 		m->internalLuaState = true;
 
 		// Load Lua libraries
-	    luaL_openlibs(m->pLuaState);
+		openLibraries();
 	} else {
 		m->pLuaState = pLuaState;
 		m->internalLuaState = false;
@@ -495,6 +2496,29 @@ void LuaEngine::initLuaState(lua_State *pLuaState)
 }
 
 
+void LuaEngine::openLibraries()
+{
+    if (m->libraries == Library_All) {
+        luaL_openlibs(m->pLuaState);
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(cLuaLibraries) / sizeof(cLuaLibraries[0]); i++) {
+        if (m->libraries & cLuaLibraries[i].flag) {
+            luaL_requiref(m->pLuaState, cLuaLibraries[i].name, cLuaLibraries[i].open, 1);
+            lua_pop(m->pLuaState, 1);
+        }
+    }
+
+    if ((m->libraries & Library_Base) && !(m->libraries & Library_IO)) {
+        // No file system access without IO library
+        lua_pushnil(m->pLuaState);
+        lua_setglobal(m->pLuaState, "dofile");
+        lua_pushnil(m->pLuaState);
+        lua_setglobal(m->pLuaState, "loadfile");
+    }
+}
+
 void LuaEngine::injectLuaEngineRef()
 {
     void *ptr = static_cast<void*>(this);
@@ -502,14 +2526,18 @@ void LuaEngine::injectLuaEngineRef()
     lua_setglobal(m->pLuaState, cLuaScriptEngineRef);
 }
 
-void LuaEngine::popError(int err)
+void LuaEngine::popError(int err, const char *chunkName)
 {
     if (err != 0) {
-        m->error = err;
+        m->error.code = err;
         const char *strErr = lua_tostring(m->pLuaState, -1);
-        if (strErr) {
-            lua_pop(m->pLuaState, 1);
-            m->errorText = std::string(strErr);
+        m->error.message = strErr ? std::string(strErr) : std::string("unknown error");
+        lua_pop(m->pLuaState, 1);
+
+        // Errors raised before the chunk started (e.g. syntax errors)
+        // have no traceback
+        if (m->error.chunkName.empty() && chunkName) {
+            m->error.chunkName = chunkId(chunkName);
         }
     }
 }
@@ -570,25 +2598,57 @@ void* LuaEngine::toData()
     return lua_touserdata(m->pLuaState, -1);
 }
 
-Variant LuaEngine::popReturnValues(int top)
+Variant LuaEngine::popReturnValues(int top, VariantArena *pArena)
 {
     if (isError()) {
         return Variant();
     }
 
-    VariantList returnValues;
     int nresults = lua_gettop(m->pLuaState) - top;
-    for (int i = 0; i < nresults; i++) {
-        returnValues.push_front(popValue());
+    if (nresults == 0) {
+        return Variant();
     }
 
-    if (returnValues.size() == 0) {
-        return Variant();
+    if (nresults == 1) {
+        return popTopValue(m->pLuaState, pArena);
+    }
+
+    // Multiple values are packed into a list (an array in the arena)
+    if (pArena) {
+        VariantArray returnValues(pArena->resource());
+        returnValues.reserve(nresults);
+        for (int i = top + 1; i <= top + nresults; i++) {
+            lua_pushvalue(m->pLuaState, i);
+            returnValues.push_back(popTopValue(m->pLuaState, pArena));
+        }
+        lua_settop(m->pLuaState, top);
+        return Variant(std::move(returnValues), pArena);
+    }
+
+    VariantList returnValues;
+    for (int i = top + 1; i <= top + nresults; i++) {
+        lua_pushvalue(m->pLuaState, i);
+        returnValues.push_back(popTopValue(m->pLuaState, pArena));
+    }
+    lua_settop(m->pLuaState, top);
+
+    return Variant(std::move(returnValues));
+}
+
+bool LuaEngine::popResults(int top, Results &results)
+{
+    results.clear();
+    if (isError()) {
+        return false;
     }
 
-    if (returnValues.size() == 1) {
-        return returnValues.front();
+    // Values are converted in place, from the first one
+    int nresults = lua_gettop(m->pLuaState) - top;
+    for (int i = top + 1; i <= top + nresults; i++) {
+        lua_pushvalue(m->pLuaState, i);
+        results.append(popTopValue(m->pLuaState, 0));
     }
+    lua_settop(m->pLuaState, top);
 
-    return Variant(returnValues);
+    return true;
 }
@@ -1,10 +1,24 @@
 #ifndef LUAENGINE_H
 #define LUAENGINE_H
 
+#include <vector>
 #include "Variant.h"
+#include "LuaFunction.h"
+#include "LuaStream.h"
+#include "ArgumentView.h"
 #include "Scriptable.h"
+#include "SharedTable.h"
+#include "TypedArray.h"
+#include "Channel.h"
+#include "Serializer.h"
+#include "ModuleRegistry.h"
+#include "Metrics.h"
+#include "Recorder.h"
+#include "MemoCache.h"
+#include "ChunkBinder.h"
 
 struct lua_State;
+class ModuleBuilder;
 
 /**
  * C++ wrapper for Lua VM
@@ -34,10 +48,136 @@ public:
 		mutable LuaEngine *m_pLuaEngine;
 	};
 
+    /**
+     * Isolated global environment for running chunks.
+     *
+     * Chunks evaluated in an environment write their globals into
+     * the environment table. Reads fall back to the engine globals,
+     * which are visible read-only, tables nested in them included.
+     * getmetatable() returns shared metatables (e.g. of strings) and
+     * require() returns modules read-only as well. The engine global
+     * table, the registry, the debug library and the functions loading
+     * chunks into the engine globals (dofile, loadfile, loadstring,
+     * getfenv, setfenv, module) are not visible at all.
+     *
+     * Environments do not restrict the libraries otherwise: io, os and
+     * package.loadlib reach the host system. Create the engine with
+     * Library_Safe to run untrusted code.
+     */
+    class Environment
+    {
+    public:
+        Environment();
+        bool isValid() const;
+        Variant value(const std::string &identifier) const;
+        void setValue(const std::string &identifier, const Variant &value);
+    private:
+        friend class LuaEngine;
+        struct Private;
+        std::shared_ptr<Private> m;
+    };
+
+    /**
+     * Return values of a call, in order, with the exact count.
+     *
+     * Up to cInlineCapacity values are stored inline, so calls
+     * returning few values do not allocate. The object is meant
+     * to be reused: clear() keeps the overflow storage capacity.
+     */
+    class Results
+    {
+    public:
+        static const int cInlineCapacity = 3;
+
+        Results();
+        int size() const { return m_size; }
+        bool isEmpty() const { return m_size == 0; }
+        const Variant& operator[](int index) const;
+        Variant& operator[](int index);
+        void append(Variant &&value);
+        void clear();
+    private:
+        Results(const Results&) = delete;
+        Results& operator =(const Results&) = delete;
+
+        Variant m_inline[cInlineCapacity];
+        std::vector<Variant> m_overflow;
+        int m_size;
+    };
+
     /// Native function
     typedef Variant (*NativeFunction)(const VariantList &args, void *pData);
 
+    /// Native function reading its arguments straight from the Lua stack
+    typedef Variant (*NativeViewFunction)(const ArgumentView &args, void *pData);
+
+    /**
+     * Standard Lua libraries.
+     * With Lua 5.1 and LuaJIT the coroutine library is part of the base
+     * library, utf8 library is available since Lua 5.3.
+     */
+    enum Library {
+        Library_Base      = 0x0001,
+        Library_Package   = 0x0002,
+        Library_Coroutine = 0x0004,
+        Library_Table     = 0x0008,
+        Library_IO        = 0x0010,
+        Library_OS        = 0x0020,
+        Library_String    = 0x0040,
+        Library_Math      = 0x0080,
+        Library_UTF8      = 0x0100,
+        Library_Debug     = 0x0200,
+
+        /// Libraries without access to the host system
+        Library_Safe = Library_Base | Library_Coroutine | Library_Table
+                     | Library_String | Library_Math | Library_UTF8,
+
+        Library_All  = 0x03FF
+    };
+
+    /// Stack frame of an error traceback
+    struct StackFrame
+    {
+        std::string source;     ///< Chunk name (as shown by Lua in messages).
+        std::string function;   ///< Function name, empty if unknown.
+        std::string what;       ///< Function kind: "Lua", "C", "main" or "tail".
+        int line;               ///< Current line, -1 if not available.
+    };
+
+    /// Structured error information
+    struct Error
+    {
+        int code;                       ///< Lua error code, 0 if no error.
+        std::string message;            ///< Error message.
+        std::string chunkName;          ///< Name of the failing chunk.
+        std::vector<StackFrame> frames; ///< Traceback, innermost frame first.
+
+        /// Format the traceback the same way luaL_traceback does.
+        std::string traceback() const;
+    };
+
+    /// Garbage collector statistics
+    struct GcStatistics
+    {
+        size_t heapSize;        ///< Memory in use by Lua, in bytes.
+        bool running;           ///< Whether the collector is running.
+        unsigned cycles;        ///< Number of cycles completed by explicit GC calls.
+        unsigned steps;         ///< Number of explicit incremental steps.
+        long long pauseTime;    ///< Total time spent in explicit GC calls, in microseconds.
+        long long maxPauseTime; ///< Longest explicit GC call, in microseconds.
+        long long lastPauseTime;///< Duration of the last explicit GC call, in microseconds.
+    };
+
     LuaEngine();
+
+    /**
+     * Construct Lua engine with selected standard libraries only.
+     * Unless Library_IO is selected, file loading functions
+     * (dofile, loadfile) are removed from the base library as well.
+     * @param libraries Combination of Library flags.
+     */
+    explicit LuaEngine(int libraries);
+
     LuaEngine(lua_State *pLuaState);
     ~LuaEngine();
 
@@ -46,37 +186,381 @@ public:
     std::string errorText() const;
     bool isError() const { return error() != 0; }
 
+    /**
+     * Returns detailed information about the last error,
+     * including the stack traceback captured at the failure point.
+     */
+    const Error& lastError() const;
+
     // Reset Lua environment.
     void reset();
 
     /**
      * Evaluate Lua script.
+     * @param script Lua script source.
+     * @param chunkName Chunk name used in error messages. Lua conventions
+     *                  apply: '@' prefix for file names, '=' for verbatim names.
+     *                  Empty name means the script itself.
      */
-    Variant evaluate(const std::string &script);
+    Variant evaluate(const std::string &script, const std::string &chunkName = std::string());
 
     Variant evaluateFile(const std::string &fileName);
 
+    /**
+     * Create new isolated environment.
+     * Environments are lightweight, many of them can share one engine.
+     */
+    Environment createEnvironment();
+
+    /**
+     * Evaluate Lua script in given environment.
+     */
+    Variant evaluate(const std::string &script, const Environment &env,
+                     const std::string &chunkName = std::string());
+
+    Variant evaluateFile(const std::string &fileName, const Environment &env);
+
     Variant invoke(const std::string &funcName,
                    const VariantList &args = VariantList());
 
+    /**
+     * Invoke Lua function and store all its return values.
+     * Unlike invoke() returning a single Variant, a table result
+     * is distinguishable from multiple return values.
+     * @return false on error, results are empty in this case.
+     */
+    bool invoke(const std::string &funcName, const VariantList &args, Results &results);
+
+    /**
+     * Evaluate Lua script and store all its return values.
+     * @return false on error, results are empty in this case.
+     */
+    bool evaluate(const std::string &script, Results &results,
+                  const std::string &chunkName = std::string());
+
+    /**
+     * Stream the values of a generic for iterator (see LuaStream).
+     * The global function is called with the arguments and has to return
+     * the iterator the way a for loop expects it, e.g. pairs(t) or a closure.
+     * Each next() of the stream then calls the iterator once.
+     * @return Invalid stream on error.
+     */
+    LuaStream iterate(const std::string &funcName, const VariantList &args = VariantList());
+
+    /**
+     * Stream the values yielded by a global function run as a coroutine
+     * (see LuaStream). The function starts on the first next() of the
+     * stream, its return values are not part of the stream.
+     */
+    LuaStream generate(const std::string &funcName, const VariantList &args = VariantList());
+
     void registerObject(const std::string &objectName, Scriptable *pScriptable);
 
     void registerFunction(const std::string &funcName, NativeFunction func, void *pData = 0);
 
+    /**
+     * Register native function taking arguments view.
+     * Arguments are not converted up front, only the values
+     * the function actually reads.
+     */
+    void registerFunction(const std::string &funcName, NativeViewFunction func, void *pData = 0);
+
+    /**
+     * Expose shared read-only table as a global variable.
+     * The table data is not copied into Lua state.
+     */
+    void registerSharedTable(const std::string &tableName, const SharedTable &table);
+
+    /**
+     * Expose typed array as a global variable.
+     * Scripts access the array memory directly, nothing is copied.
+     */
+    void registerTypedArray(const std::string &arrayName, const TypedArray &array);
+
+    /**
+     * Register typed array library (array.new, sum, dot, etc.)
+     * as a global table.
+     */
+    void registerArrayLibrary(const std::string &libraryName = "array");
+
+    /**
+     * Get typed array referenced by a global variable.
+     * @return Invalid array if the variable is not a typed array.
+     */
+    TypedArray globalTypedArray(const std::string &identifier);
+
+    /**
+     * Expose channel as a global variable.
+     * The same channel can be registered in engines running in different threads.
+     */
+    void registerChannel(const std::string &channelName, const Channel &channel);
+
+    /**
+     * Register native module (see ModuleBuilder) built in one pass.
+     * @param module Module definition, kept alive by the engine.
+     * @param lazy Whether the module is registered in package.preload and built
+     *        on the first require(). Otherwise, or without the package library,
+     *        the module table is built now and assigned to the global variable
+     *        named after the module (and to package.loaded, if available).
+     */
+    void registerModule(const ModuleBuilder &module, bool lazy = true);
+
+    /**
+     * Run all modules of the registry in this engine and keep track of them.
+     * A module returning a value is assigned to the global variable named
+     * after the module (and to package.loaded, if available).
+     * The registry must outlive the engine.
+     * @return false if a module has failed, see lastError().
+     */
+    bool loadModules(ModuleRegistry &registry);
+
+    /**
+     * Rerun modules recompiled since they have been loaded.
+     * Module tables are updated in place, so references to them
+     * held by other scripts see the new version too. Fields removed
+     * from a module are kept.
+     * This is cheap when nothing has changed and can be called
+     * before every request.
+     * @return false if a module has failed, see lastError().
+     */
+    bool refreshModules();
+
+    /**
+     * Bind registered natives and objects (registerFunction(), registerObject())
+     * and frozen globals as locals of the evaluated chunks, see ChunkBinder.
+     * Scripts then call them without looking them up in the global table.
+     * Applies to the source chunks loaded by evaluate() and evaluateFile().
+     * Names a chunk assigns to stay unbound in it. Disabled by default.
+     */
+    void setBindGlobals(bool enable);
+    bool bindGlobals() const;
+
+    /**
+     * Freeze global variable: evaluated chunks bind its current value.
+     * Numbers, strings, booleans and nil become constants, other values
+     * are bound as locals (see setBindGlobals(), which must be enabled).
+     */
+    void freezeGlobal(const std::string &identifier);
+
+    /**
+     * Stop binding global variable, frozen or registered: chunks evaluated
+     * afterwards look it up in the global table again.
+     */
+    void unbindGlobal(const std::string &identifier);
+
     Variant globalValue(const std::string &identifier);
     void setGlobalValue(const std::string &identifier, const Variant &value);
 
     Reference operator[](const std::string &identifier);
 
+    /**
+     * Switch garbage collector to incremental mode.
+     * @param pause Collector pause, in percents (0 keeps current value).
+     * @param stepMultiplier Step multiplier, in percents (0 keeps current value).
+     * @param stepSize Step size as log2 of bytes, Lua 5.4 only (0 keeps current value).
+     */
+    void setGcIncremental(int pause = 0, int stepMultiplier = 0, int stepSize = 0);
+
+    /**
+     * Switch garbage collector to generational mode.
+     * @param minorMultiplier Minor collection multiplier (0 keeps current value).
+     * @param majorMultiplier Major collection multiplier (0 keeps current value).
+     * @return false if generational mode is not supported by Lua.
+     */
+    bool setGcGenerational(int minorMultiplier = 0, int majorMultiplier = 0);
+
+    /**
+     * Perform single incremental garbage collection step.
+     * @param stepSize Step size in kilobytes, 0 for a basic step.
+     * @return true if the step has finished a collection cycle.
+     */
+    bool stepGc(int stepSize = 0);
+
+    /**
+     * Perform incremental garbage collection steps until either
+     * the time budget is spent or the collection cycle is finished.
+     * Intended to be called in idle time.
+     * @param timeBudget Time budget in microseconds.
+     * @param stepSize Step size in kilobytes, 0 for basic steps.
+     * @return true if a collection cycle has been finished.
+     */
+    bool stepGcFor(long long timeBudget, int stepSize = 0);
+
+    /// Perform full garbage collection cycle.
+    void collectGc();
+
+    /// Stop garbage collector, e.g. before a latency-critical section.
+    void stopGc();
+
+    /// Restart garbage collector stopped by stopGc().
+    void restartGc();
+
+    bool isGcRunning() const;
+
+    GcStatistics gcStatistics() const;
+
+    /**
+     * Attach metrics collecting latencies and error counts
+     * of the engine calls. Metrics can be shared by several engines.
+     * @param pMetrics Metrics, null to disable (default).
+     */
+    void setMetrics(Metrics *pMetrics);
+    Metrics* metrics() const;
+
+    /**
+     * Attach recorder logging the engine calls for replay.
+     * @param pRecorder Recorder, null to disable (default).
+     */
+    void setRecorder(Recorder *pRecorder);
+    Recorder* recorder() const;
+
+    /**
+     * Memoize results of a pure global function: invoke() by name returns
+     * cached results for arguments seen before without calling into Lua.
+     * The cache can be shared by several engines and functions.
+     * Only invoke() returning a single Variant is memoized.
+     */
+    void memoize(const std::string &funcName, MemoCache &cache);
+
+    /// Stop memoizing function, its cached results are dropped.
+    void unmemoize(const std::string &funcName);
+
+    /**
+     * Pop Lua sequences of at least the given length as Variant arrays
+     * (Type_Array, contiguous storage) instead of lists.
+     * @param length Minimal length, 0 to disable (default).
+     */
+    void setArrayThreshold(size_t length);
+    size_t arrayThreshold() const;
+
     void pushValue(const Variant &value);
     Variant popValue();
 
+    /**
+     * Push and pop values on the given Lua state of the engine, e.g. in
+     * a C function called by a coroutine, which runs on a stack of its own.
+     */
+    void pushValue(lua_State *pLuaState, const Variant &value);
+    Variant popValue(lua_State *pLuaState);
+
+    /**
+     * Per-request allocation: the returned Variant tree is allocated
+     * in the arena and has to be destroyed before the arena is released.
+     * Lists, multiple return values included, come as arrays (Type_Array,
+     * see Variant::isSequence()).
+     */
+    Variant popValue(VariantArena &arena);
+    Variant evaluate(const std::string &script, VariantArena &arena,
+                     const std::string &chunkName = std::string());
+    Variant invoke(const std::string &funcName, const VariantList &args, VariantArena &arena);
+
+    /**
+     * Invoke Lua function and serialize its first return value
+     * straight from the Lua stack, without building a Variant.
+     * Null is written if the function returns nothing.
+     * @return false on error, nothing is written in this case.
+     */
+    bool invoke(const std::string &funcName, const VariantList &args, ValueWriter &writer);
+
+    /**
+     * Serialize global value straight from the Lua stack.
+     */
+    void serializeGlobal(const std::string &identifier, ValueWriter &writer);
+
+    /**
+     * Serialize top-most value of the Lua stack and pop it.
+     * Tables nested deeper than the table depth limit and cyclic
+     * references are written as null, as are functions and userdata.
+     * Tables with keys 1..n only are written as lists, other tables as
+     * maps with numeric keys converted to strings.
+     */
+    void serializeValue(ValueWriter &writer);
+
+    /**
+     * Serialize top-most value of the given Lua state of the engine
+     * (e.g. a running coroutine, from a C function) and pop it.
+     */
+    void serializeValue(lua_State *pLuaState, ValueWriter &writer);
+
+    /**
+     * Decode serialized value straight into Lua tables and push it onto the stack.
+     * @return false if the data is malformed or nested too deep, nothing is pushed then.
+     */
+    bool pushSerialized(const char *data, size_t size, SerialFormat format);
+
+    /// Decode serialized value onto the stack of the given Lua state of the engine.
+    bool pushSerialized(lua_State *pLuaState, const char *data, size_t size, SerialFormat format);
+
+    /**
+     * Decode serialized value and assign it to a global variable.
+     */
+    bool setGlobalSerialized(const std::string &identifier, const char *data, size_t size,
+                             SerialFormat format);
+
 private:
 
+    friend class LuaFunction;
+    friend class LuaStream;
+
+    /// Shared pointer to this engine, nulled when the Lua state gets closed.
+    const std::shared_ptr<LuaEngine*>& anchor() const;
+
+    /// Invoke function referenced in Lua registry.
+    Variant invokeRef(int ref, const VariantList &args);
+
+    /// Release Lua registry reference.
+    void releaseRef(int ref);
+
+    /// Produce next value of a stream, returns false at its end or on error.
+    bool streamNext(int ref, bool coroutine, Variant &value);
+
+    /// Close stream (closing value or suspended coroutine) and release its reference.
+    void closeStream(int ref, bool coroutine);
+
+    /// Call function on top of the stack with given arguments.
+    Variant call(int top, const VariantList &args, VariantArena *pArena = 0);
+
+    /// Push arguments and call function below them, returns error code.
+    int callWithArgs(const VariantList &args);
+
+    /// Serialize value on top of the stack without popping it.
+    void serializeSafe(lua_State *pLuaState, ValueWriter &writer, int tableLevel,
+                       std::vector<const void*> &path);
+
+    /// Protected call with traceback capturing message handler.
+    int pcall(int nArgs);
+
+    /// Message handler capturing error traceback.
+    static int messageHandler(lua_State *pLuaState);
+
+    /// Account explicit GC call started at given time.
+    void updateGcStatistics(long long startTime, bool cycleFinished);
+
+    /// Load source chunk, with the globals bound if enabled.
+    int loadChunk(const char *source, size_t size, const char *chunkName);
+
+    /// Load source file, with the globals bound if enabled.
+    int loadFileChunk(const std::string &fileName);
+
+    /// Load chunk and run it in the environment (if valid).
+    Variant runChunk(int err, const Environment &env, const char *chunkName,
+                     VariantArena *pArena = 0);
+
+    /// Run module chunk and publish its result.
+    bool runModule(const ModuleRegistry::Module &module);
+
+    /// Push table of the sandbox environments base onto the stack.
+    void pushSandboxBase();
+
     void initLuaState(lua_State *pLuaState = 0);
+    void openLibraries();
     void injectLuaEngineRef();
-    void popError(int err);
-    Variant popValueSafe(int tableLevel);
+    void popError(int err, const char *chunkName = 0);
+    Variant popValueSafe(lua_State *pLuaState, int tableLevel, VariantArena *pArena);
+    void pushValueSafe(lua_State *pLuaState, const Variant &value);
+
+    /// Pop top-most value, measured as a single conversion.
+    Variant popTopValue(lua_State *pLuaState, VariantArena *pArena);
 
     void pushNull();
     void pushBoolean(bool value);
@@ -92,7 +576,10 @@ private:
     std::string toString();
     void* toData();
 
-    Variant popReturnValues(int top);
+    Variant popReturnValues(int top, VariantArena *pArena = 0);
+
+    /// Pop values above the top into results.
+    bool popResults(int top, Results &results);
 
     /**
      * Forward declaration of Lua engine data structures
@@ -0,0 +1,107 @@
+#include "LuaEngine.h"
+#include "LuaFunction.h"
+
+struct LuaFunction::Private
+{
+    std::shared_ptr<LuaEngine*> engine; ///< Owning engine, nulled when Lua state is closed.
+    int ref;                            ///< Lua registry reference.
+
+    ~Private()
+    {
+        LuaEngine *pLuaEngine = *engine;
+        if (pLuaEngine) {
+            pLuaEngine->releaseRef(ref);
+        }
+    }
+};
+
+LuaFunction::LuaFunction()
+    : m()
+{
+}
+
+LuaFunction::LuaFunction(LuaEngine *pLuaEngine, int ref)
+    : m(std::make_shared<Private>())
+{
+    m->engine = pLuaEngine->anchor();
+    m->ref = ref;
+}
+
+bool LuaFunction::isValid() const
+{
+    return luaEngine() != 0;
+}
+
+LuaEngine* LuaFunction::luaEngine() const
+{
+    return m ? *m->engine : 0;
+}
+
+int LuaFunction::ref() const
+{
+    return m ? m->ref : 0;
+}
+
+Variant LuaFunction::operator ()(const VariantList &args) const
+{
+    LuaEngine *pLuaEngine = luaEngine();
+    if (pLuaEngine) {
+        return pLuaEngine->invokeRef(m->ref, args);
+    }
+    return Variant();
+}
+
+Variant LuaFunction::operator ()(const Variant &a1) const
+{
+    VariantList args;
+    args.push_back(a1);
+    return operator ()(args);
+}
+
+Variant LuaFunction::operator ()(const Variant &a1,
+                                 const Variant &a2) const
+{
+    VariantList args;
+    args.push_back(a1);
+    args.push_back(a2);
+    return operator ()(args);
+}
+
+Variant LuaFunction::operator ()(const Variant &a1,
+                                 const Variant &a2,
+                                 const Variant &a3) const
+{
+    VariantList args;
+    args.push_back(a1);
+    args.push_back(a2);
+    args.push_back(a3);
+    return operator ()(args);
+}
+
+Variant LuaFunction::operator ()(const Variant &a1,
+                                 const Variant &a2,
+                                 const Variant &a3,
+                                 const Variant &a4) const
+{
+    VariantList args;
+    args.push_back(a1);
+    args.push_back(a2);
+    args.push_back(a3);
+    args.push_back(a4);
+    return operator ()(args);
+}
+
+Variant LuaFunction::operator ()(const Variant &a1,
+                                 const Variant &a2,
+                                 const Variant &a3,
+                                 const Variant &a4,
+                                 const Variant &a5) const
+{
+    VariantList args;
+    args.push_back(a1);
+    args.push_back(a2);
+    args.push_back(a3);
+    args.push_back(a4);
+    args.push_back(a5);
+    return operator ()(args);
+}
@@ -0,0 +1,62 @@
+#ifndef LUAFUNCTION_H
+#define LUAFUNCTION_H
+
+#include <memory>
+#include "Variant.h"
+
+class LuaEngine;
+
+/**
+ * @brief Handle to a Lua function.
+ *
+ * The function is kept in the Lua registry for as long as any copy
+ * of the handle is alive. The registry reference is released when
+ * the last copy is destroyed. A handle becomes invalid when its Lua
+ * engine is destroyed or reset.
+ */
+class LuaFunction
+{
+public:
+
+    LuaFunction();
+
+    /**
+     * Check whether the handle refers to a live Lua function.
+     * @return true if the function can be invoked.
+     */
+    bool isValid() const;
+
+    /**
+     * Returns Lua engine owning the function, or null for invalid handle.
+     */
+    LuaEngine* luaEngine() const;
+
+    /**
+     * Invoke the function.
+     * @param args Function arguments.
+     * @return Function return value(s).
+     */
+    Variant operator ()(const VariantList &args = VariantList()) const;
+    Variant operator ()(const Variant &a1) const;
+    Variant operator ()(const Variant &a1, const Variant &a2) const;
+    Variant operator ()(const Variant &a1, const Variant &a2, const Variant &a3) const;
+    Variant operator ()(const Variant &a1, const Variant &a2, const Variant &a3, const Variant &a4) const;
+    Variant operator ()(const Variant &a1, const Variant &a2, const Variant &a3, const Variant &a4, const Variant &a5) const;
+
+    bool operator ==(const LuaFunction &function) const { return m == function.m; }
+    bool operator !=(const LuaFunction &function) const { return m != function.m; }
+
+private:
+
+    friend class LuaEngine;
+
+    LuaFunction(LuaEngine *pLuaEngine, int ref);
+
+    /// Registry reference of the function.
+    int ref() const;
+
+    struct Private;
+    std::shared_ptr<Private> m;  ///< Shared between all copies of the handle.
+};
+
+#endif // LUAFUNCTION_H
@@ -0,0 +1,120 @@
+#include "LuaEngine.h"
+#include "LuaStream.h"
+
+struct LuaStream::Private
+{
+    std::shared_ptr<LuaEngine*> engine; ///< Owning engine, nulled when Lua state is closed.
+    int ref;                            ///< Lua registry reference, 0 once closed.
+    bool coroutine;                     ///< Whether ref is a coroutine or an iterator.
+    int error;
+    unsigned long long count;
+    Variant value;
+
+    void close()
+    {
+        LuaEngine *pLuaEngine = *engine;
+        if (ref != 0 && pLuaEngine) {
+            pLuaEngine->closeStream(ref, coroutine);
+        }
+        ref = 0;
+    }
+
+    ~Private()
+    {
+        close();
+    }
+};
+
+static const Variant cNullValue;
+
+LuaStream::Iterator& LuaStream::Iterator::operator ++()
+{
+    if (m_pStream && !m_pStream->next()) {
+        m_pStream = 0;
+    }
+    return *this;
+}
+
+LuaStream::LuaStream()
+    : m()
+{
+}
+
+LuaStream::LuaStream(LuaEngine *pLuaEngine, int ref, bool coroutine)
+    : m(std::make_shared<Private>())
+{
+    m->engine = pLuaEngine->anchor();
+    m->ref = ref;
+    m->coroutine = coroutine;
+    m->error = 0;
+    m->count = 0;
+}
+
+bool LuaStream::isValid() const
+{
+    return luaEngine() != 0 && m->ref != 0;
+}
+
+LuaEngine* LuaStream::luaEngine() const
+{
+    return m ? *m->engine : 0;
+}
+
+bool LuaStream::next()
+{
+    if (!isValid()) {
+        if (m) {
+            m->value.clear();
+        }
+        return false;
+    }
+
+    // The previous value is released first, only one is kept alive
+    m->value.clear();
+    LuaEngine *pLuaEngine = *m->engine;
+    if (pLuaEngine->streamNext(m->ref, m->coroutine, m->value)) {
+        m->count++;
+        return true;
+    }
+
+    m->error = pLuaEngine->error();
+    m->close();
+    return false;
+}
+
+bool LuaStream::next(Variant &value)
+{
+    if (!next()) {
+        return false;
+    }
+    value = std::move(m->value);
+    return true;
+}
+
+const Variant& LuaStream::value() const
+{
+    return m ? m->value : cNullValue;
+}
+
+int LuaStream::error() const
+{
+    return m ? m->error : 0;
+}
+
+unsigned long long LuaStream::count() const
+{
+    return m ? m->count : 0;
+}
+
+void LuaStream::close()
+{
+    if (m) {
+        m->close();
+        m->value.clear();
+    }
+}
+
+LuaStream::Iterator LuaStream::begin()
+{
+    return next() ? Iterator(this) : Iterator();
+}
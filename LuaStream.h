@@ -0,0 +1,105 @@
+#ifndef LUASTREAM_H
+#define LUASTREAM_H
+
+#include <memory>
+#include <iterator>
+#include "Variant.h"
+
+class LuaEngine;
+
+/**
+ * @brief Pull-based stream of values produced by Lua.
+ *
+ * Created by LuaEngine::iterate(), which drives a generic for iterator,
+ * or LuaEngine::generate(), which resumes a coroutine. Every next() call
+ * runs Lua until it produces one more value and converts that value only,
+ * so memory use does not depend on the length of the stream. Multiple
+ * values produced at once are packed into a list, as by invoke().
+ *
+ * The stream ends when the iterator returns nil or the coroutine returns,
+ * on error (see LuaEngine::lastError()) or when close() is called to stop
+ * early. Ending the stream runs the closing value of the iterator or the
+ * pending to-be-closed variables of the coroutine (Lua 5.4), like leaving
+ * a for loop does.
+ *
+ * LuaStream objects are handles, copies refer to the same stream, which
+ * is closed when the last copy is destroyed. A stream becomes invalid
+ * when its Lua engine is destroyed or reset.
+ */
+class LuaStream
+{
+public:
+
+    /// Input iterator over the values, for range-based for loops.
+    class Iterator
+    {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef Variant value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Variant* pointer;
+        typedef const Variant& reference;
+
+        Iterator() : m_pStream(0) {}
+        explicit Iterator(LuaStream *pStream) : m_pStream(pStream) {}
+
+        const Variant& operator *() const { return m_pStream->value(); }
+        const Variant* operator ->() const { return &m_pStream->value(); }
+        Iterator& operator ++();
+
+        bool operator ==(const Iterator &it) const { return m_pStream == it.m_pStream; }
+        bool operator !=(const Iterator &it) const { return m_pStream != it.m_pStream; }
+
+    private:
+        LuaStream *m_pStream;   ///< Null at the end.
+    };
+
+    LuaStream();
+
+    /**
+     * Check whether the stream can produce more values.
+     * @return false once the stream has ended or its engine is gone.
+     */
+    bool isValid() const;
+
+    /**
+     * Returns Lua engine running the stream, or null for invalid stream.
+     */
+    LuaEngine* luaEngine() const;
+
+    /**
+     * Advance to the next value.
+     * @return false at the end of the stream or on error.
+     */
+    bool next();
+
+    /// Advance to the next value and move it out of the stream.
+    bool next(Variant &value);
+
+    /// Current value, invalid before the first next() and after the end.
+    const Variant& value() const;
+
+    /// Error code which has ended the stream, 0 if none.
+    int error() const;
+
+    /// Number of values produced so far.
+    unsigned long long count() const;
+
+    /// Stop the stream early and release its Lua state.
+    void close();
+
+    /// Advance to the first value; a stream can be iterated once.
+    Iterator begin();
+    Iterator end() { return Iterator(); }
+
+private:
+
+    friend class LuaEngine;
+
+    LuaStream(LuaEngine *pLuaEngine, int ref, bool coroutine);
+
+    struct Private;
+    std::shared_ptr<Private> m;  ///< Shared between all copies of the handle.
+};
+
+#endif // LUASTREAM_H
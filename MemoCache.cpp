@@ -0,0 +1,285 @@
+#include <list>
+#include <mutex>
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <unordered_map>
+#include "Metrics.h"
+#include "MemoCache.h"
+
+struct MemoCache::Shard
+{
+    /// Cached call
+    struct Entry
+    {
+        size_t hash;
+        std::string funcName;
+        VariantList args;
+        Variant result;
+        unsigned long long expires;     ///< MetricsTimer::now() clock, 0 if never.
+    };
+
+    typedef std::list<Entry> EntryList;
+    typedef std::unordered_multimap<size_t, EntryList::iterator> EntryIndex;
+
+    /// Find entry of the call, returns end of the list if not cached.
+    EntryList::iterator find(size_t hash, const std::string &funcName, const VariantList &args);
+
+    /// Drop entry.
+    void erase(EntryList::iterator entry);
+
+    // Padded to a cache line of its own to keep the shard locks apart
+    alignas(64) std::mutex mutex;
+    EntryList entries;          ///< Most recently used first.
+    EntryIndex index;           ///< Entries by hash.
+    size_t capacity;
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long expirations;
+};
+
+struct MemoCache::Private
+{
+    std::vector<MemoCache::Shard> shards;
+    size_t capacity;
+    unsigned long long ttl;     ///< In nanoseconds.
+};
+
+/// Mix value into the hash seed.
+static inline size_t hashCombine(size_t seed, size_t value)
+{
+    return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+static size_t callHash(const std::string &funcName, const VariantList &args)
+{
+    size_t res = std::hash<std::string>()(funcName);
+    for (VariantList::const_iterator it = args.begin(); it != args.end(); ++it) {
+        res = hashCombine(res, it->hash());
+        res = hashCombine(res, it->type() == Variant::Type_Integer ? 1 : 0);
+    }
+    return res;
+}
+
+static bool sameValue(const Variant &first, const Variant &second);
+
+template <typename First, typename Second>
+static bool sameSequence(const First &first, const Second &second)
+{
+    return first.size() == second.size()
+        && std::equal(first.begin(), first.end(), second.begin(), sameValue);
+}
+
+/**
+ * Whether cached argument matches the call argument. Unlike Variant::operator ==
+ * integers and reals (and 0.0 and -0.0) differ, as they do in Lua (math.type(),
+ * string conversion), recursively. Lists and arrays push the same Lua table.
+ */
+static bool sameValue(const Variant &first, const Variant &second)
+{
+    Variant::Type type = first.type();
+    switch (type) {
+    case Variant::Type_Integer:
+        return second.type() == type && first.toInteger() == second.toInteger();
+    case Variant::Type_Real:
+        return second.type() == type && first.toReal() == second.toReal()
+            && std::signbit(first.toReal()) == std::signbit(second.toReal());
+    case Variant::Type_List:
+        return second.type() == Variant::Type_List ? sameSequence(first.list(), second.list())
+             : second.type() == Variant::Type_Array && sameSequence(first.list(), second.array());
+    case Variant::Type_Array:
+        return second.type() == Variant::Type_List ? sameSequence(first.array(), second.list())
+             : second.type() == Variant::Type_Array && sameSequence(first.array(), second.array());
+    case Variant::Type_Map: {
+        if (second.type() != type || first.map().size() != second.map().size()) {
+            return false;
+        }
+        VariantMap::const_iterator it = first.map().begin();
+        VariantMap::const_iterator other = second.map().begin();
+        for (; it != first.map().end(); ++it, ++other) {
+            if (it->first != other->first || !sameValue(it->second, other->second)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    default:
+        return first == second;
+    }
+}
+
+/// Deep copy of the arguments, in the default memory resource.
+static VariantList cloneList(const VariantList &args)
+{
+    VariantList res;
+    for (VariantList::const_iterator it = args.begin(); it != args.end(); ++it) {
+        res.push_back(it->clone());
+    }
+    return res;
+}
+
+
+/*
+ *  struct MemoCache::Shard
+ */
+
+MemoCache::Shard::EntryList::iterator MemoCache::Shard::find(size_t hash, const std::string &funcName,
+                                                             const VariantList &args)
+{
+    std::pair<EntryIndex::iterator, EntryIndex::iterator> range = index.equal_range(hash);
+    for (EntryIndex::iterator it = range.first; it != range.second; ++it) {
+        const Entry &entry = *it->second;
+        if (entry.funcName == funcName && sameSequence(entry.args, args)) {
+            return it->second;
+        }
+    }
+    return entries.end();
+}
+
+void MemoCache::Shard::erase(EntryList::iterator entry)
+{
+    std::pair<EntryIndex::iterator, EntryIndex::iterator> range = index.equal_range(entry->hash);
+    for (EntryIndex::iterator it = range.first; it != range.second; ++it) {
+        if (it->second == entry) {
+            index.erase(it);
+            break;
+        }
+    }
+    entries.erase(entry);
+}
+
+
+/*
+ *  class MemoCache
+ */
+
+MemoCache::MemoCache(size_t capacity, long long ttl, int shards)
+{
+    int count = 1;
+    while (count < shards) {
+        count <<= 1;
+    }
+
+    m = new MemoCache::Private();
+    m->shards = std::vector<Shard>(count);
+    m->capacity = capacity;
+    m->ttl = ttl > 0 ? static_cast<unsigned long long>(ttl) * 1000000ULL : 0;
+
+    size_t shardCapacity = (capacity + count - 1) / count;
+    for (std::vector<Shard>::iterator it = m->shards.begin(); it != m->shards.end(); ++it) {
+        it->capacity = shardCapacity > 0 ? shardCapacity : 1;
+        it->hits = 0;
+        it->misses = 0;
+        it->evictions = 0;
+        it->expirations = 0;
+    }
+}
+
+MemoCache::~MemoCache()
+{
+    delete m;
+}
+
+size_t MemoCache::capacity() const
+{
+    return m->capacity;
+}
+
+long long MemoCache::ttl() const
+{
+    return static_cast<long long>(m->ttl / 1000000ULL);
+}
+
+bool MemoCache::lookup(const std::string &funcName, const VariantList &args, Variant &result)
+{
+    size_t hash = callHash(funcName, args);
+    Shard &shard = m->shards[hash & (m->shards.size() - 1)];
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    Shard::EntryList::iterator entry = shard.find(hash, funcName, args);
+    if (entry == shard.entries.end()) {
+        ++shard.misses;
+        return false;
+    }
+
+    // The clock is only read when entries can expire
+    if (entry->expires != 0 && MetricsTimer::now() >= entry->expires) {
+        shard.erase(entry);
+        ++shard.expirations;
+        ++shard.misses;
+        return false;
+    }
+
+    // Move to the front, no allocation
+    shard.entries.splice(shard.entries.begin(), shard.entries, entry);
+    ++shard.hits;
+    result = entry->result;
+    return true;
+}
+
+void MemoCache::insert(const std::string &funcName, const VariantList &args, const Variant &result)
+{
+    size_t hash = callHash(funcName, args);
+    Shard &shard = m->shards[hash & (m->shards.size() - 1)];
+    unsigned long long expires = m->ttl != 0 ? MetricsTimer::now() + m->ttl : 0;
+
+    // Copies are made outside of the lock
+    Variant value = result.clone();
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    Shard::EntryList::iterator entry = shard.find(hash, funcName, args);
+    if (entry != shard.entries.end()) {
+        entry->result = value;
+        entry->expires = expires;
+        shard.entries.splice(shard.entries.begin(), shard.entries, entry);
+        return;
+    }
+
+    shard.entries.push_front(Shard::Entry { hash, funcName, cloneList(args), value, expires });
+    shard.index.emplace(hash, shard.entries.begin());
+
+    while (shard.entries.size() > shard.capacity) {
+        shard.erase(std::prev(shard.entries.end()));
+        ++shard.evictions;
+    }
+}
+
+void MemoCache::remove(const std::string &funcName)
+{
+    for (std::vector<Shard>::iterator it = m->shards.begin(); it != m->shards.end(); ++it) {
+        std::lock_guard<std::mutex> lock(it->mutex);
+        Shard::EntryList::iterator entry = it->entries.begin();
+        while (entry != it->entries.end()) {
+            Shard::EntryList::iterator next = std::next(entry);
+            if (entry->funcName == funcName) {
+                it->erase(entry);
+            }
+            entry = next;
+        }
+    }
+}
+
+void MemoCache::clear()
+{
+    for (std::vector<Shard>::iterator it = m->shards.begin(); it != m->shards.end(); ++it) {
+        std::lock_guard<std::mutex> lock(it->mutex);
+        it->index.clear();
+        it->entries.clear();
+    }
+}
+
+MemoCache::Statistics MemoCache::statistics() const
+{
+    Statistics res = Statistics();
+    for (std::vector<Shard>::iterator it = m->shards.begin(); it != m->shards.end(); ++it) {
+        std::lock_guard<std::mutex> lock(it->mutex);
+        res.hits += it->hits;
+        res.misses += it->misses;
+        res.evictions += it->evictions;
+        res.expirations += it->expirations;
+        res.size += it->entries.size();
+    }
+    return res;
+}
@@ -0,0 +1,82 @@
+#ifndef MEMOCACHE_H
+#define MEMOCACHE_H
+
+#include <string>
+#include "Variant.h"
+
+/**
+ * @brief Result cache of pure Lua functions.
+ *
+ * Enabled per function with LuaEngine::memoize(): invoke() by name then
+ * looks the arguments up in the cache first, and a hit returns the stored
+ * result without entering Lua at all. Only successful calls are cached.
+ *
+ * Entries are keyed by the function name and a hash of the argument
+ * Variants (compared deeply, so equal arguments hit even when built
+ * independently). Integers and reals are different arguments, even
+ * when numerically equal, as scripts can tell them apart. The cache is bounded: every shard evicts its least
+ * recently used entries, and entries older than the time to live expire.
+ * Keys and results are stored as deep copies, so values handed out by
+ * the cache do not share anything with the engine that produced them.
+ *
+ * The cache is split into independently locked shards and can be shared
+ * by engines running in different threads.
+ * Only memoize functions without side effects whose results depend
+ * on the arguments only.
+ */
+class MemoCache
+{
+public:
+
+    /// Cache counters, summed over the shards.
+    struct Statistics
+    {
+        unsigned long long hits;
+        unsigned long long misses;
+        unsigned long long evictions;   ///< Entries dropped to make room.
+        unsigned long long expirations; ///< Entries dropped because of their age.
+        size_t size;                    ///< Number of cached entries.
+    };
+
+    /**
+     * Create cache.
+     * @param capacity Maximal number of entries, split evenly between the shards.
+     * @param ttl Time to live of the entries in milliseconds, 0 for no expiration.
+     * @param shards Number of shards, rounded up to a power of two.
+     */
+    explicit MemoCache(size_t capacity = 4096, long long ttl = 0, int shards = 16);
+    ~MemoCache();
+
+    size_t capacity() const;
+    long long ttl() const;
+
+    /**
+     * Look up cached result.
+     * @return false on a miss, the result is left unchanged in this case.
+     */
+    bool lookup(const std::string &funcName, const VariantList &args, Variant &result);
+
+    /// Store result, replacing an existing entry with the same key.
+    void insert(const std::string &funcName, const VariantList &args, const Variant &result);
+
+    /// Drop all entries of a function.
+    void remove(const std::string &funcName);
+
+    /// Drop all entries.
+    void clear();
+
+    Statistics statistics() const;
+
+    /// Internal cache shard.
+    struct Shard;
+
+private:
+
+    MemoCache(const MemoCache&) = delete;
+    MemoCache& operator =(const MemoCache&) = delete;
+
+    struct Private;
+    Private *m;
+};
+
+#endif // MEMOCACHE_H
@@ -0,0 +1,268 @@
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include "Utils.h"
+#include "Metrics.h"
+
+/// Index of the most significant bit set, value must not be 0.
+static inline int highestBit(unsigned long long value)
+{
+#ifdef __GNUC__
+    return 63 - __builtin_clzll(value);
+#else
+    int bit = 0;
+    while (value >>= 1) {
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+/// Atomically lower the value to given one.
+static inline void atomicMin(std::atomic<unsigned long long> &a, unsigned long long value)
+{
+    unsigned long long current = a.load(std::memory_order_relaxed);
+    while (value < current && !a.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+/// Atomically raise the value to given one.
+static inline void atomicMax(std::atomic<unsigned long long> &a, unsigned long long value)
+{
+    unsigned long long current = a.load(std::memory_order_relaxed);
+    while (value > current && !a.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+
+/*
+ *  class LatencyHistogram
+ */
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+void LatencyHistogram::record(unsigned long long value)
+{
+    m_buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+    atomicMin(m_min, value);
+    atomicMax(m_max, value);
+}
+
+LatencyHistogram::Snapshot LatencyHistogram::snapshot() const
+{
+    // Counters are read one by one, the snapshot of a histogram
+    // being updated is not exactly consistent.
+    Snapshot snapshot;
+    snapshot.buckets.resize(cBucketCount);
+    snapshot.count = 0;
+    for (int i = 0; i < cBucketCount; i++) {
+        snapshot.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+        snapshot.count += snapshot.buckets[i];
+    }
+    snapshot.sum = m_sum.load(std::memory_order_relaxed);
+    snapshot.min = snapshot.count > 0 ? m_min.load(std::memory_order_relaxed) : 0;
+    snapshot.max = m_max.load(std::memory_order_relaxed);
+    return snapshot;
+}
+
+void LatencyHistogram::reset()
+{
+    for (int i = 0; i < cBucketCount; i++) {
+        m_buckets[i].store(0, std::memory_order_relaxed);
+    }
+    m_sum.store(0, std::memory_order_relaxed);
+    m_min.store(ULLONG_MAX, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+int LatencyHistogram::bucketIndex(unsigned long long value)
+{
+    if (value < static_cast<unsigned long long>(cSubBuckets)) {
+        return static_cast<int>(value);
+    }
+    int shift = highestBit(value) - cSubBucketBits;
+    int subBucket = static_cast<int>(value >> shift) & (cSubBuckets - 1);
+    return (shift + 1) * cSubBuckets + subBucket;
+}
+
+unsigned long long LatencyHistogram::bucketLowerBound(int index)
+{
+    if (index < cSubBuckets) {
+        return index;
+    }
+    int shift = index / cSubBuckets - 1;
+    unsigned long long subBucket = index % cSubBuckets;
+    return (cSubBuckets + subBucket) << shift;
+}
+
+unsigned long long LatencyHistogram::bucketUpperBound(int index)
+{
+    if (index >= cBucketCount - 1) {
+        return ULLONG_MAX;
+    }
+    return bucketLowerBound(index + 1) - 1;
+}
+
+double LatencyHistogram::Snapshot::mean() const
+{
+    return count > 0 ? static_cast<double>(sum) / static_cast<double>(count) : 0.0;
+}
+
+unsigned long long LatencyHistogram::Snapshot::percentile(double p) const
+{
+    if (count == 0) {
+        return 0;
+    }
+
+    unsigned long long target = static_cast<unsigned long long>(std::ceil(p / 100.0 * count));
+    if (target < 1) {
+        target = 1;
+    }
+
+    unsigned long long cumulative = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        cumulative += buckets[i];
+        if (cumulative >= target) {
+            unsigned long long value = bucketUpperBound(static_cast<int>(i));
+            return value < max ? value : max;
+        }
+    }
+    return max;
+}
+
+
+/*
+ *  class Metrics
+ */
+
+Metrics::Metrics()
+{
+    reset();
+}
+
+void Metrics::record(Operation operation, unsigned long long duration, int errorCode, size_t bytes)
+{
+    Counters &counters = m_counters[operation];
+    counters.calls.fetch_add(1, std::memory_order_relaxed);
+    if (errorCode != 0) {
+        int index = (errorCode > 0 && errorCode < cErrorCodes) ? errorCode : cErrorCodes - 1;
+        counters.errors.fetch_add(1, std::memory_order_relaxed);
+        counters.errorsByCode[index].fetch_add(1, std::memory_order_relaxed);
+    }
+    if (bytes > 0) {
+        counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+    counters.latency.record(duration);
+}
+
+Metrics::Snapshot Metrics::snapshot() const
+{
+    Snapshot snapshot;
+    for (int op = 0; op < Operation_Count; op++) {
+        const Counters &counters = m_counters[op];
+        OperationStatistics &stats = snapshot.operations[op];
+        stats.calls = counters.calls.load(std::memory_order_relaxed);
+        stats.errors = counters.errors.load(std::memory_order_relaxed);
+        stats.bytes = counters.bytes.load(std::memory_order_relaxed);
+        for (int i = 0; i < cErrorCodes; i++) {
+            stats.errorsByCode[i] = counters.errorsByCode[i].load(std::memory_order_relaxed);
+        }
+        stats.latency = counters.latency.snapshot();
+    }
+    return snapshot;
+}
+
+void Metrics::reset()
+{
+    for (int op = 0; op < Operation_Count; op++) {
+        Counters &counters = m_counters[op];
+        counters.calls.store(0, std::memory_order_relaxed);
+        counters.errors.store(0, std::memory_order_relaxed);
+        counters.bytes.store(0, std::memory_order_relaxed);
+        for (int i = 0; i < cErrorCodes; i++) {
+            counters.errorsByCode[i].store(0, std::memory_order_relaxed);
+        }
+        counters.latency.reset();
+    }
+}
+
+const char* Metrics::operationName(Operation operation)
+{
+    static const char *cNames[Operation_Count] = {
+        "evaluate",
+        "evaluateFile",
+        "invoke",
+        "nativeCall",
+        "pushValue",
+        "popValue",
+        "gc"
+    };
+    return (operation >= 0 && operation < Operation_Count) ? cNames[operation] : "";
+}
+
+Variant Metrics::Snapshot::toVariant() const
+{
+    // Counters are converted to reals, as Variant integers are 32-bit
+    VariantMap res;
+    for (int op = 0; op < Operation_Count; op++) {
+        const OperationStatistics &stats = operations[op];
+
+        VariantMap errorsByCode;
+        for (int i = 1; i < cErrorCodes; i++) {
+            if (stats.errorsByCode[i] > 0) {
+                errorsByCode[numberToString(i)] = static_cast<double>(stats.errorsByCode[i]);
+            }
+        }
+
+        VariantMap latency;
+        latency["count"] = static_cast<double>(stats.latency.count);
+        latency["min"] = static_cast<double>(stats.latency.min);
+        latency["max"] = static_cast<double>(stats.latency.max);
+        latency["mean"] = stats.latency.mean();
+        latency["p50"] = static_cast<double>(stats.latency.percentile(50.0));
+        latency["p90"] = static_cast<double>(stats.latency.percentile(90.0));
+        latency["p99"] = static_cast<double>(stats.latency.percentile(99.0));
+        latency["p999"] = static_cast<double>(stats.latency.percentile(99.9));
+
+        VariantMap entry;
+        entry["calls"] = static_cast<double>(stats.calls);
+        entry["errors"] = static_cast<double>(stats.errors);
+        entry["errorsByCode"] = Variant(std::move(errorsByCode));
+        entry["bytes"] = static_cast<double>(stats.bytes);
+        entry["latency"] = Variant(std::move(latency));
+
+        res[operationName(static_cast<Operation>(op))] = Variant(std::move(entry));
+    }
+    return Variant(std::move(res));
+}
+
+
+/*
+ *  class MetricsTimer
+ */
+
+MetricsTimer::MetricsTimer(Metrics *pMetrics, Metrics::Operation operation)
+    : m_pMetrics(pMetrics),
+      m_operation(operation),
+      m_start(pMetrics ? now() : 0),
+      m_errorCode(0),
+      m_bytes(0)
+{
+}
+
+MetricsTimer::~MetricsTimer()
+{
+    if (m_pMetrics) {
+        m_pMetrics->record(m_operation, now() - m_start, m_errorCode, m_bytes);
+    }
+}
+
+unsigned long long MetricsTimer::now()
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,181 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <vector>
+#include <string>
+#include "Variant.h"
+
+/**
+ * @brief Lock-free log-linear histogram of latencies.
+ *
+ * Values below cSubBuckets are counted exactly, larger values go to
+ * cSubBuckets linear buckets per power of two (HDR histogram style),
+ * which gives about 6% relative precision over the full 64-bit range.
+ * Recording is wait-free and can be done from any thread.
+ */
+class LatencyHistogram
+{
+public:
+
+    static const int cSubBucketBits = 4;
+    static const int cSubBuckets = 1 << cSubBucketBits;
+    static const int cBucketCount = (64 - cSubBucketBits + 1) * cSubBuckets;
+
+    /// Histogram state at some point of time.
+    struct Snapshot
+    {
+        unsigned long long count;   ///< Number of recorded values.
+        unsigned long long sum;     ///< Sum of recorded values.
+        unsigned long long min;     ///< Minimal value, 0 if empty.
+        unsigned long long max;     ///< Maximal value.
+        std::vector<unsigned long long> buckets;   ///< Counts per bucket.
+
+        double mean() const;
+
+        /**
+         * Value at given percentile (0..100), as the upper bound
+         * of the bucket the percentile falls into.
+         */
+        unsigned long long percentile(double p) const;
+    };
+
+    LatencyHistogram();
+
+    void record(unsigned long long value);
+    Snapshot snapshot() const;
+    void reset();
+
+    static int bucketIndex(unsigned long long value);
+    static unsigned long long bucketLowerBound(int index);
+    static unsigned long long bucketUpperBound(int index);
+
+private:
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator =(const LatencyHistogram&) = delete;
+
+    std::atomic<unsigned long long> m_buckets[cBucketCount];
+    std::atomic<unsigned long long> m_sum;
+    std::atomic<unsigned long long> m_min;
+    std::atomic<unsigned long long> m_max;
+};
+
+/**
+ * @brief Lua engine telemetry.
+ *
+ * Collects per-operation call counts, error counts by Lua error code,
+ * bytes of string data converted and latency histograms (in nanoseconds).
+ * Attach to one or more engines with LuaEngine::setMetrics(),
+ * engines without metrics do not measure anything.
+ *
+ * Counters are lock-free, metrics can be shared by engines
+ * running in different threads and scraped concurrently.
+ */
+class Metrics
+{
+public:
+
+    /// Measured operations
+    enum Operation {
+        Operation_Evaluate = 0,     ///< evaluate()
+        Operation_EvaluateFile,     ///< evaluateFile()
+        Operation_Invoke,           ///< invoke() and LuaFunction calls
+        Operation_NativeCall,       ///< Native functions and Scriptable methods called from Lua
+        Operation_PushValue,        ///< Variant to Lua conversion
+        Operation_PopValue,         ///< Lua to Variant conversion
+        Operation_Gc,               ///< Explicit garbage collection calls
+
+        Operation_Count
+    };
+
+    /// Number of tracked error codes, larger codes are counted in the last one.
+    static const int cErrorCodes = 8;
+
+    /// Statistics of an operation.
+    struct OperationStatistics
+    {
+        unsigned long long calls;
+        unsigned long long errors;
+        unsigned long long bytes;
+        unsigned long long errorsByCode[cErrorCodes];
+        LatencyHistogram::Snapshot latency;
+    };
+
+    /// Statistics of all the operations.
+    struct Snapshot
+    {
+        OperationStatistics operations[Operation_Count];
+
+        /**
+         * Convert to a map keyed by operation name, with latency
+         * summary (count, min, max, mean, p50, p90, p99, p999) in nanoseconds.
+         * Suitable for serialization, e.g. with toJson().
+         */
+        Variant toVariant() const;
+    };
+
+    Metrics();
+
+    /**
+     * Record an operation.
+     * @param operation Operation kind.
+     * @param duration Duration in nanoseconds.
+     * @param errorCode Lua error code, 0 for success.
+     * @param bytes Bytes of data converted.
+     */
+    void record(Operation operation, unsigned long long duration, int errorCode = 0, size_t bytes = 0);
+
+    Snapshot snapshot() const;
+    void reset();
+
+    static const char* operationName(Operation operation);
+
+private:
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator =(const Metrics&) = delete;
+
+    struct Counters
+    {
+        std::atomic<unsigned long long> calls;
+        std::atomic<unsigned long long> errors;
+        std::atomic<unsigned long long> bytes;
+        std::atomic<unsigned long long> errorsByCode[cErrorCodes];
+        LatencyHistogram latency;
+    };
+
+    Counters m_counters[Operation_Count];
+};
+
+/**
+ * @brief Measures duration of a scope into metrics.
+ *
+ * Does nothing (not even reading the clock) if metrics are null.
+ */
+class MetricsTimer
+{
+public:
+
+    MetricsTimer(Metrics *pMetrics, Metrics::Operation operation);
+    ~MetricsTimer();
+
+    void setErrorCode(int errorCode) { m_errorCode = errorCode; }
+    void addBytes(size_t bytes) { m_bytes += bytes; }
+
+    /// Monotonic clock in nanoseconds.
+    static unsigned long long now();
+
+private:
+
+    MetricsTimer(const MetricsTimer&) = delete;
+    MetricsTimer& operator =(const MetricsTimer&) = delete;
+
+    Metrics *m_pMetrics;
+    Metrics::Operation m_operation;
+    unsigned long long m_start;
+    int m_errorCode;
+    size_t m_bytes;
+};
+
+#endif // METRICS_H
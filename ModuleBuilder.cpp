@@ -0,0 +1,196 @@
+#include "LuaCompat.h"
+
+#include <deque>
+#include <vector>
+#include "ModuleBuilder.h"
+
+struct ModuleBuilder::Private
+{
+    /// Native function entry, referenced by its closure
+    struct Function
+    {
+        std::string name;
+        std::string qualifiedName;  ///< "module.function", for the recorder.
+        void *func;
+        bool view;                  ///< Whether func is a NativeViewFunction.
+        void *pData;
+    };
+
+    std::string name;
+    std::deque<Function> functions;     ///< Stable addresses, referenced by closures.
+    std::deque<std::string> cFunctionNames;
+    std::vector<luaL_Reg> cFunctions;   ///< Null-terminated for luaL_setfuncs.
+    std::vector<void*> upvalues;
+    std::vector<std::pair<std::string, Variant>> constants;
+    std::vector<ModuleBuilder> modules;
+};
+
+/// Call native function of a module, the upvalues are its entry and the engine.
+static int moduleFunctionGateway(lua_State *pLuaState)
+{
+    const ModuleBuilder::Private::Function *pFunction =
+            static_cast<const ModuleBuilder::Private::Function*>(lua_touserdata(pLuaState, lua_upvalueindex(1)));
+    LuaEngine *pLuaEngine = static_cast<LuaEngine*>(lua_touserdata(pLuaState, lua_upvalueindex(2)));
+
+    MetricsTimer timer(pLuaEngine->metrics(), Metrics::Operation_NativeCall);
+    RecorderScope record(pLuaEngine->recorder(), Recorder::Event_NativeCall, pFunction->qualifiedName);
+
+    Variant res;
+    if (pFunction->view) {
+        // Arguments are left on the stack
+        LuaEngine::NativeViewFunction func =
+                reinterpret_cast<LuaEngine::NativeViewFunction>(reinterpret_cast<size_t>(pFunction->func));
+        ArgumentView args(pLuaEngine, pLuaState, 1, lua_gettop(pLuaState));
+        record.setArgs(args);
+        res = func(args, pFunction->pData);
+    } else {
+        LuaEngine::NativeFunction func =
+                reinterpret_cast<LuaEngine::NativeFunction>(reinterpret_cast<size_t>(pFunction->func));
+        int nArgs = lua_gettop(pLuaState);
+        VariantList args;
+        for (int i = 0; i < nArgs; i++) {
+            args.push_front(pLuaEngine->popValue(pLuaState));
+        }
+        record.setArgs(args);
+        res = func(args, pFunction->pData);
+    }
+    record.setResult(res);
+
+    if (res.isValid()) {
+        pLuaEngine->pushValue(pLuaState, res);
+        return 1;
+    }
+
+    // No return value from the function
+    return 0;
+}
+
+/// Push table of the module definition.
+static void pushModuleTable(lua_State *pLuaState, LuaEngine *pLuaEngine, const ModuleBuilder::Private *pModule)
+{
+    size_t size = pModule->functions.size() + pModule->cFunctionNames.size()
+                + pModule->constants.size() + pModule->modules.size();
+    lua_createtable(pLuaState, 0, static_cast<int>(size));
+
+    if (!pModule->cFunctionNames.empty()) {
+        for (std::vector<void*>::const_iterator it = pModule->upvalues.begin(); it != pModule->upvalues.end(); ++it) {
+            lua_pushlightuserdata(pLuaState, *it);
+        }
+        luaL_setfuncs(pLuaState, pModule->cFunctions.data(), static_cast<int>(pModule->upvalues.size()));
+    }
+
+    typedef ModuleBuilder::Private::Function Function;
+    for (std::deque<Function>::const_iterator it = pModule->functions.begin(); it != pModule->functions.end(); ++it) {
+        lua_pushlightuserdata(pLuaState, const_cast<Function*>(&(*it)));
+        lua_pushlightuserdata(pLuaState, pLuaEngine);
+        lua_pushcclosure(pLuaState, moduleFunctionGateway, 2);
+        lua_setfield(pLuaState, -2, it->name.c_str());
+    }
+
+    for (std::vector<std::pair<std::string, Variant>>::const_iterator it = pModule->constants.begin();
+         it != pModule->constants.end(); ++it) {
+        pLuaEngine->pushValue(pLuaState, it->second);
+        lua_setfield(pLuaState, -2, it->first.c_str());
+    }
+
+    for (std::vector<ModuleBuilder>::const_iterator it = pModule->modules.begin(); it != pModule->modules.end(); ++it) {
+        it->push(pLuaState, pLuaEngine);
+        lua_setfield(pLuaState, -2, it->name().c_str());
+    }
+}
+
+/// package.preload loader, upvalues are the module definition and the engine.
+static int moduleLoader(lua_State *pLuaState)
+{
+    const ModuleBuilder::Private *pModule =
+            static_cast<const ModuleBuilder::Private*>(lua_touserdata(pLuaState, lua_upvalueindex(1)));
+    LuaEngine *pLuaEngine = static_cast<LuaEngine*>(lua_touserdata(pLuaState, lua_upvalueindex(2)));
+
+    pushModuleTable(pLuaState, pLuaEngine, pModule);
+    return 1;
+}
+
+
+/*
+ *  class ModuleBuilder
+ */
+
+ModuleBuilder::ModuleBuilder(const std::string &name)
+    : m(std::make_shared<Private>())
+{
+    m->name = name;
+    m->cFunctions.push_back(luaL_Reg { 0, 0 });
+}
+
+const std::string& ModuleBuilder::name() const
+{
+    return m->name;
+}
+
+size_t ModuleBuilder::size() const
+{
+    return m->functions.size() + m->cFunctionNames.size() + m->constants.size() + m->modules.size();
+}
+
+ModuleBuilder& ModuleBuilder::addFunction(const std::string &name, LuaEngine::NativeFunction func, void *pData)
+{
+    if (func) {
+        m->functions.push_back(Private::Function { name, m->name + "." + name,
+                                                   reinterpret_cast<void*>(reinterpret_cast<size_t>(func)),
+                                                   false, pData });
+    }
+    return *this;
+}
+
+ModuleBuilder& ModuleBuilder::addFunction(const std::string &name, LuaEngine::NativeViewFunction func, void *pData)
+{
+    if (func) {
+        m->functions.push_back(Private::Function { name, m->name + "." + name,
+                                                   reinterpret_cast<void*>(reinterpret_cast<size_t>(func)),
+                                                   true, pData });
+    }
+    return *this;
+}
+
+ModuleBuilder& ModuleBuilder::addCFunction(const std::string &name, CFunction func)
+{
+    if (func) {
+        m->cFunctionNames.push_back(name);
+        m->cFunctions.back() = luaL_Reg { m->cFunctionNames.back().c_str(), func };
+        m->cFunctions.push_back(luaL_Reg { 0, 0 });
+    }
+    return *this;
+}
+
+ModuleBuilder& ModuleBuilder::addConstant(const std::string &name, const Variant &value)
+{
+    // Deep copy, the definition can be shared by engines in different threads
+    m->constants.push_back(std::make_pair(name, value.clone()));
+    return *this;
+}
+
+ModuleBuilder& ModuleBuilder::addModule(const ModuleBuilder &module)
+{
+    if (module.m != m) {
+        m->modules.push_back(module);
+    }
+    return *this;
+}
+
+ModuleBuilder& ModuleBuilder::addUpvalue(void *pData)
+{
+    m->upvalues.push_back(pData);
+    return *this;
+}
+
+void ModuleBuilder::push(lua_State *pLuaState, LuaEngine *pLuaEngine) const
+{
+    pushModuleTable(pLuaState, pLuaEngine, m.get());
+}
+
+void ModuleBuilder::pushLoader(lua_State *pLuaState, LuaEngine *pLuaEngine) const
+{
+    lua_pushlightuserdata(pLuaState, m.get());
+    lua_pushlightuserdata(pLuaState, pLuaEngine);
+    lua_pushcclosure(pLuaState, moduleLoader, 2);
+}
@@ -0,0 +1,72 @@
+#ifndef MODULEBUILDER_H
+#define MODULEBUILDER_H
+
+#include <string>
+#include <memory>
+#include "LuaEngine.h"
+
+/**
+ * @brief Definition of a native module.
+ *
+ * Collects native functions, raw Lua C functions, constants and nested
+ * sub-modules to be registered with LuaEngine::registerModule() as one
+ * table. The table is built in a single pass: it is pre-sized, raw C
+ * functions are set with luaL_setfuncs() and share the module upvalues,
+ * native function closures get two light upvalues, their definition
+ * and the engine.
+ *
+ * Modules are registered lazily in package.preload by default, so the
+ * table is only built when a script requires the module.
+ *
+ * ModuleBuilder objects are handles, copies refer to the same definition.
+ * One definition can be registered in any number of engines (possibly
+ * running in different threads) and is kept alive by them. Complete
+ * the definition before registering it: engines that have built
+ * the module table do not see entries added later.
+ */
+class ModuleBuilder
+{
+public:
+
+    /// Raw Lua C function (lua_CFunction)
+    typedef int (*CFunction)(lua_State *pLuaState);
+
+    explicit ModuleBuilder(const std::string &name);
+
+    const std::string& name() const;
+
+    /// Number of entries of the module table.
+    size_t size() const;
+
+    ModuleBuilder& addFunction(const std::string &name, LuaEngine::NativeFunction func, void *pData = 0);
+    ModuleBuilder& addFunction(const std::string &name, LuaEngine::NativeViewFunction func, void *pData = 0);
+
+    /**
+     * Add raw Lua C function. Module upvalues (see addUpvalue())
+     * are available at lua_upvalueindex(1), (2) etc.
+     */
+    ModuleBuilder& addCFunction(const std::string &name, CFunction func);
+
+    ModuleBuilder& addConstant(const std::string &name, const Variant &value);
+
+    /// Add nested module, stored under its name.
+    ModuleBuilder& addModule(const ModuleBuilder &module);
+
+    /// Add upvalue shared by the raw C functions of the module (light userdata).
+    ModuleBuilder& addUpvalue(void *pData);
+
+    /// Push module table onto the engine stack.
+    void push(lua_State *pLuaState, LuaEngine *pLuaEngine) const;
+
+    /// Push package.preload loader building the module table.
+    void pushLoader(lua_State *pLuaState, LuaEngine *pLuaEngine) const;
+
+    /// Internal module definition.
+    struct Private;
+
+private:
+
+    std::shared_ptr<Private> m;
+};
+
+#endif // MODULEBUILDER_H
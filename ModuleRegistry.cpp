@@ -0,0 +1,263 @@
+#include "LuaCompat.h"
+
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <filesystem>
+#include <system_error>
+#include "ModuleRegistry.h"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+/// File state used to detect changes.
+struct FileStamp
+{
+    std::filesystem::file_time_type time;
+    std::uintmax_t size;
+
+    bool operator ==(const FileStamp &other) const { return time == other.time && size == other.size; }
+    bool operator !=(const FileStamp &other) const { return !(*this == other); }
+};
+
+static FileStamp fileStamp(const std::string &fileName)
+{
+    std::error_code ec;
+    FileStamp stamp;
+    stamp.time = std::filesystem::last_write_time(fileName, ec);
+    if (ec) {
+        stamp.time = std::filesystem::file_time_type();
+    }
+    stamp.size = std::filesystem::file_size(fileName, ec);
+    if (ec) {
+        stamp.size = 0;
+    }
+    return stamp;
+}
+
+/// lua_dump writer collecting the bytecode into a string.
+static int bytecodeWriter(lua_State *pLuaState, const void *p, size_t size, void *pData)
+{
+    (void)pLuaState;
+    static_cast<std::string*>(pData)->append(static_cast<const char*>(p), size);
+    return 0;
+}
+
+struct ModuleRegistry::Private
+{
+    /// Registered module
+    struct Entry
+    {
+        ModulePtr module;   ///< Current version of the module.
+        FileStamp stamp;    ///< File state at the last compilation.
+    };
+
+    mutable std::mutex mutex;
+    std::atomic<unsigned> generation;
+    unsigned lastVersion;   ///< Last version assigned to a module.
+    std::map<std::string, Entry> modules;
+    lua_State *pCompiler;   ///< Bare Lua state used to compile the modules.
+    std::string errorText;  ///< Last compilation error.
+    int inotifyFd;          ///< inotify instance, -1 if files are not watched.
+    std::map<std::string, int> watches; ///< Watched directories.
+
+    /// Compile file into bytecode.
+    bool compile(const std::string &fileName, std::string &bytecode);
+
+    /// Watch directory of the file.
+    void watch(const std::string &fileName);
+
+    /// Consume pending file events, returns true if there were any.
+    bool readEvents();
+};
+
+bool ModuleRegistry::Private::compile(const std::string &fileName, std::string &bytecode)
+{
+    int err = luaL_loadfile(pCompiler, fileName.c_str());
+    if (err != 0) {
+        const char *strErr = lua_tostring(pCompiler, -1);
+        errorText = strErr ? std::string(strErr) : std::string("unknown error");
+        lua_pop(pCompiler, 1);
+        return false;
+    }
+
+    // Debug information is kept for error tracebacks
+    bytecode.clear();
+    cxlua_dump(pCompiler, bytecodeWriter, &bytecode, 0);
+    lua_pop(pCompiler, 1);
+
+    return true;
+}
+
+void ModuleRegistry::Private::watch(const std::string &fileName)
+{
+#ifdef __linux__
+    if (inotifyFd < 0) {
+        return;
+    }
+
+    // Directory is watched since editors often replace files rather than write them
+    std::string dir = std::filesystem::path(fileName).parent_path().string();
+    if (dir.empty()) {
+        dir = ".";
+    }
+    if (watches.find(dir) != watches.end()) {
+        return;
+    }
+
+    int wd = inotify_add_watch(inotifyFd, dir.c_str(),
+                               IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE);
+    if (wd >= 0) {
+        watches[dir] = wd;
+    }
+#else
+    (void)fileName;
+#endif
+}
+
+bool ModuleRegistry::Private::readEvents()
+{
+#ifdef __linux__
+    if (inotifyFd < 0) {
+        return true;
+    }
+
+    // Events are not inspected: any event triggers the file stamps check
+    bool changed = false;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (read(inotifyFd, buffer, sizeof(buffer)) > 0) {
+        changed = true;
+    }
+    return changed;
+#else
+    return true;
+#endif
+}
+
+
+/*
+ *  class ModuleRegistry
+ */
+
+ModuleRegistry::ModuleRegistry()
+{
+    m = new ModuleRegistry::Private();
+    m->generation = 0;
+    m->lastVersion = 0;
+    m->pCompiler = luaL_newstate();
+#ifdef __linux__
+    m->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#else
+    m->inotifyFd = -1;
+#endif
+}
+
+ModuleRegistry::~ModuleRegistry()
+{
+#ifdef __linux__
+    if (m->inotifyFd >= 0) {
+        close(m->inotifyFd);
+    }
+#endif
+    lua_close(m->pCompiler);
+    delete m;
+}
+
+bool ModuleRegistry::addModule(const std::string &name, const std::string &fileName)
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+
+    // Watch before reading the file not to miss a change in between
+    m->watch(fileName);
+
+    std::shared_ptr<Module> module = std::make_shared<Module>();
+    module->name = name;
+    module->fileName = fileName;
+
+    FileStamp stamp = fileStamp(fileName);
+    if (!m->compile(fileName, module->bytecode)) {
+        return false;
+    }
+
+    module->version = ++m->lastVersion;
+
+    Private::Entry &entry = m->modules[name];
+    entry.module = module;
+    entry.stamp = stamp;
+    ++m->generation;
+
+    return true;
+}
+
+void ModuleRegistry::removeModule(const std::string &name)
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    if (m->modules.erase(name) > 0) {
+        ++m->generation;
+    }
+}
+
+int ModuleRegistry::poll()
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+
+    if (!m->readEvents()) {
+        return 0;
+    }
+
+    int count = 0;
+    for (std::map<std::string, Private::Entry>::iterator it = m->modules.begin(); it != m->modules.end(); ++it) {
+        Private::Entry &entry = it->second;
+        FileStamp stamp = fileStamp(entry.module->fileName);
+        if (stamp == entry.stamp) {
+            continue;
+        }
+
+        // Failed file is not retried until it changes again
+        entry.stamp = stamp;
+
+        std::shared_ptr<Module> module = std::make_shared<Module>(*entry.module);
+        if (m->compile(module->fileName, module->bytecode)) {
+            module->version = ++m->lastVersion;
+            entry.module = module;
+            ++count;
+        }
+    }
+
+    if (count > 0) {
+        ++m->generation;
+    }
+
+    return count;
+}
+
+unsigned ModuleRegistry::generation() const
+{
+    return m->generation.load(std::memory_order_acquire);
+}
+
+std::vector<ModuleRegistry::ModulePtr> ModuleRegistry::modules() const
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+
+    std::vector<ModulePtr> res;
+    res.reserve(m->modules.size());
+    for (std::map<std::string, Private::Entry>::const_iterator it = m->modules.begin(); it != m->modules.end(); ++it) {
+        res.push_back(it->second.module);
+    }
+    return res;
+}
+
+std::string ModuleRegistry::errorText() const
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    return m->errorText;
+}
+
+bool ModuleRegistry::isWatching() const
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    return m->inotifyFd >= 0 && !m->watches.empty();
+}
@@ -0,0 +1,81 @@
+#ifndef MODULEREGISTRY_H
+#define MODULEREGISTRY_H
+
+#include <string>
+#include <vector>
+#include <memory>
+
+/**
+ * @brief Registry of script modules shared by a pool of Lua engines.
+ *
+ * Each module is a script file compiled once into Lua bytecode.
+ * Engines load the bytecode (see LuaEngine::loadModules) instead
+ * of compiling the sources each.
+ *
+ * The registry watches module files (with inotify on Linux, by
+ * modification time elsewhere) and poll() recompiles the changed
+ * ones only. A recompiled module replaces the previous version
+ * atomically: engines pick it up on LuaEngine::refreshModules(),
+ * which reruns the new chunk in place, without resetting the engine.
+ *
+ * Methods are thread-safe.
+ */
+class ModuleRegistry
+{
+public:
+
+    /// Compiled module
+    struct Module
+    {
+        std::string name;       ///< Module name.
+        std::string fileName;   ///< Script file name.
+        std::string bytecode;   ///< Compiled chunk.
+        unsigned version;       ///< Unique within the registry, changes on every recompilation.
+    };
+
+    typedef std::shared_ptr<const Module> ModulePtr;
+
+    ModuleRegistry();
+    ~ModuleRegistry();
+
+    /**
+     * Compile script file and add it as a module.
+     * Adding a module with existing name replaces it.
+     * @return false if the file cannot be compiled, see errorText().
+     */
+    bool addModule(const std::string &name, const std::string &fileName);
+
+    void removeModule(const std::string &name);
+
+    /**
+     * Recompile modules changed since the last poll.
+     * Modules failing to compile keep their previous version.
+     * @return Number of recompiled modules.
+     */
+    int poll();
+
+    /**
+     * Current generation of the registry, incremented
+     * on every change of the modules set.
+     */
+    unsigned generation() const;
+
+    /// Snapshot of all the modules.
+    std::vector<ModulePtr> modules() const;
+
+    /// Text of the last compilation error.
+    std::string errorText() const;
+
+    /// Whether the module files are watched by the OS (inotify).
+    bool isWatching() const;
+
+private:
+
+    ModuleRegistry(const ModuleRegistry&) = delete;
+    ModuleRegistry& operator =(const ModuleRegistry&) = delete;
+
+    struct Private;
+    Private *m;
+};
+
+#endif // MODULEREGISTRY_H
@@ -0,0 +1,293 @@
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include "Serializer.h"
+#include "Metrics.h"
+#include "ArgumentView.h"
+#include "Recorder.h"
+
+/// Recording header: format name and version.
+const static char *cRecordingFormat = "cxLua.recording";
+const static int cRecordingVersion = 1;
+
+struct Recorder::Private
+{
+    mutable std::mutex mutex;
+    std::ofstream file;
+    std::unique_ptr<StreamSink> sink;
+    std::unique_ptr<BinaryWriter> writer;
+    std::atomic<bool> open;
+    std::atomic<unsigned long long> sequence;
+    std::atomic<unsigned long long> eventCount;
+    unsigned long long startTime;   ///< Recording start, MetricsTimer::now() clock.
+};
+
+/// Decode event list, returns false if malformed.
+static bool decodeEvent(const Variant &value, Recorder::Event &event)
+{
+    if (value.type() != Variant::Type_List || value.list().size() < 7) {
+        return false;
+    }
+
+    VariantList::const_iterator it = value.list().begin();
+    event.sequence = static_cast<unsigned long long>((*it++).toReal());
+    int type = (*it++).toInteger(-1);
+    if (type < Recorder::Event_Evaluate || type > Recorder::Event_NativeCall) {
+        return false;
+    }
+    event.type = static_cast<Recorder::EventType>(type);
+    event.name = (*it++).toString();
+    const Variant &args = *it++;
+    event.args = args.type() == Variant::Type_List ? args.list() : VariantList();
+    event.startTime = static_cast<unsigned long long>((*it++).toReal());
+    event.duration = static_cast<unsigned long long>((*it++).toReal());
+    event.errorCode = (*it++).toInteger();
+    event.result = it != value.list().end() ? *it : Variant();
+
+    return true;
+}
+
+
+/*
+ *  class Recorder
+ */
+
+Recorder::Recorder()
+{
+    m = new Recorder::Private();
+    m->open = false;
+    m->sequence = 0;
+    m->eventCount = 0;
+    m->startTime = 0;
+}
+
+Recorder::~Recorder()
+{
+    close();
+    delete m;
+}
+
+bool Recorder::open(const std::string &fileName)
+{
+    close();
+
+    std::lock_guard<std::mutex> lock(m->mutex);
+
+    m->file.open(fileName.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!m->file) {
+        return false;
+    }
+
+    m->sink.reset(new StreamSink(m->file));
+    m->writer.reset(new BinaryWriter(*m->sink));
+
+    m->writer->beginList(2);
+    m->writer->writeString(cRecordingFormat);
+    m->writer->writeInteger(cRecordingVersion);
+    m->writer->endList();
+
+    m->sequence = 0;
+    m->eventCount = 0;
+    m->startTime = MetricsTimer::now();
+    m->open = true;
+
+    return true;
+}
+
+void Recorder::close()
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    if (!m->open) {
+        return;
+    }
+
+    m->open = false;
+    m->writer->flush();
+    m->writer.reset();
+    m->sink.reset();
+    m->file.close();
+}
+
+bool Recorder::isOpen() const
+{
+    return m->open.load(std::memory_order_acquire);
+}
+
+unsigned long long Recorder::eventCount() const
+{
+    return m->eventCount.load(std::memory_order_relaxed);
+}
+
+unsigned long long Recorder::nextSequence()
+{
+    return m->sequence.fetch_add(1, std::memory_order_relaxed);
+}
+
+unsigned long long Recorder::elapsed() const
+{
+    return MetricsTimer::now() - m->startTime;
+}
+
+void Recorder::record(const Event &event)
+{
+    std::lock_guard<std::mutex> lock(m->mutex);
+    if (!m->open) {
+        return;
+    }
+
+    // Event: [sequence, type, name, args, start, duration, error(, result)]
+    BinaryWriter &writer = *m->writer;
+    bool hasResult = event.type == Event_NativeCall && event.result.isValid();
+    writer.beginList(hasResult ? 8 : 7);
+    writer.writeInteger(static_cast<long long>(event.sequence));
+    writer.writeInteger(event.type);
+    writer.writeString(event.name);
+    writer.beginList(event.args.size());
+    for (VariantList::const_iterator it = event.args.begin(); it != event.args.end(); ++it) {
+        writer.write(*it);
+    }
+    writer.endList();
+    writer.writeInteger(static_cast<long long>(event.startTime));
+    writer.writeInteger(static_cast<long long>(event.duration));
+    writer.writeInteger(event.errorCode);
+    if (hasResult) {
+        writer.write(event.result);
+    }
+    writer.endList();
+
+    m->eventCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool Recorder::load(const std::string &fileName, std::vector<Event> &events, std::string &errorText)
+{
+    events.clear();
+
+    std::ifstream file(fileName.c_str(), std::ios::in | std::ios::binary);
+    if (!file) {
+        errorText = "cannot open " + fileName;
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    VariantBuilder builder;
+    ValueReader reader(SerialFormat_Binary, builder);
+    size_t pos = 0;
+    bool header = true;
+
+    while (pos < data.size()) {
+        builder.clear();
+        size_t length = 0;
+        if (!reader.parse(data.data() + pos, data.size() - pos, &length)) {
+            // A truncated last event (e.g. recording process killed) is dropped
+            if (!header && reader.errorText() == "unexpected end of data") {
+                break;
+            }
+            errorText = reader.errorText();
+            return false;
+        }
+        pos += length;
+
+        const Variant &value = builder.result();
+        if (header) {
+            if (value.type() != Variant::Type_List || value.list().size() != 2
+                    || value.list().front().toString() != cRecordingFormat) {
+                errorText = "not a recording";
+                return false;
+            }
+            if (value.list().back().toInteger() != cRecordingVersion) {
+                errorText = "unsupported recording version";
+                return false;
+            }
+            header = false;
+            continue;
+        }
+
+        Event event;
+        if (!decodeEvent(value, event)) {
+            errorText = "malformed event";
+            return false;
+        }
+        events.push_back(std::move(event));
+    }
+
+    if (header) {
+        errorText = "not a recording";
+        return false;
+    }
+
+    std::stable_sort(events.begin(), events.end(), [](const Event &a, const Event &b) {
+        return a.sequence < b.sequence;
+    });
+
+    return true;
+}
+
+
+/*
+ *  class RecorderScope
+ */
+
+RecorderScope::RecorderScope(Recorder *pRecorder, Recorder::EventType type, const std::string &name)
+    : m_pRecorder(pRecorder && pRecorder->isOpen() ? pRecorder : 0),
+      m_event()
+{
+    if (m_pRecorder) {
+        m_event.name = name;
+        begin(type);
+    }
+}
+
+RecorderScope::RecorderScope(Recorder *pRecorder, Recorder::EventType type, const char *name)
+    : m_pRecorder(pRecorder && pRecorder->isOpen() ? pRecorder : 0),
+      m_event()
+{
+    if (m_pRecorder) {
+        m_event.name = name ? name : "";
+        begin(type);
+    }
+}
+
+RecorderScope::~RecorderScope()
+{
+    if (m_pRecorder) {
+        m_event.duration = m_pRecorder->elapsed() - m_event.startTime;
+        m_pRecorder->record(m_event);
+    }
+}
+
+void RecorderScope::begin(Recorder::EventType type)
+{
+    m_event.sequence = m_pRecorder->nextSequence();
+    m_event.type = type;
+    m_event.errorCode = 0;
+    m_event.startTime = m_pRecorder->elapsed();
+}
+
+void RecorderScope::setArgs(const VariantList &args)
+{
+    if (m_pRecorder) {
+        m_event.args = args;
+    }
+}
+
+void RecorderScope::setArgs(const ArgumentView &args)
+{
+    if (m_pRecorder) {
+        m_event.args = args.toList();
+    }
+}
+
+void RecorderScope::setResult(const Variant &result)
+{
+    if (m_pRecorder) {
+        m_event.result = result;
+    }
+}
+
+void RecorderScope::setErrorCode(int errorCode)
+{
+    m_event.errorCode = errorCode;
+}
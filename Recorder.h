@@ -0,0 +1,126 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <string>
+#include <vector>
+#include "Variant.h"
+
+class ArgumentView;
+
+/**
+ * @brief Recorder of Lua engine calls.
+ *
+ * Attached to an engine with LuaEngine::setRecorder(), it logs the
+ * engine entry points (evaluate, evaluateFile and invoke by name) and
+ * the native functions and Scriptable methods called by scripts, with
+ * their arguments, native return values, timings and error codes.
+ *
+ * The recording is a compact binary (MessagePack) file: a header
+ * followed by one list per event. It is read back with load() and
+ * replayed by the replay tool (replay.cpp), which drives a fresh engine
+ * with the recorded calls and stubs natives with the recorded results.
+ *
+ * Calls made through LuaFunction handles and Lua functions and userdata
+ * in arguments cannot be replayed and are not recorded (functions are
+ * written as null). Recording is thread-safe, but a recording shared
+ * by several engines replays as a single engine.
+ */
+class Recorder
+{
+public:
+
+    /// Recorded call
+    enum EventType {
+        Event_Evaluate = 0, ///< evaluate(), the name is the script source.
+        Event_EvaluateFile, ///< evaluateFile(), the name is the file name.
+        Event_Invoke,       ///< invoke(), the name is the function name.
+        Event_NativeCall    ///< Native function or method ("object.method") called by a script.
+    };
+
+    struct Event
+    {
+        unsigned long long sequence;    ///< Call start order.
+        EventType type;
+        std::string name;
+        VariantList args;
+        Variant result;                 ///< Native calls only, invalid if nothing returned.
+        unsigned long long startTime;   ///< Since the recording start, in nanoseconds.
+        unsigned long long duration;    ///< In nanoseconds.
+        int errorCode;                  ///< Lua error code, 0 for success.
+    };
+
+    Recorder();
+    ~Recorder();
+
+    /**
+     * Start recording into a file, replacing its content.
+     * @return false if the file cannot be created.
+     */
+    bool open(const std::string &fileName);
+
+    /// Stop recording and flush the file.
+    void close();
+
+    bool isOpen() const;
+
+    /// Number of events recorded since open().
+    unsigned long long eventCount() const;
+
+    /// Sequence number for a call being started.
+    unsigned long long nextSequence();
+
+    /// Time since the recording start, in nanoseconds.
+    unsigned long long elapsed() const;
+
+    /// Append event to the recording, ignored if not open.
+    void record(const Event &event);
+
+    /**
+     * Read all events of a recording, ordered by sequence.
+     * @return false if the file cannot be read or is malformed.
+     */
+    static bool load(const std::string &fileName, std::vector<Event> &events,
+                     std::string &errorText);
+
+private:
+
+    Recorder(const Recorder&) = delete;
+    Recorder& operator =(const Recorder&) = delete;
+
+    struct Private;
+    Private *m;
+};
+
+/**
+ * @brief Records a call on scope exit.
+ *
+ * Does nothing (not even copying the arguments) if the recorder
+ * is null or not open.
+ */
+class RecorderScope
+{
+public:
+
+    RecorderScope(Recorder *pRecorder, Recorder::EventType type, const std::string &name);
+    RecorderScope(Recorder *pRecorder, Recorder::EventType type, const char *name);
+    ~RecorderScope();
+
+    bool isActive() const { return m_pRecorder != 0; }
+
+    void setArgs(const VariantList &args);
+    void setArgs(const ArgumentView &args);
+    void setResult(const Variant &result);
+    void setErrorCode(int errorCode);
+
+private:
+
+    RecorderScope(const RecorderScope&) = delete;
+    RecorderScope& operator =(const RecorderScope&) = delete;
+
+    void begin(Recorder::EventType type);
+
+    Recorder *m_pRecorder;
+    Recorder::Event m_event;
+};
+
+#endif // RECORDER_H
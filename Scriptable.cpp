@@ -1,15 +1,25 @@
+#include <limits>
 #include "Scriptable.h"
 
 Scriptable::Scriptable()
-	: m_metaMethods()
+	: m_metaMethods(),
+	  m_viewMethods(),
+	  m_properties()
 {
 }
 
 void Scriptable::registerMethod(const std::string &methodName, Method method)
 {
+	m_viewMethods.erase(methodName);
 	m_metaMethods[methodName] = method;
 }
 
+void Scriptable::registerMethod(const std::string &methodName, ViewMethod method)
+{
+	m_metaMethods.erase(methodName);
+	m_viewMethods[methodName] = method;
+}
+
 Variant Scriptable::invokeMethod(const std::string &methodName,
 								 const VariantList &args)
 {
@@ -27,3 +37,157 @@ Variant Scriptable::invokeMethod(const std::string &methodName,
 }
 
 
+
+Variant Scriptable::invokeMethod(const std::string &methodName, const ArgumentView &args)
+{
+	ViewMethodsTable::const_iterator it = m_viewMethods.find(methodName);
+	if (it == m_viewMethods.end()) {
+		// Fall back to the method taking converted arguments
+		return invokeMethod(methodName, args.toList());
+	}
+
+	ViewMethod method = it->second;
+
+	return (*this.*method)(args);
+}
+
+bool Scriptable::registerProperty(const std::string &propertyName, Getter getter, Setter setter)
+{
+	if (getter == 0) {
+		return false;
+	}
+
+	Property &property = m_properties[propertyName];
+	property.type = Property_Accessor;
+	property.offset = 0;
+	property.getter = getter;
+	property.setter = setter;
+	property.readOnly = setter == 0;
+	return true;
+}
+
+void Scriptable::registerMember(const std::string &propertyName, PropertyType type, size_t offset, bool readOnly)
+{
+	Property &property = m_properties[propertyName];
+	property.type = type;
+	property.offset = offset;
+	property.getter = 0;
+	property.setter = 0;
+	property.readOnly = readOnly;
+}
+
+Variant Scriptable::property(const std::string &propertyName) const
+{
+	PropertiesTable::const_iterator it = m_properties.find(propertyName);
+	if (it == m_properties.end()) {
+		return Variant();
+	}
+
+	const Property &property = it->second;
+	const void *ptr = propertyAddress(property);
+
+	switch (property.type) {
+	case Property_Boolean:
+		return *static_cast<const bool*>(ptr);
+	case Property_Integer:
+		return *static_cast<const int*>(ptr);
+	case Property_Integer64: {
+		long long value = *static_cast<const long long*>(ptr);
+		if (value >= std::numeric_limits<int>::min() && value <= std::numeric_limits<int>::max()) {
+			return static_cast<int>(value);
+		}
+		return static_cast<double>(value);
+	}
+	case Property_Float:
+		return static_cast<double>(*static_cast<const float*>(ptr));
+	case Property_Real:
+		return *static_cast<const double*>(ptr);
+	case Property_String:
+		return *static_cast<const std::string*>(ptr);
+	case Property_Accessor:
+		return (*this.*property.getter)();
+	}
+
+	return Variant();
+}
+
+bool Scriptable::setProperty(const std::string &propertyName, const Variant &value)
+{
+	PropertiesTable::const_iterator it = m_properties.find(propertyName);
+	if (it == m_properties.end() || it->second.readOnly) {
+		return false;
+	}
+
+	const Property &property = it->second;
+	void *ptr = propertyAddress(property);
+
+	switch (property.type) {
+	case Property_Boolean:
+		*static_cast<bool*>(ptr) = value.toBoolean();
+		break;
+	case Property_Integer:
+		*static_cast<int*>(ptr) = value.toInteger();
+		break;
+	case Property_Integer64:
+		if (value.type() == Variant::Type_Integer) {
+			*static_cast<long long*>(ptr) = value.toInteger();
+		} else {
+			*static_cast<long long*>(ptr) = static_cast<long long>(value.toReal());
+		}
+		break;
+	case Property_Float:
+		*static_cast<float*>(ptr) = static_cast<float>(value.toReal());
+		break;
+	case Property_Real:
+		*static_cast<double*>(ptr) = value.toReal();
+		break;
+	case Property_String:
+		*static_cast<std::string*>(ptr) = value.toString();
+		break;
+	case Property_Accessor:
+		(*this.*property.setter)(value);
+		break;
+	}
+
+	return true;
+}
+
+bool Scriptable::integerProperty(const std::string &propertyName, long long &value) const
+{
+	PropertiesTable::const_iterator it = m_properties.find(propertyName);
+	if (it == m_properties.end()) {
+		return false;
+	}
+
+	const void *ptr = propertyAddress(it->second);
+	switch (it->second.type) {
+	case Property_Integer:
+		value = *static_cast<const int*>(ptr);
+		return true;
+	case Property_Integer64:
+		value = *static_cast<const long long*>(ptr);
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool Scriptable::setIntegerProperty(const std::string &propertyName, long long value)
+{
+	PropertiesTable::const_iterator it = m_properties.find(propertyName);
+	if (it == m_properties.end() || it->second.readOnly) {
+		return false;
+	}
+
+	void *ptr = propertyAddress(it->second);
+	switch (it->second.type) {
+	case Property_Integer:
+		*static_cast<int*>(ptr) = static_cast<int>(value);
+		return true;
+	case Property_Integer64:
+		*static_cast<long long*>(ptr) = value;
+		return true;
+	default:
+		return false;
+	}
+}
@@ -4,6 +4,7 @@
 #include <string>
 #include <map>
 #include "Variant.h"
+#include "ArgumentView.h"
 
 /**
  * @brief Abstract scriptable class
@@ -20,11 +21,57 @@ public:
      */
 	typedef Variant (Scriptable::*Method)(const VariantList &args);
 
+	/**
+	 * Scriptable class method reading its arguments
+	 * straight from the Lua stack.
+	 */
+	typedef Variant (Scriptable::*ViewMethod)(const ArgumentView &args);
+
+	/**
+	 * Property accessors.
+	 */
+	typedef Variant (Scriptable::*Getter)() const;
+	typedef void (Scriptable::*Setter)(const Variant &value);
+
+	/// Property storage
+	enum PropertyType {
+		Property_Boolean,   ///< bool member
+		Property_Integer,   ///< int member
+		Property_Integer64, ///< long long member
+		Property_Float,     ///< float member
+		Property_Real,      ///< double member
+		Property_String,    ///< std::string member
+		Property_Accessor   ///< getter/setter pair
+	};
+
+	/**
+	 * Scriptable property.
+	 * Member properties are accessed directly in the object memory.
+	 */
+	struct Property
+	{
+		PropertyType type;
+		size_t offset;      ///< Member offset from the Scriptable base.
+		Getter getter;      ///< Getter of accessor property.
+		Setter setter;      ///< Setter of accessor property, null if read-only.
+		bool readOnly;
+	};
+
 	/**
 	 * Table of scriptable methods.
 	 */
 	typedef std::map<std::string, Scriptable::Method> MetaMethodsTable;
 
+	/**
+	 * Table of scriptable properties.
+	 */
+	typedef std::map<std::string, Scriptable::Property> PropertiesTable;
+
+	/**
+	 * Table of scriptable methods taking argument views.
+	 */
+	typedef std::map<std::string, Scriptable::ViewMethod> ViewMethodsTable;
+
 	Scriptable();
 	virtual ~Scriptable() {};
 
@@ -35,6 +82,107 @@ public:
      */
 	void registerMethod(const std::string &methodName, Method method);
 
+    /**
+     * Register method taking arguments view.
+     * Arguments are converted on demand, which is cheaper for methods
+     * that ignore (parts of) large arguments.
+     * @param methodName Method name as it will be seen in Lua environment.
+     * @param method Corresponding native method.
+     */
+	void registerMethod(const std::string &methodName, ViewMethod method);
+
+    /**
+     * Register data member to be exposed to the Lua engine as a property.
+     * Must be called from the constructor of the class owning the member
+     * (or later), e.g. registerProperty("x", &MyUnit::x).
+     * @param propertyName Property name as it will be seen in Lua environment.
+     * @param member Pointer to the data member.
+     * @param readOnly Whether Lua may not assign the property.
+     */
+	template <class T>
+	void registerProperty(const std::string &propertyName, bool T::*member, bool readOnly = false)
+	{
+		registerMember(propertyName, Property_Boolean, memberOffset(member), readOnly);
+	}
+
+	template <class T>
+	void registerProperty(const std::string &propertyName, int T::*member, bool readOnly = false)
+	{
+		registerMember(propertyName, Property_Integer, memberOffset(member), readOnly);
+	}
+
+	template <class T>
+	void registerProperty(const std::string &propertyName, long long T::*member, bool readOnly = false)
+	{
+		registerMember(propertyName, Property_Integer64, memberOffset(member), readOnly);
+	}
+
+	template <class T>
+	void registerProperty(const std::string &propertyName, float T::*member, bool readOnly = false)
+	{
+		registerMember(propertyName, Property_Float, memberOffset(member), readOnly);
+	}
+
+	template <class T>
+	void registerProperty(const std::string &propertyName, double T::*member, bool readOnly = false)
+	{
+		registerMember(propertyName, Property_Real, memberOffset(member), readOnly);
+	}
+
+	template <class T>
+	void registerProperty(const std::string &propertyName, std::string T::*member, bool readOnly = false)
+	{
+		registerMember(propertyName, Property_String, memberOffset(member), readOnly);
+	}
+
+    /**
+     * Register property with accessor methods.
+     * @param propertyName Property name as it will be seen in Lua environment.
+     * @param getter Getter method, must not be null.
+     * @param setter Setter method, null for read-only property.
+     * @return false if the getter is null, the property is not registered then.
+     */
+	bool registerProperty(const std::string &propertyName, Getter getter, Setter setter = 0);
+
+    /**
+     * Read property value.
+     * Variant integers are 32-bit: long long members outside of that
+     * range are returned as reals, see integerProperty().
+     * @return Invalid Variant if there is no such property.
+     */
+	Variant property(const std::string &propertyName) const;
+
+    /**
+     * Assign property value.
+     * @return false if there is no such property or it is read-only.
+     */
+	bool setProperty(const std::string &propertyName, const Variant &value);
+
+    /**
+     * Read integer (int or long long member) property without
+     * a conversion through Variant.
+     * @return false if there is no such integer property.
+     */
+	bool integerProperty(const std::string &propertyName, long long &value) const;
+
+    /**
+     * Assign integer (int or long long member) property without
+     * a conversion through Variant.
+     * @return false if there is no such integer property or it is read-only.
+     */
+	bool setIntegerProperty(const std::string &propertyName, long long value);
+
+    /// Address of the member property.
+	void* propertyAddress(const Property &property)
+	{
+		return reinterpret_cast<char*>(this) + property.offset;
+	}
+
+	const void* propertyAddress(const Property &property) const
+	{
+		return reinterpret_cast<const char*>(this) + property.offset;
+	}
+
     /**
      * Invoke registered scriptable method.
      * This will be normally called by the Lua engine.
@@ -45,11 +193,19 @@ public:
 	Variant invokeMethod(const std::string &methodName,
 						 const VariantList &args = VariantList());
 
+    /**
+     * Invoke registered scriptable method taking arguments view.
+     * @param methodName Registered method name.
+     * @param args Arguments view.
+     * @return Method return value.
+     */
+	Variant invokeMethod(const std::string &methodName, const ArgumentView &args);
+
     /**
      * Number of registered scribtable methods.
      * @return Number of scriptable methods.
      */
-	int methodCount() const { return m_metaMethods.size(); }
+	int methodCount() const { return m_metaMethods.size() + m_viewMethods.size(); }
 
     /**
      * Returns reference to the table of scriptable methods.
@@ -57,9 +213,33 @@ public:
      */
 	const MetaMethodsTable& methods() const { return m_metaMethods; }
 
+    /**
+     * Returns reference to the table of scriptable methods taking argument views.
+     * @return Reference to the table of scriptable methods.
+     */
+	const ViewMethodsTable& viewMethods() const { return m_viewMethods; }
+
+    /**
+     * Returns reference to the table of scriptable properties.
+     * @return Reference to the table of scriptable properties.
+     */
+	const PropertiesTable& properties() const { return m_properties; }
+
 private:
 
+	/// Offset of the data member of a derived class from the Scriptable base.
+	template <class T, typename M>
+	size_t memberOffset(M T::*member)
+	{
+		const char *pMember = reinterpret_cast<const char*>(&(static_cast<T*>(this)->*member));
+		return static_cast<size_t>(pMember - reinterpret_cast<const char*>(this));
+	}
+
+	void registerMember(const std::string &propertyName, PropertyType type, size_t offset, bool readOnly);
+
 	MetaMethodsTable m_metaMethods; ///< Table of registered scriptable methods.
+	ViewMethodsTable m_viewMethods; ///< Table of registered methods taking argument views.
+	PropertiesTable m_properties;   ///< Table of registered properties.
 };
 
 
@@ -0,0 +1,1017 @@
+#include <string.h>
+#include <math.h>
+#include <limits>
+#include "Utils.h"
+#include "Serializer.h"
+
+/*
+ *  class ValueWriter
+ */
+
+ValueWriter::ValueWriter(OutputSink &sink)
+    : m_sink(sink),
+      m_size(0)
+{
+}
+
+ValueWriter::~ValueWriter()
+{
+    flush();
+}
+
+void ValueWriter::write(const Variant &value)
+{
+    switch (value.type()) {
+    case Variant::Type_Boolean:
+        writeBoolean(value.toBoolean());
+        break;
+    case Variant::Type_Integer:
+        writeInteger(value.toInteger());
+        break;
+    case Variant::Type_Real:
+        writeReal(value.toReal());
+        break;
+    case Variant::Type_String:
+        writeString(value.string());
+        break;
+    case Variant::Type_List: {
+        const VariantList &list = value.list();
+        beginList(list.size());
+        for (VariantList::const_iterator it = list.begin(); it != list.end(); ++it) {
+            write(*it);
+        }
+        endList();
+        break;
+    }
+    case Variant::Type_Array: {
+        const VariantArray &array = value.array();
+        beginList(array.size());
+        for (VariantArray::const_iterator it = array.begin(); it != array.end(); ++it) {
+            write(*it);
+        }
+        endList();
+        break;
+    }
+    case Variant::Type_Map: {
+        const VariantMap &map = value.map();
+        beginMap(map.size());
+        for (VariantMap::const_iterator it = map.begin(); it != map.end(); ++it) {
+            writeKey(it->first.data(), it->first.size());
+            write(it->second);
+        }
+        endMap();
+        break;
+    }
+    default:
+        // Invalid, null and function
+        writeNull();
+        break;
+    }
+}
+
+void ValueWriter::flush()
+{
+    if (m_size > 0) {
+        m_sink.write(m_buffer, m_size);
+        m_size = 0;
+    }
+}
+
+void ValueWriter::output(const char *data, size_t size)
+{
+    if (m_size + size > sizeof(m_buffer)) {
+        flush();
+        if (size > sizeof(m_buffer)) {
+            m_sink.write(data, size);
+            return;
+        }
+    }
+    memcpy(m_buffer + m_size, data, size);
+    m_size += size;
+}
+
+void ValueWriter::output(char c)
+{
+    if (m_size == sizeof(m_buffer)) {
+        flush();
+    }
+    m_buffer[m_size++] = c;
+}
+
+
+/*
+ *  class JsonWriter
+ */
+
+JsonWriter::JsonWriter(OutputSink &sink)
+    : ValueWriter(sink),
+      m_first(),
+      m_afterKey(false)
+{
+}
+
+void JsonWriter::writeNull()
+{
+    separate();
+    output("null", 4);
+}
+
+void JsonWriter::writeBoolean(bool value)
+{
+    separate();
+    if (value) {
+        output("true", 4);
+    } else {
+        output("false", 5);
+    }
+}
+
+void JsonWriter::writeInteger(long long value)
+{
+    separate();
+    char buffer[cMaxNumberLength];
+    output(buffer, formatNumber(value, buffer));
+}
+
+void JsonWriter::writeReal(double value)
+{
+    if (!isfinite(value)) {
+        // Not representable in JSON
+        writeNull();
+        return;
+    }
+
+    separate();
+    char buffer[cMaxNumberLength + 2];
+    size_t length = formatNumber(value, buffer);
+    if (memchr(buffer, '.', length) == 0 && memchr(buffer, 'e', length) == 0) {
+        // Keep the value real when read back
+        buffer[length++] = '.';
+        buffer[length++] = '0';
+    }
+    output(buffer, length);
+}
+
+void JsonWriter::writeString(const char *str, size_t length)
+{
+    separate();
+    quote(str, length);
+}
+
+void JsonWriter::beginList(size_t size)
+{
+    (void)size;
+    separate();
+    output('[');
+    m_first.push_back(true);
+}
+
+void JsonWriter::endList()
+{
+    m_first.pop_back();
+    output(']');
+}
+
+void JsonWriter::beginMap(size_t size)
+{
+    (void)size;
+    separate();
+    output('{');
+    m_first.push_back(true);
+}
+
+void JsonWriter::writeKey(const char *key, size_t length)
+{
+    separate();
+    quote(key, length);
+    output(':');
+    m_afterKey = true;
+}
+
+void JsonWriter::endMap()
+{
+    m_first.pop_back();
+    output('}');
+}
+
+void JsonWriter::separate()
+{
+    if (m_afterKey) {
+        m_afterKey = false;
+        return;
+    }
+    if (!m_first.empty()) {
+        if (m_first.back()) {
+            m_first.back() = false;
+        } else {
+            output(',');
+        }
+    }
+}
+
+void JsonWriter::quote(const char *str, size_t length)
+{
+    static const char *cHexDigits = "0123456789abcdef";
+
+    output('"');
+    const char *end = str + length;
+    const char *run = str;  // Beginning of characters not requiring escaping
+    for (const char *p = str; p != end; ++p) {
+        unsigned char c = static_cast<unsigned char>(*p);
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        output(run, p - run);
+        run = p + 1;
+        switch (c) {
+        case '"':  output("\\\"", 2); break;
+        case '\\': output("\\\\", 2); break;
+        case '\n': output("\\n", 2); break;
+        case '\r': output("\\r", 2); break;
+        case '\t': output("\\t", 2); break;
+        case '\b': output("\\b", 2); break;
+        case '\f': output("\\f", 2); break;
+        default: {
+            char escape[6] = { '\\', 'u', '0', '0', cHexDigits[c >> 4], cHexDigits[c & 0x0F] };
+            output(escape, sizeof(escape));
+            break;
+        }
+        }
+    }
+    output(run, end - run);
+    output('"');
+}
+
+
+/*
+ *  class BinaryWriter
+ */
+
+/// Write value as big-endian integer of given size.
+static void toBigEndian(unsigned long long value, size_t bytes, char *buffer)
+{
+    for (size_t i = 0; i < bytes; i++) {
+        buffer[bytes - 1 - i] = static_cast<char>(value & 0xFF);
+        value >>= 8;
+    }
+}
+
+BinaryWriter::BinaryWriter(OutputSink &sink)
+    : ValueWriter(sink)
+{
+}
+
+void BinaryWriter::writeNull()
+{
+    output(static_cast<char>(0xc0));
+}
+
+void BinaryWriter::writeBoolean(bool value)
+{
+    output(static_cast<char>(value ? 0xc3 : 0xc2));
+}
+
+void BinaryWriter::writeInteger(long long value)
+{
+    char buffer[9];
+
+    if (value >= 0) {
+        if (value < 0x80) {
+            output(static_cast<char>(value));   // positive fixint
+            return;
+        }
+        if (value <= 0xFF) {
+            buffer[0] = static_cast<char>(0xcc);
+            toBigEndian(value, 1, buffer + 1);
+            output(buffer, 2);
+            return;
+        }
+        if (value <= 0xFFFF) {
+            buffer[0] = static_cast<char>(0xcd);
+            toBigEndian(value, 2, buffer + 1);
+            output(buffer, 3);
+            return;
+        }
+        if (value <= 0xFFFFFFFFLL) {
+            buffer[0] = static_cast<char>(0xce);
+            toBigEndian(value, 4, buffer + 1);
+            output(buffer, 5);
+            return;
+        }
+    } else {
+        if (value >= -32) {
+            output(static_cast<char>(value));   // negative fixint
+            return;
+        }
+        if (value >= -0x80) {
+            buffer[0] = static_cast<char>(0xd0);
+            toBigEndian(static_cast<unsigned long long>(value), 1, buffer + 1);
+            output(buffer, 2);
+            return;
+        }
+        if (value >= -0x8000) {
+            buffer[0] = static_cast<char>(0xd1);
+            toBigEndian(static_cast<unsigned long long>(value), 2, buffer + 1);
+            output(buffer, 3);
+            return;
+        }
+        if (value >= -0x80000000LL) {
+            buffer[0] = static_cast<char>(0xd2);
+            toBigEndian(static_cast<unsigned long long>(value), 4, buffer + 1);
+            output(buffer, 5);
+            return;
+        }
+    }
+
+    buffer[0] = static_cast<char>(0xd3);
+    toBigEndian(static_cast<unsigned long long>(value), 8, buffer + 1);
+    output(buffer, 9);
+}
+
+void BinaryWriter::writeReal(double value)
+{
+    unsigned long long bits;
+    memcpy(&bits, &value, sizeof(bits));
+    char buffer[9];
+    buffer[0] = static_cast<char>(0xcb);
+    toBigEndian(bits, 8, buffer + 1);
+    output(buffer, 9);
+}
+
+void BinaryWriter::writeString(const char *str, size_t length)
+{
+    header(0xa0, 32, 0xd9, 0xda, 0xdb, length);
+    output(str, length);
+}
+
+void BinaryWriter::beginList(size_t size)
+{
+    header(0x90, 16, 0, 0xdc, 0xdd, size);
+}
+
+void BinaryWriter::beginMap(size_t size)
+{
+    header(0x80, 16, 0, 0xde, 0xdf, size);
+}
+
+void BinaryWriter::writeKey(const char *key, size_t length)
+{
+    writeString(key, length);
+}
+
+void BinaryWriter::header(unsigned char fixTag, size_t fixLimit, unsigned char tag8,
+                          unsigned char tag16, unsigned char tag32, size_t size)
+{
+    char buffer[5];
+    if (size < fixLimit) {
+        output(static_cast<char>(fixTag | size));
+    } else if (tag8 != 0 && size <= 0xFF) {
+        buffer[0] = static_cast<char>(tag8);
+        toBigEndian(size, 1, buffer + 1);
+        output(buffer, 2);
+    } else if (size <= 0xFFFF) {
+        buffer[0] = static_cast<char>(tag16);
+        toBigEndian(size, 2, buffer + 1);
+        output(buffer, 3);
+    } else {
+        buffer[0] = static_cast<char>(tag32);
+        toBigEndian(size, 4, buffer + 1);
+        output(buffer, 5);
+    }
+}
+
+
+/*
+ *  class VariantBuilder
+ */
+
+VariantBuilder::VariantBuilder()
+    : m_result(),
+      m_stack(),
+      m_key()
+{
+}
+
+void VariantBuilder::clear()
+{
+    m_result.clear();
+    m_stack.clear();
+    m_key.clear();
+}
+
+Variant* VariantBuilder::add(const Variant &value)
+{
+    if (m_stack.empty()) {
+        m_result = value;
+        return &m_result;
+    }
+
+    Variant *pContainer = m_stack.back();
+    if (pContainer->type() == Variant::Type_List) {
+        VariantList &list = pContainer->list();
+        list.push_back(value);
+        return &list.back();
+    }
+
+    Variant &item = pContainer->map()[m_key];
+    item = value;
+    return &item;
+}
+
+bool VariantBuilder::onNull()
+{
+    add(Variant(Variant::Type_Null));
+    return true;
+}
+
+bool VariantBuilder::onBoolean(bool value)
+{
+    add(Variant(value));
+    return true;
+}
+
+bool VariantBuilder::onInteger(long long value)
+{
+    if (value >= std::numeric_limits<int>::min() && value <= std::numeric_limits<int>::max()) {
+        add(Variant(static_cast<int>(value)));
+    } else {
+        add(Variant(static_cast<double>(value)));
+    }
+    return true;
+}
+
+bool VariantBuilder::onReal(double value)
+{
+    add(Variant(value));
+    return true;
+}
+
+bool VariantBuilder::onString(const char *str, size_t length)
+{
+    add(Variant(std::string(str, length)));
+    return true;
+}
+
+bool VariantBuilder::onBeginList(size_t sizeHint)
+{
+    (void)sizeHint;
+    m_stack.push_back(add(Variant(Variant::Type_List)));
+    return true;
+}
+
+bool VariantBuilder::onEndList()
+{
+    m_stack.pop_back();
+    return true;
+}
+
+bool VariantBuilder::onBeginMap(size_t sizeHint)
+{
+    (void)sizeHint;
+    m_stack.push_back(add(Variant(Variant::Type_Map)));
+    return true;
+}
+
+bool VariantBuilder::onKey(const char *key, size_t length)
+{
+    m_key.assign(key, length);
+    return true;
+}
+
+bool VariantBuilder::onEndMap()
+{
+    m_stack.pop_back();
+    return true;
+}
+
+
+/*
+ *  class ValueReader
+ */
+
+ValueReader::ValueReader(SerialFormat format, ValueHandler &handler)
+    : m_format(format),
+      m_handler(handler),
+      m_pos(0),
+      m_end(0),
+      m_string(),
+      m_errorText()
+{
+}
+
+bool ValueReader::parse(const char *data, size_t size, size_t *pLength)
+{
+    m_pos = data;
+    m_end = data + size;
+    m_errorText.clear();
+
+    bool ok = false;
+    if (m_format == SerialFormat_Json) {
+        ok = parseJson(0);
+        if (ok) {
+            skipWhitespace();
+        }
+    } else {
+        ok = parseBinary(0);
+    }
+
+    if (ok && pLength == 0 && m_pos != m_end) {
+        return fail("trailing data");
+    }
+    if (pLength) {
+        *pLength = m_pos - data;
+    }
+    return ok;
+}
+
+bool ValueReader::fail(const char *error)
+{
+    if (m_errorText.empty()) {
+        m_errorText = error;
+    }
+    return false;
+}
+
+void ValueReader::skipWhitespace()
+{
+    while (m_pos != m_end && (*m_pos == ' ' || *m_pos == '\t' || *m_pos == '\n' || *m_pos == '\r')) {
+        ++m_pos;
+    }
+}
+
+/// Match literal at current position.
+static bool matchLiteral(const char *&pos, const char *end, const char *literal, size_t length)
+{
+    if (static_cast<size_t>(end - pos) < length || memcmp(pos, literal, length) != 0) {
+        return false;
+    }
+    pos += length;
+    return true;
+}
+
+bool ValueReader::parseJson(int depth)
+{
+    if (depth > cMaxDepth) {
+        return fail("nesting too deep");
+    }
+
+    skipWhitespace();
+    if (m_pos == m_end) {
+        return fail("unexpected end of data");
+    }
+
+    switch (*m_pos) {
+    case 'n':
+        if (!matchLiteral(m_pos, m_end, "null", 4)) {
+            return fail("invalid literal");
+        }
+        return m_handler.onNull() || fail("aborted");
+    case 't':
+        if (!matchLiteral(m_pos, m_end, "true", 4)) {
+            return fail("invalid literal");
+        }
+        return m_handler.onBoolean(true) || fail("aborted");
+    case 'f':
+        if (!matchLiteral(m_pos, m_end, "false", 5)) {
+            return fail("invalid literal");
+        }
+        return m_handler.onBoolean(false) || fail("aborted");
+    case '"': {
+        if (!parseJsonString(m_string)) {
+            return false;
+        }
+        return m_handler.onString(m_string.data(), m_string.size()) || fail("aborted");
+    }
+    case '[': {
+        ++m_pos;
+        if (!m_handler.onBeginList(0)) {
+            return fail("aborted");
+        }
+        skipWhitespace();
+        if (m_pos != m_end && *m_pos == ']') {
+            ++m_pos;
+            return m_handler.onEndList() || fail("aborted");
+        }
+        for (;;) {
+            if (!parseJson(depth + 1)) {
+                return false;
+            }
+            skipWhitespace();
+            if (m_pos == m_end) {
+                return fail("unexpected end of data");
+            }
+            if (*m_pos == ']') {
+                ++m_pos;
+                return m_handler.onEndList() || fail("aborted");
+            }
+            if (*m_pos != ',') {
+                return fail("expected ',' or ']'");
+            }
+            ++m_pos;
+        }
+    }
+    case '{': {
+        ++m_pos;
+        if (!m_handler.onBeginMap(0)) {
+            return fail("aborted");
+        }
+        skipWhitespace();
+        if (m_pos != m_end && *m_pos == '}') {
+            ++m_pos;
+            return m_handler.onEndMap() || fail("aborted");
+        }
+        for (;;) {
+            skipWhitespace();
+            if (m_pos == m_end || *m_pos != '"') {
+                return fail("expected key");
+            }
+            if (!parseJsonString(m_string)) {
+                return false;
+            }
+            if (!m_handler.onKey(m_string.data(), m_string.size())) {
+                return fail("aborted");
+            }
+            skipWhitespace();
+            if (m_pos == m_end || *m_pos != ':') {
+                return fail("expected ':'");
+            }
+            ++m_pos;
+            if (!parseJson(depth + 1)) {
+                return false;
+            }
+            skipWhitespace();
+            if (m_pos == m_end) {
+                return fail("unexpected end of data");
+            }
+            if (*m_pos == '}') {
+                ++m_pos;
+                return m_handler.onEndMap() || fail("aborted");
+            }
+            if (*m_pos != ',') {
+                return fail("expected ',' or '}'");
+            }
+            ++m_pos;
+        }
+    }
+    default:
+        return parseJsonNumber();
+    }
+}
+
+/// Append code point as UTF-8.
+static void appendUtf8(std::string &str, unsigned long cp)
+{
+    if (cp < 0x80) {
+        str.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        str.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        str.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        str.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+        str.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        str.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else {
+        str.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+        str.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+        str.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        str.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+}
+
+/// Parse 4 hex digits.
+static bool parseHex4(const char *&pos, const char *end, unsigned long &value)
+{
+    if (end - pos < 4) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < 4; i++, ++pos) {
+        char c = *pos;
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            value |= c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            value |= c - 'A' + 10;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ValueReader::parseJsonString(std::string &str)
+{
+    ++m_pos; // Opening quote
+    str.clear();
+
+    const char *run = m_pos;
+    while (m_pos != m_end) {
+        char c = *m_pos;
+        if (c == '"') {
+            str.append(run, m_pos);
+            ++m_pos;
+            return true;
+        }
+        if (c != '\\') {
+            ++m_pos;
+            continue;
+        }
+
+        str.append(run, m_pos);
+        if (++m_pos == m_end) {
+            break;
+        }
+        switch (*m_pos++) {
+        case '"':  str.push_back('"'); break;
+        case '\\': str.push_back('\\'); break;
+        case '/':  str.push_back('/'); break;
+        case 'b':  str.push_back('\b'); break;
+        case 'f':  str.push_back('\f'); break;
+        case 'n':  str.push_back('\n'); break;
+        case 'r':  str.push_back('\r'); break;
+        case 't':  str.push_back('\t'); break;
+        case 'u': {
+            unsigned long cp = 0;
+            if (!parseHex4(m_pos, m_end, cp)) {
+                return fail("invalid unicode escape");
+            }
+            if (cp >= 0xD800 && cp <= 0xDBFF) {
+                // Surrogate pair
+                unsigned long low = 0;
+                if (m_end - m_pos < 2 || m_pos[0] != '\\' || m_pos[1] != 'u') {
+                    return fail("invalid surrogate pair");
+                }
+                m_pos += 2;
+                if (!parseHex4(m_pos, m_end, low) || low < 0xDC00 || low > 0xDFFF) {
+                    return fail("invalid surrogate pair");
+                }
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+            }
+            appendUtf8(str, cp);
+            break;
+        }
+        default:
+            return fail("invalid escape");
+        }
+        run = m_pos;
+    }
+
+    return fail("unterminated string");
+}
+
+bool ValueReader::parseJsonNumber()
+{
+    const char *start = m_pos;
+    bool real = false;
+    if (m_pos != m_end && *m_pos == '-') {
+        ++m_pos;
+    }
+    while (m_pos != m_end) {
+        char c = *m_pos;
+        if (c == '.' || c == 'e' || c == 'E' || c == '+' || c == '-') {
+            real = true;
+        } else if (c < '0' || c > '9') {
+            break;
+        }
+        ++m_pos;
+    }
+    if (m_pos == start) {
+        return fail("unexpected character");
+    }
+
+    if (!real) {
+        long long value = 0;
+        if (parseNumber(start, m_pos, value)) {
+            return m_handler.onInteger(value) || fail("aborted");
+        }
+        // Integer overflow, fall back to real
+    }
+
+    double value = 0.0;
+    const char *end = 0;
+    if (!parseNumber(start, m_pos, value, &end) || end != m_pos) {
+        return fail("invalid number");
+    }
+    return m_handler.onReal(value) || fail("aborted");
+}
+
+bool ValueReader::readBigEndian(size_t bytes, unsigned long long &value)
+{
+    if (static_cast<size_t>(m_end - m_pos) < bytes) {
+        return fail("unexpected end of data");
+    }
+    value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value = (value << 8) | static_cast<unsigned char>(*m_pos++);
+    }
+    return true;
+}
+
+bool ValueReader::parseBinary(int depth)
+{
+    if (depth > cMaxDepth) {
+        return fail("nesting too deep");
+    }
+    if (m_pos == m_end) {
+        return fail("unexpected end of data");
+    }
+
+    unsigned char tag = static_cast<unsigned char>(*m_pos++);
+    unsigned long long value = 0;
+
+    if (tag < 0x80) {
+        return m_handler.onInteger(tag) || fail("aborted");
+    }
+    if (tag >= 0xe0) {
+        return m_handler.onInteger(static_cast<signed char>(tag)) || fail("aborted");
+    }
+    if ((tag & 0xe0) == 0xa0) {
+        return parseBinaryString(tag & 0x1f);
+    }
+    if ((tag & 0xf0) == 0x90) {
+        return parseBinaryList(tag & 0x0f, depth);
+    }
+    if ((tag & 0xf0) == 0x80) {
+        return parseBinaryMap(tag & 0x0f, depth);
+    }
+
+    switch (tag) {
+    case 0xc0:
+        return m_handler.onNull() || fail("aborted");
+    case 0xc2:
+        return m_handler.onBoolean(false) || fail("aborted");
+    case 0xc3:
+        return m_handler.onBoolean(true) || fail("aborted");
+    case 0xcc:
+    case 0xcd:
+    case 0xce:
+    case 0xcf: {
+        size_t bytes = size_t(1) << (tag - 0xcc);
+        if (!readBigEndian(bytes, value)) {
+            return false;
+        }
+        if (value > static_cast<unsigned long long>(std::numeric_limits<long long>::max())) {
+            return m_handler.onReal(static_cast<double>(value)) || fail("aborted");
+        }
+        return m_handler.onInteger(static_cast<long long>(value)) || fail("aborted");
+    }
+    case 0xd0:
+    case 0xd1:
+    case 0xd2:
+    case 0xd3: {
+        size_t bytes = size_t(1) << (tag - 0xd0);
+        if (!readBigEndian(bytes, value)) {
+            return false;
+        }
+        // Sign-extend
+        int shift = 64 - 8 * static_cast<int>(bytes);
+        long long signedValue = static_cast<long long>(value << shift) >> shift;
+        return m_handler.onInteger(signedValue) || fail("aborted");
+    }
+    case 0xca: {
+        if (!readBigEndian(4, value)) {
+            return false;
+        }
+        unsigned int bits = static_cast<unsigned int>(value);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return m_handler.onReal(f) || fail("aborted");
+    }
+    case 0xcb: {
+        if (!readBigEndian(8, value)) {
+            return false;
+        }
+        double d;
+        memcpy(&d, &value, sizeof(d));
+        return m_handler.onReal(d) || fail("aborted");
+    }
+    case 0xd9:
+    case 0xda:
+    case 0xdb:
+        if (!readBigEndian(size_t(1) << (tag - 0xd9), value)) {
+            return false;
+        }
+        return parseBinaryString(static_cast<size_t>(value));
+    case 0xdc:
+    case 0xdd:
+        if (!readBigEndian(tag == 0xdc ? 2 : 4, value)) {
+            return false;
+        }
+        return parseBinaryList(static_cast<size_t>(value), depth);
+    case 0xde:
+    case 0xdf:
+        if (!readBigEndian(tag == 0xde ? 2 : 4, value)) {
+            return false;
+        }
+        return parseBinaryMap(static_cast<size_t>(value), depth);
+    default:
+        return fail("unsupported type");
+    }
+}
+
+bool ValueReader::parseBinaryString(size_t length)
+{
+    if (static_cast<size_t>(m_end - m_pos) < length) {
+        return fail("unexpected end of data");
+    }
+    const char *str = m_pos;
+    m_pos += length;
+    return m_handler.onString(str, length) || fail("aborted");
+}
+
+bool ValueReader::parseBinaryList(size_t size, int depth)
+{
+    // Every item takes a byte at least: the size is checked before
+    // it is passed on as a hint for preallocation
+    if (static_cast<size_t>(m_end - m_pos) < size) {
+        return fail("unexpected end of data");
+    }
+    if (!m_handler.onBeginList(size)) {
+        return fail("aborted");
+    }
+    for (size_t i = 0; i < size; i++) {
+        if (!parseBinary(depth + 1)) {
+            return false;
+        }
+    }
+    return m_handler.onEndList() || fail("aborted");
+}
+
+bool ValueReader::parseBinaryMap(size_t size, int depth)
+{
+    // Every entry takes two bytes at least (key and value)
+    if (static_cast<size_t>(m_end - m_pos) / 2 < size) {
+        return fail("unexpected end of data");
+    }
+    if (!m_handler.onBeginMap(size)) {
+        return fail("aborted");
+    }
+    for (size_t i = 0; i < size; i++) {
+        // Keys must be strings
+        if (m_pos == m_end) {
+            return fail("unexpected end of data");
+        }
+        unsigned char tag = static_cast<unsigned char>(*m_pos++);
+        unsigned long long length = 0;
+        if ((tag & 0xe0) == 0xa0) {
+            length = tag & 0x1f;
+        } else if (tag >= 0xd9 && tag <= 0xdb) {
+            if (!readBigEndian(size_t(1) << (tag - 0xd9), length)) {
+                return false;
+            }
+        } else {
+            return fail("map key is not a string");
+        }
+        if (static_cast<unsigned long long>(m_end - m_pos) < length) {
+            return fail("unexpected end of data");
+        }
+        const char *key = m_pos;
+        m_pos += length;
+        if (!m_handler.onKey(key, static_cast<size_t>(length))) {
+            return fail("aborted");
+        }
+        if (!parseBinary(depth + 1)) {
+            return false;
+        }
+    }
+    return m_handler.onEndMap() || fail("aborted");
+}
+
+
+/*
+ *  Helpers
+ */
+
+std::string toJson(const Variant &value)
+{
+    std::string res;
+    StringSink sink(res);
+    {
+        JsonWriter writer(sink);
+        writer.write(value);
+    }
+    return res;
+}
+
+std::string toBinary(const Variant &value)
+{
+    std::string res;
+    StringSink sink(res);
+    {
+        BinaryWriter writer(sink);
+        writer.write(value);
+    }
+    return res;
+}
+
+Variant fromSerialized(const char *data, size_t size, SerialFormat format)
+{
+    VariantBuilder builder;
+    ValueReader reader(format, builder);
+    if (!reader.parse(data, size)) {
+        return Variant();
+    }
+    return builder.result();
+}
@@ -0,0 +1,271 @@
+#ifndef SERIALIZER_H
+#define SERIALIZER_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "Variant.h"
+
+/**
+ * @brief Destination of serialized data.
+ */
+class OutputSink
+{
+public:
+    virtual ~OutputSink() {}
+    virtual void write(const char *data, size_t size) = 0;
+};
+
+/**
+ * @brief Sink appending serialized data to a string.
+ */
+class StringSink : public OutputSink
+{
+public:
+    explicit StringSink(std::string &output) : m_output(output) {}
+    void write(const char *data, size_t size) override { m_output.append(data, size); }
+private:
+    std::string &m_output;
+};
+
+/**
+ * @brief Sink writing serialized data to an output stream.
+ */
+class StreamSink : public OutputSink
+{
+public:
+    explicit StreamSink(std::ostream &output) : m_output(output) {}
+    void write(const char *data, size_t size) override { m_output.write(data, size); }
+private:
+    std::ostream &m_output;
+};
+
+/**
+ * @brief Streaming value writer.
+ *
+ * Values are written as a sequence of calls straight into the output
+ * sink (through a small internal buffer), no intermediate strings are
+ * built. Lists and maps announce their size up-front; a map entry is
+ * a writeKey() call followed by the value.
+ */
+class ValueWriter
+{
+public:
+    explicit ValueWriter(OutputSink &sink);
+    virtual ~ValueWriter();
+
+    virtual void writeNull() = 0;
+    virtual void writeBoolean(bool value) = 0;
+    virtual void writeInteger(long long value) = 0;
+    virtual void writeReal(double value) = 0;
+    virtual void writeString(const char *str, size_t length) = 0;
+    virtual void beginList(size_t size) = 0;
+    virtual void endList() = 0;
+    virtual void beginMap(size_t size) = 0;
+    virtual void writeKey(const char *key, size_t length) = 0;
+    virtual void endMap() = 0;
+
+    void writeString(const std::string &str) { writeString(str.data(), str.size()); }
+
+    /**
+     * Write a Variant tree.
+     * Invalid values and functions are written as null.
+     */
+    void write(const Variant &value);
+
+    /// Pass buffered data to the sink.
+    void flush();
+
+protected:
+
+    void output(const char *data, size_t size);
+    void output(char c);
+
+private:
+
+    OutputSink &m_sink;
+    char m_buffer[4096];    ///< Output buffer.
+    size_t m_size;          ///< Number of buffered bytes.
+};
+
+/**
+ * @brief JSON writer.
+ */
+class JsonWriter : public ValueWriter
+{
+public:
+    explicit JsonWriter(OutputSink &sink);
+
+    void writeNull() override;
+    void writeBoolean(bool value) override;
+    void writeInteger(long long value) override;
+    void writeReal(double value) override;
+    void writeString(const char *str, size_t length) override;
+    void beginList(size_t size) override;
+    void endList() override;
+    void beginMap(size_t size) override;
+    void writeKey(const char *key, size_t length) override;
+    void endMap() override;
+
+    using ValueWriter::writeString;
+
+private:
+
+    void separate();
+    void quote(const char *str, size_t length);
+
+    std::vector<bool> m_first; ///< Whether the next element is the first one, per nesting level.
+    bool m_afterKey;           ///< Whether a key has just been written.
+};
+
+/**
+ * @brief Compact binary (MessagePack) writer.
+ */
+class BinaryWriter : public ValueWriter
+{
+public:
+    explicit BinaryWriter(OutputSink &sink);
+
+    void writeNull() override;
+    void writeBoolean(bool value) override;
+    void writeInteger(long long value) override;
+    void writeReal(double value) override;
+    void writeString(const char *str, size_t length) override;
+    void beginList(size_t size) override;
+    void endList() override {}
+    void beginMap(size_t size) override;
+    void writeKey(const char *key, size_t length) override;
+    void endMap() override {}
+
+    using ValueWriter::writeString;
+
+private:
+
+    void header(unsigned char fixTag, size_t fixLimit, unsigned char tag8,
+                unsigned char tag16, unsigned char tag32, size_t size);
+};
+
+/**
+ * @brief Receiver of parsed values.
+ *
+ * Parsers report values as a sequence of calls, mirroring ValueWriter.
+ * Returning false from a callback aborts parsing.
+ */
+class ValueHandler
+{
+public:
+    virtual ~ValueHandler() {}
+
+    virtual bool onNull() = 0;
+    virtual bool onBoolean(bool value) = 0;
+    virtual bool onInteger(long long value) = 0;
+    virtual bool onReal(double value) = 0;
+    virtual bool onString(const char *str, size_t length) = 0;
+    virtual bool onBeginList(size_t sizeHint) = 0;   ///< sizeHint is 0 when unknown.
+    virtual bool onEndList() = 0;
+    virtual bool onBeginMap(size_t sizeHint) = 0;    ///< sizeHint is 0 when unknown.
+    virtual bool onKey(const char *key, size_t length) = 0;
+    virtual bool onEndMap() = 0;
+};
+
+/**
+ * @brief Handler building a Variant tree.
+ *
+ * Integers that do not fit Variant integer become reals.
+ */
+class VariantBuilder : public ValueHandler
+{
+public:
+    VariantBuilder();
+
+    const Variant& result() const { return m_result; }
+    void clear();
+
+    bool onNull() override;
+    bool onBoolean(bool value) override;
+    bool onInteger(long long value) override;
+    bool onReal(double value) override;
+    bool onString(const char *str, size_t length) override;
+    bool onBeginList(size_t sizeHint) override;
+    bool onEndList() override;
+    bool onBeginMap(size_t sizeHint) override;
+    bool onKey(const char *key, size_t length) override;
+    bool onEndMap() override;
+
+private:
+
+    /// Add value to the current container, returns the stored value.
+    Variant* add(const Variant &value);
+
+    Variant m_result;
+    std::vector<Variant*> m_stack;  ///< Open containers (stored in place in their parents).
+    std::string m_key;              ///< Pending map key.
+};
+
+/// Serialization format
+enum SerialFormat {
+    SerialFormat_Json,
+    SerialFormat_Binary
+};
+
+/**
+ * @brief Streaming parser of a single serialized value.
+ */
+class ValueReader
+{
+public:
+
+    /// Maximal nesting depth of lists and maps.
+    static const int cMaxDepth = 128;
+
+    ValueReader(SerialFormat format, ValueHandler &handler);
+
+    /**
+     * Parse single value.
+     * @param data Serialized data.
+     * @param size Data size.
+     * @param pLength If given, receives the number of consumed bytes and
+     *                trailing data is allowed (to read value sequences).
+     * @return false on syntax error or if aborted by the handler.
+     */
+    bool parse(const char *data, size_t size, size_t *pLength = 0);
+
+    const std::string& errorText() const { return m_errorText; }
+
+private:
+
+    bool parseJson(int depth);
+    bool parseJsonString(std::string &str);
+    bool parseJsonNumber();
+    bool parseBinary(int depth);
+    bool parseBinaryString(size_t length);
+    bool parseBinaryList(size_t size, int depth);
+    bool parseBinaryMap(size_t size, int depth);
+    bool readBigEndian(size_t bytes, unsigned long long &value);
+    void skipWhitespace();
+    bool fail(const char *error);
+
+    SerialFormat m_format;
+    ValueHandler &m_handler;
+    const char *m_pos;
+    const char *m_end;
+    std::string m_string;       ///< Scratch buffer for unescaped strings.
+    std::string m_errorText;
+};
+
+/// Serialize Variant to JSON.
+std::string toJson(const Variant &value);
+
+/// Serialize Variant to binary format.
+std::string toBinary(const Variant &value);
+
+/**
+ * Parse Variant from serialized data.
+ * @return Parsed value, invalid Variant on error.
+ */
+Variant fromSerialized(const char *data, size_t size, SerialFormat format);
+
+inline Variant fromJson(const std::string &json) { return fromSerialized(json.data(), json.size(), SerialFormat_Json); }
+inline Variant fromBinary(const std::string &data) { return fromSerialized(data.data(), data.size(), SerialFormat_Binary); }
+
+#endif // SERIALIZER_H
@@ -0,0 +1,303 @@
+#include "LuaCompat.h"
+
+#include <string.h>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include "SharedTable.h"
+
+/// Name of the shared table view metatable in Lua registry.
+const static char *cSharedTableMetatable = "cxLua.SharedTable";
+
+struct SharedTable::Node
+{
+    /// Table entry: either a scalar value or a nested table.
+    struct Entry
+    {
+        Variant value;
+        std::unique_ptr<Node> child;
+    };
+
+    typedef std::pair<std::string, Entry> Field;
+
+    std::vector<Entry> array;   ///< Entries with integer keys 1..n.
+    std::vector<Field> fields;  ///< Entries with string keys, sorted by key.
+
+    explicit Node(const Variant &data);
+
+    const Entry* find(const char *key, size_t length) const;
+    size_t fieldIndex(const char *key, size_t length) const;
+};
+
+/// Compare field key with a Lua string, without constructing std::string.
+static int compareKey(const std::string &key, const char *str, size_t length)
+{
+    int res = memcmp(key.data(), str, std::min(key.size(), length));
+    if (res != 0) {
+        return res;
+    }
+    return key.size() < length ? -1 : (key.size() > length ? 1 : 0);
+}
+
+static void initEntry(SharedTable::Node::Entry &entry, const Variant &value)
+{
+    if (value.isSequence() || value.type() == Variant::Type_Map) {
+        entry.child.reset(new SharedTable::Node(value));
+    } else {
+        entry.value = value;
+    }
+}
+
+SharedTable::Node::Node(const Variant &data)
+{
+    if (data.type() == Variant::Type_List) {
+        const VariantList &list = data.list();
+        array.resize(list.size());
+        std::vector<Entry>::iterator entry = array.begin();
+        for (VariantList::const_iterator it = list.begin(); it != list.end(); ++it, ++entry) {
+            initEntry(*entry, *it);
+        }
+    } else if (data.type() == Variant::Type_Array) {
+        const VariantArray &list = data.array();
+        array.resize(list.size());
+        for (size_t i = 0; i < list.size(); i++) {
+            initEntry(array[i], list[i]);
+        }
+    } else if (data.type() == Variant::Type_Map) {
+        // std::map keeps the keys sorted already
+        const VariantMap &map = data.map();
+        fields.resize(map.size());
+        std::vector<Field>::iterator field = fields.begin();
+        for (VariantMap::const_iterator it = map.begin(); it != map.end(); ++it, ++field) {
+            field->first = it->first;
+            initEntry(field->second, it->second);
+        }
+    }
+}
+
+size_t SharedTable::Node::fieldIndex(const char *key, size_t length) const
+{
+    size_t lo = 0;
+    size_t hi = fields.size();
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int res = compareKey(fields[mid].first, key, length);
+        if (res == 0) {
+            return mid;
+        }
+        if (res < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return fields.size();
+}
+
+const SharedTable::Node::Entry* SharedTable::Node::find(const char *key, size_t length) const
+{
+    size_t index = fieldIndex(key, length);
+    return index < fields.size() ? &fields[index].second : 0;
+}
+
+/**
+ * Lua userdata referencing a node of the shared table.
+ * Keeps the whole table alive.
+ */
+struct SharedTableView
+{
+    std::shared_ptr<const SharedTable::Node> root;
+    const SharedTable::Node *pNode;
+};
+
+static int sharedTableIndex(lua_State *pLuaState);
+static int sharedTableNewIndex(lua_State *pLuaState);
+static int sharedTableLength(lua_State *pLuaState);
+static int sharedTablePairs(lua_State *pLuaState);
+static int sharedTableNext(lua_State *pLuaState);
+static int sharedTableGc(lua_State *pLuaState);
+
+static void pushView(lua_State *pLuaState,
+                     const std::shared_ptr<const SharedTable::Node> &root,
+                     const SharedTable::Node *pNode)
+{
+    void *ptr = lua_newuserdata(pLuaState, sizeof(SharedTableView));
+    SharedTableView *pView = new (ptr) SharedTableView();
+    pView->root = root;
+    pView->pNode = pNode;
+
+    if (luaL_newmetatable(pLuaState, cSharedTableMetatable)) {
+        static const luaL_Reg metamethods[] = {
+            { "__index",    sharedTableIndex },
+            { "__newindex", sharedTableNewIndex },
+            { "__len",      sharedTableLength },
+            { "__pairs",    sharedTablePairs },
+            { "__gc",       sharedTableGc },
+            { 0, 0 }
+        };
+        luaL_setfuncs(pLuaState, metamethods, 0);
+
+        // Protect the metatable from scripts
+        lua_pushboolean(pLuaState, 0);
+        lua_setfield(pLuaState, -2, "__metatable");
+    }
+    lua_setmetatable(pLuaState, -2);
+}
+
+static void pushEntry(lua_State *pLuaState,
+                      const SharedTableView *pView,
+                      const SharedTable::Node::Entry &entry)
+{
+    if (entry.child) {
+        pushView(pLuaState, pView->root, entry.child.get());
+        return;
+    }
+
+    const Variant &value = entry.value;
+    switch (value.type()) {
+    case Variant::Type_Boolean:
+        lua_pushboolean(pLuaState, value.toBoolean() ? 1 : 0);
+        break;
+    case Variant::Type_Integer:
+        lua_pushinteger(pLuaState, value.toInteger());
+        break;
+    case Variant::Type_Real:
+        lua_pushnumber(pLuaState, value.toReal());
+        break;
+    case Variant::Type_String: {
+        const std::string &str = value.string();
+        lua_pushlstring(pLuaState, str.data(), str.size());
+        break;
+    }
+    default:
+        lua_pushnil(pLuaState);
+        break;
+    }
+}
+
+static SharedTableView* checkView(lua_State *pLuaState)
+{
+    return static_cast<SharedTableView*>(luaL_checkudata(pLuaState, 1, cSharedTableMetatable));
+}
+
+static int sharedTableIndex(lua_State *pLuaState)
+{
+    SharedTableView *pView = checkView(pLuaState);
+    const SharedTable::Node *pNode = pView->pNode;
+
+    if (lua_type(pLuaState, 2) == LUA_TNUMBER) {
+        lua_Integer index = lua_tointeger(pLuaState, 2);
+        if (index >= 1 && static_cast<size_t>(index) <= pNode->array.size()) {
+            pushEntry(pLuaState, pView, pNode->array[index - 1]);
+            return 1;
+        }
+    } else if (lua_type(pLuaState, 2) == LUA_TSTRING) {
+        size_t length = 0;
+        const char *key = lua_tolstring(pLuaState, 2, &length);
+        const SharedTable::Node::Entry *pEntry = pNode->find(key, length);
+        if (pEntry) {
+            pushEntry(pLuaState, pView, *pEntry);
+            return 1;
+        }
+    }
+
+    lua_pushnil(pLuaState);
+    return 1;
+}
+
+static int sharedTableNewIndex(lua_State *pLuaState)
+{
+    return luaL_error(pLuaState, "attempt to modify a read-only shared table");
+}
+
+static int sharedTableLength(lua_State *pLuaState)
+{
+    SharedTableView *pView = checkView(pLuaState);
+    lua_pushinteger(pLuaState, static_cast<lua_Integer>(pView->pNode->array.size()));
+    return 1;
+}
+
+static int sharedTablePairs(lua_State *pLuaState)
+{
+    checkView(pLuaState);
+    lua_pushcfunction(pLuaState, sharedTableNext);
+    lua_pushvalue(pLuaState, 1);
+    lua_pushnil(pLuaState);
+    return 3;
+}
+
+/**
+ * Stateless iterator: array entries come first, then the fields.
+ */
+static int sharedTableNext(lua_State *pLuaState)
+{
+    SharedTableView *pView = checkView(pLuaState);
+    const SharedTable::Node *pNode = pView->pNode;
+
+    size_t arrayIndex = 0;  // Index of the next array entry
+    size_t fieldIndex = 0;  // Index of the next field
+
+    switch (lua_type(pLuaState, 2)) {
+    case LUA_TNIL:
+        break;
+    case LUA_TNUMBER:
+        arrayIndex = static_cast<size_t>(lua_tointeger(pLuaState, 2));
+        break;
+    case LUA_TSTRING: {
+        size_t length = 0;
+        const char *key = lua_tolstring(pLuaState, 2, &length);
+        arrayIndex = pNode->array.size();
+        fieldIndex = pNode->fieldIndex(key, length) + 1;
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    if (arrayIndex < pNode->array.size()) {
+        lua_pushinteger(pLuaState, static_cast<lua_Integer>(arrayIndex + 1));
+        pushEntry(pLuaState, pView, pNode->array[arrayIndex]);
+        return 2;
+    }
+
+    if (fieldIndex < pNode->fields.size()) {
+        const SharedTable::Node::Field &field = pNode->fields[fieldIndex];
+        lua_pushlstring(pLuaState, field.first.data(), field.first.size());
+        pushEntry(pLuaState, pView, field.second);
+        return 2;
+    }
+
+    // End of iteration
+    return 0;
+}
+
+static int sharedTableGc(lua_State *pLuaState)
+{
+    SharedTableView *pView = checkView(pLuaState);
+    pView->~SharedTableView();
+    return 0;
+}
+
+
+/*
+ *  class SharedTable
+ */
+
+SharedTable::SharedTable()
+    : m_root()
+{
+}
+
+SharedTable::SharedTable(const Variant &data)
+    : m_root(std::make_shared<const Node>(data))
+{
+}
+
+void SharedTable::push(lua_State *pLuaState) const
+{
+    if (m_root) {
+        pushView(pLuaState, m_root, m_root.get());
+    } else {
+        lua_pushnil(pLuaState);
+    }
+}
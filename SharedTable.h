@@ -0,0 +1,45 @@
+#ifndef SHAREDTABLE_H
+#define SHAREDTABLE_H
+
+#include <memory>
+#include "Variant.h"
+
+struct lua_State;
+
+/**
+ * @brief Immutable data table shared between Lua engines.
+ *
+ * The table is built once from a Variant and then can be exposed
+ * to any number of Lua engines (possibly running in different threads)
+ * as a read-only userdata view. Lua reads go straight to the shared
+ * memory, nothing gets copied into the Lua states.
+ */
+class SharedTable
+{
+public:
+
+    SharedTable();
+
+    /**
+     * Build shared table from a Variant list or map.
+     * @param data Table data. Nested lists and maps become nested tables.
+     */
+    explicit SharedTable(const Variant &data);
+
+    bool isValid() const { return m_root != 0; }
+
+    /**
+     * Push read-only view of the table onto Lua stack.
+     * @param pLuaState Lua state.
+     */
+    void push(lua_State *pLuaState) const;
+
+    /// Internal table node.
+    struct Node;
+
+private:
+
+    std::shared_ptr<const Node> m_root;    ///< Root node, owns all the nested nodes.
+};
+
+#endif // SHAREDTABLE_H
@@ -0,0 +1,979 @@
+#include "LuaCompat.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <new>
+#include <type_traits>
+#include "TypedArray.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/// Name of the typed array view metatable in Lua registry.
+const static char *cTypedArrayMetatable = "cxLua.TypedArray";
+
+/// Alignment of owned buffers (cache line).
+const static size_t cAlignment = 64;
+
+struct TypedArray::Buffer
+{
+    ElementType type;
+    size_t size;
+    void *pData;
+    bool owned;                     ///< Whether the data has been allocated by the buffer.
+    std::shared_ptr<void> owner;    ///< Owner of wrapped memory, if any.
+
+    Buffer()
+        : type(Element_Float64),
+          size(0),
+          pData(0),
+          owned(false),
+          owner()
+    {
+    }
+
+    ~Buffer()
+    {
+        if (owned) {
+            ::operator delete(pData, std::align_val_t(cAlignment));
+        }
+    }
+
+    /// Allocate zero-filled buffer, returns null if out of memory.
+    static std::shared_ptr<Buffer> allocate(ElementType type, size_t size);
+};
+
+std::shared_ptr<TypedArray::Buffer> TypedArray::Buffer::allocate(ElementType type, size_t size)
+{
+    size_t elemSize = TypedArray::elementSize(type);
+    if (size > SIZE_MAX / elemSize) {
+        return std::shared_ptr<Buffer>();
+    }
+
+    size_t bytes = size * elemSize;
+    void *pData = 0;
+    if (bytes > 0) {
+        pData = ::operator new(bytes, std::align_val_t(cAlignment), std::nothrow);
+        if (pData == 0) {
+            return std::shared_ptr<Buffer>();
+        }
+        memset(pData, 0, bytes);
+    }
+
+    Buffer *pBuffer = new (std::nothrow) Buffer();
+    if (pBuffer == 0) {
+        ::operator delete(pData, std::align_val_t(cAlignment));
+        return std::shared_ptr<Buffer>();
+    }
+    pBuffer->type = type;
+    pBuffer->size = size;
+    pBuffer->pData = pData;
+    pBuffer->owned = true;
+
+    return std::shared_ptr<Buffer>(pBuffer);
+}
+
+/**
+ * Call visitor with a value of the C++ element type,
+ * so that generic lambdas can deduce it.
+ */
+template <typename Visitor>
+static void visitType(TypedArray::ElementType type, Visitor &&visitor)
+{
+    switch (type) {
+    case TypedArray::Element_Float32:
+        visitor(float());
+        break;
+    case TypedArray::Element_Float64:
+        visitor(double());
+        break;
+    case TypedArray::Element_Int32:
+        visitor(int32_t());
+        break;
+    case TypedArray::Element_Int64:
+        visitor(int64_t());
+        break;
+    }
+}
+
+
+/*
+ *  Kernels
+ *
+ *  Generic scalar templates are overloaded by SSE2 versions for the
+ *  types SSE2 handles well. Integer arithmetic wraps around. Reductions
+ *  of 32-bit floats are accumulated in double precision.
+ */
+
+/// Type of sums and dot products.
+template <typename T>
+using Accumulator = typename std::conditional<std::is_integral<T>::value, long long, double>::type;
+
+template <typename T>
+static inline T wrapAdd(T a, T b)
+{
+    if constexpr (std::is_integral<T>::value) {
+        typedef typename std::make_unsigned<T>::type U;
+        return static_cast<T>(static_cast<U>(a) + static_cast<U>(b));
+    } else {
+        return a + b;
+    }
+}
+
+template <typename T>
+static inline T wrapMul(T a, T b)
+{
+    if constexpr (std::is_integral<T>::value) {
+        typedef typename std::make_unsigned<T>::type U;
+        return static_cast<T>(static_cast<U>(a) * static_cast<U>(b));
+    } else {
+        return a * b;
+    }
+}
+
+template <typename T>
+static Accumulator<T> sumKernel(const T *p, size_t n)
+{
+    Accumulator<T> res = 0;
+    for (size_t i = 0; i < n; i++) {
+        res = wrapAdd<Accumulator<T>>(res, p[i]);
+    }
+    return res;
+}
+
+template <typename T>
+static Accumulator<T> dotKernel(const T *a, const T *b, size_t n)
+{
+    Accumulator<T> res = 0;
+    for (size_t i = 0; i < n; i++) {
+        res = wrapAdd<Accumulator<T>>(res, wrapMul<Accumulator<T>>(a[i], b[i]));
+    }
+    return res;
+}
+
+template <typename T>
+static void scaleKernel(T *p, size_t n, Accumulator<T> factor)
+{
+    for (size_t i = 0; i < n; i++) {
+        p[i] = static_cast<T>(wrapMul<Accumulator<T>>(p[i], factor));
+    }
+}
+
+template <typename T>
+static void addKernel(T *dst, const T *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = wrapAdd<T>(dst[i], src[i]);
+    }
+}
+
+/// Minimum (or maximum), n must not be 0.
+template <bool Max, typename T>
+static T extremumKernel(const T *p, size_t n)
+{
+    T res = p[0];
+    for (size_t i = 1; i < n; i++) {
+        if (Max ? p[i] > res : p[i] < res) {
+            res = p[i];
+        }
+    }
+    return res;
+}
+
+/// Inclusive prefix sums in place. The data dependency makes it scalar.
+template <typename T>
+static void prefixSumKernel(T *p, size_t n)
+{
+    Accumulator<T> acc = 0;
+    for (size_t i = 0; i < n; i++) {
+        acc = wrapAdd<Accumulator<T>>(acc, p[i]);
+        p[i] = static_cast<T>(acc);
+    }
+}
+
+/**
+ * Gather elements by 1-based indices.
+ * @return false if an index is out of range.
+ */
+template <typename T, typename I>
+static bool gatherKernel(const T *src, size_t n, const I *indices, size_t count, T *dst)
+{
+    for (size_t k = 0; k < count; k++) {
+        unsigned long long index = static_cast<unsigned long long>(indices[k]) - 1;
+        if (index >= n) {
+            return false;
+        }
+        dst[k] = src[index];
+    }
+    return true;
+}
+
+#ifdef __SSE2__
+
+static inline double horizontalSum(__m128d v)
+{
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+static double sumKernel(const float *p, size_t n)
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(p + i);
+        acc0 = _mm_add_pd(acc0, _mm_cvtps_pd(v));
+        acc1 = _mm_add_pd(acc1, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    }
+    double res = horizontalSum(_mm_add_pd(acc0, acc1));
+    for (; i < n; i++) {
+        res += p[i];
+    }
+    return res;
+}
+
+static double sumKernel(const double *p, size_t n)
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(p + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(p + i + 2));
+    }
+    double res = horizontalSum(_mm_add_pd(acc0, acc1));
+    for (; i < n; i++) {
+        res += p[i];
+    }
+    return res;
+}
+
+static double dotKernel(const float *a, const float *b, size_t n)
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 va = _mm_loadu_ps(a + i);
+        __m128 vb = _mm_loadu_ps(b + i);
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_cvtps_pd(va), _mm_cvtps_pd(vb)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(va, va)),
+                                           _mm_cvtps_pd(_mm_movehl_ps(vb, vb))));
+    }
+    double res = horizontalSum(_mm_add_pd(acc0, acc1));
+    for (; i < n; i++) {
+        res += static_cast<double>(a[i]) * b[i];
+    }
+    return res;
+}
+
+static double dotKernel(const double *a, const double *b, size_t n)
+{
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2), _mm_loadu_pd(b + i + 2)));
+    }
+    double res = horizontalSum(_mm_add_pd(acc0, acc1));
+    for (; i < n; i++) {
+        res += a[i] * b[i];
+    }
+    return res;
+}
+
+static void scaleKernel(float *p, size_t n, double factor)
+{
+    // Multiplied in double precision, same as the scalar tail
+    __m128d f = _mm_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v = _mm_loadu_ps(p + i);
+        __m128 lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(v), f));
+        __m128 hi = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(v, v)), f));
+        _mm_storeu_ps(p + i, _mm_movelh_ps(lo, hi));
+    }
+    for (; i < n; i++) {
+        p[i] = static_cast<float>(p[i] * factor);
+    }
+}
+
+static void scaleKernel(double *p, size_t n, double factor)
+{
+    __m128d f = _mm_set1_pd(factor);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(p + i, _mm_mul_pd(_mm_loadu_pd(p + i), f));
+    }
+    for (; i < n; i++) {
+        p[i] *= factor;
+    }
+}
+
+static void addKernel(float *dst, const float *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i), _mm_loadu_ps(src + i)));
+    }
+    for (; i < n; i++) {
+        dst[i] += src[i];
+    }
+}
+
+static void addKernel(double *dst, const double *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        _mm_storeu_pd(dst + i, _mm_add_pd(_mm_loadu_pd(dst + i), _mm_loadu_pd(src + i)));
+    }
+    for (; i < n; i++) {
+        dst[i] += src[i];
+    }
+}
+
+static void addKernel(int32_t *dst, const int32_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_add_epi32(a, b));
+    }
+    for (; i < n; i++) {
+        dst[i] = wrapAdd<int32_t>(dst[i], src[i]);
+    }
+}
+
+static void addKernel(int64_t *dst, const int64_t *src, size_t n)
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_add_epi64(a, b));
+    }
+    for (; i < n; i++) {
+        dst[i] = wrapAdd<int64_t>(dst[i], src[i]);
+    }
+}
+
+template <bool Max>
+static float extremumKernel(const float *p, size_t n)
+{
+    size_t i = 1;
+    float res = p[0];
+    if (n >= 4) {
+        __m128 acc = _mm_loadu_ps(p);
+        for (i = 4; i + 4 <= n; i += 4) {
+            __m128 v = _mm_loadu_ps(p + i);
+            acc = Max ? _mm_max_ps(acc, v) : _mm_min_ps(acc, v);
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, acc);
+        res = extremumKernel<Max, float>(lanes, 4);
+    }
+    for (; i < n; i++) {
+        if (Max ? p[i] > res : p[i] < res) {
+            res = p[i];
+        }
+    }
+    return res;
+}
+
+template <bool Max>
+static double extremumKernel(const double *p, size_t n)
+{
+    size_t i = 1;
+    double res = p[0];
+    if (n >= 2) {
+        __m128d acc = _mm_loadu_pd(p);
+        for (i = 2; i + 2 <= n; i += 2) {
+            __m128d v = _mm_loadu_pd(p + i);
+            acc = Max ? _mm_max_pd(acc, v) : _mm_min_pd(acc, v);
+        }
+        double lanes[2];
+        _mm_storeu_pd(lanes, acc);
+        res = extremumKernel<Max, double>(lanes, 2);
+    }
+    for (; i < n; i++) {
+        if (Max ? p[i] > res : p[i] < res) {
+            res = p[i];
+        }
+    }
+    return res;
+}
+
+#endif // __SSE2__
+
+
+/*
+ *  Lua bindings
+ */
+
+/**
+ * Lua userdata viewing a typed array.
+ * Keeps the buffer alive.
+ */
+struct TypedArrayView
+{
+    std::shared_ptr<TypedArray::Buffer> buffer;
+};
+
+static int typedArrayIndex(lua_State *pLuaState);
+static int typedArrayNewIndex(lua_State *pLuaState);
+static int typedArrayLength(lua_State *pLuaState);
+static int typedArrayToString(lua_State *pLuaState);
+static int typedArrayGc(lua_State *pLuaState);
+
+static int arrayNew(lua_State *pLuaState);
+static int arrayCopy(lua_State *pLuaState);
+static int arraySum(lua_State *pLuaState);
+static int arrayDot(lua_State *pLuaState);
+static int arrayScale(lua_State *pLuaState);
+static int arrayAdd(lua_State *pLuaState);
+static int arrayMin(lua_State *pLuaState);
+static int arrayMax(lua_State *pLuaState);
+static int arrayPrefixSum(lua_State *pLuaState);
+static int arrayGather(lua_State *pLuaState);
+static int arrayToTable(lua_State *pLuaState);
+static int arrayType(lua_State *pLuaState);
+
+/// Functions available both as array methods and in the library table.
+static const luaL_Reg cArrayMethods[] = {
+    { "copy",       arrayCopy },
+    { "sum",        arraySum },
+    { "dot",        arrayDot },
+    { "scale",      arrayScale },
+    { "add",        arrayAdd },
+    { "min",        arrayMin },
+    { "max",        arrayMax },
+    { "prefixSum",  arrayPrefixSum },
+    { "gather",     arrayGather },
+    { "toTable",    arrayToTable },
+    { "type",       arrayType },
+    { 0, 0 }
+};
+
+static void pushView(lua_State *pLuaState, const std::shared_ptr<TypedArray::Buffer> &buffer)
+{
+    void *ptr = lua_newuserdata(pLuaState, sizeof(TypedArrayView));
+    TypedArrayView *pView = new (ptr) TypedArrayView();
+    pView->buffer = buffer;
+
+    if (luaL_newmetatable(pLuaState, cTypedArrayMetatable)) {
+        // Methods table is the __index upvalue
+        lua_newtable(pLuaState);
+        luaL_setfuncs(pLuaState, cArrayMethods, 0);
+        lua_pushcclosure(pLuaState, typedArrayIndex, 1);
+        lua_setfield(pLuaState, -2, "__index");
+
+        static const luaL_Reg metamethods[] = {
+            { "__newindex", typedArrayNewIndex },
+            { "__len",      typedArrayLength },
+            { "__tostring", typedArrayToString },
+            { "__gc",       typedArrayGc },
+            { 0, 0 }
+        };
+        luaL_setfuncs(pLuaState, metamethods, 0);
+
+        // Protect the metatable from scripts
+        lua_pushboolean(pLuaState, 0);
+        lua_setfield(pLuaState, -2, "__metatable");
+    }
+    lua_setmetatable(pLuaState, -2);
+}
+
+static TypedArray::Buffer* checkArray(lua_State *pLuaState, int index)
+{
+    TypedArrayView *pView = static_cast<TypedArrayView*>(luaL_checkudata(pLuaState, index, cTypedArrayMetatable));
+    return pView->buffer.get();
+}
+
+/// Allocate array and push its view, raises Lua error if out of memory.
+static TypedArray::Buffer* newArray(lua_State *pLuaState, TypedArray::ElementType type, size_t size)
+{
+    TypedArray::Buffer *pBuffer = 0;
+    {
+        std::shared_ptr<TypedArray::Buffer> buffer = TypedArray::Buffer::allocate(type, size);
+        if (buffer) {
+            pushView(pLuaState, buffer);
+            pBuffer = buffer.get();
+        }
+    }
+    if (pBuffer == 0) {
+        luaL_error(pLuaState, "not enough memory for array of %d elements", static_cast<int>(size));
+    }
+    return pBuffer;
+}
+
+/// Check that two arrays can be combined element-wise.
+static void checkCompatible(lua_State *pLuaState, const TypedArray::Buffer *a, const TypedArray::Buffer *b)
+{
+    if (a->type != b->type) {
+        luaL_error(pLuaState, "array types mismatch (%s and %s)",
+                   TypedArray::typeName(a->type), TypedArray::typeName(b->type));
+    }
+    if (a->size != b->size) {
+        luaL_error(pLuaState, "array sizes mismatch (%d and %d)",
+                   static_cast<int>(a->size), static_cast<int>(b->size));
+    }
+}
+
+template <typename T>
+static inline void pushNumber(lua_State *pLuaState, T value)
+{
+    if constexpr (std::is_integral<T>::value) {
+        lua_pushinteger(pLuaState, static_cast<lua_Integer>(value));
+    } else {
+        lua_pushnumber(pLuaState, static_cast<lua_Number>(value));
+    }
+}
+
+template <typename T>
+static inline T checkNumber(lua_State *pLuaState, int index)
+{
+    if constexpr (std::is_integral<T>::value) {
+        int isNumber = 0;
+        lua_Integer value = lua_tointegerx(pLuaState, index, &isNumber);
+        if (!isNumber) {
+            luaL_argerror(pLuaState, index, "integer expected");
+        }
+        return static_cast<T>(value);
+    } else {
+        return static_cast<T>(luaL_checknumber(pLuaState, index));
+    }
+}
+
+/// Convert key at given stack index to a 0-based index, returns false if not an integer.
+static bool elementIndex(lua_State *pLuaState, int index, size_t &res)
+{
+    if (lua_type(pLuaState, index) != LUA_TNUMBER) {
+        return false;
+    }
+    int isNumber = 0;
+    lua_Integer key = lua_tointegerx(pLuaState, index, &isNumber);
+    if (!isNumber) {
+        return false;
+    }
+    res = static_cast<size_t>(key - 1);
+    return true;
+}
+
+static int typedArrayIndex(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pBuffer = checkArray(pLuaState, 1);
+
+    size_t index = 0;
+    if (elementIndex(pLuaState, 2, index)) {
+        if (index < pBuffer->size) {
+            visitType(pBuffer->type, [&](auto tag) {
+                typedef decltype(tag) T;
+                pushNumber(pLuaState, static_cast<const T*>(pBuffer->pData)[index]);
+            });
+        } else {
+            lua_pushnil(pLuaState);
+        }
+        return 1;
+    }
+
+    lua_pushvalue(pLuaState, 2);
+    lua_rawget(pLuaState, lua_upvalueindex(1));
+    return 1;
+}
+
+static int typedArrayNewIndex(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pBuffer = checkArray(pLuaState, 1);
+
+    size_t index = 0;
+    if (!elementIndex(pLuaState, 2, index) || index >= pBuffer->size) {
+        return luaL_error(pLuaState, "array index out of range");
+    }
+
+    visitType(pBuffer->type, [&](auto tag) {
+        typedef decltype(tag) T;
+        static_cast<T*>(pBuffer->pData)[index] = checkNumber<T>(pLuaState, 3);
+    });
+    return 0;
+}
+
+static int typedArrayLength(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pBuffer = checkArray(pLuaState, 1);
+    lua_pushinteger(pLuaState, static_cast<lua_Integer>(pBuffer->size));
+    return 1;
+}
+
+static int typedArrayToString(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pBuffer = checkArray(pLuaState, 1);
+    char str[64];
+    snprintf(str, sizeof(str), "array<%s>(%zu)", TypedArray::typeName(pBuffer->type), pBuffer->size);
+    lua_pushstring(pLuaState, str);
+    return 1;
+}
+
+static int typedArrayGc(lua_State *pLuaState)
+{
+    TypedArrayView *pView = static_cast<TypedArrayView*>(luaL_checkudata(pLuaState, 1, cTypedArrayMetatable));
+    pView->~TypedArrayView();
+    return 0;
+}
+
+/**
+ * array.new(type, size) or array.new(type, table)
+ */
+static int arrayNew(lua_State *pLuaState)
+{
+    const char *typeName = luaL_checkstring(pLuaState, 1);
+    TypedArray::ElementType type = TypedArray::Element_Float64;
+    int t = 0;
+    for (; t <= TypedArray::Element_Int64; t++) {
+        if (strcmp(typeName, TypedArray::typeName(static_cast<TypedArray::ElementType>(t))) == 0) {
+            type = static_cast<TypedArray::ElementType>(t);
+            break;
+        }
+    }
+    if (t > TypedArray::Element_Int64) {
+        return luaL_argerror(pLuaState, 1, "unknown array type");
+    }
+
+    if (lua_type(pLuaState, 2) == LUA_TTABLE) {
+        size_t size = lua_rawlen(pLuaState, 2);
+        TypedArray::Buffer *pBuffer = newArray(pLuaState, type, size);
+        visitType(type, [&](auto tag) {
+            typedef decltype(tag) T;
+            T *p = static_cast<T*>(pBuffer->pData);
+            for (size_t i = 0; i < size; i++) {
+                lua_rawgeti(pLuaState, 2, static_cast<lua_Integer>(i + 1));
+                p[i] = checkNumber<T>(pLuaState, -1);
+                lua_pop(pLuaState, 1);
+            }
+        });
+        return 1;
+    }
+
+    lua_Integer size = luaL_checkinteger(pLuaState, 2);
+    if (size < 0) {
+        return luaL_argerror(pLuaState, 2, "negative array size");
+    }
+    newArray(pLuaState, type, static_cast<size_t>(size));
+    return 1;
+}
+
+static int arrayCopy(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pSource = checkArray(pLuaState, 1);
+    TypedArray::Buffer *pBuffer = newArray(pLuaState, pSource->type, pSource->size);
+    if (pSource->size > 0) {
+        memcpy(pBuffer->pData, pSource->pData, pSource->size * TypedArray::elementSize(pSource->type));
+    }
+    return 1;
+}
+
+static int arraySum(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pBuffer = checkArray(pLuaState, 1);
+    visitType(pBuffer->type, [&](auto tag) {
+        typedef decltype(tag) T;
+        pushNumber(pLuaState, sumKernel(static_cast<const T*>(pBuffer->pData), pBuffer->size));
+    });
+    return 1;
+}
+
+static int arrayDot(lua_State *pLuaState)
+{
+    TypedArray::Buffer *a = checkArray(pLuaState, 1);
+    TypedArray::Buffer *b = checkArray(pLuaState, 2);
+    checkCompatible(pLuaState, a, b);
+    visitType(a->type, [&](auto tag) {
+        typedef decltype(tag) T;
+        pushNumber(pLuaState, dotKernel(static_cast<const T*>(a->pData),
+                                        static_cast<const T*>(b->pData), a->size));
+    });
+    return 1;
+}
+
+/**
+ * Multiply elements in place, integer arrays take integer factors only.
+ * Returns the array.
+ */
+static int arrayScale(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pBuffer = checkArray(pLuaState, 1);
+    visitType(pBuffer->type, [&](auto tag) {
+        typedef decltype(tag) T;
+        Accumulator<T> factor = checkNumber<Accumulator<T>>(pLuaState, 2);
+        scaleKernel(static_cast<T*>(pBuffer->pData), pBuffer->size, factor);
+    });
+    lua_settop(pLuaState, 1);
+    return 1;
+}
+
+/**
+ * Add second array to the first one in place, returns the first one.
+ */
+static int arrayAdd(lua_State *pLuaState)
+{
+    TypedArray::Buffer *a = checkArray(pLuaState, 1);
+    TypedArray::Buffer *b = checkArray(pLuaState, 2);
+    checkCompatible(pLuaState, a, b);
+    visitType(a->type, [&](auto tag) {
+        typedef decltype(tag) T;
+        addKernel(static_cast<T*>(a->pData), static_cast<const T*>(b->pData), a->size);
+    });
+    lua_settop(pLuaState, 1);
+    return 1;
+}
+
+template <bool Max>
+static int arrayExtremum(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pBuffer = checkArray(pLuaState, 1);
+    if (pBuffer->size == 0) {
+        lua_pushnil(pLuaState);
+        return 1;
+    }
+    visitType(pBuffer->type, [&](auto tag) {
+        typedef decltype(tag) T;
+        pushNumber(pLuaState, extremumKernel<Max>(static_cast<const T*>(pBuffer->pData), pBuffer->size));
+    });
+    return 1;
+}
+
+static int arrayMin(lua_State *pLuaState)
+{
+    return arrayExtremum<false>(pLuaState);
+}
+
+static int arrayMax(lua_State *pLuaState)
+{
+    return arrayExtremum<true>(pLuaState);
+}
+
+/**
+ * Inclusive prefix sums in place, returns the array.
+ */
+static int arrayPrefixSum(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pBuffer = checkArray(pLuaState, 1);
+    visitType(pBuffer->type, [&](auto tag) {
+        typedef decltype(tag) T;
+        prefixSumKernel(static_cast<T*>(pBuffer->pData), pBuffer->size);
+    });
+    lua_settop(pLuaState, 1);
+    return 1;
+}
+
+/**
+ * array.gather(a, indices) returns new array of a[indices[k]].
+ * Indices (1-based) are given by an integer array or a Lua table.
+ */
+static int arrayGather(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pSource = checkArray(pLuaState, 1);
+
+    if (lua_type(pLuaState, 2) == LUA_TTABLE) {
+        size_t count = lua_rawlen(pLuaState, 2);
+        TypedArray::Buffer *pBuffer = newArray(pLuaState, pSource->type, count);
+        visitType(pSource->type, [&](auto tag) {
+            typedef decltype(tag) T;
+            const T *src = static_cast<const T*>(pSource->pData);
+            T *dst = static_cast<T*>(pBuffer->pData);
+            for (size_t k = 0; k < count; k++) {
+                lua_rawgeti(pLuaState, 2, static_cast<lua_Integer>(k + 1));
+                size_t index = 0;
+                if (!elementIndex(pLuaState, -1, index) || index >= pSource->size) {
+                    luaL_error(pLuaState, "gather index %d out of range", static_cast<int>(k + 1));
+                }
+                dst[k] = src[index];
+                lua_pop(pLuaState, 1);
+            }
+        });
+        return 1;
+    }
+
+    TypedArray::Buffer *pIndices = checkArray(pLuaState, 2);
+    if (pIndices->type != TypedArray::Element_Int32 && pIndices->type != TypedArray::Element_Int64) {
+        return luaL_argerror(pLuaState, 2, "integer array expected");
+    }
+
+    TypedArray::Buffer *pBuffer = newArray(pLuaState, pSource->type, pIndices->size);
+    bool ok = true;
+    visitType(pSource->type, [&](auto tag) {
+        typedef decltype(tag) T;
+        const T *src = static_cast<const T*>(pSource->pData);
+        T *dst = static_cast<T*>(pBuffer->pData);
+        if (pIndices->type == TypedArray::Element_Int32) {
+            ok = gatherKernel(src, pSource->size, static_cast<const int32_t*>(pIndices->pData), pIndices->size, dst);
+        } else {
+            ok = gatherKernel(src, pSource->size, static_cast<const int64_t*>(pIndices->pData), pIndices->size, dst);
+        }
+    });
+    if (!ok) {
+        return luaL_error(pLuaState, "gather index out of range");
+    }
+    return 1;
+}
+
+static int arrayToTable(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pBuffer = checkArray(pLuaState, 1);
+    lua_createtable(pLuaState, static_cast<int>(pBuffer->size), 0);
+    visitType(pBuffer->type, [&](auto tag) {
+        typedef decltype(tag) T;
+        const T *p = static_cast<const T*>(pBuffer->pData);
+        for (size_t i = 0; i < pBuffer->size; i++) {
+            pushNumber(pLuaState, p[i]);
+            lua_rawseti(pLuaState, -2, static_cast<lua_Integer>(i + 1));
+        }
+    });
+    return 1;
+}
+
+static int arrayType(lua_State *pLuaState)
+{
+    TypedArray::Buffer *pBuffer = checkArray(pLuaState, 1);
+    lua_pushstring(pLuaState, TypedArray::typeName(pBuffer->type));
+    return 1;
+}
+
+
+/*
+ *  class TypedArray
+ */
+
+TypedArray::TypedArray()
+    : m_buffer()
+{
+}
+
+TypedArray::TypedArray(ElementType type, size_t size)
+    : m_buffer(Buffer::allocate(type, size))
+{
+}
+
+TypedArray::TypedArray(ElementType type, void *pData, size_t size, const std::shared_ptr<void> &owner)
+    : m_buffer(std::make_shared<Buffer>())
+{
+    m_buffer->type = type;
+    m_buffer->size = size;
+    m_buffer->pData = pData;
+    m_buffer->owner = owner;
+}
+
+TypedArray::TypedArray(const std::shared_ptr<Buffer> &buffer)
+    : m_buffer(buffer)
+{
+}
+
+TypedArray::ElementType TypedArray::type() const
+{
+    return m_buffer ? m_buffer->type : Element_Float64;
+}
+
+size_t TypedArray::size() const
+{
+    return m_buffer ? m_buffer->size : 0;
+}
+
+void* TypedArray::data() const
+{
+    return m_buffer ? m_buffer->pData : 0;
+}
+
+double TypedArray::at(size_t index) const
+{
+    double res = 0.0;
+    if (m_buffer && index < m_buffer->size) {
+        visitType(m_buffer->type, [&](auto tag) {
+            typedef decltype(tag) T;
+            res = static_cast<double>(static_cast<const T*>(m_buffer->pData)[index]);
+        });
+    }
+    return res;
+}
+
+void TypedArray::setAt(size_t index, double value)
+{
+    if (m_buffer && index < m_buffer->size) {
+        visitType(m_buffer->type, [&](auto tag) {
+            typedef decltype(tag) T;
+            static_cast<T*>(m_buffer->pData)[index] = static_cast<T>(value);
+        });
+    }
+}
+
+TypedArray TypedArray::copy() const
+{
+    if (!m_buffer) {
+        return TypedArray();
+    }
+    TypedArray res(m_buffer->type, m_buffer->size);
+    if (res.isValid() && m_buffer->size > 0) {
+        memcpy(res.data(), m_buffer->pData, m_buffer->size * elementSize(m_buffer->type));
+    }
+    return res;
+}
+
+void TypedArray::push(lua_State *pLuaState) const
+{
+    if (m_buffer) {
+        pushView(pLuaState, m_buffer);
+    } else {
+        lua_pushnil(pLuaState);
+    }
+}
+
+TypedArray TypedArray::fromStack(lua_State *pLuaState, int index)
+{
+    void *ptr = lua_touserdata(pLuaState, index);
+    if (ptr == 0 || !lua_getmetatable(pLuaState, index)) {
+        return TypedArray();
+    }
+    luaL_getmetatable(pLuaState, cTypedArrayMetatable);
+    bool isArray = lua_rawequal(pLuaState, -1, -2) != 0;
+    lua_pop(pLuaState, 2);
+
+    return isArray ? TypedArray(static_cast<TypedArrayView*>(ptr)->buffer) : TypedArray();
+}
+
+void TypedArray::openLibrary(lua_State *pLuaState)
+{
+    lua_newtable(pLuaState);
+    luaL_setfuncs(pLuaState, cArrayMethods, 0);
+    lua_pushcfunction(pLuaState, arrayNew);
+    lua_setfield(pLuaState, -2, "new");
+}
+
+size_t TypedArray::elementSize(ElementType type)
+{
+    switch (type) {
+    case Element_Float32:
+    case Element_Int32:
+        return 4;
+    case Element_Float64:
+    case Element_Int64:
+        return 8;
+    }
+    return 8;
+}
+
+const char* TypedArray::typeName(ElementType type)
+{
+    switch (type) {
+    case Element_Float32:
+        return "f32";
+    case Element_Float64:
+        return "f64";
+    case Element_Int32:
+        return "i32";
+    case Element_Int64:
+        return "i64";
+    }
+    return "";
+}
@@ -0,0 +1,101 @@
+#ifndef TYPEDARRAY_H
+#define TYPEDARRAY_H
+
+#include <memory>
+#include <cstddef>
+
+struct lua_State;
+
+/**
+ * @brief Fixed-size numeric array exposed to Lua as userdata.
+ *
+ * Elements are stored contiguously as 32/64-bit floats or integers,
+ * either in a buffer owned by the array or in C++ memory wrapped
+ * without a copy. Copies of TypedArray, as well as the Lua views of it,
+ * share the same buffer.
+ *
+ * In Lua the array is indexed from 1 (a[i], #a) and has the methods of
+ * the array library (see openLibrary): sum, dot, scale, add, min, max,
+ * prefixSum, gather, copy, toTable and type. Bulk kernels are
+ * vectorized with SSE2 when available.
+ *
+ * The buffer is not synchronized: an array modified by a script
+ * must not be accessed concurrently by other threads or engines.
+ */
+class TypedArray
+{
+public:
+
+    enum ElementType {
+        Element_Float32 = 0,
+        Element_Float64,
+        Element_Int32,
+        Element_Int64
+    };
+
+    TypedArray();
+
+    /**
+     * Allocate zero-filled array.
+     * @param type Element type.
+     * @param size Number of elements.
+     */
+    TypedArray(ElementType type, size_t size);
+
+    /**
+     * Wrap existing memory, nothing is copied.
+     * @param type Element type.
+     * @param pData Elements, must stay valid as long as the array
+     *              (and any Lua view of it) exists, unless owner is given.
+     * @param size Number of elements.
+     * @param owner Optional owner of the memory, kept alive by the array.
+     */
+    TypedArray(ElementType type, void *pData, size_t size,
+               const std::shared_ptr<void> &owner = std::shared_ptr<void>());
+
+    bool isValid() const { return m_buffer != 0; }
+
+    ElementType type() const;
+    size_t size() const;
+    void* data() const;
+
+    /// Element converted to double, index is 0-based.
+    double at(size_t index) const;
+    void setAt(size_t index, double value);
+
+    /// Deep copy into an owned buffer.
+    TypedArray copy() const;
+
+    /**
+     * Push Lua view of the array onto the stack.
+     * @param pLuaState Lua state.
+     */
+    void push(lua_State *pLuaState) const;
+
+    /**
+     * Get array viewed by the Lua value at given stack index.
+     * @return Invalid array if the value is not a typed array.
+     */
+    static TypedArray fromStack(lua_State *pLuaState, int index);
+
+    /**
+     * Push array library table (array.new and the kernels) onto the stack.
+     */
+    static void openLibrary(lua_State *pLuaState);
+
+    static size_t elementSize(ElementType type);
+
+    /// Short type name used in Lua: "f32", "f64", "i32" or "i64".
+    static const char* typeName(ElementType type);
+
+    /// Internal shared buffer.
+    struct Buffer;
+
+private:
+
+    explicit TypedArray(const std::shared_ptr<Buffer> &buffer);
+
+    std::shared_ptr<Buffer> m_buffer;
+};
+
+#endif // TYPEDARRAY_H
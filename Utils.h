@@ -2,27 +2,83 @@
 #define UTILS_H_INCLUDED
 
 #include <string>
-#include <sstream>
+#include <charconv>
 
 std::string& rtrim(std::string &s, const char *t = 0);
 std::string& ltrim(std::string &s, const char *t = 0);
 std::string& trim(std::string &s, const char *t = 0);
 
+/// Buffer size sufficient for any number formatted by formatNumber().
+const size_t cMaxNumberLength = 32;
+
+/**
+ * Parse number from a character range.
+ * Parsing is locale-independent and does not allocate.
+ * Leading whitespace and '+' sign are skipped, parsing stops
+ * at the first character that does not belong to the number.
+ * @param first Beginning of the range.
+ * @param last End of the range.
+ * @param value Parsed value, unchanged on failure.
+ * @param pEnd Optional pointer to receive the end of the parsed number.
+ * @return true if the number has been parsed and fits the type.
+ */
+template <typename T>
+bool parseNumber(const char *first, const char *last, T &value, const char **pEnd = 0)
+{
+    while (first != last && (*first == ' ' || (*first >= '\t' && *first <= '\r'))) {
+        ++first;
+    }
+    if (first != last && *first == '+') {
+        ++first;
+    }
+
+    std::from_chars_result res = std::from_chars(first, last, value);
+    if (pEnd) {
+        *pEnd = res.ptr;
+    }
+    return res.ec == std::errc();
+}
+
+/**
+ * Format number into a buffer of at least cMaxNumberLength characters.
+ * Floating point numbers are formatted in the shortest form
+ * that round-trips. The result is not null-terminated.
+ * @return Number of characters written.
+ */
+template <typename T>
+size_t formatNumber(T number, char *buffer)
+{
+    std::to_chars_result res = std::to_chars(buffer, buffer + cMaxNumberLength, number);
+    return static_cast<size_t>(res.ptr - buffer);
+}
+
+/**
+ * Append formatted number to a string.
+ */
+template <typename T>
+void appendNumber(std::string &s, T number)
+{
+    char buffer[cMaxNumberLength];
+    s.append(buffer, formatNumber(number, buffer));
+}
+
 template <typename T>
 std::string numberToString(T number)
 {
-    std::ostringstream ss;
-    ss << number;
-    return ss.str();
+    char buffer[cMaxNumberLength];
+    return std::string(buffer, formatNumber(number, buffer));
 }
 
+/**
+ * Convert string to number.
+ * @param s String to be converted.
+ * @param def Value to be returned if the string does not start with a number.
+ */
 template <typename T>
-T stringToNumber(const std::string &s)
+T stringToNumber(const std::string &s, T def = T())
 {
-    std::istringstream ss(s);
-    T res;
-    ss >> res;
-    return res;
+    T res = def;
+    return parseNumber(s.data(), s.data() + s.size(), res) ? res : def;
 }
 
 #endif // UTILS_H_INCLUDED
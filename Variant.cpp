@@ -1,108 +1,276 @@
 #include <string.h>
-#include <sstream>
-#include <iomanip>
+#include <new>
+#include <atomic>
+#include <ostream>
+#include <functional>
+#include <algorithm>
 #include "Utils.h"
+#include "LuaFunction.h"
 #include "Variant.h"
 
+/**
+ * Reference counter shared by the heap payloads.
+ */
+struct PayloadBase
+{
+    std::atomic<int> refCount;
+    std::pmr::memory_resource *pResource;   ///< Arena memory resource, null for heap.
+    void (*destroy)(PayloadBase *pBase);    ///< Destroys the typed payload.
+
+    PayloadBase() : refCount(1), pResource(0), destroy(0) {}
+};
+
+/**
+ * Heap payload of string, list, array, map and function values.
+ * Copies of a Variant share the payload, it gets copied (detached)
+ * only when modified through a shared Variant.
+ */
+template <typename T>
+struct Payload : public PayloadBase
+{
+    T value;
+
+    Payload() : PayloadBase(), value() { destroy = destroyPayload; }
+    explicit Payload(const T &v) : PayloadBase(), value(v) { destroy = destroyPayload; }
+    explicit Payload(T &&v) : PayloadBase(), value(std::move(v)) { destroy = destroyPayload; }
+
+    static void destroyPayload(PayloadBase *pBase)
+    {
+        Payload<T> *pPayload = static_cast<Payload<T>*>(pBase);
+        std::pmr::memory_resource *pResource = pPayload->pResource;
+        if (pResource == 0) {
+            delete pPayload;
+        } else {
+            pPayload->~Payload<T>();
+            pResource->deallocate(pPayload, sizeof(Payload<T>), alignof(Payload<T>));
+        }
+    }
+};
+
+template <typename T>
+static inline T& payloadValue(void *ptr)
+{
+    return static_cast<Payload<T>*>(static_cast<PayloadBase*>(ptr))->value;
+}
+
+template <typename T>
+static inline void* newPayload(const T &value)
+{
+    return static_cast<PayloadBase*>(new Payload<T>(value));
+}
+
+template <typename T>
+static inline void* newPayload(T &&value)
+{
+    return static_cast<PayloadBase*>(new Payload<T>(std::move(value)));
+}
+
+/// Allocate payload from the memory resource (heap if null).
+template <typename T>
+static inline void* newPayload(T &&value, std::pmr::memory_resource *pResource)
+{
+    if (pResource == 0) {
+        return newPayload<T>(std::move(value));
+    }
+    void *mem = pResource->allocate(sizeof(Payload<T>), alignof(Payload<T>));
+    Payload<T> *pPayload = new (mem) Payload<T>(std::move(value));
+    pPayload->pResource = pResource;
+    return static_cast<PayloadBase*>(pPayload);
+}
+
+static inline void retainPayload(void *ptr)
+{
+    static_cast<PayloadBase*>(ptr)->refCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+static inline void releasePayload(void *ptr)
+{
+    PayloadBase *pBase = static_cast<PayloadBase*>(ptr);
+    if (pBase->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        pBase->destroy(pBase);
+    }
+}
+
+static inline bool isSharedPayload(void *ptr)
+{
+    return static_cast<PayloadBase*>(ptr)->refCount.load(std::memory_order_acquire) > 1;
+}
+
+/// Make sure the payload is not shared, returns the (possibly new) payload.
+template <typename T>
+static inline void* detachPayload(void *ptr)
+{
+    if (!isSharedPayload(ptr)) {
+        return ptr;
+    }
+    void *copy = newPayload<T>(payloadValue<T>(ptr));
+    releasePayload(ptr);
+    return copy;
+}
+
+/// Assign value to payload, reusing it when not shared.
+template <typename T, typename V>
+static inline void* assignPayload(void *ptr, V &&value)
+{
+    if (isSharedPayload(ptr)) {
+        releasePayload(ptr);
+        return newPayload<T>(T(std::forward<V>(value)));
+    }
+    payloadValue<T>(ptr) = std::forward<V>(value);
+    return ptr;
+}
+
+/// Canonical quiet NaN, the only NaN stored in a Variant.
+const static uint64_t cCanonicalNaN = 0x7FF8000000000000ULL;
+
+static_assert(sizeof(void*) <= sizeof(uint64_t), "pointers must fit into 64 bits");
+
 
 Variant::Variant()
-    : m_type(Type_Invalid)
+    : m_bits(tagBits(Type_Invalid))
 {
-    m_data.ptr = 0;
 }
 
 Variant::Variant(Type type)
-    : m_type(type)
+    : m_bits(tagBits(type))
 {
-    m_data.ptr = 0;
     initializeType();
 }
 
 Variant::Variant(const Variant &variant)
-    : m_type(variant.m_type)
+    : m_bits(variant.m_bits)
 {
     initFrom(variant);
 }
 
+Variant::Variant(Variant &&variant) noexcept
+    : m_bits(variant.m_bits)
+{
+    variant.m_bits = tagBits(Type_Invalid);
+}
+
 Variant::Variant(bool value)
-    : m_type(Type_Boolean)
 {
-    m_data.b = value;
+    setBoolean(value);
 }
 
 Variant::Variant(int value)
-    : m_type(Type_Integer)
 {
-    m_data.i = value;
+    setInteger(value);
 }
 
 Variant::Variant(double value)
-    : m_type(Type_Real)
 {
-    m_data.r = value;
+    setReal(value);
 }
 
 Variant::Variant(const char *pValue)
-    : m_type(Type_String)
 {
-    m_data.ptr = new std::string(pValue);
+    setPointer(Type_String, newPayload(std::string(pValue)));
 }
 
 Variant::Variant(const std::string &value)
-    : m_type(Type_String)
 {
-    m_data.ptr = new std::string(value);
+    setPointer(Type_String, newPayload(value));
+}
+
+Variant::Variant(std::string &&value)
+{
+    setPointer(Type_String, newPayload(std::move(value)));
 }
 
 Variant::Variant(const VariantList &value)
-    : m_type(Type_List)
 {
-    m_data.ptr = new VariantList(value);
+    setPointer(Type_List, newPayload(value));
+}
+
+Variant::Variant(VariantList &&value)
+{
+    setPointer(Type_List, newPayload(std::move(value)));
 }
 
 Variant::Variant(const VariantMap &value)
-    : m_type(Type_Map)
 {
-    m_data.ptr = new VariantMap(value);
+    setPointer(Type_Map, newPayload(value));
+}
+
+Variant::Variant(VariantMap &&value)
+{
+    setPointer(Type_Map, newPayload(std::move(value)));
+}
+
+Variant::Variant(const VariantArray &value)
+{
+    setPointer(Type_Array, newPayload(value));
+}
+
+Variant::Variant(VariantArray &&value)
+{
+    setPointer(Type_Array, newPayload(std::move(value)));
+}
+
+Variant::Variant(const LuaFunction &value)
+{
+    setPointer(Type_Function, newPayload(value));
+}
+
+Variant::Variant(std::string &&value, VariantArena *pArena)
+{
+    setPointer(Type_String, newPayload<std::string>(std::move(value), pArena ? pArena->resource() : 0));
+}
+
+Variant::Variant(VariantList &&value, VariantArena *pArena)
+{
+    setPointer(Type_List, newPayload<VariantList>(std::move(value), pArena ? pArena->resource() : 0));
+}
+
+Variant::Variant(VariantMap &&value, VariantArena *pArena)
+{
+    setPointer(Type_Map, newPayload<VariantMap>(std::move(value), pArena ? pArena->resource() : 0));
+}
+
+Variant::Variant(VariantArray &&value, VariantArena *pArena)
+{
+    setPointer(Type_Array, newPayload<VariantArray>(std::move(value), pArena ? pArena->resource() : 0));
 }
 
 Variant& Variant::operator =(const Variant &variant)
 {
     if (this != &variant) {
-        clear();
-        m_type = variant.m_type;
-        initFrom(variant);
+        // The source may be owned by this variant, keep it alive
+        Variant copy(variant);
+        swap(copy);
     }
     return *this;
 }
 
-Variant& Variant::operator =(bool value)
+Variant& Variant::operator =(Variant &&variant) noexcept
 {
-    if (m_type != Type_Boolean) {
-        clear();
-        m_type = Type_Boolean;
+    if (this != &variant) {
+        Variant tmp(std::move(variant));
+        swap(tmp);
     }
-    m_data.b = value;
+    return *this;
+}
+
+Variant& Variant::operator =(bool value)
+{
+    clear();
+    setBoolean(value);
     return *this;
 }
 
 Variant& Variant::operator =(int value)
 {
-    if (m_type != Type_Integer) {
-        clear();
-        m_type = Type_Integer;
-    }
-    m_data.i = value;
+    clear();
+    setInteger(value);
     return *this;
 }
 
 Variant& Variant::operator =(double value)
 {
-    if (m_type != Type_Real) {
-        clear();
-        m_type = Type_Real;
-    }
-    m_data.r = value;
+    clear();
+    setReal(value);
     return *this;
 }
 
@@ -113,86 +281,226 @@ Variant& Variant::operator =(const char *pValue)
 
 Variant& Variant::operator =(const std::string &value)
 {
-    if (m_type != Type_String) {
+    if (type() != Type_String) {
         clear();
-        m_type = Type_String;
-        m_data.ptr = new std::string(value);
+        setPointer(Type_String, newPayload(value));
     } else {
-        std::string *pString = static_cast<std::string*>(m_data.ptr);
-        *pString = value;
+        setPointer(Type_String, assignPayload<std::string>(pointer(), value));
     }
     return *this;
 }
 
 Variant& Variant::operator =(const VariantList &value)
 {
-    if (m_type != Type_List) {
+    if (type() != Type_List) {
         clear();
-        m_type = Type_List;
-        m_data.ptr = new VariantList(value);
+        setPointer(Type_List, newPayload(value));
     } else {
-        VariantList *pList = static_cast<VariantList*>(m_data.ptr);
-        *pList = value;
+        setPointer(Type_List, assignPayload<VariantList>(pointer(), value));
     }
     return *this;
 }
 
 Variant& Variant::operator =(const VariantMap &value)
 {
-    if (m_type != Type_Map) {
+    if (type() != Type_Map) {
+        clear();
+        setPointer(Type_Map, newPayload(value));
+    } else {
+        setPointer(Type_Map, assignPayload<VariantMap>(pointer(), value));
+    }
+    return *this;
+}
+
+Variant& Variant::operator =(const VariantArray &value)
+{
+    if (type() != Type_Array) {
+        clear();
+        setPointer(Type_Array, newPayload(value));
+    } else {
+        setPointer(Type_Array, assignPayload<VariantArray>(pointer(), value));
+    }
+    return *this;
+}
+
+Variant& Variant::operator =(const LuaFunction &value)
+{
+    if (type() != Type_Function) {
         clear();
-        m_type = Type_Map;
-        m_data.ptr = new VariantMap(value);
+        setPointer(Type_Function, newPayload(value));
     } else {
-        VariantMap *pMap = static_cast<VariantMap*>(m_data.ptr);
-        *pMap = value;
+        setPointer(Type_Function, assignPayload<LuaFunction>(pointer(), value));
     }
     return *this;
 }
 
 Variant::~Variant()
 {
-    clear();
+    if (hasPayload()) {
+        releasePayload(pointer());
+    }
 }
 
 void Variant::clear()
 {
-    switch (m_type) {
-    case Type_String: {
-        std::string *pStr = static_cast<std::string*>(m_data.ptr);
-        delete pStr;
-        break;
+    if (hasPayload()) {
+        releasePayload(pointer());
+    }
+    m_bits = tagBits(Type_Invalid);
+}
+
+void Variant::swap(Variant &variant)
+{
+    std::swap(m_bits, variant.m_bits);
+}
+
+bool Variant::isShared() const
+{
+    return hasPayload() && isSharedPayload(pointer());
+}
+
+/// Compare list or array elements.
+template <typename A, typename B>
+static bool equalElements(const A &a, const B &b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin());
+}
+
+/// Compare lists and arrays with each other.
+static bool equalSequences(const Variant &a, const Variant &b)
+{
+    if (a.type() == Variant::Type_List) {
+        return b.type() == Variant::Type_List ? equalElements(a.list(), b.list()) : equalElements(a.list(), b.array());
+    }
+    return b.type() == Variant::Type_List ? equalElements(a.array(), b.list()) : equalElements(a.array(), b.array());
+}
+
+bool Variant::operator ==(const Variant &variant) const
+{
+    Type t = type();
+    Type other = variant.type();
+    bool numeric = (t == Type_Integer || t == Type_Real)
+                && (other == Type_Integer || other == Type_Real);
+    if (numeric) {
+        return toReal() == variant.toReal();
+    }
+    if (isSequence() && variant.isSequence()) {
+        return m_bits == variant.m_bits || equalSequences(*this, variant);
+    }
+    if (t != other) {
+        return false;
+    }
+
+    switch (t) {
+    case Type_Boolean:
+        return boolean() == variant.boolean();
+    case Type_String:
+        return m_bits == variant.m_bits || string() == variant.string();
+    case Type_Map:
+        return m_bits == variant.m_bits || map() == variant.map();
+    case Type_Function:
+        return m_bits == variant.m_bits;
+    default:
+        // Invalid and null
+        return true;
+    }
+}
+
+/// Mix value into the hash seed.
+static inline size_t hashCombine(size_t seed, size_t value)
+{
+    return seed ^ (value + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+template <typename Sequence>
+static size_t hashSequence(size_t seed, const Sequence &sequence)
+{
+    for (typename Sequence::const_iterator it = sequence.begin(); it != sequence.end(); ++it) {
+        seed = hashCombine(seed, it->hash());
+    }
+    return seed;
+}
+
+size_t Variant::hash() const
+{
+    // Integers hash as reals and arrays as lists, to be consistent with the comparison
+    Type t = type();
+    size_t res = static_cast<size_t>(t == Type_Integer ? Type_Real : (t == Type_Array ? Type_List : t));
+
+    switch (t) {
+    case Type_Boolean:
+        return hashCombine(res, boolean() ? 1 : 0);
+    case Type_Integer:
+    case Type_Real: {
+        // -0.0 as 0
+        double value = toReal();
+        return hashCombine(res, value == 0.0 ? 0 : std::hash<double>()(value));
+    }
+    case Type_String:
+        return hashCombine(res, std::hash<std::string>()(string()));
+    case Type_List:
+        return hashSequence(res, list());
+    case Type_Array:
+        return hashSequence(res, array());
+    case Type_Map:
+        for (VariantMap::const_iterator it = map().begin(); it != map().end(); ++it) {
+            res = hashCombine(res, std::hash<std::string>()(it->first));
+            res = hashCombine(res, it->second.hash());
+        }
+        return res;
+    case Type_Function:
+        return hashCombine(res, std::hash<void*>()(pointer()));
+    default:
+        return res;
     }
+}
+
+Variant Variant::clone() const
+{
+    switch (type()) {
+    case Type_String:
+        return Variant(std::string(string()));
     case Type_List: {
-        VariantList *pList = static_cast<VariantList*>(m_data.ptr);
-        delete pList;
-        break;
+        VariantList list;
+        for (VariantList::const_iterator it = this->list().begin(); it != this->list().end(); ++it) {
+            list.push_back(it->clone());
+        }
+        return Variant(std::move(list));
+    }
+    case Type_Array: {
+        VariantArray array;
+        array.reserve(this->array().size());
+        for (VariantArray::const_iterator it = this->array().begin(); it != this->array().end(); ++it) {
+            array.push_back(it->clone());
+        }
+        return Variant(std::move(array));
     }
     case Type_Map: {
-        VariantMap *pMap = static_cast<VariantMap*>(m_data.ptr);
-        delete pMap;
-        break;
+        VariantMap map;
+        for (VariantMap::const_iterator it = this->map().begin(); it != this->map().end(); ++it) {
+            map.emplace(it->first, it->second.clone());
+        }
+        return Variant(std::move(map));
     }
+    case Type_Function:
+        return Variant(function());
     default:
-        break;
+        return *this;
     }
-
-    memset(&m_data, 0, sizeof(Data));
-    m_type = Type_Invalid;
 }
 
 bool Variant::toBoolean(bool def) const
 {
     bool res = def;
-    switch (m_type) {
+    switch (type()) {
     case Type_Boolean:
-        res = m_data.b;
+        res = boolean();
         break;
     case Type_Integer:
-        res = m_data.i != 0;
+        res = integer() != 0;
         break;
     case Type_String: {
-        std::string *pStr = static_cast<std::string*>(m_data.ptr);
+        const std::string *pStr = &string();
         res = (*pStr == "true");
         break;
     }
@@ -206,19 +514,19 @@ bool Variant::toBoolean(bool def) const
 int Variant::toInteger(int def) const
 {
     int res = def;
-    switch (m_type) {
+    switch (type()) {
     case Type_Boolean:
-        res = m_data.b ? 1 : 0;
+        res = boolean() ? 1 : 0;
         break;
     case Type_Integer:
-        res = m_data.i;
+        res = integer();
         break;
     case Type_Real:
-        res = static_cast<int>(m_data.r);
+        res = static_cast<int>(real());
         break;
     case Type_String: {
-        std::string *pStr = static_cast<std::string*>(m_data.ptr);
-        res = stringToNumber<int>(*pStr);
+        const std::string *pStr = &string();
+        res = stringToNumber<int>(*pStr, def);
         break;
     }
     default:
@@ -231,19 +539,19 @@ int Variant::toInteger(int def) const
 double Variant::toReal(double def) const
 {
     double res = def;
-    switch (m_type) {
+    switch (type()) {
     case Type_Boolean:
-        res = m_data.b ? 1.0 : 0.0;
+        res = boolean() ? 1.0 : 0.0;
         break;
     case Type_Integer:
-        res = static_cast<double>(m_data.i);
+        res = static_cast<double>(integer());
         break;
     case Type_Real:
-        res = m_data.r;
+        res = real();
         break;
     case Type_String: {
-        std::string *pStr = static_cast<std::string*>(m_data.ptr);
-        res = stringToNumber<double>(*pStr);
+        const std::string *pStr = &string();
+        res = stringToNumber<double>(*pStr, def);
         break;
     }
     default:
@@ -257,7 +565,7 @@ std::string Variant::toString(const std::string &def) const
 {
     std::string res(def);
 
-    switch (m_type) {
+    switch (type()) {
     case Type_Invalid:
     	res = "invalid";
     	break;
@@ -265,85 +573,142 @@ std::string Variant::toString(const std::string &def) const
     	res = "null";
     	break;
     case Type_Boolean:
-        res = m_data.b ? "true" : "false";
+        res = boolean() ? "true" : "false";
         break;
     case Type_Integer:
-        res = numberToString(m_data.i);
+        res = numberToString(integer());
         break;
     case Type_Real:
-        res = numberToString(m_data.r);
+        res = numberToString(real());
         break;
     case Type_String: {
-        std::string *pStr = static_cast<std::string*>(m_data.ptr);
+        const std::string *pStr = &string();
         res = *pStr;
         break;
     }
-    case Type_List: {
-        VariantList *pList = static_cast<VariantList*>(m_data.ptr);
-        res = "[";
+    case Type_List:
+    case Type_Array:
+    case Type_Map:
+        res.clear();
+        appendTo(res);
+        break;
+    case Type_Function:
+        res = "function";
+        break;
+    default:
+        break;
+    }
+
+    return res;
+}
+
+void Variant::appendTo(std::string &res) const
+{
+    auto appendSequence = [](std::string &res, const auto &sequence) {
+        res.push_back('[');
         bool first = true;
-        for (VariantList::const_iterator it = pList->begin(); it != pList->end(); ++it) {
+        for (auto it = sequence.begin(); it != sequence.end(); ++it) {
             if (!first) {
                 res.append(", ");
             } else {
                 first = false;
             }
-            res.append((*it).toString());
+            it->appendTo(res);
         }
-        res.append("]");
+        res.push_back(']');
+    };
+
+    switch (type()) {
+    case Type_Integer:
+        appendNumber(res, integer());
+        break;
+    case Type_Real:
+        appendNumber(res, real());
+        break;
+    case Type_String:
+        res.append(string());
+        break;
+    case Type_List:
+        appendSequence(res, list());
+        break;
+    case Type_Array:
+        appendSequence(res, array());
         break;
-    }
     case Type_Map: {
-        VariantMap *pMap = static_cast<VariantMap*>(m_data.ptr);
-        res = "{";
+        const VariantMap *pMap = &map();
+        res.push_back('{');
         VariantMap::const_iterator i = pMap->begin();
         while (i != pMap->end()) {
             res.append(i->first);
             res.append(": ");
-            res.append(i->second.toString());
+            i->second.appendTo(res);
             ++i;
             if (i != pMap->end()) {
                 res.append(", ");
             }
         }
-        res.append("}");
+        res.push_back('}');
         break;
     }
     default:
+        res.append(toString());
         break;
     }
-
-    return res;
 }
 
 std::string& Variant::string()
 {
-    return *static_cast<std::string*>(m_data.ptr);
+    setPointer(Type_String, detachPayload<std::string>(pointer()));
+    return payloadValue<std::string>(pointer());
 }
 
 const std::string& Variant::string() const
 {
-    return *static_cast<std::string*>(m_data.ptr);
+    return payloadValue<std::string>(pointer());
 }
 
 VariantList& Variant::list()
 {
-    return *static_cast<VariantList*>(m_data.ptr);
+    setPointer(Type_List, detachPayload<VariantList>(pointer()));
+    return payloadValue<VariantList>(pointer());
 }
 
 const VariantList& Variant::list() const
 {
-    return *static_cast<VariantList*>(m_data.ptr);
+    return payloadValue<VariantList>(pointer());
 }
 
 VariantMap& Variant::map()
 {
-    return *static_cast<VariantMap*>(m_data.ptr);
+    setPointer(Type_Map, detachPayload<VariantMap>(pointer()));
+    return payloadValue<VariantMap>(pointer());
 }
 
 const VariantMap& Variant::map() const
 {
-    return *static_cast<VariantMap*>(m_data.ptr);
+    return payloadValue<VariantMap>(pointer());
+}
+
+VariantArray& Variant::array()
+{
+    setPointer(Type_Array, detachPayload<VariantArray>(pointer()));
+    return payloadValue<VariantArray>(pointer());
+}
+
+const VariantArray& Variant::array() const
+{
+    return payloadValue<VariantArray>(pointer());
+}
+
+LuaFunction& Variant::function()
+{
+    setPointer(Type_Function, detachPayload<LuaFunction>(pointer()));
+    return payloadValue<LuaFunction>(pointer());
+}
+
+const LuaFunction& Variant::function() const
+{
+    return payloadValue<LuaFunction>(pointer());
 }
 
 std::ostream& operator <<(std::ostream &output, const Variant &variant)
@@ -351,17 +716,49 @@ std::ostream& operator <<(std::ostream &output, const Variant &variant)
     return output << variant.toString();
 }
 
+double Variant::real() const
+{
+    double value;
+    memcpy(&value, &m_bits, sizeof(value));
+    return value;
+}
+
+void Variant::setReal(double value)
+{
+    if (value != value) {
+        // Any NaN could collide with the tags
+        m_bits = cCanonicalNaN;
+    } else {
+        memcpy(&m_bits, &value, sizeof(value));
+    }
+}
+
 void Variant::initializeType()
 {
-    switch (m_type) {
+    switch (type()) {
+    case Type_Boolean:
+        setBoolean(false);
+        break;
+    case Type_Integer:
+        setInteger(0);
+        break;
+    case Type_Real:
+        setReal(0.0);
+        break;
     case Type_String:
-        m_data.ptr = new std::string();
+        setPointer(Type_String, newPayload(std::string()));
         break;
     case Type_List:
-        m_data.ptr = new VariantList();
+        setPointer(Type_List, newPayload(VariantList()));
         break;
     case Type_Map:
-        m_data.ptr = new VariantMap();
+        setPointer(Type_Map, newPayload(VariantMap()));
+        break;
+    case Type_Function:
+        setPointer(Type_Function, newPayload(LuaFunction()));
+        break;
+    case Type_Array:
+        setPointer(Type_Array, newPayload(VariantArray()));
         break;
     default:
         break;
@@ -370,24 +767,8 @@ void Variant::initializeType()
 
 void Variant::initFrom(const Variant &variant)
 {
-    switch (m_type) {
-    case Type_String: {
-        std::string *pStr = static_cast<std::string*>(variant.m_data.ptr);
-        m_data.ptr = new std::string(*pStr);
-        break;
-    }
-    case Type_List: {
-        VariantList *pList = static_cast<VariantList*>(variant.m_data.ptr);
-        m_data.ptr = new VariantList(*pList);
-        break;
-    }
-    case Type_Map: {
-        VariantMap *pMap = static_cast<VariantMap*>(variant.m_data.ptr);
-        m_data.ptr = new VariantMap(*pMap);
-        break;
-    }
-    default:
-        memcpy(&m_data, &variant.m_data, sizeof(Data));
-        break;
+    // The bits are copied, share the payload
+    if (variant.hasPayload()) {
+        retainPayload(pointer());
     }
 }
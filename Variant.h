@@ -4,15 +4,70 @@
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
+#include <cstdint>
+#include <memory_resource>
 
 class Variant;
+class LuaFunction;
 
 typedef std::list<Variant> VariantList;
 typedef std::map<std::string, Variant> VariantMap;
 
+/**
+ * Contiguous list storage: one allocation for all the elements
+ * (8 bytes each) instead of a node per element. Used for large lists,
+ * see LuaEngine::setArrayThreshold(), and for the lists of Variant trees
+ * allocated in a VariantArena (polymorphic allocator). Copies always
+ * allocate from the heap.
+ */
+typedef std::pmr::vector<Variant> VariantArray;
+
+/**
+ * @brief Monotonic memory arena for Variant trees.
+ *
+ * Variants built in the arena (see LuaEngine::popValue(VariantArena&))
+ * allocate their payloads from the arena memory, which is freed at once
+ * when the arena is released or destroyed. Lists are built as arrays
+ * (Type_Array) with the elements in the arena as well. Deallocation of
+ * individual payloads is a no-op.
+ *
+ * All Variants referring to arena memory, including their copies
+ * (which share payloads), must be destroyed before the arena is
+ * released. Use Variant::clone() to keep a value beyond that point.
+ * Character data of long strings and map nodes are still allocated
+ * on the heap (VariantMap is a std::map).
+ */
+class VariantArena
+{
+public:
+    explicit VariantArena(size_t initialSize = 16384) : m_resource(initialSize) {}
+
+    std::pmr::memory_resource* resource() { return &m_resource; }
+
+    /// Free all the arena memory at once.
+    void release() { m_resource.release(); }
+
+private:
+    VariantArena(const VariantArena&) = delete;
+    VariantArena& operator =(const VariantArena&) = delete;
+
+    std::pmr::monotonic_buffer_resource m_resource;
+};
+
 /**
  * @brief Anytype concept implementation.
  * The Variant class is a holder of any-type Lua value.
+ *
+ * Strings, lists, arrays, maps and functions are stored in reference
+ * counted payloads shared between copies, so copying a Variant is cheap.
+ * A shared payload is copied on the first mutable access
+ * (string(), list(), array(), map(), function()); references obtained
+ * earlier through another copy remain bound to the shared payload.
+ *
+ * A Variant is 8 bytes (NaN-boxing): reals are stored as they are,
+ * other values in the unused NaN space as a type tag and an inline
+ * boolean, integer or payload pointer.
  */
 class Variant
 {
@@ -27,21 +82,43 @@ public:
         Type_String  = 5,
         Type_List    = 6,
         Type_Map     = 7,
+        Type_Function = 8,
+        Type_Array   = 9,   ///< List with contiguous storage.
 
-        MaxTypes = Type_Map + 1
+        MaxTypes = Type_Array + 1
     };
 
+    /// Whether values of the type are stored in a shared payload.
+    static constexpr bool hasPayload(Type type) { return type >= Type_String; }
+
     Variant();
     Variant(Type type);
     Variant(const Variant &variant);
+    Variant(Variant &&variant) noexcept;
     Variant(bool value);
     Variant(int value);
     Variant(double value);
     Variant(const char *pValue);
     Variant(const std::string &value);
+    Variant(std::string &&value);
     Variant(const VariantList &value);
+    Variant(VariantList &&value);
     Variant(const VariantMap &value);
+    Variant(VariantMap &&value);
+    Variant(const VariantArray &value);
+    Variant(VariantArray &&value);
+    Variant(const LuaFunction &value);
+
+    /**
+     * Construct string, list or map value with payload allocated in the arena.
+     * Null arena means heap allocation.
+     */
+    Variant(std::string &&value, VariantArena *pArena);
+    Variant(VariantList &&value, VariantArena *pArena);
+    Variant(VariantMap &&value, VariantArena *pArena);
+    Variant(VariantArray &&value, VariantArena *pArena);
     Variant& operator =(const Variant &variant);
+    Variant& operator =(Variant &&variant) noexcept;
     Variant& operator =(bool value);
     Variant& operator =(int value);
     Variant& operator =(double value);
@@ -49,12 +126,44 @@ public:
     Variant& operator =(const std::string &value);
     Variant& operator =(const VariantList &value);
     Variant& operator =(const VariantMap &value);
+    Variant& operator =(const VariantArray &value);
+    Variant& operator =(const LuaFunction &value);
     ~Variant();
 
-    Type type() const { return m_type; }
-    bool isValid() const { return m_type != Type_Invalid; }
-    bool isNull() const { return m_type == Type_Null; }
+    Type type() const
+    {
+        return m_bits < cTaggedBits ? Type_Real : static_cast<Type>((m_bits >> cTagShift) - cTagBase);
+    }
+    bool isValid() const { return m_bits != tagBits(Type_Invalid); }
+    bool isNull() const { return m_bits == tagBits(Type_Null); }
+
+    /// Whether the value is a list or an array.
+    bool isSequence() const { Type t = type(); return t == Type_List || t == Type_Array; }
+
+    /// Whether the value holds the C++ type T (bool, int, double, std::string etc.)
+    template <typename T>
+    bool is() const;
     void clear();
+    void swap(Variant &variant);
+
+    /// Whether the payload is shared with other copies.
+    bool isShared() const;
+
+    /**
+     * Deep comparison. Integers and reals compare by numeric value,
+     * functions by identity (copies of the same function are equal).
+     */
+    bool operator ==(const Variant &variant) const;
+    bool operator !=(const Variant &variant) const { return !(*this == variant); }
+
+    /// Hash of the value, consistent with operator ==.
+    size_t hash() const;
+
+    /**
+     * Deep copy of the value that does not share any payload
+     * and is allocated on the heap (e.g. to outlive an arena).
+     */
+    Variant clone() const;
 
     bool toBoolean(bool def = false) const;
     int toInteger(int def = 0) const;
@@ -67,6 +176,10 @@ public:
     const VariantList& list() const;
     VariantMap& map();
     const VariantMap& map() const;
+    VariantArray& array();
+    const VariantArray& array() const;
+    LuaFunction& function();
+    const LuaFunction& function() const;
 
     friend std::ostream& operator <<(std::ostream &output, const Variant &variant);
 
@@ -75,14 +188,53 @@ private:
     void initializeType();
     void initFrom(const Variant &variant);
 
-    Type m_type;    ///< Value type.
-
-    union Data {
-        bool b;		///< Boolean value.
-        int i;		///< Integer value.
-        double r;	///< Real value.
-        void *ptr;	///< Pointer to object-based value (string, list, map)
-    } m_data;
+    /// Append string representation (see toString()) to the string.
+    void appendTo(std::string &res) const;
+
+    /*
+     * Values other than reals are tagged in the upper 16 bits with
+     * 0xFFF1 + type, which is above negative infinity (0xFFF0...) and only
+     * used by NaNs. Reals are stored as they are, except that NaNs are
+     * canonicalized to the positive quiet NaN, so anything below
+     * cTaggedBits is a real. The lower 48 bits hold the boolean,
+     * the integer or the payload pointer (user space addresses fit
+     * into 48 bits on the supported 64-bit platforms).
+     */
+    static const int cTagShift = 48;
+    static const uint64_t cTagBase = 0xFFF1;
+    static const uint64_t cTaggedBits = cTagBase << cTagShift;
+    static const uint64_t cValueMask = (uint64_t(1) << cTagShift) - 1;
+
+    static constexpr uint64_t tagBits(Type type) { return (cTagBase + type) << cTagShift; }
+
+    bool hasPayload() const { return m_bits >= tagBits(Type_String); }
+    void* pointer() const { return reinterpret_cast<void*>(static_cast<uintptr_t>(m_bits & cValueMask)); }
+    void setPointer(Type type, void *ptr) { m_bits = tagBits(type) | reinterpret_cast<uintptr_t>(ptr); }
+    bool boolean() const { return (m_bits & 1) != 0; }
+    int integer() const { return static_cast<int>(static_cast<uint32_t>(m_bits)); }
+    double real() const;
+    void setBoolean(bool value) { m_bits = tagBits(Type_Boolean) | (value ? 1 : 0); }
+    void setInteger(int value) { m_bits = tagBits(Type_Integer) | static_cast<uint32_t>(value); }
+    void setReal(double value);
+
+    uint64_t m_bits;    ///< Real value or tagged value.
 };
 
+/// Variant type holding the C++ type, for compile-time dispatch.
+template <typename T> struct VariantType;
+template <> struct VariantType<bool> { static constexpr Variant::Type value = Variant::Type_Boolean; };
+template <> struct VariantType<int> { static constexpr Variant::Type value = Variant::Type_Integer; };
+template <> struct VariantType<double> { static constexpr Variant::Type value = Variant::Type_Real; };
+template <> struct VariantType<std::string> { static constexpr Variant::Type value = Variant::Type_String; };
+template <> struct VariantType<VariantList> { static constexpr Variant::Type value = Variant::Type_List; };
+template <> struct VariantType<VariantMap> { static constexpr Variant::Type value = Variant::Type_Map; };
+template <> struct VariantType<LuaFunction> { static constexpr Variant::Type value = Variant::Type_Function; };
+template <> struct VariantType<VariantArray> { static constexpr Variant::Type value = Variant::Type_Array; };
+
+template <typename T>
+inline bool Variant::is() const
+{
+    return type() == VariantType<T>::value;
+}
+
 #endif // VARIANT_H
@@ -0,0 +1,174 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <map>
+#include "LuaEngine.h"
+
+//
+// Replay of Lua engine calls recorded with Recorder.
+//
+// Every iteration drives a fresh engine with the recorded evaluate,
+// evaluateFile and invoke calls, in the recorded order. Native functions
+// and Scriptable methods are replaced by stubs returning the recorded
+// results. Latencies of the recording and of the replay are reported
+// side by side.
+//
+// Usage: cxLuaReplay <recording> [iterations]
+//
+
+/// Recorded results of a native function, in call order
+struct NativeStub
+{
+    std::vector<Variant> results;
+    size_t next;
+};
+
+static Variant replayNative(const VariantList &args, void *pData)
+{
+    (void)args;
+    NativeStub *pStub = static_cast<NativeStub*>(pData);
+    if (pStub->next >= pStub->results.size()) {
+        // Called more often than recorded
+        return Variant();
+    }
+    return pStub->results[pStub->next++];
+}
+
+/// Register stubs of all the recorded natives.
+static void bindStubs(LuaEngine &lua, std::map<std::string, NativeStub> &stubs)
+{
+    // Methods ("object.method") and module functions ("module.function") are
+    // stored into tables named after the objects, which are also returned
+    // by require() for the modules
+    lua.evaluate("function __replayBind(object, method, stub)"
+                 "  local t = rawget(_G, object) or {}"
+                 "  rawset(_G, object, t)"
+                 "  if package then package.loaded[object] = t end"
+                 "  t[method] = rawget(_G, stub)"
+                 "  rawset(_G, stub, nil) "
+                 "end");
+
+    for (std::map<std::string, NativeStub>::iterator it = stubs.begin(); it != stubs.end(); ++it) {
+        it->second.next = 0;
+        const std::string &name = it->first;
+        size_t dot = name.find('.');
+        if (dot == std::string::npos) {
+            lua.registerFunction(name, replayNative, &it->second);
+        } else {
+            lua.registerFunction("__replayStub", replayNative, &it->second);
+            lua.invoke("__replayBind", VariantList { name.substr(0, dot), name.substr(dot + 1), "__replayStub" });
+        }
+    }
+
+    lua.setGlobalValue("__replayBind", Variant());
+}
+
+static void printRow(const std::string &label, const LatencyHistogram::Snapshot &latency)
+{
+    std::cout << std::left << std::setw(24) << label << std::right
+              << std::setw(10) << latency.count
+              << std::setw(12) << std::fixed << std::setprecision(1) << latency.mean() / 1000.0
+              << std::setw(12) << latency.percentile(50.0) / 1000.0
+              << std::setw(12) << latency.percentile(90.0) / 1000.0
+              << std::setw(12) << latency.percentile(99.0) / 1000.0
+              << std::setw(12) << latency.max / 1000.0
+              << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <recording> [iterations]" << std::endl;
+        return 1;
+    }
+
+    int iterations = argc > 2 ? atoi(argv[2]) : 1;
+    if (iterations < 1) {
+        iterations = 1;
+    }
+
+    std::vector<Recorder::Event> events;
+    std::string errorText;
+    if (!Recorder::load(argv[1], events, errorText)) {
+        std::cerr << "Cannot load " << argv[1] << ": " << errorText << std::endl;
+        return 1;
+    }
+
+    // Split recorded calls into the entry points and the native stubs
+    std::vector<const Recorder::Event*> calls;
+    std::map<std::string, NativeStub> stubs;
+    static const Metrics::Operation cOperations[] = {
+        Metrics::Operation_Evaluate,
+        Metrics::Operation_EvaluateFile,
+        Metrics::Operation_Invoke,
+        Metrics::Operation_NativeCall
+    };
+    LatencyHistogram recorded[4];
+
+    for (std::vector<Recorder::Event>::const_iterator it = events.begin(); it != events.end(); ++it) {
+        recorded[it->type].record(it->duration);
+        if (it->type == Recorder::Event_NativeCall) {
+            stubs[it->name].results.push_back(it->result);
+        } else {
+            calls.push_back(&(*it));
+        }
+    }
+
+    Metrics metrics;
+    unsigned long long replayTime = 0;
+    int errorMismatches = 0;
+
+    for (int i = 0; i < iterations; i++) {
+        LuaEngine lua;
+        bindStubs(lua, stubs);
+        lua.setMetrics(&metrics);
+
+        unsigned long long start = MetricsTimer::now();
+        for (std::vector<const Recorder::Event*>::const_iterator it = calls.begin(); it != calls.end(); ++it) {
+            const Recorder::Event &event = **it;
+            switch (event.type) {
+            case Recorder::Event_Evaluate:
+                lua.evaluate(event.name);
+                break;
+            case Recorder::Event_EvaluateFile:
+                lua.evaluateFile(event.name);
+                break;
+            case Recorder::Event_Invoke:
+                lua.invoke(event.name, event.args);
+                break;
+            default:
+                break;
+            }
+            if ((lua.error() != 0) != (event.errorCode != 0)) {
+                ++errorMismatches;
+            }
+        }
+        replayTime += MetricsTimer::now() - start;
+    }
+
+    Metrics::Snapshot snapshot = metrics.snapshot();
+
+    std::cout << events.size() << " events, " << calls.size() << " calls, "
+              << stubs.size() << " natives, " << iterations << " iteration(s)" << std::endl;
+    std::cout << std::left << std::setw(24) << "latency, us" << std::right
+              << std::setw(10) << "count" << std::setw(12) << "mean" << std::setw(12) << "p50"
+              << std::setw(12) << "p90" << std::setw(12) << "p99" << std::setw(12) << "max" << std::endl;
+
+    for (int type = 0; type < 4; type++) {
+        if (recorded[type].snapshot().count == 0) {
+            continue;
+        }
+        std::string name = Metrics::operationName(cOperations[type]);
+        printRow("recorded " + name, recorded[type].snapshot());
+        printRow("replayed " + name, snapshot.operations[cOperations[type]].latency);
+    }
+
+    double seconds = replayTime / 1e9;
+    std::cout << "throughput: " << std::fixed << std::setprecision(0)
+              << (seconds > 0 ? calls.size() * iterations / seconds : 0.0) << " calls/s" << std::endl;
+    if (errorMismatches > 0) {
+        std::cout << "warning: " << errorMismatches << " call(s) failed differently than recorded" << std::endl;
+    }
+
+    return 0;
+}
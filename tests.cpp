@@ -0,0 +1,1126 @@
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <stdexcept>
+#include <type_traits>
+#include <limits>
+#include <cstring>
+#include "LuaCompat.h"
+#include "LuaEngine.h"
+#include "LuaActor.h"
+#include "ModuleBuilder.h"
+#include "Utils.h"
+
+#ifdef __linux__
+#include <poll.h>
+#endif
+
+//
+// Regression tests, run by the Tests target
+//
+
+static int failures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            failures++; \
+        } \
+    } while (0)
+
+// Function values become handles releasing their registry reference
+static void testFunctionHandles()
+{
+    const char *countRefs = "local n = 0 for _, v in pairs(debug.getregistry()) do "
+                            "if type(v) == 'function' then n = n + 1 end end return n";
+    LuaFunction kept;
+    {
+        LuaEngine lua;
+        Variant add = lua.evaluate("return function(x, y) return x + y end");
+        CHECK(add.type() == Variant::Type_Function);
+        CHECK(add.function()(2, 3).toInteger() == 5);
+
+        long long before = lua.evaluate(countRefs).toInteger();
+        for (int i = 0; i < 100; i++) {
+            Variant f = lua.evaluate("return function() end");
+            CHECK(f.function().isValid());
+        }
+        CHECK(lua.evaluate(countRefs).toInteger() == before);
+
+        kept = add.function();
+        CHECK(kept.luaEngine() == &lua);
+    }
+    // Engine is gone
+    CHECK(!kept.isValid());
+    CHECK(!kept(1, 2).isValid());
+}
+
+// Garbage collector control and statistics
+static void testGcControl()
+{
+    LuaEngine lua;
+    lua.evaluate("garbage = {} for i = 1, 10000 do garbage[i] = { i } end garbage = nil");
+    size_t heapSize = lua.gcStatistics().heapSize;
+
+    lua.collectGc();
+    LuaEngine::GcStatistics stats = lua.gcStatistics();
+    CHECK(stats.cycles == 1);
+    CHECK(stats.heapSize < heapSize);
+    CHECK(stats.maxPauseTime >= stats.lastPauseTime);
+
+    lua.stopGc();
+    CHECK(!lua.isGcRunning());
+    CHECK(!lua.gcStatistics().running);
+    lua.restartGc();
+    CHECK(lua.isGcRunning());
+
+    // Steps run until the cycle is finished, a large budget is never spent
+    lua.evaluate("for i = 1, 1000 do local t = { i } end");
+    CHECK(lua.stepGcFor(10000000));
+    CHECK(lua.gcStatistics().cycles == 2);
+    CHECK(lua.gcStatistics().steps > 0);
+
+    lua.setGcGenerational();
+    lua.setGcIncremental(150, 200);
+    CHECK(lua.isGcRunning());
+    CHECK(lua.evaluate("return collectgarbage('count') > 0").toBoolean());
+}
+
+// Shared tables are read-only views visible in several engines
+static void testSharedTable()
+{
+    VariantList items;
+    items.push_back(Variant(10));
+    items.push_back(Variant(20));
+    items.push_back(Variant(30));
+    VariantMap limits;
+    limits["max"] = Variant(5);
+    VariantMap data;
+    data["name"] = Variant("config");
+    data["items"] = Variant(items);
+    data["limits"] = Variant(limits);
+    SharedTable table{Variant(data)};
+    CHECK(table.isValid());
+
+    LuaEngine first;
+    {
+        LuaEngine second;
+        first.registerSharedTable("config", table);
+        second.registerSharedTable("config", table);
+        CHECK(second.evaluate("return config.items[2] + config.limits.max").toInteger() == 25);
+    }
+
+    // Data outlives the engines it was registered in
+    CHECK(first.evaluate("return config.name").toString() == "config");
+    CHECK(first.evaluate("return #config.items").toInteger() == 3);
+    CHECK(first.evaluate("local n = 0 for k, v in pairs(config) do n = n + 1 end return n").toInteger() == 3);
+    CHECK(first.evaluate("return config.missing == nil").toBoolean());
+
+    first.evaluate("config.name = 'changed'");
+    CHECK(first.isError());
+    first.evaluate("config.limits.max = 100");
+    CHECK(first.isError());
+    CHECK(first.evaluate("return config.limits.max").toInteger() == 5);
+}
+
+// Errors carry the chunk name and the traceback of the failure point
+static void testStructuredErrors()
+{
+    LuaEngine lua;
+    lua.evaluate("function inner()\n"
+                 "  error('boom')\n"
+                 "end\n"
+                 "function outer()\n"
+                 "  inner()\n"
+                 "end\n", "=script");
+    CHECK(!lua.isError());
+
+    lua.invoke("outer");
+    const LuaEngine::Error &error = lua.lastError();
+    CHECK(error.code != 0);
+    CHECK(error.code == lua.error());
+    CHECK(error.message.find("boom") != std::string::npos);
+    CHECK(error.chunkName == "script");
+    CHECK(error.frames.size() >= 3);
+    if (error.frames.size() >= 3) {
+        // error() itself, then the Lua functions
+        CHECK(error.frames[0].what == "C");
+        CHECK(error.frames[0].function == "error");
+        CHECK(error.frames[1].source == "script");
+        CHECK(error.frames[1].function == "inner");
+        CHECK(error.frames[1].what == "Lua");
+        CHECK(error.frames[1].line == 2);
+        CHECK(error.frames[2].line == 5);
+    }
+    CHECK(error.traceback().compare(0, 16, "stack traceback:") == 0);
+    CHECK(error.traceback().find("script:2:") != std::string::npos);
+
+    // Syntax errors name the chunk, successful calls clear the error
+    lua.evaluate("return +", "=broken");
+    CHECK(lua.isError());
+    CHECK(lua.lastError().chunkName == "broken");
+    CHECK(lua.evaluate("return 1").toInteger() == 1);
+    CHECK(lua.lastError().code == 0);
+    CHECK(lua.lastError().frames.empty());
+}
+
+// Locale-independent number parsing and shortest round-trip formatting
+static void testNumberConversions()
+{
+    CHECK(numberToString(42) == "42");
+    CHECK(numberToString(-7LL) == "-7");
+    CHECK(numberToString(0.1) == "0.1");
+    CHECK(numberToString(1e300) == "1e+300");
+    CHECK(stringToNumber<double>(numberToString(1.0 / 3.0)) == 1.0 / 3.0);
+
+    CHECK(stringToNumber<int>(" +12abc") == 12);
+    CHECK(stringToNumber<int>("abc", -1) == -1);
+    CHECK(stringToNumber<int>("99999999999", -1) == -1);
+    CHECK(stringToNumber<double>("2.5e3") == 2500.0);
+
+    const char *text = "3.25 rest";
+    const char *end = 0;
+    double value = 0.0;
+    CHECK(parseNumber(text, text + 9, value, &end) && value == 3.25 && end == text + 4);
+    int unchanged = 5;
+    CHECK(!parseNumber(text + 5, text + 9, unchanged) && unchanged == 5);
+
+    std::string s("n=");
+    appendNumber(s, 1.5);
+    CHECK(s == "n=1.5");
+
+    CHECK(Variant("17").toInteger() == 17);
+    CHECK(Variant("x").toInteger(3) == 3);
+    CHECK(Variant("0.5").toReal() == 0.5);
+    CHECK(Variant("x").toReal(1.5) == 1.5);
+}
+
+// Variant trees written and parsed as JSON and MessagePack
+static void testSerializers()
+{
+    VariantList list;
+    list.push_back(Variant(1));
+    list.push_back(Variant(2.5));
+    list.push_back(Variant("a\"b\n"));
+    list.push_back(Variant(Variant::Type_Null));
+    VariantMap map;
+    map["list"] = Variant(list);
+    map["flag"] = Variant(true);
+    Variant value(map);
+
+    std::string json = toJson(value);
+    CHECK(json == "{\"flag\":true,\"list\":[1,2.5,\"a\\\"b\\n\",null]}");
+    CHECK(fromJson(json) == value);
+    CHECK(fromBinary(toBinary(value)) == value);
+    CHECK(toBinary(Variant(1)) == std::string("\x01", 1));
+
+    // Streaming straight into a sink
+    std::string output;
+    StringSink sink(output);
+    JsonWriter writer(sink);
+    writer.beginList(2);
+    writer.writeInteger(-3);
+    writer.writeString("x");
+    writer.endList();
+    writer.flush();
+    CHECK(output == "[-3,\"x\"]");
+
+    CHECK(fromJson(" [ 1 , { \"k\" : \"\\u00e9\" } ] ").list().back().map().at("k").toString() == "\xc3\xa9");
+    CHECK(!fromJson("[1,").isValid());
+    CHECK(!fromJson("{\"a\" 1}").isValid());
+    CHECK(!fromJson("[1] x").isValid());
+}
+
+// Lua values serialized and decoded without a Variant tree
+static void testDirectSerialization()
+{
+    LuaEngine lua;
+    lua.evaluate("data = { list = { 1, 2.5, 'x' }, map = { a = true }, fn = print } "
+                 "cyclic = { } cyclic.self = cyclic "
+                 "function make(n) return { n = n } end");
+
+    std::string json;
+    StringSink sink(json);
+    JsonWriter writer(sink);
+    lua.serializeGlobal("data", writer);
+    writer.flush();
+    CHECK(fromJson(json).map().at("list") == fromJson("[1,2.5,\"x\"]"));
+    CHECK(fromJson(json).map().at("map") == fromJson("{\"a\":true}"));
+    CHECK(fromJson(json).map().at("fn").type() == Variant::Type_Null);
+
+    json.clear();
+    lua.serializeGlobal("cyclic", writer);
+    writer.flush();
+    CHECK(json == "{\"self\":null}");
+
+    // Function result, binary format
+    std::string binary;
+    StringSink binarySink(binary);
+    BinaryWriter binaryWriter(binarySink);
+    VariantList args;
+    args.push_back(Variant(7));
+    CHECK(lua.invoke("make", args, binaryWriter));
+    binaryWriter.flush();
+    CHECK(fromBinary(binary) == fromJson("{\"n\":7}"));
+
+    // Decoded straight into Lua tables
+    CHECK(lua.setGlobalSerialized("decoded", binary.data(), binary.size(), SerialFormat_Binary));
+    CHECK(lua.evaluate("return decoded.n").toInteger() == 7);
+    std::string text("{\"k\":[10,20]}");
+    CHECK(lua.pushSerialized(text.data(), text.size(), SerialFormat_Json));
+    Variant pushed = lua.popValue();
+    CHECK(pushed.map().at("k") == fromJson("[10,20]"));
+}
+
+// Copies share payloads until one of them is modified
+static void testCopyOnWrite()
+{
+    VariantList items;
+    items.push_back(Variant("a"));
+    Variant original(items);
+    Variant copy = original;
+    CHECK(original.isShared() && copy.isShared());
+
+    // Read access through const references keeps sharing
+    const Variant &constCopy = copy;
+    CHECK(constCopy.list().size() == 1);
+    CHECK(copy.isShared());
+
+    copy.list().push_back(Variant("b"));
+    CHECK(!original.isShared() && !copy.isShared());
+    CHECK(original.list().size() == 1);
+    CHECK(copy.list().size() == 2);
+
+    Variant text("payload");
+    Variant textCopy = text;
+    textCopy.string().append("!");
+    CHECK(text.toString() == "payload");
+    CHECK(textCopy.toString() == "payload!");
+
+    Variant deep = original.clone();
+    CHECK(!deep.isShared() && deep == original);
+}
+
+// Public container types stay the standard ones
+static_assert(std::is_same<VariantList, std::list<Variant>>::value, "VariantList is std::list");
+static_assert(std::is_same<VariantMap, std::map<std::string, Variant>>::value, "VariantMap is std::map");
+
+static Variant countArguments(const std::list<Variant> &args, void *pData)
+{
+    (void)pData;
+    return Variant(static_cast<int>(args.size()));
+}
+
+// Result trees allocated in an arena, freed at once
+static void testArenaResults()
+{
+    LuaEngine lua;
+    lua.registerFunction("countArguments", countArguments);
+    CHECK(lua.evaluate("return countArguments(1, 2, 3)").toInteger() == 3);
+    lua.evaluate("function pair() return 1, { 'a', 'b' } end");
+
+    VariantArena arena(1024);
+    Variant kept;
+    for (int i = 0; i < 3; i++) {
+        {
+            Variant res = lua.evaluate("return { list = { 1, 2, 3 }, name = 'request' }", arena);
+            CHECK(res.map().at("list").isSequence());
+            CHECK(res.map().at("list") == fromJson("[1,2,3]"));
+            CHECK(res.map().at("name").toString() == "request");
+
+            Variant values = lua.invoke("pair", VariantList(), arena);
+            CHECK(values.isSequence() && values.array().size() == 2);
+            CHECK(values.array()[1] == fromJson("[\"a\",\"b\"]"));
+
+            kept = values.clone();
+        }
+        arena.release();
+    }
+
+    // Clones do not use the arena memory
+    CHECK(kept.array()[0].toInteger() == 1);
+    CHECK(kept.array()[1].array().size() == 2);
+}
+
+// Return values are kept apart, with the exact count
+static void testMultipleResults()
+{
+    LuaEngine lua;
+    lua.evaluate("function many(n) local t = {} for i = 1, n do t[i] = i end return table.unpack(t, 1, n) end "
+                 "function holes() return nil, 2, nil end "
+                 "function single() return { 1, 2 } end");
+    if (lua.evaluate("return table.unpack == nil").toBoolean()) {
+        lua.evaluate("table.unpack = unpack");
+    }
+
+    LuaEngine::Results results;
+    VariantList args;
+    args.push_back(Variant(2));
+    CHECK(lua.invoke("many", args, results));
+    CHECK(results.size() == 2 && results[1].toInteger() == 2);
+
+    // Beyond the inline capacity
+    args.front() = Variant(10);
+    CHECK(lua.invoke("many", args, results));
+    CHECK(results.size() == 10);
+    CHECK(results[9].toInteger() == 10);
+
+    // Trailing nils are counted, a table is a single value
+    CHECK(lua.invoke("holes", VariantList(), results));
+    CHECK(results.size() == 3);
+    CHECK(results[0].isNull() && results[2].isNull());
+    CHECK(lua.invoke("single", VariantList(), results));
+    CHECK(results.size() == 1 && results[0].isSequence());
+
+    CHECK(lua.evaluate("return", results));
+    CHECK(results.isEmpty());
+    CHECK(!lua.evaluate("error('x')", results));
+    CHECK(results.isEmpty());
+}
+
+static void writeFile(const std::string &fileName, const std::string &content)
+{
+    std::ofstream(fileName) << content;
+    // Newer modification time even on file systems with coarse timestamps
+    std::filesystem::last_write_time(fileName, std::filesystem::last_write_time(fileName) + std::chrono::seconds(2));
+}
+
+// Modules compiled once, recompiled and rerun in place when changed
+static void testModuleReload()
+{
+    std::string fileName = (std::filesystem::temp_directory_path() / "cxlua_test_module.lua").string();
+    writeFile(fileName, "local M = {} function M.version() return 1 end return M");
+
+    ModuleRegistry registry;
+    CHECK(registry.addModule("mod", fileName));
+    CHECK(!registry.addModule("broken", fileName + ".missing"));
+
+    LuaEngine lua;
+    CHECK(lua.loadModules(registry));
+    lua.evaluate("saved = mod");
+    CHECK(lua.evaluate("return mod.version()").toInteger() == 1);
+    CHECK(registry.poll() == 0);
+    CHECK(lua.refreshModules());
+
+    writeFile(fileName, "local M = {} function M.version() return 2 end return M");
+    CHECK(registry.poll() == 1);
+    CHECK(lua.refreshModules());
+    // Updated in place, references held by scripts see the new version
+    CHECK(lua.evaluate("return saved.version()").toInteger() == 2);
+
+    // Compilation errors keep the previous version
+    writeFile(fileName, "return {");
+    CHECK(registry.poll() == 0);
+    CHECK(!registry.errorText().empty());
+    CHECK(lua.refreshModules());
+    CHECK(lua.evaluate("return mod.version()").toInteger() == 2);
+
+    std::filesystem::remove(fileName);
+}
+
+static Variant echo(const VariantList &args, void *pData)
+{
+    (void)pData;
+    return args.empty() ? Variant() : args.front();
+}
+
+// Call counts, errors and latencies of the engine operations
+static void testMetrics()
+{
+    LatencyHistogram histogram;
+    for (unsigned long long value = 1; value <= 1000; value++) {
+        histogram.record(value);
+    }
+    LatencyHistogram::Snapshot latency = histogram.snapshot();
+    CHECK(latency.count == 1000 && latency.min == 1 && latency.max == 1000);
+    CHECK(latency.mean() == 500.5);
+    CHECK(latency.percentile(50) >= 500 && latency.percentile(50) <= 500 * 107 / 100);
+    CHECK(LatencyHistogram::bucketIndex(15) == 15);
+    CHECK(LatencyHistogram::bucketLowerBound(LatencyHistogram::bucketIndex(123456)) <= 123456);
+    CHECK(LatencyHistogram::bucketUpperBound(LatencyHistogram::bucketIndex(123456)) >= 123456);
+
+    Metrics metrics;
+    LuaEngine lua;
+    lua.registerFunction("echo", echo);
+    lua.evaluate("function f(x) return echo(x) end");
+
+    // Nothing measured before metrics are attached
+    lua.setMetrics(&metrics);
+    CHECK(lua.metrics() == &metrics);
+    lua.invoke("f", VariantList(1, Variant("abc")));
+    lua.invoke("f", VariantList(1, Variant(1)));
+    lua.evaluate("error('x')");
+    lua.setMetrics(0);
+    lua.evaluate("return 1");
+
+    Metrics::Snapshot snapshot = metrics.snapshot();
+    const Metrics::OperationStatistics &invoke = snapshot.operations[Metrics::Operation_Invoke];
+    const Metrics::OperationStatistics &evaluate = snapshot.operations[Metrics::Operation_Evaluate];
+    CHECK(invoke.calls == 2 && invoke.errors == 0);
+    CHECK(invoke.latency.count == 2);
+    CHECK(snapshot.operations[Metrics::Operation_NativeCall].calls == 2);
+    CHECK(evaluate.calls == 1 && evaluate.errors == 1);
+    CHECK(evaluate.errorsByCode[2] == 1);   // LUA_ERRRUN
+    CHECK(snapshot.toVariant().map().count(Metrics::operationName(Metrics::Operation_Invoke)) == 1);
+
+    metrics.reset();
+    CHECK(metrics.snapshot().operations[Metrics::Operation_Invoke].calls == 0);
+}
+
+// Same behaviour on every supported Lua version
+static void testBackendBehaviour()
+{
+    LuaEngine lua;
+    CHECK(lua.evaluate("return 6 / 4").toReal() == 1.5);
+    CHECK(lua.evaluate("return 2^10").toInteger() == 1024);
+    CHECK(lua.evaluate("return #'a\\0b'").toInteger() == 3);
+    CHECK(lua.evaluate("return select('#', (table.unpack or unpack)({ 1, 2, 3 }))").toInteger() == 3);
+
+    // Globals set from C++ visible to scripts and back
+    lua.setGlobalValue("answer", Variant(42));
+    CHECK(lua.evaluate("return answer + 0.5").toReal() == 42.5);
+    lua.evaluate("answer = { 1, 2 }");
+    CHECK(lua.globalValue("answer") == fromJson("[1,2]"));
+
+    // Coroutines
+    CHECK(lua.evaluate("local co = coroutine.wrap(function(a) local b = coroutine.yield(a + 1) return b * 2 end) "
+                       "return co(1) + co(10)").toInteger() == 22);
+}
+
+class Unit : public Scriptable
+{
+public:
+    Unit() : count(1), big(0), ratio(0.5f), enabled(true), name("unit"), m_level(3)
+    {
+        registerProperty("count", &Unit::count);
+        registerProperty("big", &Unit::big);
+        registerProperty("ratio", &Unit::ratio);
+        registerProperty("enabled", &Unit::enabled);
+        registerProperty("name", &Unit::name, true);
+        registerProperty("level", static_cast<Getter>(&Unit::level), static_cast<Setter>(&Unit::setLevel));
+        registerProperty("constant", static_cast<Getter>(&Unit::level));
+    }
+
+    Variant level() const { return Variant(m_level); }
+    void setLevel(const Variant &value) { m_level = value.toInteger(); }
+
+    int count;
+    long long big;
+    float ratio;
+    bool enabled;
+    std::string name;
+    int m_level;
+};
+
+// Data members and accessors exposed as properties
+static void testScriptableProperties()
+{
+    Unit unit;
+    CHECK(!unit.registerProperty("broken", 0, static_cast<Scriptable::Setter>(&Unit::setLevel)));
+    CHECK(unit.properties().count("broken") == 0);
+
+    LuaEngine lua;
+    lua.registerObject("unit", &unit);
+    lua.evaluate("unit.count = unit.count + 1 unit.ratio = 0.25 unit.enabled = false unit.level = 7");
+    CHECK(!lua.isError());
+    CHECK(unit.count == 2 && unit.ratio == 0.25f && !unit.enabled && unit.m_level == 7);
+    CHECK(lua.evaluate("return unit.name .. unit.level").toString() == "unit7");
+
+    lua.evaluate("unit.name = 'x'");
+    CHECK(lua.isError());
+    lua.evaluate("unit.constant = 1");
+    CHECK(lua.isError());
+    lua.evaluate("unit.count = 'x'");
+    CHECK(lua.isError());
+    CHECK(unit.name == "unit" && unit.count == 2);
+
+    // 64-bit members keep their precision
+    const long long big = (1LL << 53) + 1;
+    long long value = 0;
+    CHECK(unit.setIntegerProperty("big", big));
+    CHECK(unit.integerProperty("big", value) && value == big);
+    CHECK(!unit.integerProperty("ratio", value));
+    CHECK(!unit.setIntegerProperty("name", 1));
+    CHECK(lua.evaluate("return unit.big % 1000").toInteger() == big % 1000);
+
+    CHECK(unit.setProperty("big", Variant(-5)));
+    CHECK(unit.big == -5);
+    CHECK(unit.property("big").type() == Variant::Type_Integer);
+    CHECK(unit.property("constant").toInteger() == 7);
+    CHECK(!unit.setProperty("constant", Variant(1)));
+    CHECK(!unit.property("missing").isValid());
+}
+
+// Typed arrays share the C++ buffer with scripts
+static void testTypedArrays()
+{
+    double data[] = { 1.0, 2.0, 3.0, 4.0 };
+    TypedArray wrapped(TypedArray::Element_Float64, data, 4);
+    TypedArray counts(TypedArray::Element_Int32, 3);
+    CHECK(counts.isValid() && counts.size() == 3 && counts.at(2) == 0.0);
+
+    LuaEngine lua;
+    lua.registerArrayLibrary();
+    lua.registerTypedArray("values", wrapped);
+    lua.registerTypedArray("counts", counts);
+
+    CHECK(lua.evaluate("return #values").toInteger() == 4);
+    CHECK(lua.evaluate("return values[1] + values[4]").toReal() == 5.0);
+    CHECK(lua.evaluate("return values:sum()").toReal() == 10.0);
+    CHECK(lua.evaluate("return array.dot(values, values)").toReal() == 30.0);
+    lua.evaluate("values[2] = 20 counts[3] = 7");
+    CHECK(!lua.isError());
+    CHECK(data[1] == 20.0 && counts.at(2) == 7.0);
+    lua.evaluate("values[5] = 1");
+    CHECK(lua.isError());
+    lua.evaluate("counts[1] = 0.5");
+    CHECK(lua.isError());
+
+    lua.evaluate("created = array.new('f32', { 0.5, 1.5 })");
+    CHECK(!lua.isError());
+    TypedArray created = lua.globalTypedArray("created");
+    CHECK(created.isValid() && created.type() == TypedArray::Element_Float32);
+    CHECK(created.size() == 2 && created.at(1) == 1.5);
+    CHECK(lua.evaluate("return created:type()").toString() == "f32");
+    lua.evaluate("array.new('u8', 4)");
+    CHECK(lua.isError());
+    CHECK(!lua.globalTypedArray("missing").isValid());
+
+    TypedArray copy = wrapped.copy();
+    copy.setAt(0, 5.0);
+    CHECK(data[0] == 1.0 && copy.at(0) == 5.0);
+}
+
+// Recorded entry points and native calls, including module functions
+static void testRecorder()
+{
+    std::string fileName = (std::filesystem::temp_directory_path() / "cxlua_test_recording.bin").string();
+
+    LuaEngine lua;
+    lua.registerFunction("echo", echo);
+    lua.registerModule(ModuleBuilder("util").addFunction("echo", echo));
+    // Not recording yet
+    lua.evaluate("echo(0)");
+
+    Recorder recorder;
+    CHECK(recorder.open(fileName));
+    lua.setRecorder(&recorder);
+    CHECK(lua.evaluate("return echo(1) + require('util').echo(2)").toInteger() == 3);
+    lua.setRecorder(0);
+    lua.evaluate("echo(3)");
+    recorder.close();
+
+    std::vector<Recorder::Event> events;
+    std::string errorText;
+    CHECK(Recorder::load(fileName, events, errorText));
+    CHECK(events.size() == 3);
+    if (events.size() == 3) {
+        CHECK(events[0].type == Recorder::Event_Evaluate && events[0].errorCode == 0);
+        CHECK(events[1].type == Recorder::Event_NativeCall && events[1].name == "echo");
+        CHECK(events[1].args.size() == 1 && events[1].result.toInteger() == 1);
+        CHECK(events[2].name == "util.echo" && events[2].result.toInteger() == 2);
+    }
+    std::filesystem::remove(fileName);
+}
+
+// Channel messages between C++ and scripts, also sent from coroutines
+static void testChannels()
+{
+    Channel channel(4, Channel::Mode_MPMC, Channel::Wait_EventFd);
+    CHECK(channel.capacity() == 4);
+
+    LuaEngine lua;
+    lua.registerChannel("ch", channel);
+    CHECK(channel.send(VariantMap { { "x", 1 } }));
+    CHECK(lua.evaluate("local ok, v = ch:recv() return ok and v.x").toInteger() == 1);
+    CHECK(!lua.evaluate("return (ch:recv())").toBoolean(true));
+
+    lua.evaluate("local co = coroutine.wrap(function(value)"
+                 "  ch:send({ value, 'two' })"
+                 "  local ok, v = ch:recv()"
+                 "  coroutine.yield(ok and v[2])"
+                 "end) "
+                 "result = co(1) "
+                 "ch:send(co)");
+    CHECK(!lua.isError());
+    CHECK(lua.evaluate("return result").toString() == "two");
+
+    // Functions are sent as null
+    Variant value;
+    CHECK(channel.receive(value) && value.isNull());
+    CHECK(channel.size() == 0);
+
+#ifdef __linux__
+    // Every received message takes its eventfd token
+    struct pollfd pfd;
+    pfd.fd = channel.eventFd();
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    CHECK(pfd.fd >= 0 && poll(&pfd, 1, 0) == 0);
+    CHECK(channel.send(Variant(2)) && poll(&pfd, 1, 0) == 1);
+    CHECK(channel.receive(value) && value.toInteger() == 2);
+    CHECK(poll(&pfd, 1, 0) == 0);
+#endif
+
+    channel.close();
+    CHECK(!channel.send(Variant(3)));
+    CHECK(lua.evaluate("return ch:closed()").toBoolean());
+}
+
+// Memoized calls hit on equal arguments only, integers and reals differ
+static void testMemoization()
+{
+    LuaEngine lua;
+    lua.evaluate("calls = 0 "
+                 "function describe(x)"
+                 "  calls = calls + 1"
+                 "  return type(x) == 'table' and 't' .. tostring(x[1]) or tostring(x) "
+                 "end");
+    const VariantList integer { Variant(1) };
+    const VariantList real { Variant(1.0) };
+    const VariantList nested { Variant(VariantList { Variant(1.0) }) };
+    const std::string expected[] = {
+        lua.invoke("describe", integer).toString(),
+        lua.invoke("describe", real).toString(),
+        lua.invoke("describe", nested).toString()
+    };
+
+    MemoCache cache(16, 0, 1);
+    lua.memoize("describe", cache);
+    lua.evaluate("calls = 0");
+    for (int i = 0; i < 2; i++) {
+        CHECK(lua.invoke("describe", integer).toString() == expected[0]);
+        CHECK(lua.invoke("describe", real).toString() == expected[1]);
+        CHECK(lua.invoke("describe", nested).toString() == expected[2]);
+        CHECK(lua.invoke("describe", VariantList { Variant(VariantList { Variant(1) }) }).toString() == "t1");
+    }
+    CHECK(lua.evaluate("return calls").toInteger() == 4);
+    MemoCache::Statistics statistics = cache.statistics();
+    CHECK(statistics.hits == 4 && statistics.misses == 4 && statistics.size == 4);
+
+    lua.unmemoize("describe");
+    CHECK(cache.statistics().size == 0);
+    lua.invoke("describe", integer);
+    CHECK(lua.evaluate("return calls").toInteger() == 5);
+}
+
+// Truncated and oversized MessagePack headers must fail cleanly
+static void testMalformedSerialized()
+{
+    LuaEngine lua;
+
+    static const struct {
+        const char *data;
+        size_t size;
+    } cases[] = {
+        { "\xdf\x7f\xff\xff\xff", 5 },  // map32, 2^31 entries
+        { "\xdd\x7f\xff\xff\xff", 5 },  // array32, 2^31 items
+        { "\xdd\xff\xff\xff\xff", 5 },
+        { "\xdc\x00\x05\x01", 4 },      // array16, 5 items, 1 present
+        { "\xde\x00\x02\xa1\x61", 5 },  // map16, key without value
+        { "\xdd\x00\x00", 3 },          // truncated header
+        { "\x92\x01", 2 }               // fixarray, 2 items, 1 present
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        CHECK(!lua.pushSerialized(cases[i].data, cases[i].size, SerialFormat_Binary));
+        CHECK(!lua.setGlobalSerialized("decoded", cases[i].data, cases[i].size, SerialFormat_Binary));
+    }
+
+    // Valid data still decodes and the engine is usable
+    CHECK(lua.setGlobalSerialized("decoded", "\xdc\x00\x02\x01\x02", 5, SerialFormat_Binary));
+    CHECK(lua.evaluate("return decoded[1] + decoded[2]").toInteger() == 3);
+}
+
+// Sandboxed chunks must not modify engine globals through nested tables
+static void testSandboxNestedWrites()
+{
+    LuaEngine lua;
+    lua.evaluate("config = { limits = { max = 10 } }");
+    LuaEngine::Environment env = lua.createEnvironment();
+
+    static const char *writes[] = {
+        "config.limits.max = 999",
+        "package.loaded._G.injected = 42",
+        "package.loaded.string.rep = nil",
+        "getmetatable('').__index.rep = nil",
+        "for k, v in pairs(config) do v.max = 999 end"
+    };
+    for (size_t i = 0; i < sizeof(writes) / sizeof(writes[0]); i++) {
+        lua.evaluate(writes[i], env);
+        CHECK(lua.isError());
+    }
+
+    CHECK(lua.evaluate("return config.limits.max").toInteger() == 10);
+    CHECK(lua.evaluate("return injected == nil").toBoolean());
+    CHECK(lua.evaluate("return ('ab'):rep(2)").toString() == "abab");
+
+    // Reads see through the proxies, the engine keeps its own metatables
+    CHECK(lua.evaluate("return config.limits.max + #string.rep('x', 3)", env).toInteger() == 13);
+    CHECK(lua.evaluate("local n = 0 for k, v in pairs(config) do n = n + v.max end return n", env).toInteger() == 10);
+    CHECK(lua.evaluate("return type(getmetatable(''))").toString() == "table");
+}
+
+// Sandboxed chunks must not reach the engine globals through functions
+static void testSandboxEscapes()
+{
+    LuaEngine lua;
+    lua.evaluate("shared = 1");
+    LuaEngine::Environment env = lua.createEnvironment();
+
+    static const char *escapes[] = {
+        "require('_G').shared = 3",
+        "require('string').rep = nil",
+        "require('debug').getregistry()[2].shared = 4",
+        "debug.getregistry()[2].shared = 4",
+        "package.loaded.debug.getregistry()[2].shared = 4",
+        "package.loaded._G.shared = 4",
+        "getfenv(0).shared = 5",
+        "loadstring('shared = 6')()",
+        "dofile()",
+        "loadfile()()"
+    };
+    for (size_t i = 0; i < sizeof(escapes) / sizeof(escapes[0]); i++) {
+        lua.evaluate(escapes[i], env);
+        CHECK(lua.isError());
+    }
+
+    CHECK(lua.evaluate("return shared").toInteger() == 1);
+    CHECK(lua.evaluate("return ('ab'):rep(2)").toString() == "abab");
+    CHECK(lua.evaluate("return type(debug.getregistry)").toString() == "function");
+
+    // Hidden from the environment only, modules stay readable
+    CHECK(lua.evaluate("return debug == nil and dofile == nil and loadfile == nil", env).toBoolean());
+    CHECK(lua.evaluate("return require('string').rep('x', 2)", env).toString() == "xx");
+    CHECK(lua.evaluate("return require('_G') == nil", env).toBoolean());
+}
+
+static Variant describeArguments(const ArgumentView &args, void *pData)
+{
+    (void)pData;
+    std::string res;
+    res.append(std::to_string(args.size())).append(":");
+    res.append(args.stringViewAt(0)).append(",");
+    res.append(std::to_string(args.int64At(1, -1))).append(",");
+    res.append(args.booleanAt(2) ? "true" : "false").append(",");
+
+    TableView table = args.tableAt(3);
+    res.append(std::to_string(table.length())).append(",");
+    res.append(table.stringViewField("name")).append(",");
+    res.append(std::to_string(table.realField("missing", 0.5))).append(",");
+    res.append(table.typeAt(1) == Variant::Type_Real || table.typeAt(1) == Variant::Type_Integer ? "n" : "?");
+
+    // Out of range and mistyped arguments give defaults
+    res.append(args.tableAt(0).isValid() ? "!" : "");
+    res.append(args.stringViewAt(9).empty() ? "" : "!");
+    res.append(args.typeAt(9) == Variant::Type_Invalid ? "" : "!");
+    return Variant(res);
+}
+
+// Arguments read on demand from the Lua stack
+static void testArgumentViews()
+{
+    LuaEngine lua;
+    lua.registerFunction("describe", describeArguments);
+    CHECK(lua.evaluate("return describe('s', 42, true, { 7, 8, name = 'n' })").toString()
+          == "4:s,42,true,2,n,0.500000,n");
+    CHECK(lua.evaluate("return describe()").toString() == "0:,-1,false,0,,0.500000,?");
+}
+
+static Variant sumPositions(const ArgumentView &args, void *pData)
+{
+    (void)pData;
+    TableView rows = args.tableAt(0);
+    int sum = 0;
+    for (size_t i = 1; i <= rows.length(); i++) {
+        TableView row = rows.tableAt(static_cast<int>(i));
+        TableView pos = row.tableField("pos");
+        if (!pos.isValid()) {
+            return Variant(-1);
+        }
+        sum += static_cast<int>(pos.int64Field("x"));
+    }
+    return Variant(sum);
+}
+
+// Nested table views read in a loop must not grow the Lua stack
+static void testNestedViewsInLoop()
+{
+    LuaEngine lua;
+    lua.registerFunction("sumPositions", sumPositions);
+
+    // More rows than the Lua stack can hold
+    Variant res = lua.evaluate("local rows = {} for i = 1, 600000 do rows[i] = { pos = { x = 1 } } end "
+                               "return sumPositions(rows)");
+    CHECK(!lua.isError());
+    CHECK(res.toInteger() == 600000);
+}
+
+// Only names the chunk references are bound, fields, strings and comments are skipped
+static void testChunkBinder()
+{
+    ChunkBinder binder;
+    binder.bind("print");
+    binder.bindConstant("limit", "5");
+    binder.bind("unused");
+
+    std::string source = "print(limit) -- unused\nreturn 'unused', t.unused";
+    std::string wrapped;
+    CHECK(binder.wrap(source.data(), source.size(), wrapped));
+    // Lua 5.4 declares the bindings <const>
+    for (size_t pos; (pos = wrapped.find("<const>")) != std::string::npos; ) {
+        wrapped.erase(pos, 7);
+    }
+    CHECK(wrapped.find("local print =print;") == 0);
+    CHECK(wrapped.find("local limit =5;") != std::string::npos);
+    CHECK(wrapped.find("local unused") == std::string::npos);
+    CHECK(wrapped.compare(wrapped.size() - source.size(), source.size(), source) == 0);
+
+    wrapped.clear();
+    source = "return x.print, { limit = 1 }";
+    CHECK(!binder.wrap(source.data(), source.size(), wrapped) && wrapped.empty());
+    source = "\x1bLua";
+    CHECK(!binder.wrap(source.data(), source.size(), wrapped));
+
+    binder.unbind("print");
+    source = "print(1)";
+    CHECK(!binder.wrap(source.data(), source.size(), wrapped));
+}
+
+// Bound globals must not hide assignments, bindings can be undone
+static void testBoundGlobalAssignments()
+{
+    LuaEngine lua;
+    lua.setBindGlobals(true);
+    lua.registerFunction("f", echo);
+    lua.evaluate("limit = 5 t = {}");
+    lua.freezeGlobal("limit");
+
+    CHECK(lua.evaluate("return limit + f(1)").toInteger() == 6);
+
+    static const struct {
+        const char *chunk;
+        const char *global;
+    } assignments[] = {
+        { "limit, t[f(1)], t.x = 3, 1, 2 return limit", "limit" },
+        { "limit --[[ c ]] , t.y = 4, 1 return limit", "limit" },
+        { "limit, t[ (function() return 1 end)() ] = 5, 1 return limit", "limit" },
+        { "f(1) limit = 6 return limit", "limit" },
+        { "local a f, a = 2, 1 return f", "f" }
+    };
+    for (size_t i = 0; i < sizeof(assignments) / sizeof(assignments[0]); i++) {
+        Variant res = lua.evaluate(assignments[i].chunk);
+        CHECK(!lua.isError());
+        CHECK(res.toInteger() == lua.globalValue(assignments[i].global).toInteger());
+    }
+    CHECK(lua.globalValue("f").toInteger() == 2);
+    CHECK(lua.globalValue("limit").toInteger() == 6);
+
+    // Frozen value is used until unbound
+    CHECK(lua.evaluate("return limit").toInteger() == 5);
+    lua.unbindGlobal("limit");
+    CHECK(lua.evaluate("return limit").toInteger() == 6);
+}
+
+/// Raw module function multiplying its argument by the module upvalue.
+static int scaled(lua_State *pLuaState)
+{
+    int factor = *static_cast<int*>(lua_touserdata(pLuaState, lua_upvalueindex(1)));
+    lua_pushinteger(pLuaState, factor * luaL_checkinteger(pLuaState, 1));
+    return 1;
+}
+
+// Native modules built in one pass, lazily or at once
+static void testModuleBuilder()
+{
+    int factor = 3;
+    ModuleBuilder geometry("geometry");
+    geometry.addFunction("echo", echo)
+            .addFunction("sumPositions", sumPositions)
+            .addCFunction("scaled", scaled)
+            .addUpvalue(&factor)
+            .addConstant("unit", Variant(VariantMap { { "x", 1 } }))
+            .addModule(ModuleBuilder("inner").addConstant("depth", 2))
+            .addFunction("missing", static_cast<LuaEngine::NativeFunction>(0));
+    CHECK(geometry.name() == "geometry" && geometry.size() == 5);
+
+    LuaEngine lua;
+    lua.registerModule(geometry);
+    CHECK(lua.evaluate("return geometry").isNull());
+    CHECK(lua.evaluate("local g = require('geometry')"
+                       "return g.echo('a') .. g.scaled(2) .. g.unit.x .. g.inner.depth"
+                       "  .. g.sumPositions({ { pos = { x = 4 } } })").toString() == "a6124");
+    CHECK(lua.evaluate("return require('geometry') == require('geometry')").toBoolean());
+
+    LuaEngine eager;
+    eager.registerModule(geometry, false);
+    CHECK(eager.evaluate("return geometry.scaled(5)").toInteger() == 15);
+    CHECK(eager.evaluate("return require('geometry') == geometry").toBoolean());
+}
+
+// NaN-boxed values keep their types and values, long sequences pop as arrays
+static void testVariantLayout()
+{
+    static_assert(sizeof(Variant) == 8, "Variant is NaN-boxed into 8 bytes");
+    static_assert(Variant::hasPayload(Variant::Type_Array) && !Variant::hasPayload(Variant::Type_Integer),
+                  "payload types");
+
+    const double infinity = std::numeric_limits<double>::infinity();
+    const Variant values[] = {
+        Variant(), Variant(Variant::Type_Null), Variant(true), Variant(-7),
+        Variant(2.5), Variant(-infinity), Variant("text")
+    };
+    const Variant::Type types[] = {
+        Variant::Type_Invalid, Variant::Type_Null, Variant::Type_Boolean, Variant::Type_Integer,
+        Variant::Type_Real, Variant::Type_Real, Variant::Type_String
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        CHECK(values[i].type() == types[i]);
+    }
+    CHECK(values[2].is<bool>() && values[3].is<int>() && values[6].is<std::string>());
+    CHECK(values[3].toInteger() == -7 && values[4].toReal() == 2.5 && values[5].toReal() == -infinity);
+    CHECK(Variant(std::numeric_limits<int>::min()).toInteger() == std::numeric_limits<int>::min());
+
+    // Any NaN, including ones with tag-like bits, stays a real
+    uint64_t bits = 0xFFF5000000000001ULL;
+    double tagged;
+    memcpy(&tagged, &bits, sizeof(tagged));
+    Variant nan(tagged);
+    CHECK(nan.type() == Variant::Type_Real && nan.toReal() != nan.toReal());
+    CHECK(Variant(-std::numeric_limits<double>::quiet_NaN()).type() == Variant::Type_Real);
+
+    LuaEngine lua;
+    lua.setArrayThreshold(3);
+    CHECK(lua.arrayThreshold() == 3);
+    Variant longList = lua.evaluate("return { 1, 2, 3, { 4, 5 } }");
+    CHECK(longList.type() == Variant::Type_Array && longList.array().size() == 4);
+    CHECK(longList.array()[3].type() == Variant::Type_List);
+    CHECK(longList == Variant(VariantList { 1, 2, 3, Variant(VariantList { 4, 5 }) }));
+    lua.setGlobalValue("t", longList);
+    CHECK(lua.evaluate("return #t + #t[4]").toInteger() == 6);
+}
+
+static Variant twice(const VariantList &args, void *pData)
+{
+    (void)pData;
+    return Variant(args.front().toInteger() * 2);
+}
+
+// Streams, with natives called from the generator coroutine on its own stack
+static void testStreams()
+{
+    Unit unit;
+    LuaEngine lua;
+    lua.registerFunction("twice", twice);
+    lua.registerFunction("sumPositions", sumPositions);
+    lua.registerModule(ModuleBuilder("util").addFunction("echo", echo));
+    lua.registerObject("unit", &unit);
+    lua.evaluate("function gen(n)"
+                 "  for i = 1, n do coroutine.yield(twice(i)) end"
+                 "  coroutine.yield(pcall(twice, 5))"
+                 "  coroutine.yield(sumPositions({ { pos = { x = 3 } } }), require('util').echo('e'))"
+                 "  unit.level = 9"
+                 "  return 'not streamed' "
+                 "end "
+                 "function pairsOf(t) return ipairs(t) end");
+    CHECK(!lua.isError());
+    CHECK(lua.evaluate("return coroutine.wrap(function() return twice(21) end)()").toInteger() == 42);
+
+    LuaStream stream = lua.generate("gen", VariantList { 3 });
+    std::vector<Variant> values;
+    for (LuaStream::Iterator it = stream.begin(); it != stream.end(); ++it) {
+        values.push_back(*it);
+    }
+    CHECK(stream.error() == 0 && stream.count() == 5 && values.size() == 5);
+    if (values.size() == 5) {
+        CHECK(values[0].toInteger() == 2 && values[2].toInteger() == 6);
+        CHECK(values[3] == Variant(VariantList { true, 10 }));
+        CHECK(values[4] == Variant(VariantList { 3, "e" }));
+    }
+    CHECK(unit.m_level == 9);
+    // The engine stack is left balanced
+    CHECK(lua.evaluate("return twice(4)").toInteger() == 8);
+
+    LuaStream pairs = lua.iterate("pairsOf", VariantList { Variant(VariantList { "a", "b" }) });
+    Variant value;
+    CHECK(pairs.next(value) && value == Variant(VariantList { 1, "a" }));
+    pairs.close();
+    CHECK(!pairs.isValid() && !pairs.next());
+
+    lua.evaluate("function failing() coroutine.yield(1) error('broken') end");
+    LuaStream failing = lua.generate("failing");
+    CHECK(failing.next() && !failing.next() && failing.error() == 2);  // LUA_ERRRUN
+}
+
+// Exceptions thrown by actor tasks come back through the future
+static void testActorTaskException()
+{
+    LuaActor actor;
+
+    std::future<LuaActor::Result> thrown = actor.execute([](LuaEngine &) -> Variant {
+        throw std::runtime_error("task failed");
+    });
+    bool caught = false;
+    try {
+        thrown.get();
+    } catch (const std::runtime_error &) {
+        caught = true;
+    }
+    CHECK(caught);
+
+    // The actor keeps serving requests
+    CHECK(actor.evaluate("return 1 + 2").get().value.toInteger() == 3);
+
+    // Function handles do not leave the actor thread
+    LuaActor::Result result = actor.evaluate("return function() end").get();
+    CHECK(!result.isError() && result.value.isNull());
+    result = actor.evaluate("return { f = print, n = 1, list = { 2, print, 3 } }").get();
+    CHECK(!result.isError() && result.value.type() == Variant::Type_Map);
+    const VariantMap &map = result.value.map();
+    CHECK(map.at("f").isNull() && map.at("n").toInteger() == 1);
+    CHECK(map.at("list") == Variant(VariantList { 2, Variant(Variant::Type_Null), 3 }));
+    CHECK(actor.execute([](LuaEngine &lua) -> Variant {
+        Variant function = lua.globalValue("print");
+        return function.type() == Variant::Type_Function ? Variant(VariantList { function }) : Variant();
+    }).get().value == Variant(VariantList { Variant(Variant::Type_Null) }));
+}
+
+int main()
+{
+    testFunctionHandles();
+    testGcControl();
+    testSharedTable();
+    testStructuredErrors();
+    testMalformedSerialized();
+    testNumberConversions();
+    testSandboxNestedWrites();
+    testSandboxEscapes();
+    testSerializers();
+    testDirectSerialization();
+    testCopyOnWrite();
+    testArenaResults();
+    testMultipleResults();
+    testArgumentViews();
+    testNestedViewsInLoop();
+    testModuleReload();
+    testMetrics();
+    testBackendBehaviour();
+    testScriptableProperties();
+    testTypedArrays();
+    testRecorder();
+    testChannels();
+    testMemoization();
+    testChunkBinder();
+    testBoundGlobalAssignments();
+    testModuleBuilder();
+    testVariantLayout();
+    testStreams();
+    testActorTaskException();
+
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All tests passed" << std::endl;
+    return 0;
+}